@@ -0,0 +1,799 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <pcilib.h>
+#include <pcilib/error.h>
+
+#include "private.h"
+#include "reader.h"
+#include "data.h"
+#include "base.h"
+#include "scanner.h"
+#include "replay.h"
+#include "events.h"
+#include "decoder.h"
+#include "memory.h"
+#include "synth.h"
+
+#define BENCH_PACKET_SIZE 4096
+#define BENCH_PACKETS 1000000
+#define BENCH_FRAMES 4			/**< Number of frames in the synthetic stream, the ring buffer is twice larger to have a slot for the frame in flight */
+#define BENCH_LOOPS 16			/**< Number of times the synthetic stream is replayed */
+#define BENCH_WAKEUPS 10000		/**< Number of wake-ups to measure notification latency */
+#define BENCH_DEADLINES 100		/**< Number of timed waits to measure deadline precision */
+#define BENCH_DEADLINE 1000		/**< Timeout of timed waits in us */
+#define BENCH_MAX_BANDS 16		/**< Maximal number of bands to split the frame in */
+#define BENCH_RING_SIZE (256ul * 1024 * 1024)	/**< Size of the ring used to measure the first-lap penalty */
+#define BENCH_SLOT_UPDATES 10000000	/**< Number of updates of slot metadata by each thread to measure false sharing */
+
+typedef struct {
+    ipecamera_notifier_t ping;
+    ipecamera_notifier_t pong;
+    volatile size_t sent, received;
+    volatile double timestamp;
+    double latency;
+} bench_wakeup_t;
+
+typedef struct {
+    volatile uint64_t *seq;		/**< Sequence counter updated by the thread */
+    int cpu;				/**< CPU to run on or -1 */
+    double time;
+} bench_slot_writer_t;
+
+/* Slot layout prior to splitting it in the raw and decoded parts */
+typedef struct {
+    ipecamera_event_info_t event;
+    volatile uint64_t raw_seq;
+    volatile uint64_t image_seq;
+    ipecamera_frame_layout_t layout;
+    volatile size_t bands_done;
+    volatile int band_error;
+} bench_packed_slot_t;
+
+typedef struct {
+    ipecamera_t *ctx;
+    size_t lines;			/**< Number of lines which should be available before the frame is complete */
+    size_t frame_size;			/**< Size of the raw frame */
+    pcilib_event_id_t last_id;		/**< Last complete frame */
+    size_t bytes;			/**< Number of bytes received since the last frame was complete */
+    int checked;			/**< The first lines of the current frame are already available */
+    size_t frames;			/**< Number of frames with the first lines available before they were complete */
+    double received;			/**< Sum of the received parts of these frames once the first lines were available */
+} bench_progressive_t;
+
+typedef size_t (*bench_scanner_t)(const void *buf, size_t size, size_t offset);
+
+static void bench_log(void *arg, const char *file, int line, pcilib_log_priority_t prio, const char *format, va_list ap) {
+    vprintf(format, ap);
+    printf("\n");
+}
+
+static double bench_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_report(const char *stage, const char *variant, double time, size_t bytes, size_t items, const char *item_name) {
+    printf("%-10s %-10s %10.1f MB/s %12.1f %s/s\n", stage, variant, bytes / time / 1024. / 1024., items / time, item_name);
+}
+
+static int bench_scanner() {
+    int i;
+    size_t j, found = 0;
+    double start, time;
+    uint32_t *packet;
+
+    const char *names[] = { "scalar", "sse2", "avx2", ipecamera_get_scanner_name() };
+    bench_scanner_t scanners[] = { ipecamera_find_frame_magic_scalar, ipecamera_find_frame_magic_sse2, ipecamera_find_frame_magic_avx2, ipecamera_find_frame_magic };
+
+    packet = malloc(BENCH_PACKET_SIZE);
+    if (!packet) return 1;
+
+	// Worst case: padded packet without frame magic
+    memset(packet, 0, BENCH_PACKET_SIZE);
+    for (i = 0; i < 4; i++) {
+	start = bench_time();
+	for (j = 0; j < BENCH_PACKETS; j++) {
+	    found += scanners[i](packet, BENCH_PACKET_SIZE, 0);
+	}
+	time = bench_time() - start;
+	bench_report("scanner", names[i], time, (size_t)BENCH_PACKETS * BENCH_PACKET_SIZE, BENCH_PACKETS, "packets");
+    }
+
+    free(packet);
+
+    return (found == 0);
+}
+
+static void bench_wait(ipecamera_notifier_t *notifier, volatile size_t *counter, size_t value) {
+    uint32_t key;
+
+    while (*counter != value) {
+	key = ipecamera_notifier_prepare(notifier);
+	if (*counter != value) ipecamera_notifier_wait(notifier, key, NULL);
+	ipecamera_notifier_cancel(notifier);
+    }
+}
+
+static void *bench_wakeup_thread(void *user) {
+    size_t i;
+    bench_wakeup_t *w = (bench_wakeup_t*)user;
+
+    for (i = 1; i <= BENCH_WAKEUPS; i++) {
+	bench_wait(&w->ping, &w->sent, i);
+	w->latency += bench_time() - w->timestamp;
+	w->received = i;
+	ipecamera_notify(&w->pong);
+    }
+
+    return NULL;
+}
+
+static int bench_notifier() {
+    size_t i;
+    int err;
+    uint32_t key;
+    pthread_t thread;
+    struct timeval deadline, now;
+    double overshoot = 0;
+    bench_wakeup_t w;
+
+    memset(&w, 0, sizeof(w));
+
+    if (pthread_create(&thread, NULL, bench_wakeup_thread, &w)) return 1;
+
+    for (i = 1; i <= BENCH_WAKEUPS; i++) {
+	w.timestamp = bench_time();
+	w.sent = i;
+	ipecamera_notify(&w.ping);
+	bench_wait(&w.pong, &w.received, i);
+    }
+
+    pthread_join(thread, NULL);
+
+    printf("%-10s %-10s %10.1f us average wake-up latency\n", "notifier", "wakeup", 1000000. * w.latency / BENCH_WAKEUPS);
+
+    for (i = 0; i < BENCH_DEADLINES; i++) {
+	gettimeofday(&deadline, NULL);
+	deadline.tv_usec += BENCH_DEADLINE;
+	if (deadline.tv_usec > 999999) {
+	    deadline.tv_sec++;
+	    deadline.tv_usec -= 1000000;
+	}
+
+	key = ipecamera_notifier_prepare(&w.ping);
+	err = ipecamera_notifier_wait(&w.ping, key, &deadline);
+	ipecamera_notifier_cancel(&w.ping);
+	if (err != PCILIB_ERROR_TIMEOUT) {
+	    printf("Timed wait is interrupted without notification\n");
+	    return 1;
+	}
+
+	gettimeofday(&now, NULL);
+	overshoot += (now.tv_sec - deadline.tv_sec) * 1000000. + (now.tv_usec - deadline.tv_usec);
+    }
+
+    printf("%-10s %-10s %10.1f us average deadline overshoot\n", "notifier", "deadline", overshoot / BENCH_DEADLINES);
+
+    return 0;
+}
+
+static int bench_memory() {
+    int lap;
+    double start, time[2];
+    void *ring;
+    ipecamera_memory_t mem;
+    ipecamera_memory_mode_t mode;
+    char variant[32];
+
+    for (mode = IPECAMERA_MEMORY_MALLOC; mode <= IPECAMERA_MEMORY_HUGE_1GB; mode++) {
+	ring = ipecamera_memory_alloc(&mem, BENCH_RING_SIZE, mode, -1);
+	if (!ring) {
+	    printf("Failed to allocate %lu MB ring using %s pages\n", BENCH_RING_SIZE / 1024 / 1024, ipecamera_memory_mode_name(mode));
+	    return 1;
+	}
+
+	    // The first lap pays for the page faults unless the ring is prefaulted
+	for (lap = 0; lap < 2; lap++) {
+	    start = bench_time();
+	    memset(ring, lap + 1, BENCH_RING_SIZE);
+	    time[lap] = bench_time() - start;
+	}
+
+	if (mem.mode == mode) snprintf(variant, sizeof(variant), "%s", ipecamera_memory_mode_name(mode));
+	else snprintf(variant, sizeof(variant), "%s>%s", ipecamera_memory_mode_name(mode), ipecamera_memory_mode_name(mem.mode));
+	if ((mem.mode != IPECAMERA_MEMORY_MALLOC)&&(!mem.locked)) strncat(variant, "/unlocked", sizeof(variant) - strlen(variant) - 1);
+	printf("%-10s %-10s %10.1f MB/s first lap %10.1f MB/s next laps\n", "memory", variant, BENCH_RING_SIZE / time[0] / 1024. / 1024., BENCH_RING_SIZE / time[1] / 1024. / 1024.);
+
+	ipecamera_memory_free(&mem);
+    }
+
+    return 0;
+}
+
+static void *bench_slot_writer_thread(void *user) {
+    size_t i;
+    double start;
+    cpu_set_t cpus;
+    bench_slot_writer_t *w = (bench_slot_writer_t*)user;
+
+    if (w->cpu >= 0) {
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    }
+
+    start = bench_time();
+    for (i = 0; i < BENCH_SLOT_UPDATES; i++)
+	(*w->seq)++;
+    w->time = bench_time() - start;
+
+    return NULL;
+}
+
+static int bench_slot_writers(const char *variant, volatile uint64_t *raw_seq, volatile uint64_t *image_seq, const int *cpus) {
+    int i;
+    pthread_t thread[2];
+    bench_slot_writer_t w[2];
+
+    w[0].seq = raw_seq;
+    w[1].seq = image_seq;
+
+    for (i = 0; i < 2; i++) {
+	w[i].cpu = cpus[i];
+	if (pthread_create(&thread[i], NULL, bench_slot_writer_thread, &w[i])) {
+	    if (i) pthread_join(thread[0], NULL);
+	    return 1;
+	}
+    }
+
+    for (i = 0; i < 2; i++)
+	pthread_join(thread[i], NULL);
+
+    printf("%-10s %-10s %10.1f M updates/s (reader) %10.1f M updates/s (preprocessor)\n", "slots", variant, BENCH_SLOT_UPDATES / w[0].time / 1e6, BENCH_SLOT_UPDATES / w[1].time / 1e6);
+
+    return 0;
+}
+
+/*
+ The reader thread publishes a frame while a preprocessor is decoding the
+ frame in the same slot (or in the neighbouring one). Both update their
+ sequence counters and the throughput shows how much coherence traffic the
+ slot layout is causing. The threads are placed on different cores if possible.
+*/
+static int bench_slots() {
+    int err;
+    int cpus[2] = { -1, -1 };
+    cpu_set_t allowed, preproc_cpus;
+    bench_packed_slot_t *packed = NULL;
+    ipecamera_frame_t *frame = NULL;
+    ipecamera_decoded_t *decoded = NULL;
+
+    if ((!sched_getaffinity(0, sizeof(cpu_set_t), &allowed))&&(CPU_COUNT(&allowed) > 1)) {
+	ipecamera_plan_threads(&allowed, NULL, &cpus[0], &preproc_cpus);
+	for (cpus[1] = 0; cpus[1] < CPU_SETSIZE; cpus[1]++)
+	    if (CPU_ISSET(cpus[1], &preproc_cpus)) break;
+	if (cpus[1] == CPU_SETSIZE) cpus[1] = -1;
+    }
+
+    if (cpus[1] < 0) printf("%-10s %-10s the threads are sharing a core, no coherence traffic is expected\n", "slots", "warning");
+
+    if ((posix_memalign((void**)&packed, IPECAMERA_CACHE_LINE_SIZE, 2 * sizeof(bench_packed_slot_t)))||
+	(posix_memalign((void**)&frame, IPECAMERA_CACHE_LINE_SIZE, 2 * sizeof(ipecamera_frame_t)))||
+	(posix_memalign((void**)&decoded, IPECAMERA_CACHE_LINE_SIZE, 2 * sizeof(ipecamera_decoded_t)))) {
+	err = 1;
+	goto cleanup;
+    }
+
+    memset(packed, 0, 2 * sizeof(bench_packed_slot_t));
+    memset(frame, 0, 2 * sizeof(ipecamera_frame_t));
+    memset(decoded, 0, 2 * sizeof(ipecamera_decoded_t));
+
+    err = bench_slot_writers("packed", &packed[1].raw_seq, &packed[1].image_seq, cpus);
+    if (!err) err = bench_slot_writers("packed-nb", &packed[1].raw_seq, &packed[0].image_seq, cpus);
+    if (!err) err = bench_slot_writers("split", &frame[1].raw_seq, &decoded[1].image_seq, cpus);
+    if (!err) err = bench_slot_writers("split-nb", &frame[1].raw_seq, &decoded[0].image_seq, cpus);
+
+cleanup:
+    if (decoded) free(decoded);
+    if (frame) free(frame);
+    if (packed) free(packed);
+
+    return err;
+}
+
+	// The context is configured as by ipecamera_start with the camera in the mode used to generate the stream
+static int bench_init_context(ipecamera_t *ctx, const synth_config_t *cfg) {
+    memset(ctx, 0, sizeof(ipecamera_t));
+
+    ctx->firmware = (cfg->format == IPECAMERA_FORMAT_CMOSIS20)?IPECAMERA_FIRMWARE_CMOSIS20:IPECAMERA_FIRMWARE_UFO5;
+    ctx->cmosis_outputs = cfg->outputs;
+    ctx->buffer_size = 2 * BENCH_FRAMES;
+    ctx->image_buffer_size = BENCH_FRAMES;
+    ctx->rdma = PCILIB_DMA_ENGINE_INVALID;
+    ctx->numa_node = -1;
+    ctx->consumers[0].used = 1;
+    ctx->consumers[0].decimation = 1;
+    ctx->consumers[0].prefetch = 1;
+    ctx->dim.bpp = 16;
+    ctx->dim.real_bpp = cfg->adc_resolution;
+    ctx->parse_data = 1;
+    ctx->run_reader = 1;
+    ctx->change_threshold = -1;
+
+    return ipecamera_alloc_buffers(ctx);
+}
+
+static int bench_replay(ipecamera_t *ctx, void *stream, size_t stream_size, size_t loops, pcilib_dma_callback_t cb, void *user) {
+    int err;
+    ipecamera_replay_t *replay;
+
+    replay = ipecamera_replay_new(stream, stream_size, BENCH_PACKET_SIZE);
+    if (!replay) return PCILIB_ERROR_MEMORY;
+
+    ipecamera_replay_set_pacing(replay, 0, 0, loops);
+
+    err = ipecamera_replay_stream(replay, 0, cb?cb:ipecamera_data_callback, cb?user:ctx);
+    if (err == PCILIB_ERROR_TIMEOUT) err = 0;
+    if (err) printf("Reader has failed with error %i\n", err);
+
+    ipecamera_replay_free(replay);
+
+    return err;
+}
+
+	// Decodes the last frames of the stream again and again, the frames are decoded in order
+static double bench_decode(ipecamera_t *ctx, size_t *broken) {
+    size_t j, k;
+    double start;
+    pcilib_event_id_t last = ipecamera_get_last_event_id(ctx);
+
+    start = bench_time();
+    for (k = 0; k < BENCH_LOOPS; k++) {
+	for (j = BENCH_FRAMES; j > 0; j--) {
+	    ipecamera_drop_image(ctx, last - j + 1);
+	    if (ipecamera_decode_frame(ctx, last - j + 1)) (*broken)++;
+	}
+    }
+
+    return bench_time() - start;
+}
+
+static int bench_builtin(ipecamera_t *ctx, const char *name, const synth_config_t *cfg) {
+    int i, err = 0;
+    size_t broken = 0;
+    double time;
+    char variant[32];
+    const char *unpackers[] = { "scalar", "sse4", "avx2", NULL };
+
+    for (i = 0; i < 4; i++) {
+	if (ipecamera_select_unpacker(unpackers[i])) continue;
+
+	err = ipecamera_set_decoder(ctx, unpackers[i]?unpackers[i]:"builtin", 0);
+	if (err) break;
+
+	time = bench_decode(ctx, &broken);
+	if (broken) {
+	    printf("%zu of %zu frames were not decoded by the %s decoder\n", broken, (size_t)BENCH_LOOPS * BENCH_FRAMES, ipecamera_get_unpacker_name());
+	    err = 1;
+	    break;
+	}
+
+	snprintf(variant, sizeof(variant), "%s/%s", name, unpackers[i]?unpackers[i]:"auto");
+	bench_report("builtin", variant, time, synth_get_frame_size(cfg) * (size_t)BENCH_LOOPS * BENCH_FRAMES, (size_t)BENCH_LOOPS * BENCH_FRAMES, "frames");
+    }
+
+    ipecamera_set_decoder(ctx, NULL, 0);
+
+    return err?1:0;
+}
+
+	// Compares decoding with a copy into the caller buffer and directly into it
+static int bench_direct(ipecamera_t *ctx, const char *name) {
+    int direct, err = 0;
+    size_t j, k, size;
+    size_t image_size = ctx->dim.width * ctx->dim.height * sizeof(ipecamera_pixel_t);
+    pcilib_event_id_t evid, last = ipecamera_get_last_event_id(ctx);
+    double start, time;
+    char variant[32];
+    void *data;
+    ipecamera_pixel_t *buf;
+
+    buf = malloc(image_size);
+    if (!buf) return 1;
+
+    err = ipecamera_set_decoder(ctx, "builtin", 0);
+
+    for (direct = 0; (!err)&&(direct < 2); direct++) {
+	start = bench_time();
+	for (k = 0; (!err)&&(k < BENCH_LOOPS); k++) {
+	    for (j = 0; (!err)&&(j < BENCH_FRAMES); j++) {
+		evid = last - j;
+		ipecamera_drop_image(ctx, evid);
+		if (!direct) ipecamera_decode_frame(ctx, evid);
+
+		data = buf;
+		size = image_size;
+		err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+		if (err) printf("Failed to get image of frame %zu, error %i\n", (size_t)evid, err);
+	    }
+	}
+	time = bench_time() - start;
+
+	snprintf(variant, sizeof(variant), "%s/%s", name, direct?"direct":"copy");
+	if (!err) bench_report("builtin", variant, time, image_size * (size_t)BENCH_LOOPS * BENCH_FRAMES, (size_t)BENCH_LOOPS * BENCH_FRAMES, "frames");
+    }
+
+    ipecamera_set_decoder(ctx, NULL, 0);
+    free(buf);
+
+    return err?1:0;
+}
+
+	// Each bit depth needs own stream, the decoded image is packed by all kernels
+static int bench_packed(const char *name, const synth_config_t *stream_cfg) {
+    int i, bpp, err = 0;
+    size_t j, k, size, stream_size;
+    pcilib_event_id_t evid;
+    double start, time;
+    char variant[32];
+    void *stream;
+    uint8_t *buf = NULL;
+    ipecamera_pixel_t *image;
+    ipecamera_t ctx;
+    synth_config_t cfg = *stream_cfg;
+    const char *unpackers[] = { "scalar", "sse4", "avx2", NULL };
+
+    stream = malloc(synth_get_stream_size(&cfg, BENCH_FRAMES));
+    if (!stream) return 1;
+
+    for (bpp = 10; (!err)&&(bpp <= 12); bpp++) {
+	cfg.adc_resolution = bpp;
+	stream_size = synth_generate_stream(&cfg, BENCH_FRAMES, stream);
+
+	err = bench_init_context(&ctx, &cfg);
+	if (!err) err = bench_replay(&ctx, stream, stream_size, 1, NULL, NULL);
+	if (!err) err = ipecamera_set_decoder(&ctx, "builtin", 0);
+	if (err) {
+	    ipecamera_free_buffers(&ctx);
+	    break;
+	}
+
+	size = ctx.dim.width * ctx.dim.height * sizeof(ipecamera_pixel_t);
+	if (!buf) buf = malloc(size);
+
+	evid = ipecamera_get_last_event_id(&ctx);
+
+	image = NULL;
+	err = buf?ipecamera_get(&ctx.event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, (void**)&image):1;
+	if (err) printf("Failed to get image of frame %zu, error %i\n", (size_t)evid, err);
+
+	for (i = 0; (!err)&&(i < 4); i++) {
+	    if (ipecamera_select_unpacker(unpackers[i])) continue;
+
+	    start = bench_time();
+	    for (k = 0; k < BENCH_LOOPS; k++) {
+		for (j = 0; j < BENCH_FRAMES; j++)
+		    ipecamera_pack_lines(&ctx, image, 0, ctx.dim.height, buf);
+	    }
+	    time = bench_time() - start;
+
+	    snprintf(variant, sizeof(variant), "%s/%i/%s", name, bpp, unpackers[i]?unpackers[i]:"auto");
+	    bench_report("packed", variant, time, size * (size_t)BENCH_LOOPS * BENCH_FRAMES, (size_t)BENCH_LOOPS * BENCH_FRAMES, "frames");
+	}
+
+	if (image) ipecamera_return(&ctx.event, evid, IPECAMERA_IMAGE_DATA, image);
+
+	ipecamera_select_unpacker(NULL);
+	ipecamera_set_decoder(&ctx, NULL, 0);
+	ipecamera_free_buffers(&ctx);
+    }
+
+    free(buf);
+    free(stream);
+
+    return err?1:0;
+}
+
+	// Region reads of the frames which are not decoded, only the rows of the region are decoded
+static int bench_region(ipecamera_t *ctx, const char *name, const synth_config_t *cfg) {
+    int err = 0;
+    size_t j, k, size = 0;
+    pcilib_event_id_t last = ipecamera_get_last_event_id(ctx);
+    double start, time;
+    char variant[32];
+    void *data;
+    ipecamera_image_region_t region;
+
+    region.x = ctx->dim.width / 4 + 3;
+    region.y = (cfg->lines / 3) | 1;
+    region.width = ctx->dim.width / 2;
+    region.height = (cfg->lines - region.y < 256)?(cfg->lines - region.y):256;
+
+    data = malloc(region.width * region.height * sizeof(ipecamera_pixel_t));
+    if (!data) return 1;
+
+    err = ipecamera_set_decoder(ctx, "builtin", 0);
+
+    start = bench_time();
+    for (k = 0; (!err)&&(k < BENCH_LOOPS); k++) {
+	for (j = 0; (!err)&&(j < BENCH_FRAMES); j++) {
+	    size = region.width * region.height * sizeof(ipecamera_pixel_t);
+	    ipecamera_drop_image(ctx, last - j);
+	    err = ipecamera_get(&ctx->event, last - j, IPECAMERA_IMAGE_REGION, sizeof(region), &region, &size, &data);
+	    if (err) printf("Failed to get region of frame %zu, error %i\n", (size_t)(last - j), err);
+	}
+    }
+    time = bench_time() - start;
+
+    snprintf(variant, sizeof(variant), "%s/%u-rows", name, region.height);
+    if (!err) bench_report("region", variant, time, size * (size_t)BENCH_LOOPS * BENCH_FRAMES, (size_t)BENCH_LOOPS * BENCH_FRAMES, "regions");
+
+    ipecamera_set_decoder(ctx, NULL, 0);
+    free(data);
+
+    return err?1:0;
+}
+
+	// Counts the bytes received until the first lines of the frame are available
+static int bench_progressive_callback(void *user, pcilib_dma_flags_t flags, size_t bufsize, void *buf) {
+    int res;
+    size_t lines;
+    bench_progressive_t *state = (bench_progressive_t*)user;
+    ipecamera_t *ctx = state->ctx;
+    pcilib_event_id_t evid;
+
+    res = ipecamera_data_callback(ctx, flags, bufsize, buf);
+    state->bytes += bufsize;
+
+    evid = ipecamera_get_last_event_id(ctx);
+    if (evid != state->last_id) {
+	state->last_id = evid;
+	state->bytes = 0;
+	state->checked = 0;
+	return res;
+    }
+
+    if (state->checked) return res;
+
+    if ((!ipecamera_get_lines_ready(ctx, evid + 1, &lines))&&(lines >= state->lines)) {
+	state->checked = 1;
+	state->frames++;
+	state->received += (double)state->bytes / state->frame_size;
+    }
+
+    return res;
+}
+
+	// Streams the frames with the reader publishing progress and measures how early the first lines are available
+static int bench_progressive(const char *name, const synth_config_t *cfg, void *stream, size_t stream_size) {
+    int err;
+    ipecamera_t ctx;
+    bench_progressive_t state;
+
+    memset(&state, 0, sizeof(bench_progressive_t));
+    state.ctx = &ctx;
+    state.lines = (cfg->lines / 2 < 256)?(cfg->lines / 2):256;
+    state.frame_size = stream_size / BENCH_FRAMES;
+
+    err = bench_init_context(&ctx, cfg);
+    if (!err) err = ipecamera_set_progressive(&ctx, 1);
+    if (!err) err = bench_replay(&ctx, stream, stream_size, 1, bench_progressive_callback, &state);
+
+    if ((!err)&&(!state.frames)) {
+	printf("The first %zu lines are never available before the frame is complete\n", state.lines);
+	err = 1;
+    }
+
+    if (!err)
+	printf("%-10s %-10s %10.1f %% of the frame is received when %zu lines are available\n", "progressive", name, 100. * state.received / state.frames, state.lines);
+
+    ipecamera_free_buffers(&ctx);
+
+    return err?1:0;
+}
+
+	// Change detection fused into the built-in decoder, the synthetic rows are either all changed or all unchanged depending on the threshold
+static int bench_cmask(ipecamera_t *ctx, const char *name, const synth_config_t *cfg) {
+    int i, err = 0;
+    size_t broken = 0;
+    double time;
+    char variant[32];
+    const int thresholds[] = { -1, 0, 0xFFFF };
+    const char *modes[] = { "off", "changed", "unchanged" };
+
+    err = ipecamera_set_decoder(ctx, "builtin", 0);
+
+	// The frames are decoded in order, so the previous frame is always available
+    for (i = 0; (!err)&&(i < 3); i++) {
+	err = ipecamera_set_change_threshold(ctx, thresholds[i]);
+	if (err) break;
+
+	time = bench_decode(ctx, &broken);
+
+	snprintf(variant, sizeof(variant), "%s/%s", name, modes[i]);
+	bench_report("cmask", variant, time, synth_get_frame_size(cfg) * (size_t)BENCH_LOOPS * BENCH_FRAMES, (size_t)BENCH_LOOPS * BENCH_FRAMES, "frames");
+
+	if (broken) {
+	    printf("%zu of %zu frames were not decoded with change detection\n", broken, (size_t)BENCH_LOOPS * BENCH_FRAMES);
+	    err = 1;
+	}
+    }
+
+    ipecamera_set_change_threshold(ctx, -1);
+    ipecamera_set_decoder(ctx, NULL, 0);
+
+    return err?1:0;
+}
+
+	// The main thread decodes frames one after another and the preprocessors help with bands, i.e. per-frame latency is measured
+static int bench_bands(ipecamera_t *ctx, const char *name, const synth_config_t *cfg, size_t n_bands) {
+    int err;
+    size_t n_threads;
+    size_t broken = 0;
+    double time;
+    char variant[32];
+
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads > n_bands) n_threads = n_bands;
+    if (n_threads > BENCH_MAX_BANDS) n_threads = BENCH_MAX_BANDS;
+
+    err = ipecamera_start_preprocessors(ctx, n_threads - 1, n_bands);
+    if (err) return err;
+
+    time = bench_decode(ctx, &broken);
+
+    ipecamera_stop_preprocessors(ctx);
+
+    if (broken) {
+	printf("%zu of %zu frames were not decoded in %zu bands\n", broken, (size_t)BENCH_LOOPS * BENCH_FRAMES, n_bands);
+	return 1;
+    }
+
+    snprintf(variant, sizeof(variant), "%s*%zu", name, n_bands);
+    bench_report("bands", variant, time, synth_get_frame_size(cfg) * (size_t)BENCH_LOOPS * BENCH_FRAMES, (size_t)BENCH_LOOPS * BENCH_FRAMES, "frames");
+    printf("%-10s %-10s %10.1f ms per frame using %zu threads\n", "bands", variant, 1000. * time / ((size_t)BENCH_LOOPS * BENCH_FRAMES), n_threads);
+
+    return 0;
+}
+
+static int bench_stream(const char *stage, const char *name, synth_config_t *cfg) {
+    int err;
+    size_t i, size;
+    size_t frames = BENCH_FRAMES * BENCH_LOOPS;
+    size_t broken = 0;
+    double start, time;
+    void *data;
+    ipecamera_t ctx;
+
+    data = malloc(synth_get_stream_size(cfg, BENCH_FRAMES));
+    if (!data) return 1;
+
+    size = synth_generate_stream(cfg, BENCH_FRAMES, data);
+
+    err = bench_init_context(&ctx, cfg);
+    if (err) goto cleanup;
+
+    start = bench_time();
+    err = bench_replay(&ctx, data, size, BENCH_LOOPS, NULL, NULL);
+    time = bench_time() - start;
+    if (err) goto cleanup;
+
+    if (ipecamera_get_last_event_id(&ctx) != frames) {
+	printf("Reader has found %lu frames, but %zu are expected\n", (unsigned long)ipecamera_get_last_event_id(&ctx), frames);
+	err = 1;
+	goto cleanup;
+    }
+
+    if ((!strcmp(stage, "all"))||(!strcmp(stage, "reader"))) {
+	bench_report("reader", name, time, size * BENCH_LOOPS, frames, "frames");
+    }
+
+    if ((!strcmp(stage, "all"))||(!strcmp(stage, "decode"))) {
+	time = bench_decode(&ctx, &broken);
+	bench_report("decode", name, time, synth_get_frame_size(cfg) * (size_t)BENCH_LOOPS * BENCH_FRAMES, (size_t)BENCH_LOOPS * BENCH_FRAMES, "frames");
+	if (broken) printf("%zu of %zu frames were not decoded\n", broken, (size_t)BENCH_LOOPS * BENCH_FRAMES);
+    }
+
+    if ((!strcmp(stage, "all"))||(!strcmp(stage, "builtin"))) {
+	err = bench_builtin(&ctx, name, cfg);
+	if (!err) err = bench_direct(&ctx, name);
+	if (!err) err = bench_packed(name, cfg);
+	if (!err) err = bench_region(&ctx, name, cfg);
+	if (!err) err = bench_progressive(name, cfg, data, size);
+	if (!err) err = bench_cmask(&ctx, name, cfg);
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "bands")))) {
+	for (i = 1; (!err)&&(i <= BENCH_MAX_BANDS); i *= 2) {
+	    err = bench_bands(&ctx, name, cfg, i);
+	}
+    }
+
+cleanup:
+    ipecamera_free_buffers(&ctx);
+    free(data);
+
+    return err;
+}
+
+static int bench_streams(const char *stage) {
+    int i, err = 0;
+    synth_config_t cfg;
+
+    struct {
+	const char *name;
+	ipecamera_format_t format;
+	size_t outputs;
+	int version;
+	synth_bug_t bugs;
+    } streams[] = {
+	{ "cmosis", IPECAMERA_FORMAT_CMOSIS, 16, 1, 0 },
+	{ "cmosis/4", IPECAMERA_FORMAT_CMOSIS, 4, 0, 0 },
+	{ "cmosis/bug", IPECAMERA_FORMAT_CMOSIS, 16, 1, SYNTH_BUG_SPLIT_HEADERS|SYNTH_BUG_MULTIFRAME|SYNTH_BUG_REPEATING_DATA },
+	{ "cmosis20", IPECAMERA_FORMAT_CMOSIS20, 16, 1, 0 },
+	{ "cmosis20/4", IPECAMERA_FORMAT_CMOSIS20, 4, 1, 0 },
+	{ NULL }
+    };
+
+    for (i = 0; streams[i].name; i++) {
+	synth_init(&cfg, streams[i].format);
+	cfg.outputs = streams[i].outputs;
+	cfg.version = streams[i].version;
+	cfg.bugs |= streams[i].bugs;
+
+	err = bench_stream(stage, streams[i].name, &cfg);
+	if (err) {
+	    printf("Benchmark of %s stream has failed\n", streams[i].name);
+	    break;
+	}
+    }
+
+    return err;
+}
+
+int main(int argc, char *argv[]) {
+    int err = 0;
+    const char *stage = (argc > 1)?argv[1]:"all";
+
+	// The injected hardware bugs are reported as warnings
+    pcilib_set_logger(PCILIB_LOG_ERROR, &bench_log, NULL);
+
+    if ((!strcmp(stage, "all"))||(!strcmp(stage, "scanner"))) {
+	err = bench_scanner();
+	if (err) printf("Frame magic scanner benchmark has failed\n");
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "notifier")))) {
+	err = bench_notifier();
+	if (err) printf("Notifier benchmark has failed\n");
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "memory")))) {
+	err = bench_memory();
+	if (err) printf("Ring allocation benchmark has failed\n");
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "slots")))) {
+	err = bench_slots();
+	if (err) printf("Slot layout benchmark has failed\n");
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "reader"))||(!strcmp(stage, "decode"))||(!strcmp(stage, "builtin"))||(!strcmp(stage, "bands")))) {
+	err = bench_streams(stage);
+    }
+
+    return err;
+}
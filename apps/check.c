@@ -0,0 +1,1648 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <pcilib.h>
+#include <pcilib/error.h>
+
+#include "private.h"
+#include "reader.h"
+#include "data.h"
+#include "base.h"
+#include "scanner.h"
+#include "replay.h"
+#include "events.h"
+#include "decoder.h"
+#include "topology.h"
+#include "synth.h"
+
+#define CHECK_PACKET_SIZE 4096
+#define CHECK_FRAMES 4			/**< Number of frames in the synthetic stream, the ring buffer is twice larger to have a slot for the frame in flight */
+#define CHECK_LOOPS 4			/**< Number of times the synthetic stream is replayed, so the ring is wrapped around */
+#define CHECK_RING_SIZE (2 * CHECK_FRAMES)
+#define CHECK_DEADLINES 10		/**< Number of timed waits which should time out */
+#define CHECK_DEADLINE 1000		/**< Timeout of timed waits in us */
+#define CHECK_MAX_BANDS 16		/**< Maximal number of bands to split the frame in */
+#define CHECK_CONSUMER_DELAY 5000	/**< Processing time of the slow consumer in us */
+#define CHECK_CONSUMER_TIMEOUT 3000000	/**< Consumers fail if no event is received within this timeout (us), longer than IPECAMERA_HOLD_TIMEOUT */
+#define CHECK_DECIMATION 3		/**< Decimation of the fast consumer */
+#define CHECK_BATCH_SIZE 8		/**< Maximal number of events retrieved at once */
+
+#define CHECK_SEQNUM(evid) (((evid) - 1) % CHECK_FRAMES)	//**< Generated frame replayed as the event */
+
+typedef struct {
+    ipecamera_t *ctx;
+    ipecamera_consumer_t *consumer;
+    size_t frames;			/**< Number of frames in the stream */
+    size_t step;			/**< Minimal distance between the reported events */
+    useconds_t delay;			/**< Processing time of a single event */
+    size_t gaps;			/**< Number of times the distance between the reported events was larger than step */
+    int err;
+} check_consumer_t;
+
+typedef struct {
+    ipecamera_t *ctx;
+    const synth_config_t *cfg;
+    size_t lines;			/**< Number of lines which should be checked before the frame is complete */
+    int progressive;			/**< Progressive mode is enabled, otherwise no lines should be available before the frame is complete */
+    pcilib_event_id_t event_id;		/**< Frame being received */
+    size_t ready;			/**< Number of lines ready at the previous packet */
+    int checked;			/**< The first lines of the current frame are already checked */
+    size_t frames;			/**< Number of frames checked before they were complete */
+    pcilib_event_id_t payload_id;	/**< Frame the payload of the first lines was copied from */
+    void *payload;			/**< Payload of the first lines copied while the frame was received */
+    size_t payload_size;		/**< Size of the payload buffer */
+    size_t payload_copied;		/**< Size of the copied payload */
+    int err;
+} check_progressive_t;
+
+typedef struct {
+    ipecamera_t *ctx;
+    pcilib_event_id_t last_id;		/**< Last frame compared */
+    size_t compared;			/**< Number of frames decoded by both decoders */
+    size_t rejected;			/**< Number of frames rejected by ufodecode */
+    size_t mismatch;			/**< Number of frames decoded differently by the built-in decoder */
+    ipecamera_pixel_t *ufo;		/**< Frame decoded by ufodecode */
+    ipecamera_pixel_t *builtin;		/**< Frame decoded by the built-in decoder */
+    int err;
+} check_dump_t;
+
+static const char *check_unpackers[] = { "scalar", "sse4", "avx2", NULL };
+
+static void check_log(void *arg, const char *file, int line, pcilib_log_priority_t prio, const char *format, va_list ap) {
+    vprintf(format, ap);
+    printf("\n");
+}
+
+static int check_scanner() {
+    size_t pos, res1, res2, res3;
+    uint32_t *packet;
+
+    packet = malloc(CHECK_PACKET_SIZE);
+    if (!packet) return 1;
+
+    for (pos = 0; pos < CHECK_PACKET_SIZE; pos += sizeof(uint32_t)) {
+	memset(packet, 0, CHECK_PACKET_SIZE);
+	if ((pos + 12) <= CHECK_PACKET_SIZE) {
+	    packet[pos / 4 + 1] = 0x52222222;
+	    packet[pos / 4 + 2] = 0x53333333;
+	}
+
+	res1 = ipecamera_find_frame_magic_scalar(packet, CHECK_PACKET_SIZE, 0);
+	res2 = ipecamera_find_frame_magic_sse2(packet, CHECK_PACKET_SIZE, 0);
+	res3 = ipecamera_find_frame_magic_avx2(packet, CHECK_PACKET_SIZE, 0);
+	if ((res1 != res2)||(res1 != res3)) {
+	    printf("Scanner mismatch for magic at %zu: scalar %zu, sse2 %zu, avx2 %zu\n", pos, res1, res2, res3);
+	    break;
+	}
+
+	res2 = ipecamera_find_frame_magic(packet, CHECK_PACKET_SIZE, pos / 2);
+	res1 = ipecamera_find_frame_magic_scalar(packet, CHECK_PACKET_SIZE, pos / 2);
+	if (res1 != res2) {
+	    printf("Scanner mismatch for magic at %zu starting from %zu: scalar %zu, %s %zu\n", pos, pos / 2, res1, ipecamera_get_scanner_name(), res2);
+	    break;
+	}
+    }
+
+    free(packet);
+
+    if (pos < CHECK_PACKET_SIZE) return 1;
+
+    printf("%-10s %-10s all scanners agree on %i magic positions\n", "scanner", ipecamera_get_scanner_name(), CHECK_PACKET_SIZE / 4);
+
+    return 0;
+}
+
+	// The wait returns right away if notified after the key is taken, otherwise it times out
+static int check_notifier() {
+    int i, err;
+    uint32_t key;
+    struct timeval deadline;
+    ipecamera_notifier_t notifier;
+
+    memset(&notifier, 0, sizeof(notifier));
+
+    for (i = 0; i < CHECK_DEADLINES; i++) {
+	gettimeofday(&deadline, NULL);
+	deadline.tv_usec += CHECK_DEADLINE;
+	if (deadline.tv_usec > 999999) {
+	    deadline.tv_sec++;
+	    deadline.tv_usec -= 1000000;
+	}
+
+	key = ipecamera_notifier_prepare(&notifier);
+	if (i % 2) ipecamera_notify(&notifier);
+	err = ipecamera_notifier_wait(&notifier, key, &deadline);
+	ipecamera_notifier_cancel(&notifier);
+
+	if ((i % 2)&&(err)) {
+	    printf("Notified wait has failed with error %i\n", err);
+	    return 1;
+	}
+
+	if ((!(i % 2))&&(err != PCILIB_ERROR_TIMEOUT)) {
+	    printf("Timed wait is interrupted without notification\n");
+	    return 1;
+	}
+    }
+
+    printf("%-10s %-10s %10i waits are woken up or timed out as expected\n", "notifier", "deadline", CHECK_DEADLINES);
+
+    return 0;
+}
+
+static int check_topology() {
+    int reader_cpu;
+    char cpulist[256];
+    cpu_set_t allowed, preproc_cpus;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) return 1;
+
+    ipecamera_plan_threads(&allowed, NULL, &reader_cpu, &preproc_cpus);
+    if (reader_cpu < 0) {
+	printf("No CPU is found for the reader thread\n");
+	return 1;
+    }
+
+    if (CPU_ISSET(reader_cpu, &preproc_cpus)) {
+	printf("Preprocessor is placed on the reader CPU %i\n", reader_cpu);
+	return 1;
+    }
+
+    printf("%-10s %-10s reader on CPU %i, %i preprocessors on CPUs %s (of %s)\n", "topology", "auto", reader_cpu, CPU_COUNT(&preproc_cpus),
+	ipecamera_format_cpulist(&preproc_cpus, cpulist, sizeof(cpulist)), ipecamera_format_cpulist(&allowed, cpulist + 128, sizeof(cpulist) - 128));
+
+    return 0;
+}
+
+	// The context is configured as by ipecamera_start with the camera in the mode used to generate the stream
+static int check_init_context(ipecamera_t *ctx, const synth_config_t *cfg, int packed) {
+    memset(ctx, 0, sizeof(ipecamera_t));
+
+    ctx->firmware = (cfg->format == IPECAMERA_FORMAT_CMOSIS20)?IPECAMERA_FIRMWARE_CMOSIS20:IPECAMERA_FIRMWARE_UFO5;
+    ctx->cmosis_outputs = cfg->outputs;
+    ctx->buffer_size = CHECK_RING_SIZE;
+    ctx->image_buffer_size = CHECK_FRAMES;
+    ctx->pack_images = packed;
+    ctx->rdma = PCILIB_DMA_ENGINE_INVALID;
+    ctx->numa_node = -1;
+    ctx->consumers[0].used = 1;
+    ctx->consumers[0].decimation = 1;
+    ctx->consumers[0].prefetch = 1;
+    ctx->dim.bpp = 16;
+    ctx->dim.real_bpp = cfg->adc_resolution;
+    ctx->parse_data = 1;
+    ctx->run_reader = 1;
+    ctx->change_threshold = -1;
+
+    return ipecamera_alloc_buffers(ctx);
+}
+
+static int check_replay(ipecamera_t *ctx, void *stream, size_t stream_size, size_t loops, pcilib_dma_callback_t cb, void *user) {
+    int err;
+    ipecamera_replay_t *replay;
+
+    replay = ipecamera_replay_new(stream, stream_size, CHECK_PACKET_SIZE);
+    if (!replay) return PCILIB_ERROR_MEMORY;
+
+    ipecamera_replay_set_pacing(replay, 0, 0, loops);
+
+    err = ipecamera_replay_stream(replay, 0, cb?cb:ipecamera_data_callback, cb?user:ctx);
+    if (err == PCILIB_ERROR_TIMEOUT) err = 0;
+    if (err) printf("Reader has failed with error %i\n", err);
+
+    ipecamera_replay_free(replay);
+
+    return err;
+}
+
+static int check_pixels(ipecamera_t *ctx, const synth_config_t *cfg, size_t frame, const ipecamera_pixel_t *pixels) {
+    size_t row, col;
+
+    for (row = 0; row < cfg->lines; row++) {
+	for (col = 0; col < ctx->dim.width; col++) {
+	    if (pixels[row * ctx->dim.width + col] != synth_pixel(cfg, frame, row, col)) {
+		printf("Frame %zu has pixel (%zu, %zu) = 0x%x, but 0x%x is expected\n", frame, row, col, pixels[row * ctx->dim.width + col], synth_pixel(cfg, frame, row, col));
+		return 1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+static int check_meta(const synth_config_t *cfg, size_t frame, const UfoDecoderMeta *meta) {
+    if ((meta->frame_number != frame)||(meta->n_rows != cfg->lines)||(meta->time_stamp != synth_time_stamp(frame))||(meta->adc_resolution != (cfg->adc_resolution - 10))) {
+	printf("Frame %zu has wrong metadata: frame number %u, %u rows, time stamp 0x%x, ADC resolution %u\n", frame, meta->frame_number, meta->n_rows, meta->time_stamp, meta->adc_resolution);
+	return 1;
+    }
+
+    if ((meta->status1.bits != synth_status(frame, 1))||(meta->status2.bits != synth_status(frame, 2))||(meta->status3.bits != synth_status(frame, 3))) {
+	printf("Frame %zu has wrong status words: 0x%x 0x%x 0x%x\n", frame, meta->status1.bits, meta->status2.bits, meta->status3.bits);
+	return 1;
+    }
+
+    return 0;
+}
+
+	// The packed buffer starts at the first line
+static int check_packed(ipecamera_t *ctx, const synth_config_t *cfg, size_t frame, size_t first_line, size_t n_lines, const uint8_t *packed) {
+    int bpp = ctx->dim.real_bpp;
+    size_t row, col, bit;
+    uint32_t value, expected;
+
+    for (row = first_line; row < first_line + n_lines; row++) {
+	for (col = 0; col < ctx->dim.width; col++) {
+	    bit = ((row - first_line) * ctx->dim.width + col) * bpp;
+	    value = packed[bit / 8] | (packed[bit / 8 + 1] << 8);
+	    if ((bit % 8) + bpp > 16) value |= packed[bit / 8 + 2] << 16;
+	    value = (value >> (bit % 8)) & ((1 << bpp) - 1);
+	    expected = synth_pixel(cfg, frame, row, col) >> (12 - bpp);
+	    if (value != expected) {
+		printf("Frame %zu has packed %i-bit pixel (%zu, %zu) = 0x%x, but 0x%x is expected\n", frame, bpp, row, col, value, expected);
+		return 1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+static int check_region(ipecamera_t *ctx, const synth_config_t *cfg, size_t frame, const ipecamera_image_region_t *region, const ipecamera_pixel_t *pixels) {
+    size_t row, col;
+    ipecamera_pixel_t expected;
+
+    for (row = region->y; row < region->y + region->height; row++) {
+	for (col = region->x; col < region->x + region->width; col++) {
+		// The rows not transferred by the camera are zeroed
+	    expected = (row < cfg->lines)?synth_pixel(cfg, frame, row, col):0;
+	    if (pixels[(row - region->y) * region->width + col - region->x] != expected) {
+		printf("Frame %zu has region pixel (%zu, %zu) = 0x%x, but 0x%x is expected\n", frame, row, col, pixels[(row - region->y) * region->width + col - region->x], expected);
+		return 1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+	// The slot of the frame following the stream is already taken by the next one, even if nothing is written yet
+static int check_frames(ipecamera_t *ctx, size_t frames) {
+    int err;
+    size_t size;
+    void *data = NULL;
+
+    if (ipecamera_get_last_event_id(ctx) != frames) {
+	printf("Reader has found %lu frames, but %zu are expected\n", (unsigned long)ipecamera_get_last_event_id(ctx), frames);
+	return 1;
+    }
+
+    err = ipecamera_get(&ctx->event, frames + 1 - CHECK_RING_SIZE, IPECAMERA_RAW_DATA, 0, NULL, &size, &data);
+    if (err != PCILIB_ERROR_OVERWRITTEN) {
+	printf("Overwritten frame %zu is not detected (error %i)\n", frames + 1 - CHECK_RING_SIZE, err);
+	return 1;
+    }
+
+    return 0;
+}
+
+	// The lagging consumer takes a single event, the other one drains the ring. Both should skip the overwritten events on their own.
+static int check_consumers(ipecamera_t *ctx, const synth_config_t *cfg, ipecamera_consumer_t *lagging, ipecamera_consumer_t *consumer, size_t frames) {
+    int err;
+    size_t first = frames - (CHECK_RING_SIZE - 1 - IPECAMERA_RESERVE_BUFFERS);
+    pcilib_event_id_t evid, next_id;
+    ipecamera_event_info_t info;
+    ipecamera_consumer_stats_t stats;
+
+    ctx->started = 1;
+
+    err = ipecamera_consumer_next_event(ctx, lagging, 0, &evid, 0, NULL);
+    if ((err)||(evid != first)) {
+	printf("Lagging consumer got event %zu (error %i), but %zu is expected\n", evid, err, first);
+	goto done;
+    }
+
+    for (next_id = first; next_id <= frames; next_id++) {
+	err = ipecamera_consumer_next_event(ctx, consumer, 0, &evid, sizeof(info), (pcilib_event_info_t*)&info);
+	if ((err)||(evid != next_id)) {
+	    printf("Subscribed consumer got event %zu (error %i), but %zu is expected\n", evid, err, next_id);
+	    if (!err) err = PCILIB_ERROR_INVALID_DATA;
+	    goto done;
+	}
+
+	if ((info.info.flags&PCILIB_EVENT_INFO_FLAG_BROKEN)||(info.raw_size != synth_get_frame_size(cfg))||(info.info.seqnum != CHECK_SEQNUM(evid))) {
+	    printf("Frame %zu has %zu bytes and sequence number %lu, but %zu and %zu are expected (flags 0x%x)\n", (size_t)evid, info.raw_size, (unsigned long)info.info.seqnum, synth_get_frame_size(cfg), (size_t)CHECK_SEQNUM(evid), info.info.flags);
+	    err = PCILIB_ERROR_INVALID_DATA;
+	    goto done;
+	}
+    }
+
+    err = ipecamera_consumer_next_event(ctx, consumer, 0, &evid, 0, NULL);
+    if (err != PCILIB_ERROR_TIMEOUT) {
+	printf("Subscribed consumer got event beyond the last one\n");
+	err = PCILIB_ERROR_INVALID_DATA;
+	goto done;
+    }
+    err = 0;
+
+    ipecamera_consumer_get_stats(ctx, lagging, &stats);
+    if ((stats.reported != 1)||(stats.dropped != first - 1)||(stats.lag != frames - first)) {
+	printf("Lagging consumer reports %zu events, %zu dropped, lag %zu\n", stats.reported, stats.dropped, stats.lag);
+	err = PCILIB_ERROR_INVALID_DATA;
+	goto done;
+    }
+
+    ipecamera_consumer_get_stats(ctx, consumer, &stats);
+    if ((stats.reported != frames - first + 1)||(stats.dropped != first - 1)||(stats.lag)) {
+	printf("Subscribed consumer reports %zu events, %zu dropped, lag %zu\n", stats.reported, stats.dropped, stats.lag);
+	err = PCILIB_ERROR_INVALID_DATA;
+	goto done;
+    }
+
+    printf("%-10s %-10s %10zu events delivered to both consumers independently\n", "consumers", "skip", frames - first + 1);
+
+done:
+    ctx->started = 0;
+    return err?1:0;
+}
+
+	// The batch is limited by the number of available events, the data is returned in place
+static int check_batch(ipecamera_t *ctx, const synth_config_t *cfg, ipecamera_consumer_t *consumer, size_t frames) {
+    int err;
+    size_t i, n_events;
+    pcilib_event_id_t evid;
+    ipecamera_batch_entry_t events[CHECK_BATCH_SIZE];
+    size_t sizes[] = { 2, CHECK_BATCH_SIZE };
+    size_t expected[] = { 2, 1 };
+
+    ctx->started = 1;
+
+	// The consumer is lagging and skips to the oldest event still in the ring, 3 events before the end
+    err = ipecamera_consumer_next_event(ctx, consumer, 0, &evid, 0, NULL);
+    if ((err)||(evid != frames - 3)) {
+	printf("Batch consumer got event %zu (error %i), but %zu is expected\n", (size_t)evid, err, frames - 3);
+	if (!err) err = PCILIB_ERROR_INVALID_DATA;
+	goto done;
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	err = ipecamera_next_batch(ctx, consumer, 0, IPECAMERA_RAW_DATA, sizes[i], events, &n_events);
+	if ((err)||(n_events != expected[i])) {
+	    printf("Batch of %zu events is returned (error %i), but %zu are expected\n", n_events, err, expected[i]);
+	    if (!err) err = PCILIB_ERROR_INVALID_DATA;
+	    goto done;
+	}
+
+	for (n_events = 0; n_events < expected[i]; n_events++) {
+	    if ((events[n_events].error)||(!events[n_events].data)||(events[n_events].size != synth_get_frame_size(cfg))||(events[n_events].info.raw_size != synth_get_frame_size(cfg))) {
+		printf("Event %zu of the batch is not returned properly (error %i)\n", (size_t)events[n_events].event_id, events[n_events].error);
+		err = PCILIB_ERROR_INVALID_DATA;
+		goto done;
+	    }
+	}
+
+	err = ipecamera_return_batch(ctx, IPECAMERA_RAW_DATA, n_events, events);
+	if (err) {
+	    printf("Batch was overwritten while in use\n");
+	    goto done;
+	}
+    }
+
+    if (events[0].event_id != frames) {
+	printf("Batch has ended at event %zu, but %zu is expected\n", (size_t)events[0].event_id, frames);
+	err = PCILIB_ERROR_INVALID_DATA;
+	goto done;
+    }
+
+    err = ipecamera_next_batch(ctx, consumer, 0, IPECAMERA_RAW_DATA, CHECK_BATCH_SIZE, events, &n_events);
+    if ((err != PCILIB_ERROR_TIMEOUT)||(n_events)) {
+	printf("Batch is returned beyond the last event\n");
+	err = PCILIB_ERROR_INVALID_DATA;
+	goto done;
+    }
+    err = 0;
+
+    printf("%-10s %-10s %10zu events delivered in %zu batches\n", "consumers", "batch", expected[0] + expected[1], sizeof(sizes) / sizeof(sizes[0]));
+
+done:
+    ctx->started = 0;
+    return err?1:0;
+}
+
+static void *check_consumer_thread(void *user) {
+    check_consumer_t *cc = (check_consumer_t*)user;
+    pcilib_event_id_t evid, last_id = 0;
+
+    while ((cc->frames - last_id) >= cc->step) {
+	cc->err = ipecamera_consumer_next_event(cc->ctx, cc->consumer, CHECK_CONSUMER_TIMEOUT, &evid, 0, NULL);
+	if (cc->err) break;
+
+	if (evid - last_id < cc->step) {
+	    printf("Consumer got event %zu after %zu, but decimation is %zu\n", evid, last_id, cc->step);
+	    cc->err = PCILIB_ERROR_INVALID_DATA;
+	    break;
+	}
+
+	if (evid - last_id > cc->step) cc->gaps++;
+	last_id = evid;
+
+	if (cc->delay) usleep(cc->delay);
+    }
+
+    return NULL;
+}
+
+	// The drop-newest consumer blocks the ring once it is full, the rest of the stream is discarded by the reader
+static int check_drop_newest(ipecamera_t *ctx, void *stream, size_t stream_size, size_t frames) {
+    int err;
+    size_t published = CHECK_RING_SIZE - IPECAMERA_RESERVE_BUFFERS;
+    ipecamera_consumer_t *consumer;
+    ipecamera_consumer_stats_t stats;
+    check_consumer_t cc = { ctx, NULL, published, 1, 0, 0, 0 };
+
+    consumer = ipecamera_subscribe(ctx);
+    if (!consumer) return 1;
+
+    err = ipecamera_consumer_set_policy(ctx, consumer, IPECAMERA_POLICY_DROP_NEWEST, 0);
+    if (!err) err = check_replay(ctx, stream, stream_size, CHECK_LOOPS, NULL, NULL);
+    if (err) return 1;
+
+    if (ipecamera_get_last_event_id(ctx) != published) {
+	printf("Reader has published %lu frames, but %zu are expected\n", (unsigned long)ipecamera_get_last_event_id(ctx), published);
+	return 1;
+    }
+
+    ctx->started = 1;
+    cc.consumer = consumer;
+    check_consumer_thread(&cc);
+    ctx->started = 0;
+
+    ipecamera_consumer_get_stats(ctx, consumer, &stats);
+    if ((cc.err)||(cc.gaps)||(stats.reported != published)||(stats.dropped)||(stats.discarded != frames - published)) {
+	printf("Drop-newest consumer reports %zu events (error %i), %zu gaps, %zu dropped, %zu discarded\n", stats.reported, cc.err, cc.gaps, stats.dropped, stats.discarded);
+	return 1;
+    }
+
+    printf("%-10s %-10s %10zu events delivered, %zu discarded by reader\n", "policies", "newest", stats.reported, stats.discarded);
+
+    return 0;
+}
+
+	// The slow blocking consumer throttles the reader and gets all events, the fast decimating one gets every Nth of them
+static int check_block(ipecamera_t *ctx, void *stream, size_t stream_size, size_t frames) {
+    int err;
+    pthread_t slow_thread, fast_thread;
+    ipecamera_consumer_stats_t slow_stats, fast_stats;
+    check_consumer_t slow = { ctx, NULL, frames, 1, CHECK_CONSUMER_DELAY, 0, 0 };
+    check_consumer_t fast = { ctx, NULL, frames, CHECK_DECIMATION, 0, 0, 0 };
+
+    slow.consumer = ipecamera_subscribe(ctx);
+    fast.consumer = ipecamera_subscribe(ctx);
+    if ((!slow.consumer)||(!fast.consumer)) return 1;
+
+    err = ipecamera_consumer_set_policy(ctx, slow.consumer, IPECAMERA_POLICY_BLOCK, 0);
+    if (!err) err = ipecamera_consumer_set_policy(ctx, fast.consumer, IPECAMERA_POLICY_DECIMATE, CHECK_DECIMATION);
+    if (err) return 1;
+
+    ctx->started = 1;
+    if (pthread_create(&slow_thread, NULL, check_consumer_thread, &slow)) return 1;
+    if (pthread_create(&fast_thread, NULL, check_consumer_thread, &fast)) return 1;
+
+    err = check_replay(ctx, stream, stream_size, CHECK_LOOPS, NULL, NULL);
+
+    pthread_join(slow_thread, NULL);
+    pthread_join(fast_thread, NULL);
+    ctx->started = 0;
+
+    if (err) return 1;
+
+    ipecamera_consumer_get_stats(ctx, slow.consumer, &slow_stats);
+    if ((slow.err)||(slow.gaps)||(slow_stats.reported != frames)||(slow_stats.dropped)||(slow_stats.discarded)) {
+	printf("Blocking consumer reports %zu events (error %i), %zu gaps, %zu dropped, %zu discarded\n", slow_stats.reported, slow.err, slow.gaps, slow_stats.dropped, slow_stats.discarded);
+	return 1;
+    }
+
+    ipecamera_consumer_get_stats(ctx, fast.consumer, &fast_stats);
+    if ((fast.err)||(fast_stats.reported + fast_stats.dropped + fast_stats.decimated != fast_stats.last_id)||(frames - fast_stats.last_id >= CHECK_DECIMATION)) {
+	printf("Decimating consumer reports %zu events (error %i) up to %zu, %zu dropped, %zu decimated\n", fast_stats.reported, fast.err, fast_stats.last_id, fast_stats.dropped, fast_stats.decimated);
+	return 1;
+    }
+
+    printf("%-10s %-10s %10zu events delivered, reader was blocked %zu times\n", "policies", "block", slow_stats.reported, slow_stats.stalls);
+    printf("%-10s %-10s %10zu events delivered, %zu decimated, %zu dropped\n", "policies", "decimate", fast_stats.reported, fast_stats.decimated, fast_stats.dropped);
+
+    return 0;
+}
+
+	// The blocking consumer which never advances stalls the reader only once, the other consumer gets the whole stream
+static int check_stuck(ipecamera_t *ctx, void *stream, size_t stream_size, size_t frames) {
+    int err;
+    pthread_t thread;
+    ipecamera_consumer_t *stuck;
+    ipecamera_consumer_stats_t stuck_stats, stats;
+    check_consumer_t cc = { ctx, NULL, frames, 1, 0, 0, 0 };
+
+    stuck = ipecamera_subscribe(ctx);
+    cc.consumer = ipecamera_subscribe(ctx);
+    if ((!stuck)||(!cc.consumer)) return 1;
+
+    err = ipecamera_consumer_set_policy(ctx, stuck, IPECAMERA_POLICY_BLOCK, 0);
+    if (err) return 1;
+
+    ctx->started = 1;
+    if (pthread_create(&thread, NULL, check_consumer_thread, &cc)) return 1;
+
+    err = check_replay(ctx, stream, stream_size, CHECK_LOOPS, NULL, NULL);
+
+    pthread_join(thread, NULL);
+    ctx->started = 0;
+
+    if (err) return 1;
+
+    ipecamera_consumer_get_stats(ctx, stuck, &stuck_stats);
+    ipecamera_consumer_get_stats(ctx, cc.consumer, &stats);
+    if ((cc.err)||(stats.last_id != frames)||(ipecamera_get_last_event_id(ctx) != frames)||(stuck_stats.stalls != 1)||(stuck_stats.overruns != 1)) {
+	printf("Consumer reports %zu events up to %zu (error %i) of %zu, the stuck one has blocked the reader %zu times and timed out %zu times\n", stats.reported, stats.last_id, cc.err, frames, stuck_stats.stalls, stuck_stats.overruns);
+	return 1;
+    }
+
+    printf("%-10s %-10s %10zu events delivered, reader was blocked by the stuck consumer %zu times\n", "policies", "stuck", stats.reported, stuck_stats.stalls);
+
+    return 0;
+}
+
+static int check_policies() {
+    int i, err;
+    size_t size;
+    size_t frames = CHECK_FRAMES * CHECK_LOOPS;
+    void *data;
+    ipecamera_t ctx;
+    synth_config_t cfg;
+    int (*checks[])(ipecamera_t*, void*, size_t, size_t) = { check_drop_newest, check_block, check_stuck, NULL };
+
+    synth_init(&cfg, IPECAMERA_FORMAT_CMOSIS);
+
+    data = malloc(synth_get_stream_size(&cfg, CHECK_FRAMES));
+    if (!data) return 1;
+
+    size = synth_generate_stream(&cfg, CHECK_FRAMES, data);
+
+    for (i = 0, err = 0; (!err)&&(checks[i]); i++) {
+	err = check_init_context(&ctx, &cfg, 0);
+	if (!err) err = checks[i](&ctx, data, size, frames);
+	ipecamera_free_buffers(&ctx);
+    }
+
+    free(data);
+
+    return err;
+}
+
+	// The image pool is smaller than the ring, the least recently decoded or requested images should be replaced first
+static int check_image_pool(ipecamera_t *ctx, size_t frames) {
+    int err;
+    size_t i, size;
+    void *data;
+    pcilib_event_id_t last = frames;
+    pcilib_event_id_t replaced[] = { last, last - 2 };
+    pcilib_event_id_t kept[] = { last - 1, last - 3, last - 4, last - 5 };
+
+    for (i = 0; i < CHECK_FRAMES; i++) {
+	ipecamera_drop_image(ctx, last - i);
+	ipecamera_decode_frame(ctx, last - i);
+    }
+
+    ipecamera_decode_frame(ctx, last - 4);
+
+    data = NULL;
+    err = ipecamera_get(&ctx->event, last - 1, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+    if (!err) ipecamera_return(&ctx->event, last - 1, IPECAMERA_IMAGE_DATA, data);
+    else if (err != PCILIB_ERROR_INVALID_DATA) {
+	printf("Failed to get image of frame %zu, error %i\n", (size_t)(last - 1), err);
+	return 1;
+    }
+
+    ipecamera_decode_frame(ctx, last - 5);
+
+    for (i = 0; i < sizeof(replaced) / sizeof(replaced[0]); i++) {
+	if (ipecamera_find_image(ctx, replaced[i]) >= 0) {
+	    printf("Image of frame %zu should have been replaced\n", (size_t)replaced[i]);
+	    return 1;
+	}
+    }
+
+    for (i = 0; i < sizeof(kept) / sizeof(kept[0]); i++) {
+	if (ipecamera_find_image(ctx, kept[i]) < 0) {
+	    printf("Image of frame %zu should have been kept\n", (size_t)kept[i]);
+	    return 1;
+	}
+    }
+
+	// The dimensions are not bound to the image pool, so they can be returned for any frame
+    data = NULL;
+    err = ipecamera_get(&ctx->event, replaced[1], IPECAMERA_DIMENSIONS, 0, NULL, &size, &data);
+    if (!err) err = ipecamera_return(&ctx->event, replaced[1], IPECAMERA_DIMENSIONS, data);
+    if (err) {
+	printf("Failed to get and return dimensions with frame %zu, error %i\n", (size_t)replaced[1], err);
+	return 1;
+    }
+
+    printf("%-10s %-10s %10i images are kept for %i ring slots\n", "decode", "lru", CHECK_FRAMES, CHECK_RING_SIZE);
+
+    return 0;
+}
+
+	// In lazy mode, only the frames expected by the prefetching consumers or hinted explicitly are decoded ahead
+static int check_lazy(ipecamera_t *ctx, ipecamera_consumer_t *lagging, size_t frames) {
+    int err, wanted;
+    size_t i, size;
+    void *data;
+    pcilib_event_id_t evid, last = frames, hint;
+    ipecamera_consumer_stats_t stats;
+    ipecamera_cache_stats_t before, after;
+
+	// The lagging consumer has taken the oldest event, it only wants every third event after it
+    ipecamera_consumer_get_stats(ctx, lagging, &stats);
+    hint = stats.last_id + 1;
+
+    ctx->started = 1;
+    err = ipecamera_consumer_set_prefetch(ctx, lagging, 1);
+    if (!err) err = ipecamera_consumer_set_policy(ctx, lagging, IPECAMERA_POLICY_DECIMATE, 3);
+    if (!err) err = ipecamera_prefetch(ctx, hint);
+    ctx->started = 0;
+    if (err) return 1;
+
+    for (evid = stats.last_id - 1; evid <= last; evid++) {
+	wanted = (evid == hint)||((evid > stats.last_id)&&(!((evid - stats.last_id) % 3)));
+	if (ipecamera_frame_wanted(ctx, evid) != wanted) {
+	    printf("Frame %zu should be decoded %s\n", (size_t)evid, wanted?"ahead":"on demand");
+	    return 1;
+	}
+    }
+
+    ipecamera_get_cache_stats(ctx, &before);
+
+	// The first two requests are missing the cache as the image is replaced in between, the last one is a hit
+    for (i = 0; i < 3; i++) {
+	if (i < 2) ipecamera_drop_image(ctx, last);
+
+	data = NULL;
+	err = ipecamera_get(&ctx->event, last, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+	if (!err) ipecamera_return(&ctx->event, last, IPECAMERA_IMAGE_DATA, data);
+	else if (err != PCILIB_ERROR_INVALID_DATA) {
+	    printf("Failed to get image of frame %zu, error %i\n", (size_t)last, err);
+	    return 1;
+	}
+    }
+
+    ipecamera_get_cache_stats(ctx, &after);
+
+    if ((after.misses - before.misses != 2)||(after.hits - before.hits != 1)||(after.decoded - before.decoded != 2)) {
+	printf("Cache has counted %zu hits, %zu misses and %zu decoded frames, but 1, 2 and 2 are expected\n", after.hits - before.hits, after.misses - before.misses, after.decoded - before.decoded);
+	return 1;
+    }
+
+    ipecamera_consumer_set_policy(ctx, lagging, IPECAMERA_POLICY_DROP_OLDEST, 1);
+    ipecamera_consumer_set_prefetch(ctx, lagging, 0);
+
+    printf("%-10s %-10s %10zu hits, %zu misses, %zu decoded\n", "decode", "cache", after.hits, after.misses, after.decoded);
+
+    return 0;
+}
+
+	// Runs all kernels of the built-in decoder, both through the decoding API and ipecamera_get, and checks the result against the generated frames
+static int check_builtin(ipecamera_t *ctx, const char *name, const synth_config_t *cfg, size_t frames) {
+    int i, err = 0;
+    size_t j, size, raw_size;
+    size_t image_size = ctx->dim.width * ctx->dim.height * sizeof(ipecamera_pixel_t);
+    pcilib_event_id_t evid = frames;
+    char variant[32];
+    void *raw, *data;
+    ipecamera_pixel_t *buf;
+    ipecamera_frame_layout_t layout;
+    UfoDecoderMeta meta;
+
+    buf = malloc(image_size);
+    if (!buf) return 1;
+
+    for (i = 0; (!err)&&(i < 4); i++) {
+	if (ipecamera_select_unpacker(check_unpackers[i])) continue;
+
+	err = ipecamera_set_decoder(ctx, check_unpackers[i]?check_unpackers[i]:"builtin", 0);
+	for (j = 0; (!err)&&(j < CHECK_FRAMES); j++) {
+	    evid = frames - j;
+
+	    raw = NULL;
+	    err = ipecamera_get(&ctx->event, evid, IPECAMERA_RAW_DATA, 0, NULL, &raw_size, &raw);
+	    if (err) break;
+
+	    memset(buf, 0, image_size);
+	    err = ipecamera_parse_layout(ctx, raw, raw_size, &layout);
+	    if (!err) err = ipecamera_decode_lines(ctx, &layout, raw, 0, layout.lines, buf);
+	    if (!err) {
+		ipecamera_decode_meta(&layout, raw, raw_size, &meta);
+		err = check_meta(cfg, CHECK_SEQNUM(evid), &meta);
+	    }
+	    if (!err) err = check_pixels(ctx, cfg, CHECK_SEQNUM(evid), buf);
+	    if (!err) err = ipecamera_return(&ctx->event, evid, IPECAMERA_RAW_DATA, raw);
+	    if (err) break;
+
+	    memset(buf, 0, image_size);
+	    ipecamera_drop_image(ctx, evid);
+
+	    data = buf;
+	    size = image_size;
+	    err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+	    if (!err) err = check_pixels(ctx, cfg, CHECK_SEQNUM(evid), buf);
+	}
+
+	if (err) {
+	    printf("Frame %zu is not decoded properly by the %s decoder, error %i\n", (size_t)evid, ipecamera_get_unpacker_name(), err);
+	    break;
+	}
+
+	snprintf(variant, sizeof(variant), "%s/%s", name, check_unpackers[i]?check_unpackers[i]:"auto");
+	printf("%-10s %-10s %10i frames match the generated images\n", "builtin", variant, CHECK_FRAMES);
+    }
+
+    ipecamera_set_decoder(ctx, NULL, 0);
+    free(buf);
+
+    return err?1:0;
+}
+
+	// Compares decoding with a copy into the caller buffer and directly into it, then checks the buffer registered ahead of decoding
+static int check_direct(ipecamera_t *ctx, const char *name, const synth_config_t *cfg, size_t frames) {
+    int direct, err = 0;
+    size_t j, size;
+    size_t image_size = ctx->dim.width * ctx->dim.height * sizeof(ipecamera_pixel_t);
+    pcilib_event_id_t evid;
+    void *data;
+    ipecamera_pixel_t *buf;
+    ipecamera_cache_stats_t before, after;
+
+    buf = malloc(image_size);
+    if (!buf) return 1;
+
+    ctx->started = 1;
+    err = ipecamera_set_decoder(ctx, "builtin", 0);
+
+    for (direct = 0; (!err)&&(direct < 2); direct++) {
+	for (j = 0; (!err)&&(j < CHECK_FRAMES); j++) {
+	    evid = frames - j;
+	    ipecamera_drop_image(ctx, evid);
+	    if (!direct) ipecamera_decode_frame(ctx, evid);
+
+	    memset(buf, 0, image_size);
+	    data = buf;
+	    size = image_size;
+	    err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+	    if (err) printf("Failed to get image of frame %zu, error %i\n", (size_t)evid, err);
+	    else err = check_pixels(ctx, cfg, CHECK_SEQNUM(evid), buf);
+	}
+    }
+    if (err) goto done;
+
+	// The preprocessor decodes the frame into the registered buffer and hands the image over right away
+    ipecamera_get_cache_stats(ctx, &before);
+
+    evid = frames;
+    ipecamera_drop_image(ctx, evid);
+    memset(buf, 0, image_size);
+
+    err = ipecamera_register_image_buffer(ctx, evid, buf, image_size);
+    if (!err) err = ipecamera_decode_frame(ctx, evid);
+    if (!err) err = check_pixels(ctx, cfg, CHECK_SEQNUM(evid), buf);
+    if (err) goto done;
+
+    if ((ipecamera_find_image(ctx, evid) >= 0)||(!ipecamera_get_handed_over(ctx, evid, buf, NULL, NULL))) {
+	printf("The image decoded into the registered buffer is not handed over\n");
+	err = 1;
+	goto done;
+    }
+
+	// Another consumer decodes the frame again instead of getting the caller buffer
+    data = NULL;
+    err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+    if ((!err)&&(data == buf)) {
+	printf("The registered buffer is returned to another consumer\n");
+	err = 1;
+    }
+    if (err) goto done;
+
+    data = buf;
+    size = image_size;
+    err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+    if (err) {
+	printf("Failed to get image of frame %zu, error %i\n", (size_t)evid, err);
+	goto done;
+    }
+
+    ipecamera_get_cache_stats(ctx, &after);
+
+    if ((after.direct - before.direct != 1)||(after.hits - before.hits != 1)||(after.misses - before.misses != 1)||(after.decoded - before.decoded != 2)) {
+	printf("Cache has counted %zu hits, %zu misses, %zu decoded and %zu direct frames, but 1, 1, 2 and 1 are expected\n", after.hits - before.hits, after.misses - before.misses, after.decoded - before.decoded, after.direct - before.direct);
+	err = 1;
+	goto done;
+    }
+
+	// The registrations are dropped on stop, the frame is decoded into the image pool then
+    evid = frames - 1;
+    ipecamera_drop_image(ctx, evid);
+
+    err = ipecamera_register_image_buffer(ctx, evid, buf, image_size);
+    if (!err) {
+	ipecamera_unregister_image_buffers(ctx);
+	err = ipecamera_decode_frame(ctx, evid);
+    }
+    if ((!err)&&(ipecamera_find_image(ctx, evid) < 0)) {
+	printf("The registered buffer is not dropped\n");
+	err = 1;
+    }
+
+    if (!err) printf("%-10s %-10s %10i frames decoded into the caller buffers\n", "direct", name, 2 * CHECK_FRAMES + 1);
+
+done:
+    ipecamera_set_decoder(ctx, NULL, 0);
+    ctx->started = 0;
+    free(buf);
+
+    return err?1:0;
+}
+
+	// Region reads of the decoded and not decoded frames, the latter should only decode the rows of the region
+static int check_region_reads(ipecamera_t *ctx, const char *name, const synth_config_t *cfg, size_t frames) {
+    int err = 0;
+    size_t k, size;
+    pcilib_event_id_t evid = frames;
+    size_t frame = CHECK_SEQNUM(evid);
+    void *data;
+    ipecamera_pixel_t *pixels;
+    ipecamera_image_region_t region, tail;
+
+	// Unaligned region starting at the odd row to check the block boundaries of CMOSIS20
+    region.x = ctx->dim.width / 4 + 3;
+    region.y = (cfg->lines / 3) | 1;
+    region.width = ctx->dim.width / 2;
+    region.height = (cfg->lines - region.y < 256)?(cfg->lines - region.y):256;
+
+    tail.x = 0;
+    tail.y = cfg->lines - 1;
+    tail.width = ctx->dim.width;
+    tail.height = ctx->dim.height - tail.y;
+
+    err = ipecamera_set_decoder(ctx, "builtin", 0);
+    if (err) return 1;
+
+    ipecamera_drop_image(ctx, evid);
+
+	// Stale lines of the previous frames beyond the end of the frame should not be copied
+    pixels = NULL;
+    err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, (void**)&pixels);
+    if (!err) {
+	memset(pixels + cfg->lines * ctx->dim.width, 0xFF, (ctx->dim.height - cfg->lines) * ctx->dim.width * sizeof(ipecamera_pixel_t));
+	ipecamera_return(&ctx->event, evid, IPECAMERA_IMAGE_DATA, pixels);
+    }
+
+    for (k = 0; (!err)&&(k < 2); k++) {
+	data = NULL;
+	err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_REGION, sizeof(region), &region, &size, &data);
+	if (!err) {
+	    if (size != region.width * region.height * sizeof(ipecamera_pixel_t)) err = 1;
+	    else err = check_region(ctx, cfg, frame, &region, data);
+	    ipecamera_return(&ctx->event, evid, IPECAMERA_IMAGE_REGION, data);
+	}
+
+	if (!err) {
+	    data = NULL;
+	    err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_REGION, sizeof(tail), &tail, &size, &data);
+	    if (!err) {
+		err = check_region(ctx, cfg, frame, &tail, data);
+		ipecamera_return(&ctx->event, evid, IPECAMERA_IMAGE_REGION, data);
+	    }
+	}
+
+	if (err) printf("Failed to get region of %s frame %zu, error %i\n", k?"not decoded":"decoded", (size_t)evid, err);
+
+	    // The second pass decodes the region from the raw data
+	ipecamera_drop_image(ctx, evid);
+    }
+
+    if (!err) printf("%-10s %-10s %10u rows are read from decoded and raw frames\n", "region", name, region.height + tail.height);
+
+    ipecamera_set_decoder(ctx, NULL, 0);
+
+    return err?1:0;
+}
+
+	// Every row of the synthetic frames changes, so the reference is patched to get rows equal to the next frame or differing just by the threshold
+static int check_cmask_threshold(ipecamera_t *ctx, const synth_config_t *cfg, size_t frames, int threshold) {
+    int err;
+    size_t row, col, size;
+    pcilib_event_id_t evid = frames;
+    size_t frame = CHECK_SEQNUM(evid);
+    ipecamera_pixel_t *ref;
+    ipecamera_change_mask_t *cmask, expected;
+
+    cmask = malloc(ctx->dim.height * sizeof(ipecamera_change_mask_t));
+    if (!cmask) return 1;
+
+    err = ipecamera_set_change_threshold(ctx, threshold);
+    if (err) {
+	free(cmask);
+	return 1;
+    }
+
+    ipecamera_drop_image(ctx, evid - 1);
+
+    ref = NULL;
+    err = ipecamera_get(&ctx->event, evid - 1, IPECAMERA_IMAGE_DATA, 0, NULL, &size, (void**)&ref);
+    if (err) {
+	printf("Failed to decode the reference frame %zu, error %i\n", (size_t)(evid - 1), err);
+	free(cmask);
+	return 1;
+    }
+
+    for (row = 0; (threshold >= 0)&&(row < cfg->lines); row++) {
+	if ((row % 4) == 3) continue;
+
+	for (col = 0; col < ctx->dim.width; col++)
+	    ref[row * ctx->dim.width + col] = synth_pixel(cfg, frame, row, col);
+
+	    // The single pixel at the threshold (not a change) or just above it
+	col = (row * 37) % ctx->dim.width;
+	if ((row % 4) == 1) ref[row * ctx->dim.width + col] += threshold;
+	if ((row % 4) == 2) ref[row * ctx->dim.width + col] += threshold + 1;
+    }
+
+    ipecamera_return(&ctx->event, evid - 1, IPECAMERA_IMAGE_DATA, ref);
+
+    ipecamera_drop_image(ctx, evid);
+
+    size = ctx->dim.height * sizeof(ipecamera_change_mask_t);
+    err = ipecamera_get(&ctx->event, evid, IPECAMERA_CHANGE_MASK, 0, NULL, &size, (void**)&cmask);
+    if (err) {
+	printf("Failed to get change mask of frame %zu, error %i\n", (size_t)evid, err);
+	free(cmask);
+	return 1;
+    }
+
+    for (row = 0; (!err)&&(row < ctx->dim.height); row++) {
+	if (threshold < 0) expected = 1;
+	else expected = ((row < cfg->lines)&&((row % 4) >= 2))?1:0;
+
+	if (cmask[row] != expected) {
+	    printf("Frame %zu has change mask 0x%x of row %zu with threshold %i, but 0x%x is expected\n", frame, cmask[row], row, threshold, expected);
+	    err = 1;
+	}
+    }
+
+    free(cmask);
+
+    return err;
+}
+
+	// Change detection fused into the built-in decoder
+static int check_cmask(ipecamera_t *ctx, const char *name, const synth_config_t *cfg, size_t frames) {
+    int i, err = 0;
+
+    for (i = 0; (!err)&&(i < 4); i++) {
+	if (ipecamera_select_unpacker(check_unpackers[i])) continue;
+
+	err = ipecamera_set_decoder(ctx, check_unpackers[i]?check_unpackers[i]:"builtin", 0);
+	if (!err) err = check_cmask_threshold(ctx, cfg, frames, 9);
+	if (!err) err = check_cmask_threshold(ctx, cfg, frames, 0);
+    }
+    if (!err) err = check_cmask_threshold(ctx, cfg, frames, -1);
+
+    if (!err) printf("%-10s %-10s %10s lines are flagged as expected\n", "cmask", name, "all");
+
+    ipecamera_set_change_threshold(ctx, -1);
+    ipecamera_set_decoder(ctx, NULL, 0);
+
+    return err?1:0;
+}
+
+	// The main thread decodes frames one after another and the preprocessors help with bands, the bands are always decoded by the built-in decoder
+static int check_bands(ipecamera_t *ctx, const char *name, const synth_config_t *cfg, size_t frames) {
+    int err = 0;
+    size_t i, j, size, n_bands, n_threads;
+    size_t image_size = ctx->dim.width * ctx->dim.height * sizeof(ipecamera_pixel_t);
+    char variant[32];
+    void *data;
+    ipecamera_pixel_t *buf;
+
+    buf = malloc(image_size);
+    if (!buf) return 1;
+
+    for (n_bands = 1; (!err)&&(n_bands <= CHECK_MAX_BANDS); n_bands *= 2) {
+	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads > n_bands) n_threads = n_bands;
+
+	err = ipecamera_start_preprocessors(ctx, n_threads, n_bands);
+	if (err) break;
+
+	for (j = 0; (!err)&&(j < CHECK_FRAMES); j++) {
+	    ipecamera_drop_image(ctx, frames - j);
+
+	    memset(buf, 0, image_size);
+	    data = buf;
+	    size = image_size;
+	    err = ipecamera_get(&ctx->event, frames - j, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+	    if (!err) err = check_pixels(ctx, cfg, CHECK_SEQNUM(frames - j), buf);
+	    else printf("Frame %zu is not decoded in %zu bands, error %i\n", (size_t)(frames - j), n_bands, err);
+	}
+
+	ipecamera_stop_preprocessors(ctx);
+
+	snprintf(variant, sizeof(variant), "%s*%zu", name, n_bands);
+	if (!err) printf("%-10s %-10s %10i frames decoded using %zu preprocessors\n", "bands", variant, CHECK_FRAMES, n_threads);
+    }
+
+    for (i = 0; i < CHECK_FRAMES; i++)
+	ipecamera_drop_image(ctx, frames - i);
+
+    free(buf);
+
+    return err?1:0;
+}
+
+	// The synthetic frames should be accepted by ufodecode and decoded to the same image as by the built-in decoder
+static int check_ufodecode(ipecamera_t *ctx, const char *name, size_t frames) {
+    int err = 0;
+    size_t j, size;
+    size_t mismatch = 0;
+    size_t image_size = ctx->dim.width * ctx->dim.height * sizeof(ipecamera_pixel_t);
+    pcilib_event_id_t evid;
+    void *data;
+    ipecamera_pixel_t *ufo, *buf;
+
+    ufo = malloc(2 * image_size);
+    if (!ufo) return 1;
+    buf = ufo + ctx->dim.width * ctx->dim.height;
+
+    for (j = 0; j < CHECK_FRAMES; j++) {
+	evid = frames - j;
+
+	err = ipecamera_set_decoder(ctx, NULL, 0);
+	if (err) break;
+
+	ipecamera_drop_image(ctx, evid);
+
+	data = ufo;
+	size = image_size;
+	err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+	if (err) {
+	    printf("Frame %zu is rejected by ufodecode, error %i\n", (size_t)evid, err);
+	    break;
+	}
+
+	err = ipecamera_set_decoder(ctx, "builtin", 0);
+	if (err) break;
+
+	ipecamera_drop_image(ctx, evid);
+
+	data = buf;
+	size = image_size;
+	err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+	if (err) {
+	    printf("Failed to get image of frame %zu, error %i\n", (size_t)evid, err);
+	    break;
+	}
+
+	if (memcmp(ufo, buf, image_size)) mismatch++;
+    }
+
+    ipecamera_set_decoder(ctx, NULL, 0);
+    free(ufo);
+
+    if (err) return 1;
+
+    if (mismatch) {
+	printf("%zu of %i frames decoded by ufodecode differ from the built-in decoder\n", mismatch, CHECK_FRAMES);
+	return 1;
+    }
+
+    printf("%-10s %-10s %10i frames are bit-exact with ufodecode\n", "builtin", name, CHECK_FRAMES);
+
+    return 0;
+}
+
+	// Each bit depth needs own stream, the packed images are either stored along with the decoded ones or packed on request
+static int check_packed_images(const char *name, const synth_config_t *stream_cfg) {
+    int i, bpp, packed, err = 0;
+    size_t size, stream_size;
+    size_t frames = CHECK_FRAMES * CHECK_LOOPS;
+    pcilib_event_id_t evid = frames;
+    char variant[32];
+    void *stream, *data;
+    uint8_t *buf = NULL;
+    ipecamera_t ctx;
+    synth_config_t cfg = *stream_cfg;
+
+    stream = malloc(synth_get_stream_size(&cfg, CHECK_FRAMES));
+    if (!stream) return 1;
+
+    for (bpp = 10; (!err)&&(bpp <= 12); bpp++) {
+	cfg.adc_resolution = bpp;
+	stream_size = synth_generate_stream(&cfg, CHECK_FRAMES, stream);
+
+	for (packed = 1; (!err)&&(packed >= 0); packed--) {
+	    err = check_init_context(&ctx, &cfg, packed);
+	    if (!err) err = check_replay(&ctx, stream, stream_size, CHECK_LOOPS, NULL, NULL);
+	    if (err) {
+		ipecamera_free_buffers(&ctx);
+		break;
+	    }
+
+	    if (!buf) buf = malloc(ctx.dim.width * ctx.dim.height * sizeof(ipecamera_pixel_t));
+	    if (!buf) err = 1;
+
+	    for (i = 0; (!err)&&(packed)&&(i < 4); i++) {
+		if (ipecamera_select_unpacker(check_unpackers[i])) continue;
+
+		err = ipecamera_set_decoder(&ctx, check_unpackers[i]?check_unpackers[i]:"builtin", 0);
+		if (err) break;
+
+		ipecamera_drop_image(&ctx, evid);
+
+		data = NULL;
+		err = ipecamera_get(&ctx.event, evid, IPECAMERA_PACKED_IMAGE, 0, NULL, &size, &data);
+		if ((err)||(size != ctx.dim.width * ctx.dim.height * bpp / 8)) {
+		    printf("Failed to get packed image of frame %zu, error %i\n", (size_t)evid, err);
+		    if (!err) err = 1;
+		    break;
+		}
+
+		err = check_packed(&ctx, &cfg, CHECK_SEQNUM(evid), 0, cfg.lines, data);
+		ipecamera_return(&ctx.event, evid, IPECAMERA_PACKED_IMAGE, data);
+
+		snprintf(variant, sizeof(variant), "%s/%i/%s", name, bpp, check_unpackers[i]?check_unpackers[i]:"auto");
+		if (!err) printf("%-10s %-10s %10s lines match the generated image\n", "packed", variant, "all");
+	    }
+
+		// Without the packed copy, the image is packed on request
+	    if ((!err)&&(!packed)) {
+		err = ipecamera_set_decoder(&ctx, "builtin", 0);
+		if (!err) {
+		    data = buf;
+		    size = ctx.dim.width * ctx.dim.height * sizeof(ipecamera_pixel_t);
+		    err = ipecamera_get(&ctx.event, evid, IPECAMERA_PACKED_IMAGE, 0, NULL, &size, &data);
+		    if (!err) err = check_packed(&ctx, &cfg, CHECK_SEQNUM(evid), 0, cfg.lines, buf);
+		    else printf("Failed to pack image of frame %zu into user buffer, error %i\n", (size_t)evid, err);
+		}
+
+		snprintf(variant, sizeof(variant), "%s/%i/user", name, bpp);
+		if (!err) printf("%-10s %-10s %10s lines match the generated image\n", "packed", variant, "all");
+	    }
+
+	    ipecamera_set_decoder(&ctx, NULL, 0);
+	    ipecamera_free_buffers(&ctx);
+	}
+    }
+
+    free(buf);
+    free(stream);
+
+    return err?1:0;
+}
+
+	// Checks the first lines of the frame being received after each DMA packet
+static int check_progressive_callback(void *user, pcilib_dma_flags_t flags, size_t bufsize, void *buf) {
+    int res, err;
+    size_t lines, size, frame;
+    void *data;
+    check_progressive_t *state = (check_progressive_t*)user;
+    ipecamera_t *ctx = state->ctx;
+    pcilib_event_id_t evid = ipecamera_get_last_event_id(ctx) + 1;
+    ipecamera_line_range_t range;
+    ipecamera_image_region_t region;
+
+    res = ipecamera_data_callback(ctx, flags, bufsize, buf);
+    if (state->err) return res;
+
+    if (evid != state->event_id) {
+	state->event_id = evid;
+	state->ready = 0;
+	state->checked = 0;
+    }
+
+	// Without progressive mode, the frame being received is reported as not started and the next one is not available either
+    if (!state->progressive) {
+	if ((ipecamera_get_last_event_id(ctx) >= evid)||(state->checked)) return res;
+	state->checked = 1;
+
+	region.x = 0;
+	region.y = 0;
+	region.width = ctx->dim.width;
+	region.height = 1;
+
+	err = ipecamera_get_lines_ready(ctx, evid, &lines);
+	if ((!err)&&(lines)) err = 1;
+	if (!err) {
+	    data = NULL;
+	    err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_REGION, sizeof(region), &region, &size, &data);
+	    if (!err) ipecamera_return(&ctx->event, evid, IPECAMERA_IMAGE_REGION, data);
+	    err = (err == PCILIB_ERROR_BUSY)?0:(err?err:1);
+	}
+	if (!err) {
+	    data = NULL;
+	    err = ipecamera_get(&ctx->event, evid + 1, IPECAMERA_IMAGE_REGION, sizeof(region), &region, &size, &data);
+	    if (!err) ipecamera_return(&ctx->event, evid + 1, IPECAMERA_IMAGE_REGION, data);
+	    err = (err == PCILIB_ERROR_BUSY)?0:(err?err:1);
+	}
+	if (err) {
+	    printf("Frame %zu is available before it is complete without progressive mode, error %i\n", (size_t)evid, err);
+	    state->err = 1;
+	}
+	return res;
+    }
+
+    err = ipecamera_get_lines_ready(ctx, evid, &lines);
+    if ((err)||(lines < state->ready)) {
+	printf("Frame %zu has %zu lines ready after %zu, error %i\n", (size_t)evid, lines, state->ready, err);
+	state->err = 1;
+	return res;
+    }
+    state->ready = lines;
+
+    if ((state->checked)||(lines < state->lines)) return res;
+
+    state->checked = 1;
+    frame = CHECK_SEQNUM(evid);
+
+    if (ipecamera_get_last_event_id(ctx) < evid) {
+	state->frames++;
+
+	    // The lines which are not received yet are not available
+	range.first_line = lines;
+	range.n_lines = 1;
+	data = NULL;
+	err = ipecamera_get(&ctx->event, evid, IPECAMERA_PACKED_LINE, sizeof(range), &range, &size, &data);
+	if ((lines < state->cfg->lines)&&(err != PCILIB_ERROR_BUSY)) {
+	    printf("Line %zu of frame %zu is not received yet, but returned with error %i\n", lines, (size_t)evid, err);
+	    state->err = 1;
+	}
+	if (!err) ipecamera_return(&ctx->event, evid, IPECAMERA_PACKED_LINE, data);
+    }
+
+    region.x = 5;
+    region.y = 1;
+    region.width = ctx->dim.width - 10;
+    region.height = state->lines - 1;
+
+    data = NULL;
+    err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_REGION, sizeof(region), &region, &size, &data);
+    if (!err) {
+	state->err |= check_region(ctx, state->cfg, frame, &region, data);
+	ipecamera_return(&ctx->event, evid, IPECAMERA_IMAGE_REGION, data);
+    } else state->err = 1;
+
+    range.first_line = 0;
+    range.n_lines = state->lines;
+
+    if (!err) {
+	data = NULL;
+	err = ipecamera_get(&ctx->event, evid, IPECAMERA_PACKED_LINE, sizeof(range), &range, &size, &data);
+	if (!err) {
+	    state->err |= check_packed(ctx, state->cfg, frame, 0, state->lines, data);
+	    ipecamera_return(&ctx->event, evid, IPECAMERA_PACKED_LINE, data);
+	} else state->err = 1;
+    }
+
+    if (!err) {
+	size = state->payload_size;
+	err = ipecamera_get(&ctx->event, evid, IPECAMERA_PACKED_PAYLOAD, sizeof(range), &range, &size, &state->payload);
+	if (!err) {
+	    state->payload_id = evid;
+	    state->payload_copied = size;
+	} else state->err = 1;
+    }
+
+    if (err) printf("Failed to get the first lines of frame %zu while receiving it, error %i\n", (size_t)evid, err);
+
+    return res;
+}
+
+	// Streams the frames with the reader publishing progress and checks that the first lines are available before the frames are complete
+static int check_progressive(const char *name, const synth_config_t *cfg, void *stream, size_t stream_size) {
+    int err;
+    size_t raw_size;
+    void *raw;
+    ipecamera_t ctx;
+    ipecamera_frame_layout_t layout;
+    check_progressive_t state;
+
+    memset(&state, 0, sizeof(check_progressive_t));
+    state.ctx = &ctx;
+    state.cfg = cfg;
+    state.lines = (cfg->lines / 2 < 256)?(cfg->lines / 2):256;
+    state.payload_size = synth_get_frame_size(cfg);
+    state.payload = malloc(state.payload_size);
+    if (!state.payload) return 1;
+
+    err = check_init_context(&ctx, cfg, 0);
+    if (!err) err = ipecamera_set_decoder(&ctx, "builtin", 0);
+    if (!err) err = ipecamera_set_progressive(&ctx, 1);
+    if (!err) {
+	state.progressive = 1;
+	err = check_replay(&ctx, stream, stream_size, 1, check_progressive_callback, &state);
+    }
+
+    if ((!err)&&(state.err)) err = 1;
+    else if ((!err)&&((ipecamera_get_last_event_id(&ctx) != CHECK_FRAMES)||(state.frames != CHECK_FRAMES))) {
+	printf("Only %zu of %i frames were checked before they were complete\n", state.frames, CHECK_FRAMES);
+	err = 1;
+    }
+
+	// The payload copied while the frame was received should match the complete frame
+    if (!err) {
+	raw = NULL;
+	err = ipecamera_get(&ctx.event, state.payload_id, IPECAMERA_RAW_DATA, 0, NULL, &raw_size, &raw);
+	if ((err)||(ipecamera_parse_layout(&ctx, raw, raw_size, &layout))||(state.payload_copied != (ipecamera_layout_block_offset(&layout, (state.lines + layout.block_lines - 1) / layout.block_lines) - layout.data_offset))||(memcmp(raw + layout.data_offset, state.payload, state.payload_copied))) {
+	    printf("The payload of frame %zu does not match the complete frame, error %i\n", (size_t)state.payload_id, err);
+	    err = 1;
+	}
+	if (raw) ipecamera_return(&ctx.event, state.payload_id, IPECAMERA_RAW_DATA, raw);
+    }
+
+    ipecamera_set_progressive(&ctx, 0);
+    ipecamera_set_decoder(&ctx, NULL, 0);
+    ipecamera_free_buffers(&ctx);
+
+	// The same stream is received again without progressive mode
+    if (!err) {
+	state.progressive = 0;
+	state.event_id = 0;
+
+	err = check_init_context(&ctx, cfg, 0);
+	if (!err) err = ipecamera_set_decoder(&ctx, "builtin", 0);
+	if (!err) err = check_replay(&ctx, stream, stream_size, 1, check_progressive_callback, &state);
+	if ((!err)&&(state.err)) err = 1;
+
+	ipecamera_set_decoder(&ctx, NULL, 0);
+	ipecamera_free_buffers(&ctx);
+    }
+
+    if (!err) printf("%-10s %-10s %10i frames have the first %zu lines available before they are complete\n", "progressive", name, CHECK_FRAMES, state.lines);
+
+    free(state.payload);
+
+    return err?1:0;
+}
+
+static int check_stream(const char *name, synth_config_t *cfg) {
+    int err;
+    size_t size;
+    size_t frames = CHECK_FRAMES * CHECK_LOOPS;
+    void *data;
+    ipecamera_t ctx;
+    ipecamera_consumer_t *lagging, *consumer, *batcher;
+
+    data = malloc(synth_get_stream_size(cfg, CHECK_FRAMES));
+    if (!data) return 1;
+
+    size = synth_generate_stream(cfg, CHECK_FRAMES, data);
+
+    err = check_init_context(&ctx, cfg, 0);
+    if (err) goto cleanup;
+
+	// The consumers are subscribed before the stream starts, so all of them are lagging behind the reader
+    lagging = ipecamera_subscribe(&ctx);
+    consumer = ipecamera_subscribe(&ctx);
+    batcher = ipecamera_subscribe(&ctx);
+    if ((!lagging)||(!consumer)||(!batcher)) {
+	err = 1;
+	goto cleanup;
+    }
+
+    err = check_replay(&ctx, data, size, CHECK_LOOPS, NULL, NULL);
+    if (!err) err = check_frames(&ctx, frames);
+    if (!err) err = check_consumers(&ctx, cfg, lagging, consumer, frames);
+    if (!err) err = check_batch(&ctx, cfg, batcher, frames);
+    if (!err) err = check_image_pool(&ctx, frames);
+    if (!err) err = check_lazy(&ctx, lagging, frames);
+    if (!err) err = check_builtin(&ctx, name, cfg, frames);
+    if (!err) err = check_direct(&ctx, name, cfg, frames);
+    if (!err) err = check_region_reads(&ctx, name, cfg, frames);
+    if (!err) err = check_cmask(&ctx, name, cfg, frames);
+    if (!err) err = check_bands(&ctx, name, cfg, frames);
+    if (!err) err = check_packed_images(name, cfg);
+    if (!err) err = check_progressive(name, cfg, data, size);
+    if (!err) err = check_ufodecode(&ctx, name, frames);
+
+cleanup:
+    ipecamera_free_buffers(&ctx);
+    free(data);
+
+    return err;
+}
+
+	// ufodecode stays the reference, the built-in decoder should produce the same image
+static void check_dump_frame(check_dump_t *state, pcilib_event_id_t evid) {
+    int err;
+    size_t pos, size;
+    ipecamera_t *ctx = state->ctx;
+    size_t image_size = ctx->dim.width * ctx->dim.height * sizeof(ipecamera_pixel_t);
+    void *data;
+
+    err = ipecamera_set_decoder(ctx, NULL, 0);
+    if (!err) {
+	ipecamera_drop_image(ctx, evid);
+
+	data = state->ufo;
+	size = image_size;
+	err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+	if (err) {
+	    printf("Frame %zu of the dump is rejected by ufodecode, error %i\n", (size_t)evid, err);
+	    state->rejected++;
+	    return;
+	}
+    }
+
+    if (!err) err = ipecamera_set_decoder(ctx, "builtin", 0);
+    if (!err) {
+	ipecamera_drop_image(ctx, evid);
+
+	data = state->builtin;
+	size = image_size;
+	err = ipecamera_get(&ctx->event, evid, IPECAMERA_IMAGE_DATA, 0, NULL, &size, &data);
+	if (err) printf("Frame %zu of the dump is decoded by ufodecode, but rejected by the built-in decoder, error %i\n", (size_t)evid, err);
+    }
+
+    if (err) {
+	state->err = err;
+	return;
+    }
+
+    state->compared++;
+
+    if (memcmp(state->ufo, state->builtin, image_size)) {
+	for (pos = 0; state->ufo[pos] == state->builtin[pos]; pos++);
+	printf("Frame %zu of the dump has pixel (%zu, %zu) = 0x%x, but ufodecode has decoded 0x%x\n", (size_t)evid, pos / ctx->dim.width, pos % ctx->dim.width, state->builtin[pos], state->ufo[pos]);
+	state->mismatch++;
+    }
+}
+
+	// The frames are compared as soon as they are complete, so the ring is never overwritten
+static int check_dump_callback(void *user, pcilib_dma_flags_t flags, size_t bufsize, void *buf) {
+    int res;
+    check_dump_t *state = (check_dump_t*)user;
+    pcilib_event_id_t last_id;
+
+    res = ipecamera_data_callback(state->ctx, flags, bufsize, buf);
+
+    last_id = ipecamera_get_last_event_id(state->ctx);
+    while ((!state->err)&&(state->last_id < last_id))
+	check_dump_frame(state, ++state->last_id);
+
+    return state->err?PCILIB_STREAMING_STOP:res;
+}
+
+	// Replays the recorded stream (see IPECAMERA_REPLAY) and compares the built-in decoder against ufodecode
+static int check_dump(const char *path, ipecamera_format_t format, size_t outputs) {
+    int err;
+    size_t frames = 0;
+    ipecamera_t ctx;
+    ipecamera_replay_t *replay;
+    synth_config_t cfg;
+    check_dump_t state;
+
+    synth_init(&cfg, format);
+    cfg.outputs = outputs;
+
+    replay = ipecamera_replay_open(path, 0);
+    if (!replay) {
+	printf("Failed to load recorded DMA stream from %s\n", path);
+	return 1;
+    }
+
+    ipecamera_replay_set_pacing(replay, 0, 0, 1);
+
+    memset(&state, 0, sizeof(check_dump_t));
+    state.ctx = &ctx;
+
+    err = check_init_context(&ctx, &cfg, 0);
+    if (!err) {
+	state.ufo = malloc(2 * ctx.dim.width * ctx.dim.height * sizeof(ipecamera_pixel_t));
+	if (!state.ufo) err = 1;
+	else state.builtin = state.ufo + ctx.dim.width * ctx.dim.height;
+    }
+
+    if (!err) {
+	err = ipecamera_replay_stream(replay, 0, check_dump_callback, &state);
+	if (err == PCILIB_ERROR_TIMEOUT) err = 0;
+	if (err) printf("Reader has failed with error %i\n", err);
+	else err = state.err;
+
+	frames = ipecamera_get_last_event_id(&ctx);
+    }
+
+    if (!err) {
+	if ((!state.compared)||(state.compared < frames)) {
+	    printf("Only %zu of %zu frames (%zu in the dump) were decoded by both decoders, %zu are rejected by ufodecode\n", state.compared, frames, ipecamera_replay_get_frames(replay), state.rejected);
+	    err = 1;
+	} else if (state.mismatch) {
+	    printf("%zu of %zu frames decoded by ufodecode differ from the built-in decoder\n", state.mismatch, state.compared);
+	    err = 1;
+	} else {
+	    printf("%-10s %-10s %10zu frames of the dump are bit-exact with ufodecode\n", "replay", (format == IPECAMERA_FORMAT_CMOSIS20)?"cmosis20":"cmosis", state.compared);
+	}
+    }
+
+    ipecamera_set_decoder(&ctx, NULL, 0);
+    ipecamera_free_buffers(&ctx);
+    ipecamera_replay_free(replay);
+    free(state.ufo);
+
+    return err?1:0;
+}
+
+static int check_streams() {
+    int i, err = 0;
+    synth_config_t cfg;
+
+    struct {
+	const char *name;
+	ipecamera_format_t format;
+	size_t outputs;
+	int version;
+	synth_bug_t bugs;
+    } streams[] = {
+	{ "cmosis", IPECAMERA_FORMAT_CMOSIS, 16, 1, 0 },
+	{ "cmosis/4", IPECAMERA_FORMAT_CMOSIS, 4, 0, 0 },
+	{ "cmosis/bug", IPECAMERA_FORMAT_CMOSIS, 16, 1, SYNTH_BUG_SPLIT_HEADERS|SYNTH_BUG_MULTIFRAME|SYNTH_BUG_REPEATING_DATA },
+	{ "cmosis20", IPECAMERA_FORMAT_CMOSIS20, 16, 1, 0 },
+	{ "cmosis20/4", IPECAMERA_FORMAT_CMOSIS20, 4, 1, 0 },
+	{ NULL }
+    };
+
+    for (i = 0; streams[i].name; i++) {
+	synth_init(&cfg, streams[i].format);
+	cfg.outputs = streams[i].outputs;
+	cfg.version = streams[i].version;
+	cfg.bugs |= streams[i].bugs;
+
+	err = check_stream(streams[i].name, &cfg);
+	if (err) {
+	    printf("Check of %s stream has failed\n", streams[i].name);
+	    break;
+	}
+    }
+
+    return err;
+}
+
+int main(int argc, char *argv[]) {
+    int err = 0;
+    const char *stage = (argc > 1)?argv[1]:"all";
+
+	// The injected hardware bugs are reported as warnings
+    pcilib_set_logger(PCILIB_LOG_ERROR, &check_log, NULL);
+
+    if ((!strcmp(stage, "all"))||(!strcmp(stage, "scanner"))) {
+	err = check_scanner();
+	if (err) printf("Frame magic scanner check has failed\n");
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "notifier")))) {
+	err = check_notifier();
+	if (err) printf("Notifier check has failed\n");
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "topology")))) {
+	err = check_topology();
+	if (err) printf("Thread placement has failed\n");
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "policies")))) {
+	err = check_policies();
+	if (err) printf("Consumer policies have failed\n");
+    }
+
+    if ((!err)&&((!strcmp(stage, "all"))||(!strcmp(stage, "streams")))) {
+	err = check_streams();
+    }
+
+	// The recorded dumps are not shipped, so they are only checked on request
+    if (!strcmp(stage, "replay")) {
+	if (argc < 3) {
+	    printf("Usage: %s replay <dump> [cmosis|cmosis20] [outputs]\n", argv[0]);
+	    return 1;
+	}
+
+	err = check_dump(argv[2], ((argc > 3)&&(!strcmp(argv[3], "cmosis20")))?IPECAMERA_FORMAT_CMOSIS20:IPECAMERA_FORMAT_CMOSIS, (argc > 4)?atol(argv[4]):16);
+	if (err) printf("Check of the recorded stream has failed\n");
+    }
+
+    return err?1:0;
+}
@@ -0,0 +1,152 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "synth.h"
+
+static void usage() {
+    printf(
+"Usage:\n"
+" gen [options] -o <file>\n"
+"  Generates synthetic raw stream of IPECamera frames as it is returned by DMA\n"
+"  engine. The output can be replayed with IPECAMERA_REPLAY.\n"
+"\n"
+"  Options:\n"
+"   -f, --format <cmosis|cmosis20>	- Data format [cmosis]\n"
+"   -c, --outputs <4|16>		- Number of CMOSIS outputs [16]\n"
+"   -v, --version <0|1>		- Frame header version [1]\n"
+"   -l, --lines <lines>		- Number of lines [full frame]\n"
+"   -a, --adc <10|11|12>		- ADC resolution [12]\n"
+"   -n, --frames <frames>		- Number of frames [16]\n"
+"   -b, --bugs <bug,...>		- Emulated hardware bugs [missing]\n"
+"		split		- header split between DMA packets\n"
+"		multiframe	- frames are not padded to the DMA packet size\n"
+"		repeat		- 16 bytes repeated at frame offset 4096\n"
+"		missing		- the first payload of the frame is missing\n"
+"		none		- no bugs\n"
+"   -o, --output <file>		- Output file\n"
+"   -h, --help			- Help message\n"
+"\n"
+    );
+
+    exit(0);
+}
+
+static int parse_bugs(const char *arg, synth_bug_t *bugs) {
+    char *str, *bug, *saveptr = NULL;
+
+    str = strdup(arg);
+    if (!str) return -1;
+
+    *bugs = 0;
+    for (bug = strtok_r(str, ",", &saveptr); bug; bug = strtok_r(NULL, ",", &saveptr)) {
+	if (!strcasecmp(bug, "split")) *bugs |= SYNTH_BUG_SPLIT_HEADERS;
+	else if (!strcasecmp(bug, "multiframe")) *bugs |= SYNTH_BUG_MULTIFRAME;
+	else if (!strcasecmp(bug, "repeat")) *bugs |= SYNTH_BUG_REPEATING_DATA;
+	else if (!strcasecmp(bug, "missing")) *bugs |= SYNTH_BUG_MISSING_PAYLOAD;
+	else if (strcasecmp(bug, "none")) {
+	    free(str);
+	    return -1;
+	}
+    }
+
+    free(str);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    FILE *f;
+    void *data;
+    size_t size;
+    size_t frames = 16;
+    const char *output = NULL;
+    const char *format = "cmosis";
+    long version = -1, outputs = 0, lines = 0, adc = 0;
+    const char *bugs = NULL;
+    synth_config_t cfg;
+
+    static struct option long_options[] = {
+	{ "format", required_argument, 0, 'f' },
+	{ "outputs", required_argument, 0, 'c' },
+	{ "version", required_argument, 0, 'v' },
+	{ "lines", required_argument, 0, 'l' },
+	{ "adc", required_argument, 0, 'a' },
+	{ "frames", required_argument, 0, 'n' },
+	{ "bugs", required_argument, 0, 'b' },
+	{ "output", required_argument, 0, 'o' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "f:c:v:l:a:n:b:o:h", long_options, NULL)) != -1) {
+	switch (c) {
+	 case 'f': format = optarg; break;
+	 case 'c': outputs = atol(optarg); break;
+	 case 'v': version = atol(optarg); break;
+	 case 'l': lines = atol(optarg); break;
+	 case 'a': adc = atol(optarg); break;
+	 case 'n': frames = atol(optarg); break;
+	 case 'b': bugs = optarg; break;
+	 case 'o': output = optarg; break;
+	 default: usage();
+	}
+    }
+
+    if (!output) usage();
+
+    if (!strcasecmp(format, "cmosis")) synth_init(&cfg, IPECAMERA_FORMAT_CMOSIS);
+    else if (!strcasecmp(format, "cmosis20")) synth_init(&cfg, IPECAMERA_FORMAT_CMOSIS20);
+    else {
+	printf("Unsupported format (%s)\n", format);
+	return 1;
+    }
+
+    if (outputs) cfg.outputs = outputs;
+    if (version >= 0) cfg.version = version;
+    if (lines) cfg.lines = lines;
+    if (adc) cfg.adc_resolution = adc;
+    if ((bugs)&&(parse_bugs(bugs, &cfg.bugs))) {
+	printf("Invalid list of bugs (%s)\n", bugs);
+	return 1;
+    }
+
+    if (synth_check(&cfg)) {
+	printf("Invalid frame configuration\n");
+	return 1;
+    }
+
+    data = malloc(synth_get_stream_size(&cfg, frames));
+    if (!data) {
+	printf("Failed to allocate memory for %zu frames\n", frames);
+	return 1;
+    }
+
+    size = synth_generate_stream(&cfg, frames, data);
+
+    f = fopen(output, "w");
+    if (!f) {
+	printf("Failed to open output file (%s)\n", output);
+	free(data);
+	return 1;
+    }
+
+    if (fwrite(data, 1, size, f) != size) {
+	printf("Failed to write %zu bytes to %s\n", size, output);
+	fclose(f);
+	free(data);
+	return 1;
+    }
+
+    fclose(f);
+    free(data);
+
+    printf("%zu frames (%zu bytes per frame, %zu bytes in total) are written to %s\n", frames, synth_get_frame_size(&cfg), size, output);
+
+    return 0;
+}
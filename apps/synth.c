@@ -0,0 +1,215 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <pcilib/error.h>
+
+#include "synth.h"
+
+#define SYNTH_PAYLOAD_SIZE 32
+#define SYNTH_PAYLOAD_WORDS (SYNTH_PAYLOAD_SIZE / sizeof(uint32_t))
+#define SYNTH_LANES 16
+
+void synth_init(synth_config_t *cfg, ipecamera_format_t format) {
+    memset(cfg, 0, sizeof(synth_config_t));
+
+    cfg->format = format;
+    cfg->outputs = 16;
+    cfg->version = 1;
+    cfg->adc_resolution = 12;
+    cfg->lines = (format == IPECAMERA_FORMAT_CMOSIS20)?CMOSIS20_MAX_LINES:1088;
+#ifdef IPECAMERA_BUG_MISSING_PAYLOAD
+    cfg->bugs = SYNTH_BUG_MISSING_PAYLOAD;
+#endif /* IPECAMERA_BUG_MISSING_PAYLOAD */
+}
+
+int synth_check(const synth_config_t *cfg) {
+    switch (cfg->format) {
+     case IPECAMERA_FORMAT_CMOSIS:
+	if (cfg->lines > CMOSIS_MAX_LINES) return PCILIB_ERROR_INVALID_ARGUMENT;
+	break;
+     case IPECAMERA_FORMAT_CMOSIS20:
+	if ((cfg->lines > CMOSIS20_MAX_LINES)||(cfg->lines % 2)) return PCILIB_ERROR_INVALID_ARGUMENT;
+	break;
+     default:
+	return PCILIB_ERROR_NOTSUPPORTED;
+    }
+
+    if ((!cfg->lines)||((cfg->version == 0)&&(cfg->lines > 0x7FF))) return PCILIB_ERROR_INVALID_ARGUMENT;
+    if ((cfg->version != 0)&&(cfg->version != 1)) return PCILIB_ERROR_NOTSUPPORTED;
+    if ((cfg->outputs != 4)&&(cfg->outputs != 16)) return PCILIB_ERROR_NOTSUPPORTED;
+    if ((cfg->adc_resolution < 10)||(cfg->adc_resolution > 12)) return PCILIB_ERROR_NOTSUPPORTED;
+
+    return 0;
+}
+
+size_t synth_get_width(const synth_config_t *cfg) {
+    return (cfg->format == IPECAMERA_FORMAT_CMOSIS20)?CMOSIS20_WIDTH:CMOSIS_WIDTH;
+}
+
+	// Number of payloads including the line headers (CMOSIS) or C0 payloads (CMOSIS20)
+static size_t synth_get_payloads(const synth_config_t *cfg) {
+    size_t repeats = CMOSIS_MAX_CHANNELS / cfg->outputs;
+
+    if (cfg->format == IPECAMERA_FORMAT_CMOSIS20)
+	return (cfg->lines / 2) * repeats * (1 + CMOSIS20_WIDTH / 8);
+
+    return cfg->lines * repeats * (1 + CMOSIS_PIXELS_PER_CHANNEL);
+}
+
+size_t synth_get_frame_size(const synth_config_t *cfg) {
+    size_t size = CMOSIS_FRAME_HEADER_SIZE + synth_get_payloads(cfg) * SYNTH_PAYLOAD_SIZE + CMOSIS_FRAME_TAIL_SIZE;
+    if (cfg->bugs&SYNTH_BUG_MISSING_PAYLOAD) size -= SYNTH_PAYLOAD_SIZE;
+    return size;
+}
+
+size_t synth_get_stream_size(const synth_config_t *cfg, size_t frames) {
+	// frame, padding up to the packet boundary, 16 bytes of split header, 16 repeated bytes
+    size_t frame_size = synth_get_frame_size(cfg) + SYNTH_PACKET_SIZE + 32;
+    return frames * frame_size + SYNTH_PACKET_SIZE;
+}
+
+static void synth_pack(uint32_t *payload, const ipecamera_pixel_t *lanes) {
+    int i;
+    uint64_t bits[3] = { 0 };
+
+    for (i = 0; i < SYNTH_LANES; i++) {
+	size_t offset = 12 * i;
+	bits[offset / 64] |= ((uint64_t)lanes[i]) << (offset % 64);
+	if ((offset % 64) > 52)
+	    bits[offset / 64 + 1] |= ((uint64_t)lanes[i]) >> (64 - offset % 64);
+    }
+
+    for (i = 0; i < 3; i++) {
+	payload[2 * i] = bits[i] & 0xFFFFFFFF;
+	payload[2 * i + 1] = bits[i] >> 32;
+    }
+
+    payload[6] = 0;
+    payload[7] = 0;
+}
+
+static void synth_fill(uint32_t *payload, uint32_t value) {
+    int i;
+    for (i = 0; i < SYNTH_PAYLOAD_WORDS; i++)
+	payload[i] = value;
+}
+
+	// Channel transferred by the specified lane in the specified repetition of the line
+static inline int synth_get_channel(const synth_config_t *cfg, size_t lane, size_t repetition) {
+    if (cfg->outputs == CMOSIS_MAX_CHANNELS) return lane;
+    if (lane >= cfg->outputs) return -1;
+    return lane * (CMOSIS_MAX_CHANNELS / cfg->outputs) + repetition;
+}
+
+void synth_generate_frame(const synth_config_t *cfg, size_t frame, void *buf) {
+    int ch;
+    size_t row, rep, k, lane;
+    size_t repeats = CMOSIS_MAX_CHANNELS / cfg->outputs;
+    ipecamera_pixel_t lanes[SYNTH_LANES];
+    uint32_t *data = (uint32_t*)buf;
+    int skip = (cfg->bugs&SYNTH_BUG_MISSING_PAYLOAD)?1:0;
+
+    data[0] = 0x51111111 | (cfg->version << 1);
+    data[1] = 0x52222222;
+    data[2] = 0x53333333;
+    data[3] = 0x54444444;
+    data[4] = 0x55555555;
+    data[5] = 0x56000000 | cfg->lines;
+    data[6] = (cfg->version?(0x50000000 | (cfg->format << 24)):0x57000000) | (frame & 0xFFFFFF);
+    data[7] = 0x50000000 | ((cfg->adc_resolution - 10) << 26) | synth_time_stamp(frame);
+    data += SYNTH_PAYLOAD_WORDS;
+
+    if (cfg->format == IPECAMERA_FORMAT_CMOSIS20) {
+	const size_t width = CMOSIS20_WIDTH / 8;
+
+	    // The last pixel payload of the first line pair is missing
+	for (row = 0; row < cfg->lines; row += 2) {
+	    for (rep = 0; rep < repeats; rep++) {
+		synth_fill(data, 0xC0000000 | row);
+		data += SYNTH_PAYLOAD_WORDS;
+
+		for (k = 0; k < width; k++) {
+		    if ((skip)&&(!row)&&(rep == (repeats - 1))&&(k == (width - 1))) break;
+		    for (lane = 0; lane < SYNTH_LANES; lane++) {
+			ch = synth_get_channel(cfg, lane, rep);
+			if (ch < 0) lanes[lane] = 0;
+			else if (ch < 8) lanes[lane] = synth_pixel(cfg, frame, row, ch * width + k);
+			else lanes[lane] = synth_pixel(cfg, frame, row + 1, (ch - 8) * width + k);
+		    }
+		    synth_pack(data, lanes);
+		    data += SYNTH_PAYLOAD_WORDS;
+		}
+	    }
+	}
+    } else {
+	    // The header of the first line is missing
+	for (row = 0; row < cfg->lines; row++) {
+	    for (rep = 0; rep < repeats; rep++) {
+		if (skip) skip = 0;
+		else {
+		    synth_fill(data, 0xC0000000 | row);
+		    data += SYNTH_PAYLOAD_WORDS;
+		}
+
+		for (k = 0; k < CMOSIS_PIXELS_PER_CHANNEL; k++) {
+		    for (lane = 0; lane < SYNTH_LANES; lane++) {
+			ch = synth_get_channel(cfg, lane, rep);
+			lanes[lane] = (ch < 0)?0:synth_pixel(cfg, frame, row, ch * CMOSIS_PIXELS_PER_CHANNEL + k);
+		    }
+		    synth_pack(data, lanes);
+		    data += SYNTH_PAYLOAD_WORDS;
+		}
+	    }
+	}
+    }
+
+    synth_fill(data, 0x0AAAAAAA);
+    data[1] = synth_status(frame, 1);
+    data[2] = synth_status(frame, 2);
+    data[3] = synth_status(frame, 3);
+}
+
+size_t synth_generate_stream(const synth_config_t *cfg, size_t frames, void *buf) {
+    size_t i;
+    size_t pos = 0, start, boundary;
+    size_t frame_size = synth_get_frame_size(cfg);
+
+    for (i = 0; i < frames; i++) {
+	if (cfg->bugs&SYNTH_BUG_SPLIT_HEADERS) {
+		// The header is split between two DMA packets
+	    start = (pos + 16 + SYNTH_PACKET_SIZE - 1) / SYNTH_PACKET_SIZE * SYNTH_PACKET_SIZE - 16;
+	} else if ((pos % SYNTH_PACKET_SIZE)&&(!(cfg->bugs&SYNTH_BUG_MULTIFRAME))) {
+	    start = (pos / SYNTH_PACKET_SIZE + 1) * SYNTH_PACKET_SIZE;
+	} else {
+	    start = pos;
+	}
+
+	memset(buf + pos, 0, start - pos);
+	synth_generate_frame(cfg, i, buf + start);
+	pos = start + frame_size;
+
+	if (cfg->bugs&SYNTH_BUG_REPEATING_DATA) {
+		// The first packet boundary after the frame header, it is frame offset 4096 if the frame is aligned
+	    boundary = (start + 16) / SYNTH_PACKET_SIZE * SYNTH_PACKET_SIZE + SYNTH_PACKET_SIZE;
+	    if ((boundary + 16) < pos) {
+		memmove(buf + boundary + 16, buf + boundary, pos - boundary);
+		memcpy(buf + boundary, buf + boundary - 16, 16);
+		pos += 16;
+	    }
+	}
+    }
+
+    if (pos % SYNTH_PACKET_SIZE) {
+	start = (pos / SYNTH_PACKET_SIZE + 1) * SYNTH_PACKET_SIZE;
+	memset(buf + pos, 0, start - pos);
+	pos = start;
+    }
+
+    return pos;
+}
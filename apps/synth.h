@@ -0,0 +1,95 @@
+#ifndef _IPECAMERA_SYNTH_H
+#define _IPECAMERA_SYNTH_H
+
+#include <stdint.h>
+
+#include "model.h"
+#include "private.h"
+
+#define SYNTH_PACKET_SIZE IPECAMERA_DMA_PACKET_LENGTH
+
+typedef enum {
+    SYNTH_BUG_SPLIT_HEADERS = 1,		//**< Start each frame 16 bytes before the DMA packet boundary (IPECAMERA_BUG_MULTIFRAME_HEADERS) */
+    SYNTH_BUG_MULTIFRAME = 2,			//**< Do not pad frames to the DMA packet size (IPECAMERA_BUG_MULTIFRAME_PACKETS) */
+    SYNTH_BUG_REPEATING_DATA = 4,		//**< Repeat 16 bytes at the start of the second DMA packet of a frame (IPECAMERA_BUG_REPEATING_DATA) */
+    SYNTH_BUG_MISSING_PAYLOAD = 8		//**< Skip the first payload of the frame for CMOSIS and the last payload of the first line pair for CMOSIS20 (IPECAMERA_BUG_MISSING_PAYLOAD) */
+} synth_bug_t;
+
+typedef struct {
+    ipecamera_format_t format;			//**< IPECAMERA_FORMAT_CMOSIS or IPECAMERA_FORMAT_CMOSIS20 */
+    size_t outputs;				//**< Number of CMOSIS outputs: 4 or 16 */
+    int version;				//**< Header version: 0 or 1 */
+    size_t lines;				//**< Number of lines in the frame, should be even for CMOSIS20 */
+    size_t adc_resolution;			//**< 10, 11, or 12 bits */
+    synth_bug_t bugs;				//**< Hardware bugs to emulate */
+} synth_config_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void synth_init(synth_config_t *cfg, ipecamera_format_t format);
+int synth_check(const synth_config_t *cfg);
+
+/**
+ * Checks if the pixel is carried by the missing payload of the first CMOSIS20 line pair
+ */
+static inline int synth_pixel_missing(const synth_config_t *cfg, size_t row, size_t col) {
+    size_t width = CMOSIS20_WIDTH / 8;
+    size_t repeats = CMOSIS_MAX_CHANNELS / cfg->outputs;
+
+    if ((!(cfg->bugs&SYNTH_BUG_MISSING_PAYLOAD))||(cfg->format != IPECAMERA_FORMAT_CMOSIS20)||(row > 1)) return 0;
+    if ((col % width) != (width - 1)) return 0;
+    return (((row * 8 + col / width) % repeats) == (repeats - 1));
+}
+
+/**
+ * Expected pixel value, the generated frames can be verified with it
+ */
+static inline ipecamera_pixel_t synth_pixel(const synth_config_t *cfg, size_t frame, size_t row, size_t col) {
+    ipecamera_pixel_t value = (frame * 13 + row * 7 + col * 3) & 0xFFF;
+    if (synth_pixel_missing(cfg, row, col)) return 0;
+    return value & (0xFFF << (12 - cfg->adc_resolution));
+}
+
+/**
+ * Expected time stamp and status words (1-3) of the frame
+ */
+static inline uint32_t synth_time_stamp(size_t frame) {
+    return (frame * 1000) & 0xFFFFFF;
+}
+
+static inline uint32_t synth_status(size_t frame, int word) {
+    return ((frame << 4) | word) & 0x0FFFFFFF;
+}
+
+size_t synth_get_width(const synth_config_t *cfg);
+
+/**
+ * Size of a single frame excluding padding and repeated data
+ */
+size_t synth_get_frame_size(const synth_config_t *cfg);
+
+/**
+ * Maximal size of the stream with the specified number of frames (including padding and injected bugs)
+ */
+size_t synth_get_stream_size(const synth_config_t *cfg, size_t frames);
+
+/**
+ * Generates a frame (without padding and bugs except missing payload)
+ * @param buf		- buffer of synth_get_frame_size() bytes
+ */
+void synth_generate_frame(const synth_config_t *cfg, size_t frame, void *buf);
+
+/**
+ * Generates a stream of frames as it is returned by DMA engine
+ * @param buf		- buffer of synth_get_stream_size() bytes
+ * @return		- actual stream size
+ */
+size_t synth_generate_stream(const synth_config_t *cfg, size_t frames, void *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IPECAMERA_SYNTH_H */
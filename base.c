@@ -25,6 +25,7 @@
 #include "reader.h"
 #include "events.h"
 #include "data.h"
+#include "decoder.h"
 
 
 #define FIND_REG(var, bank, name)  \
@@ -97,7 +98,10 @@ pcilib_context_t *ipecamera_init(pcilib_t *pcilib) {
     
     const pcilib_model_description_t *model_info = pcilib_get_model_description(pcilib);
 
-    ipecamera_t *ctx = malloc(sizeof(ipecamera_t));
+    ipecamera_t *ctx = NULL;
+
+	// The fields updated by different threads are placed on separate cache lines
+    if (posix_memalign((void**)&ctx, IPECAMERA_CACHE_LINE_SIZE, sizeof(ipecamera_t))) ctx = NULL;
 
     if (ctx) {
 	pcilib_register_value_t value;
@@ -115,7 +119,12 @@ pcilib_context_t *ipecamera_init(pcilib_t *pcilib) {
 	}
 
 	ctx->dim.bpp = sizeof(ipecamera_pixel_t) * 8;
+	ctx->dim.real_bpp = 12;
 	ctx->buffer_size = IPECAMERA_DEFAULT_BUFFER_SIZE;
+	ctx->change_threshold = -1;
+	ctx->consumers[0].used = 1;
+	ctx->consumers[0].decimation = 1;
+	ctx->consumers[0].prefetch = 1;
 
 	FIND_REG(status_reg, "fpga", "status");
 	FIND_REG(control_reg, "fpga", "control");
@@ -222,6 +231,7 @@ int ipecamera_set_buffer_size(ipecamera_t *ctx, int size) {
     
     if ((size^(size-1)) < size) {
 	pcilib_error("The buffer size is not power of 2");
+	return PCILIB_ERROR_INVALID_ARGUMENT;
     }
     
     ctx->buffer_size = size;
@@ -229,6 +239,76 @@ int ipecamera_set_buffer_size(ipecamera_t *ctx, int size) {
     return 0;
 }
 
+int ipecamera_set_preprocess_mode(ipecamera_t *ctx, ipecamera_preprocess_mode_t mode) {
+    if (ctx->started) {
+	pcilib_error("Can't change preprocessing mode while grabbing");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    if ((mode != IPECAMERA_PREPROCESS_ALL)&&(mode != IPECAMERA_PREPROCESS_LAZY)) {
+	pcilib_error("Invalid preprocessing mode (%i) is specified", mode);
+	return PCILIB_ERROR_INVALID_ARGUMENT;
+    }
+
+    ctx->preprocess_mode = mode;
+
+    return 0;
+}
+
+int ipecamera_set_packed_images(ipecamera_t *ctx, int enable) {
+    if (ctx->started) {
+	pcilib_error("Can't enable packed images while grabbing");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    ctx->pack_images = enable?1:0;
+
+    return 0;
+}
+
+int ipecamera_set_progressive(ipecamera_t *ctx, int enable) {
+    if (ctx->started) {
+	pcilib_error("Can't enable progressive mode while grabbing");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    ctx->progressive = enable?1:0;
+
+    return 0;
+}
+
+int ipecamera_set_change_threshold(ipecamera_t *ctx, int threshold) {
+    if (ctx->started) {
+	pcilib_error("Can't change the change detection threshold while grabbing");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    if (threshold > 0xFFFF) {
+	pcilib_error("The change detection threshold (%i) is out of range", threshold);
+	return PCILIB_ERROR_INVALID_ARGUMENT;
+    }
+
+    ctx->change_threshold = (threshold < 0)?-1:threshold;
+
+    return 0;
+}
+
+int ipecamera_set_image_buffer_size(ipecamera_t *ctx, int size) {
+    if (ctx->started) {
+	pcilib_error("Can't change image buffer size while grabbing");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    if ((size < 0)||(size > IPECAMERA_IMAGE_SLOT_MASK)) {
+	pcilib_error("The image buffer size (%i) is out of range", size);
+	return PCILIB_ERROR_INVALID_ARGUMENT;
+    }
+
+    ctx->image_buffer_size = size;
+
+    return 0;
+}
+
 int ipecamera_reset(pcilib_context_t *vctx) {
     int err = 0;
     ipecamera_t *ctx = (ipecamera_t*)vctx;
@@ -312,13 +392,383 @@ int ipecamera_reset(pcilib_context_t *vctx) {
 }
 
 
-int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_event_flags_t flags) {
+int ipecamera_alloc_buffers(ipecamera_t *ctx) {
+    const char *memory, *images, *packed;
+
+    switch (ctx->firmware) {
+     case IPECAMERA_FIRMWARE_UFO5:
+	ctx->dim.width = CMOSIS_WIDTH;
+	ctx->dim.height = CMOSIS_MAX_LINES;
+
+	ctx->data_line_size = (1 + CMOSIS_PIXELS_PER_CHANNEL) * 32; 
+	break;
+     case IPECAMERA_FIRMWARE_CMOSIS20:
+	ctx->dim.width = CMOSIS20_WIDTH;
+	ctx->dim.height = CMOSIS20_MAX_LINES;
+
+	    // There is skipped C0 line once per every two lines (which are in fact encoded together)
+	ctx->data_line_size = CMOSIS20_PIXELS_PER_CHANNEL * 32 + 16;
+	break;
+     default:
+	pcilib_error("Can't start undefined version (%lu) of IPECamera", ctx->firmware);
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    ctx->raw_line_size = ctx->data_line_size * (CMOSIS_MAX_CHANNELS / ctx->cmosis_outputs);
+
+	// We should be careful here (currently firmware matches format, but this may not be the case in future)
+    ipecamera_compute_buffer_size(ctx, ctx->firmware, CMOSIS_FRAME_HEADER_SIZE, ctx->dim.height);
+
+    if ((!ctx->buffer_size)||(ctx->buffer_size & (ctx->buffer_size - 1))) {
+	pcilib_error("The buffer size (%zu) is not power of 2", ctx->buffer_size);
+	return PCILIB_ERROR_INVALID_STATE;
+    }
+
+    ctx->buffer_mask = ctx->buffer_size - 1;
+
+    ctx->raw_size = ctx->roi_raw_size;
+    ctx->padded_size = ctx->roi_padded_size;
+
+    ctx->image_size = ctx->dim.width * ctx->dim.height;
+    ctx->packed_size = ctx->image_size * ctx->dim.real_bpp / 8;
+
+    images = ipecamera_getenv(IPECAMERA_IMAGE_BUFFER_SIZE_ENV, "IPECAMERA_IMAGE_BUFFER_SIZE");
+    if (images) {
+	ctx->image_slots = atol(images);
+	if ((!ctx->image_slots)||(ctx->image_slots > IPECAMERA_IMAGE_SLOT_MASK)) {
+	    pcilib_error("Invalid number of image slots (%s)", images);
+	    return PCILIB_ERROR_INVALID_ARGUMENT;
+	}
+    } else {
+	ctx->image_slots = ctx->image_buffer_size?ctx->image_buffer_size:IPECAMERA_DEFAULT_IMAGE_BUFFER_SIZE;
+    }
+
+	// The images are only kept as long as the raw data is available
+    if (ctx->image_slots > ctx->buffer_size) ctx->image_slots = ctx->buffer_size;
+
+	// malloc (default), locked, thp, huge
+    memory = ipecamera_getenv(IPECAMERA_RING_MEMORY_ENV, "IPECAMERA_RING_MEMORY");
+    if ((memory)&&(ipecamera_memory_parse_mode(memory, &ctx->memory_mode))) {
+	pcilib_error("Unsupported allocation mode (%s) of ring buffers", memory);
+	return PCILIB_ERROR_INVALID_ARGUMENT;
+    }
+
+    ctx->buffer = ipecamera_memory_alloc(&ctx->buffer_mem, ctx->padded_size * ctx->buffer_size, ctx->memory_mode, ctx->numa_node);
+    if (!ctx->buffer) {
+	pcilib_error("Unable to allocate ring buffer (%lu bytes)", ctx->padded_size * ctx->buffer_size);
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    ctx->image = (ipecamera_pixel_t*)ipecamera_memory_alloc(&ctx->image_mem, ctx->image_size * ctx->image_slots * sizeof(ipecamera_pixel_t), ctx->memory_mode, ctx->numa_node);
+    if (!ctx->image) {
+	pcilib_error("Unable to allocate image buffer (%lu bytes)", ctx->image_size * ctx->image_slots * sizeof(ipecamera_pixel_t));
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    ctx->cmask = ipecamera_memory_alloc(&ctx->cmask_mem, ctx->dim.height * ctx->image_slots * sizeof(ipecamera_change_mask_t), ctx->memory_mode, ctx->numa_node);
+    if (!ctx->cmask) {
+	pcilib_error("Unable to allocate change-mask buffer");
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    packed = ipecamera_getenv(IPECAMERA_PACKED_IMAGES_ENV, "IPECAMERA_PACKED_IMAGES");
+    if ((ctx->pack_images)||((packed)&&(atoi(packed)))) {
+	ctx->packed = ipecamera_memory_alloc(&ctx->packed_mem, ctx->packed_size * ctx->image_slots, ctx->memory_mode, ctx->numa_node);
+	if (!ctx->packed) {
+	    pcilib_error("Unable to allocate packed image buffer (%lu bytes)", ctx->packed_size * ctx->image_slots);
+	    return PCILIB_ERROR_MEMORY;
+	}
+    }
+
+    if (ctx->memory_mode != IPECAMERA_MEMORY_MALLOC) {
+	pcilib_info("Ring buffers are allocated using %s (raw frames), %s (images), %s (change masks) pages%s",
+	    ipecamera_memory_mode_name(ctx->buffer_mem.mode), ipecamera_memory_mode_name(ctx->image_mem.mode), ipecamera_memory_mode_name(ctx->cmask_mem.mode),
+	    (ctx->buffer_mem.locked&&ctx->image_mem.locked&&ctx->cmask_mem.locked)?"":", failed to lock pages in memory (check RLIMIT_MEMLOCK)"
+	);
+    }
+
+    if (posix_memalign((void**)&ctx->frame, IPECAMERA_CACHE_LINE_SIZE, ctx->buffer_size * sizeof(ipecamera_frame_t))) {
+	ctx->frame = NULL;
+	pcilib_error("Unable to allocate frame-info buffer");
+	return PCILIB_ERROR_MEMORY;
+    }
+    
+    memset(ctx->frame, 0, ctx->buffer_size * sizeof(ipecamera_frame_t));
+
+    if (posix_memalign((void**)&ctx->decoded, IPECAMERA_CACHE_LINE_SIZE, ctx->image_slots * sizeof(ipecamera_decoded_t))) {
+	ctx->decoded = NULL;
+	pcilib_error("Unable to allocate buffer for decoding state of frames");
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    memset(ctx->decoded, 0, ctx->image_slots * sizeof(ipecamera_decoded_t));
+
+    ctx->scratch = (ipecamera_pixel_t*)malloc(IPECAMERA_REGION_SCRATCH * IPECAMERA_REGION_LINES * ctx->dim.width * sizeof(ipecamera_pixel_t));
+    if (!ctx->scratch) {
+	pcilib_error("Unable to allocate scratch buffers for decoding of image regions");
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    ctx->scratch_used = 0;
+
+    ctx->image_ref = (volatile uint64_t*)calloc(ctx->buffer_size, sizeof(uint64_t));
+    if (!ctx->image_ref) {
+	pcilib_error("Unable to allocate image references");
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    ctx->image_clock = 0;
+    ctx->image_hits = 0;
+    ctx->image_misses = 0;
+    ctx->image_decoded = 0;
+    ctx->lazy_skipped = 0;
+    ctx->image_direct = 0;
+
+    ctx->prefetch = (volatile pcilib_event_id_t*)calloc(ctx->buffer_size, sizeof(pcilib_event_id_t));
+    if (!ctx->prefetch) {
+	pcilib_error("Unable to allocate prefetch hints");
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    ctx->dest = (ipecamera_destination_t*)calloc(ctx->buffer_size, sizeof(ipecamera_destination_t));
+    if (!ctx->dest) {
+	pcilib_error("Unable to allocate the table of registered image buffers");
+	return PCILIB_ERROR_MEMORY;
+    }
+
+	// The reader starts by filling the first slot
+    ctx->frame[0].raw_seq = IPECAMERA_SEQ_WRITING(1);
+    
+    ctx->ipedec = ufo_decoder_new(ctx->dim.height, ctx->dim.width, NULL, 0);
+    if (!ctx->ipedec) {
+	pcilib_error("Unable to initialize IPECamera decoder library");
+	return PCILIB_ERROR_FAILED;
+    }
+
+    return 0;
+}
+
+void ipecamera_free_buffers(ipecamera_t *ctx) {
+    if (ctx->ipedec) {
+	ufo_decoder_free(ctx->ipedec);
+	ctx->ipedec = NULL;
+    }
+
+    if (ctx->verify_pixels) {
+	free(ctx->verify_pixels);
+	ctx->verify_pixels = NULL;
+    }
+
+    if (ctx->frame) {
+	free(ctx->frame);
+	ctx->frame = NULL;
+    }
+
+    if (ctx->decoded) {
+	free(ctx->decoded);
+	ctx->decoded = NULL;
+    }
+
+    if (ctx->scratch) {
+	free(ctx->scratch);
+	ctx->scratch = NULL;
+    }
+
+    if (ctx->image_ref) {
+	free((void*)ctx->image_ref);
+	ctx->image_ref = NULL;
+    }
+
+    if (ctx->prefetch) {
+	free((void*)ctx->prefetch);
+	ctx->prefetch = NULL;
+    }
+
+    if (ctx->dest) {
+	free(ctx->dest);
+	ctx->dest = NULL;
+    }
+
+    if (ctx->packed) {
+	ipecamera_memory_free(&ctx->packed_mem);
+	ctx->packed = NULL;
+    }
+
+    if (ctx->cmask) {
+	ipecamera_memory_free(&ctx->cmask_mem);
+	ctx->cmask = NULL;
+    }
+
+    if (ctx->image) {
+	ipecamera_memory_free(&ctx->image_mem);
+	ctx->image = NULL;
+    }
+
+    if (ctx->buffer) {
+	ipecamera_memory_free(&ctx->buffer_mem);
+	ctx->buffer = NULL;
+    }
+}
+
+/*
+ The built-in decoder is verified against ufodecode before it is used. The
+ buffer for the image produced by the built-in decoder meanwhile is allocated
+ once, it is released with the other buffers.
+*/
+int ipecamera_request_verification(ipecamera_t *ctx) {
+    if (!ctx->verify_pixels) {
+	ctx->verify_pixels = (ipecamera_pixel_t*)malloc(ctx->image_size * sizeof(ipecamera_pixel_t));
+	if (!ctx->verify_pixels) {
+	    pcilib_error("Unable to allocate buffer to verify the built-in decoder (%lu bytes)", ctx->image_size * sizeof(ipecamera_pixel_t));
+	    return PCILIB_ERROR_MEMORY;
+	}
+    }
+
+    ctx->verify_busy = 0;
+    ctx->builtin_unverified = IPECAMERA_BUILTIN_VERIFY_FRAMES;
+
+    return 0;
+}
+
+
+/*
+ Selects ufodecode (NULL or "ufodecode"), the fastest kernel of the built-in
+ decoder ("builtin"), or one of its kernels. Unless verify is 0, the built-in
+ decoder is only used once it is verified against ufodecode.
+*/
+int ipecamera_set_decoder(ipecamera_t *ctx, const char *name, int verify) {
+    int err;
+
+    ctx->builtin_decoder = ((name)&&(strcmp(name, "ufodecode")))?1:0;
+    ctx->builtin_unverified = 0;
+
+    if (ctx->builtin_decoder) {
+	err = ipecamera_select_unpacker(strcmp(name, "builtin")?name:NULL);
+	if (err) {
+	    ctx->builtin_decoder = 0;
+	    pcilib_error("The decoder (%s) is not supported", name);
+	    return err;
+	}
+
+	if (verify) {
+	    err = ipecamera_request_verification(ctx);
+	    if (err) return err;
+	}
+    }
+
+    err = ipecamera_select_decoder(ctx);
+    if (err) pcilib_error("The built-in decoder does not support %i outputs", ctx->cmosis_outputs);
+
+    return err;
+}
+
+/*
+ The preprocessors are pinned to the CPUs planned for them and are only
+ decoding the frames received from now on. With n_bands, each frame is
+ decoded in bands by all of them.
+*/
+int ipecamera_start_preprocessors(ipecamera_t *ctx, size_t n_preproc, size_t n_bands) {
+    int i, cpu;
+    int err = 0;
+    char cpulist[256];
+    cpu_set_t preproc_cpus;
+    pthread_attr_t attr;
+
+    ctx->preproc = (ipecamera_preprocessor_t*)malloc(n_preproc * sizeof(ipecamera_preprocessor_t));
+    if (!ctx->preproc) {
+	pcilib_error("Unable to allocate memory for preprocessor contexts");
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    memset(ctx->preproc, 0, n_preproc * sizeof(ipecamera_preprocessor_t));
+
+    ctx->n_preproc = n_preproc;
+    ctx->n_bands = (n_bands > IPECAMERA_MAX_BANDS)?IPECAMERA_MAX_BANDS:n_bands;
+    ctx->band_job = 0;
+    ctx->preproc_id = __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE);
+
+    if (ctx->n_bands) pcilib_info("Decoding frames in %zu bands using %zu preprocessors", ctx->n_bands, ctx->n_preproc);
+
+    ctx->run_preprocessors = 1;
+    for (i = 0, cpu = 0; i < ctx->n_preproc; i++, cpu++) {
+	while ((cpu < CPU_SETSIZE)&&(!CPU_ISSET(cpu, &ctx->preproc_cpus))) cpu++;
+
+	ctx->preproc[i].i = i;
+	ctx->preproc[i].ipecamera = ctx;
+	ctx->preproc[i].cpu = (cpu < CPU_SETSIZE)?cpu:-1;
+
+	pthread_attr_init(&attr);
+	if (ctx->preproc[i].cpu >= 0) {
+	    CPU_ZERO(&preproc_cpus);
+	    CPU_SET(cpu, &preproc_cpus);
+	    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &preproc_cpus);
+	} else if (ctx->numa_node >= 0)
+	    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &ctx->numa_cpus);
+
+	err = pthread_create(&ctx->preproc[i].thread, &attr, ipecamera_preproc_thread, ctx->preproc + i);
+	pthread_attr_destroy(&attr);
+	if (err) {
+	    err = PCILIB_ERROR_FAILED;
+	    break;
+	} else {
+	    ctx->preproc[i].started = 1;
+	}
+    }
+    
+    if (err) {
+	ipecamera_stop_preprocessors(ctx);
+	pcilib_error("Failed to schedule some of the preprocessor threads");
+	return err;
+    }
+
+    CPU_ZERO(&preproc_cpus);
+    for (i = 0; i < ctx->n_preproc; i++) {
+	if (ctx->preproc[i].cpu >= 0) CPU_SET(ctx->preproc[i].cpu, &preproc_cpus);
+    }
+
+    if (CPU_COUNT(&preproc_cpus)) pcilib_info("Reader is pinned to CPU %i, %zu preprocessors to CPUs %s", ctx->reader_cpu, ctx->n_preproc, ipecamera_format_cpulist(&preproc_cpus, cpulist, sizeof(cpulist)));
+    else pcilib_info("Reader is pinned to CPU %i, %zu preprocessors are not pinned", ctx->reader_cpu, ctx->n_preproc);
+
+    return 0;
+}
+
+void ipecamera_stop_preprocessors(ipecamera_t *ctx) {
     int i;
+    void *retcode;
+
+    if (ctx->preproc) {
+	ctx->run_preprocessors = 0;
+	ipecamera_notify(&ctx->new_event);
+	
+	for (i = 0; i < ctx->n_preproc; i++) {
+	    if (ctx->preproc[i].started) {
+		pthread_join(ctx->preproc[i].thread, &retcode);
+		ctx->preproc[i].started = 0;
+	    }
+	}
+	
+	free(ctx->preproc);
+	ctx->preproc = NULL;
+
+	if (ctx->preproc_skipped) pcilib_info("Preprocessing of %zu events was skipped as decoding was not fast enough", ctx->preproc_skipped);
+	if (ctx->lazy_skipped) pcilib_info("%zu events were not decoded ahead in lazy preprocessing mode", ctx->lazy_skipped);
+    }
+
+    ctx->n_bands = 0;
+}
+
+int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_event_flags_t flags) {
     int err = 0;
 
     ipecamera_t *ctx = (ipecamera_t*)vctx;
     pcilib_t *pcilib = vctx->pcilib;
     pcilib_register_value_t value;
+    const char *replay, *bands, *decoder, *node, *cpus, *policy, *preprocess, *progressive, *threshold;
+    char cpulist[256];
+    cpu_set_t allowed, preproc_cpus;
+    ipecamera_consumer_policy_t consumer_policy;
+    size_t decimation;
+    size_t n_preproc, n_bands = 0;
     
     const pcilib_model_description_t *model_info = pcilib_get_model_description(pcilib);
 
@@ -341,7 +791,9 @@ int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_ev
 
     ctx->event_id = 0;
     ctx->preproc_id = 0;
-    ctx->reported_id = 0;
+    ctx->preproc_skipped = 0;
+    ipecamera_reset_consumers(ctx);
+    ctx->band_job = 0;
     ctx->buffer_pos = 0;
     ctx->parse_data = (flags&PCILIB_EVENT_FLAG_RAW_DATA_ONLY)?0:1;
     ctx->cur_size = 0;
@@ -350,26 +802,6 @@ int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_ev
     ctx->saved_header_size = 0;
 #endif /* IPECAMERA_BUG_MULTIFRAME_HEADERS */
 
-    switch (ctx->firmware) {
-     case IPECAMERA_FIRMWARE_UFO5:
-	ctx->dim.width = CMOSIS_WIDTH;
-	ctx->dim.height = CMOSIS_MAX_LINES;
-
-	ctx->data_line_size = (1 + CMOSIS_PIXELS_PER_CHANNEL) * 32; 
-	break;
-     case IPECAMERA_FIRMWARE_CMOSIS20:
-	ctx->dim.width = CMOSIS20_WIDTH;
-	ctx->dim.height = CMOSIS20_MAX_LINES;
-
-	    // There is skipped C0 line once per every two lines (which are in fact encoded together)
-	ctx->data_line_size = CMOSIS20_PIXELS_PER_CHANNEL * 32 + 16;
-	break;
-     default:
-	UNLOCK(run);
-	pcilib_error("Can't start undefined version (%lu) of IPECamera", ctx->firmware);
-	return PCILIB_ERROR_INVALID_REQUEST;
-    }
-
     if ((1)||(ctx->firmware == IPECAMERA_FIRMWARE_UFO5)) {
 	GET_REG(output_mode_reg, value);
 	switch (value) {
@@ -386,69 +818,103 @@ int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_ev
 	}
     } 
 
-	// We should be careful here (currently firmware matches format, but this may not be the case in future)
-    ipecamera_compute_buffer_size(ctx, ctx->firmware, CMOSIS_FRAME_HEADER_SIZE, ctx->dim.height);
-
-    ctx->raw_size = ctx->roi_raw_size;
-    ctx->padded_size = ctx->roi_padded_size;
-
-    ctx->image_size = ctx->dim.width * ctx->dim.height;
-
-    
     GET_REG(max_frames_reg, value);
     ctx->max_frames = value;
 
-    ctx->buffer = malloc(ctx->padded_size * ctx->buffer_size);
-    if (!ctx->buffer) {
-	ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	pcilib_error("Unable to allocate ring buffer (%lu bytes)", ctx->padded_size * ctx->buffer_size);
-	return PCILIB_ERROR_MEMORY;
+	// 10, 11, or 12 bit ADC resolution, only affects IPECAMERA_PACKED_IMAGE
+    GET_REG(adc_resolution_reg, value);
+    if (value > 2) {
+	pcilib_warning("Unknown ADC resolution (%lu), assuming 12 bits", value);
+	value = 2;
     }
-
-    ctx->image = (ipecamera_pixel_t*)malloc(ctx->image_size * ctx->buffer_size * sizeof(ipecamera_pixel_t));
-    if (!ctx->image) {
-	ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	pcilib_error("Unable to allocate image buffer (%lu bytes)", ctx->image_size * ctx->buffer_size * sizeof(ipecamera_pixel_t));
-	return PCILIB_ERROR_MEMORY;
+    ctx->dim.real_bpp = 10 + value;
+
+	// The rings and threads are placed on the NUMA node of the camera unless IPECAMERA_NUMA_NODE specifies another one (-1 disables)
+    node = ipecamera_getenv(IPECAMERA_NUMA_NODE_ENV, "IPECAMERA_NUMA_NODE");
+    ctx->numa_node = node?atoi(node):ipecamera_get_device_node(pcilib);
+    if ((ctx->numa_node >= 0)&&(ipecamera_get_node_cpus(ctx->numa_node, &ctx->numa_cpus))) {
+	pcilib_warning("NUMA node %i has no usable CPUs, thread and memory placement is not restricted", ctx->numa_node);
+	ctx->numa_node = -1;
     }
 
-    ctx->cmask = malloc(ctx->dim.height * ctx->buffer_size * sizeof(ipecamera_change_mask_t));
-    if (!ctx->cmask) {
+    if (ctx->numa_node >= 0)
+	pcilib_info("Placing ring buffers on NUMA node %i, reader and preprocessors on CPUs %s", ctx->numa_node, ipecamera_format_cpulist(&ctx->numa_cpus, cpulist, sizeof(cpulist)));
+
+	// The reader gets its own physical core and preprocessors one per remaining core, unless IPECAMERA_PREPROC_CPUS lists CPUs explicitly
+    if (ctx->numa_node >= 0) memcpy(&allowed, &ctx->numa_cpus, sizeof(cpu_set_t));
+    else if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) CPU_ZERO(&allowed);
+
+    cpus = ipecamera_getenv(IPECAMERA_PREPROC_CPUS_ENV, "IPECAMERA_PREPROC_CPUS");
+    if ((cpus)&&(ipecamera_parse_cpulist(cpus, &preproc_cpus))) {
 	ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	pcilib_error("Unable to allocate change-mask buffer");
-	return PCILIB_ERROR_MEMORY;
+	pcilib_error("Invalid list of preprocessor CPUs (%s)", cpus);
+	return PCILIB_ERROR_INVALID_ARGUMENT;
     }
 
-    ctx->frame = (ipecamera_frame_t*)malloc(ctx->buffer_size * sizeof(ipecamera_frame_t));
-    if (!ctx->frame) {
-	ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	pcilib_error("Unable to allocate frame-info buffer");
-	return PCILIB_ERROR_MEMORY;
+    ipecamera_plan_threads(&allowed, cpus?&preproc_cpus:NULL, &ctx->reader_cpu, &ctx->preproc_cpus);
+
+	// drop-oldest (default), drop-newest, block, or decimate:N for the default consumer
+    policy = ipecamera_getenv(IPECAMERA_CONSUMER_POLICY_ENV, "IPECAMERA_CONSUMER_POLICY");
+    if (policy) {
+	if (ipecamera_parse_consumer_policy(policy, &consumer_policy, &decimation)) {
+	    ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
+	    pcilib_error("Invalid consumer policy (%s)", policy);
+	    return PCILIB_ERROR_INVALID_ARGUMENT;
+	}
+	ipecamera_consumer_set_policy(ctx, NULL, consumer_policy, decimation);
     }
-    
-    memset(ctx->frame, 0, ctx->buffer_size * sizeof(ipecamera_frame_t));
-    
-    for (i = 0; i < ctx->buffer_size; i++) {
-	err = pthread_rwlock_init(&ctx->frame[i].mutex, NULL);
-	if (err) break;
+
+	// The reader publishes the progress of the frame being received, so the completed lines can be used before the frame end
+    progressive = ipecamera_getenv(IPECAMERA_PROGRESSIVE_ENV, "IPECAMERA_PROGRESSIVE");
+    if ((progressive)&&(atoi(progressive))&&(!ctx->progressive)) {
+	ctx->progressive = 1;
+	ctx->overrides.progressive = 1;
     }
 
-    ctx->frame_mutex_destroy = i;
+	// The lines are compared with the previous frame while decoding, -1 disables the change detection
+    threshold = ipecamera_getenv(IPECAMERA_CHANGE_THRESHOLD_ENV, "IPECAMERA_CHANGE_THRESHOLD");
+    if (threshold) {
+	ctx->overrides.saved_change_threshold = ctx->change_threshold;
+	ctx->overrides.change_threshold = 1;
 
+	if (ipecamera_set_change_threshold(ctx, atoi(threshold))) {
+	    ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
+	    return PCILIB_ERROR_INVALID_ARGUMENT;
+	}
+    }
+
+    err = ipecamera_alloc_buffers(ctx);
     if (err) {
-        ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	pcilib_error("Initialization of rwlock mutexes for frame synchronization has failed");
-	return PCILIB_ERROR_FAILED;
+	ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
+	return err;
     }
-    
-    ctx->ipedec = ufo_decoder_new(ctx->dim.height, ctx->dim.width, NULL, 0);
-    if (!ctx->ipedec) {
-        ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	pcilib_error("Unable to initialize IPECamera decoder library");
-	return PCILIB_ERROR_FAILED;
+
+	// ufodecode (default), builtin (the fastest supported kernel), or one of scalar, sse4, avx2
+    decoder = ipecamera_getenv(IPECAMERA_DECODER_ENV, "IPECAMERA_DECODER");
+    err = ipecamera_set_decoder(ctx, decoder, 1);
+    if (err) {
+	ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
+	return err;
     }
 
-    if (!err) {
+    if (ctx->builtin_decoder) pcilib_info("Using built-in decoder (%s) once it is verified against ufodecode", ipecamera_get_unpacker_name());
+
+    replay = ipecamera_getenv(IPECAMERA_REPLAY_ENV, "IPECAMERA_REPLAY");
+    if ((!err)&&(replay)) {
+	const char *packet_size = ipecamera_getenv(IPECAMERA_REPLAY_PACKET_SIZE_ENV, "IPECAMERA_REPLAY_PACKET_SIZE");
+	const char *fps = ipecamera_getenv(IPECAMERA_REPLAY_FPS_ENV, "IPECAMERA_REPLAY_FPS");
+	const char *rate = ipecamera_getenv(IPECAMERA_REPLAY_RATE_ENV, "IPECAMERA_REPLAY_RATE");
+	const char *loops = ipecamera_getenv(IPECAMERA_REPLAY_LOOPS_ENV, "IPECAMERA_REPLAY_LOOPS");
+
+	ctx->replay = ipecamera_replay_open(replay, packet_size?atol(packet_size):0);
+	if (ctx->replay) {
+	    ipecamera_replay_set_pacing(ctx->replay, fps?atof(fps):0, rate?atof(rate):0, loops?atol(loops):1);
+	    pcilib_info("Replaying %zu frames (%zu bytes) from %s instead of reading DMA engine", ipecamera_replay_get_frames(ctx->replay), ipecamera_replay_get_size(ctx->replay), replay);
+	} else {
+	    err = PCILIB_ERROR_FAILED;
+	    pcilib_error("Failed to load recorded DMA stream from %s", replay);
+	}
+    } else if (!err) {
 	ctx->rdma = pcilib_find_dma_by_addr(vctx->pcilib, PCILIB_DMA_FROM_DEVICE, IPECAMERA_DMA_ADDRESS);
 	if (ctx->rdma == PCILIB_DMA_ENGINE_INVALID) {
 	    err = PCILIB_ERROR_NOTFOUND;
@@ -468,7 +934,7 @@ int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_ev
     }
 
 #ifdef IPECAMERA_CLEAN_ON_START
-    err = pcilib_skip_dma(vctx->pcilib, ctx->rdma);
+    if (!ctx->replay) err = pcilib_skip_dma(vctx->pcilib, ctx->rdma);
     if (err) {
         ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
 	pcilib_error("Can't start grabbing, device continuously writes unexpected data using DMA engine");
@@ -492,52 +958,45 @@ int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_ev
     }
     
     if ((ctx->parse_data)&&(flags&PCILIB_EVENT_FLAG_PREPROCESS)) {
-	ctx->n_preproc = pcilib_get_cpu_count();
-	
-	    // it would be greate to detect hyperthreading cores and ban them
-	switch (ctx->n_preproc) {
-	    case 1: break;
-	    case 2 ... 3: ctx->n_preproc -= 1; break;
-	    default: ctx->n_preproc -= 2; break;
-	}
-
-	if ((vctx->params.parallel.max_threads)&&(vctx->params.parallel.max_threads < ctx->n_preproc))
-	    ctx->n_preproc = vctx->params.parallel.max_threads;
-
-	ctx->preproc = (ipecamera_preprocessor_t*)malloc(ctx->n_preproc * sizeof(ipecamera_preprocessor_t));
-	if (!ctx->preproc) {
-	    ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	    pcilib_error("Unable to allocate memory for preprocessor contexts");
-	    return PCILIB_ERROR_MEMORY;
-	}
-
-	memset(ctx->preproc, 0, ctx->n_preproc * sizeof(ipecamera_preprocessor_t));
-
-	err = pthread_mutex_init(&ctx->preproc_mutex, NULL);
-	if (err) {
-	    ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	    pcilib_error("Failed to initialize event mutex");
-	    return PCILIB_ERROR_FAILED;
+	n_preproc = CPU_COUNT(&ctx->preproc_cpus);
+
+	    // No cores are left after the reader, a single unpinned preprocessor is started anyway
+	if (!n_preproc) n_preproc = 1;
+
+	if ((vctx->params.parallel.max_threads)&&(vctx->params.parallel.max_threads < n_preproc))
+	    n_preproc = vctx->params.parallel.max_threads;
+
+	    // Decode each frame by all preprocessors instead of a frame per thread, this reduces decoding latency of large frames
+	bands = ipecamera_getenv(IPECAMERA_DECODE_BANDS_ENV, "IPECAMERA_DECODE_BANDS");
+	if (bands) {
+	    n_bands = atol(bands);
+	    if (n_bands) {
+		err = ipecamera_request_verification(ctx);
+		if (err) {
+		    ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
+		    return err;
+		}
+	    }
 	}
-	ctx->preproc_mutex_destroy = 1;
-	
 
-	ctx->run_preprocessors = 1;
-	for (i = 0; i < ctx->n_preproc; i++) {
-	    ctx->preproc[i].i = i;
-	    ctx->preproc[i].ipecamera = ctx;
-	    err = pthread_create(&ctx->preproc[i].thread, NULL, ipecamera_preproc_thread, ctx->preproc + i);
-	    if (err) {
-		err = PCILIB_ERROR_FAILED;
-		break;
-	    } else {
-		ctx->preproc[i].started = 1;
+	    // all (default) or lazy, only the frames expected by prefetching consumers are decoded ahead
+	preprocess = ipecamera_getenv(IPECAMERA_PREPROCESS_ENV, "IPECAMERA_PREPROCESS");
+	if (preprocess) {
+	    ctx->overrides.saved_preprocess_mode = ctx->preprocess_mode;
+	    ctx->overrides.preprocess_mode = 1;
+
+	    if (!strcmp(preprocess, "lazy")) ctx->preprocess_mode = IPECAMERA_PREPROCESS_LAZY;
+	    else if (!strcmp(preprocess, "all")) ctx->preprocess_mode = IPECAMERA_PREPROCESS_ALL;
+	    else {
+		ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
+		pcilib_error("Invalid preprocessing mode (%s)", preprocess);
+		return PCILIB_ERROR_INVALID_ARGUMENT;
 	    }
 	}
-	
+
+	err = ipecamera_start_preprocessors(ctx, n_preproc, n_bands);
 	if (err) {
 	    ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
-	    pcilib_error("Failed to schedule some of the preprocessor threads");
 	    return err;
 	}
     } else {
@@ -556,6 +1015,12 @@ int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_ev
 	pthread_attr_setschedparam(&attr, &sched);
     }
 
+    if (ctx->reader_cpu >= 0) {
+	CPU_ZERO(&preproc_cpus);
+	CPU_SET(ctx->reader_cpu, &preproc_cpus);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &preproc_cpus);
+    }
+
     if (pthread_create(&ctx->rthread, &attr, &ipecamera_reader_thread, (void*)ctx)) {
 	ctx->started = 0;
 	ipecamera_stop(vctx, PCILIB_EVENT_FLAGS_DEFAULT);
@@ -571,7 +1036,6 @@ int ipecamera_start(pcilib_context_t *vctx, pcilib_event_t event_mask, pcilib_ev
 
 
 int ipecamera_stop(pcilib_context_t *vctx, pcilib_event_flags_t flags) {
-    int i;
     int err;
     void *retcode;
     ipecamera_t *ctx = (ipecamera_t*)vctx;
@@ -590,77 +1054,51 @@ int ipecamera_stop(pcilib_context_t *vctx, pcilib_event_flags_t flags) {
 
     if (ctx->started) {
 	ctx->run_reader = 0;
+	ipecamera_notify(&ctx->consumed);
 	err = pthread_join(ctx->rthread, &retcode);
 	if (err) pcilib_error("Error joining the reader thread");
     }
-    
-    if (ctx->preproc) {
-	ctx->run_preprocessors = 0;
-	
-	for (i = 0; i < ctx->n_preproc; i++) {
-	    if (ctx->preproc[i].started) {
-		pthread_join(ctx->preproc[i].thread, &retcode);
-		ctx->preproc[i].started = 0;
-	    }
-	}
 
-	if (ctx->preproc_mutex_destroy) {
-	    pthread_mutex_destroy(&ctx->preproc_mutex);
-	    ctx->preproc_mutex_destroy = 0;
-	}
-	
-	free(ctx->preproc);
-	ctx->preproc = NULL;
-    }
+	// The registered buffers may be freed once we return, the preprocessors still decoding into them are joined below
+    if (ctx->dest) ipecamera_unregister_image_buffers(ctx);
     
-    if (ctx->frame_mutex_destroy) {
-	for (i = 0; i < ctx->frame_mutex_destroy; i++) {
-	    pthread_rwlock_destroy(&ctx->frame[i].mutex);
-	}
-	ctx->frame_mutex_destroy = 0;
-    }
+    ipecamera_stop_preprocessors(ctx);
 
     if (ctx->rdma != PCILIB_DMA_ENGINE_INVALID) {
 	pcilib_stop_dma(vctx->pcilib, ctx->rdma, PCILIB_DMA_FLAGS_DEFAULT);
 	ctx->rdma = PCILIB_DMA_ENGINE_INVALID;
     }
 
-    while (ctx->streaming) {
-        usleep(IPECAMERA_NOFRAME_SLEEP);
-    }
-
-    if (ctx->ipedec) {
-	ufo_decoder_free(ctx->ipedec);
-	ctx->ipedec = NULL;
-    }
-
-    if (ctx->frame) {
-	free(ctx->frame);
-	ctx->frame = NULL;
+    if (ctx->replay) {
+	ipecamera_replay_free(ctx->replay);
+	ctx->replay = NULL;
     }
 
-    if (ctx->cmask) {
-	free(ctx->cmask);
-	ctx->cmask = NULL;
-    }
-
-    if (ctx->image) {
-	free(ctx->image);
-	ctx->image = NULL;
+    while (ctx->streaming) {
+        usleep(IPECAMERA_NOFRAME_SLEEP);
     }
 
-    if (ctx->buffer) {
-	free(ctx->buffer);
-	ctx->buffer = NULL;
-    }
+    ipecamera_free_buffers(ctx);
 
     memset(&ctx->autostop, 0, sizeof(ipecamera_autostop_t));
 
     ctx->event_id = 0;
-    ctx->reported_id = 0;
+    ipecamera_reset_consumers(ctx);
+    ctx->builtin_decoder = 0;
+    ctx->builtin_unverified = 0;
+    ctx->decode_blocks = NULL;
+
+	// The options set from environment are only valid for the acquisition
+    if (ctx->overrides.preprocess_mode) ctx->preprocess_mode = ctx->overrides.saved_preprocess_mode;
+    if (ctx->overrides.progressive) ctx->progressive = 0;
+    if (ctx->overrides.change_threshold) ctx->change_threshold = ctx->overrides.saved_change_threshold;
+    memset(&ctx->overrides, 0, sizeof(ipecamera_overrides_t));
     ctx->buffer_pos = 0; 
     ctx->started = 0;
 
+    ipecamera_notify(&ctx->new_event);
+    ipecamera_notify(&ctx->new_image);
+
     ipecamera_debug(API, "ipecamera: stopped");
     UNLOCK(run);
 
@@ -18,6 +18,18 @@ int ipecamera_trigger(pcilib_context_t *ctx, pcilib_event_t event, size_t trigge
 int ipecamera_stream(pcilib_context_t *vctx, pcilib_event_callback_t callback, void *user);
 int ipecamera_next_event(pcilib_context_t *vctx, pcilib_timeout_t timeout, pcilib_event_id_t *evid, size_t info_size, pcilib_event_info_t *info);
 
+void ipecamera_reset_consumers(ipecamera_t *ctx);
+int ipecamera_parse_consumer_policy(const char *name, ipecamera_consumer_policy_t *policy, size_t *decimation);
+int ipecamera_frame_wanted(ipecamera_t *ctx, pcilib_event_id_t evid);
+
+int ipecamera_alloc_buffers(ipecamera_t *ctx);
+void ipecamera_free_buffers(ipecamera_t *ctx);
+int ipecamera_request_verification(ipecamera_t *ctx);
+int ipecamera_set_decoder(ipecamera_t *ctx, const char *name, int verify);
+
+int ipecamera_start_preprocessors(ipecamera_t *ctx, size_t n_preproc, size_t n_bands);
+void ipecamera_stop_preprocessors(ipecamera_t *ctx);
+
 int ipecamera_get(pcilib_context_t *ctx, pcilib_event_id_t event_id, pcilib_event_data_type_t data_type, size_t arg_size, void *arg, size_t *size, void **buf);
 int ipecamera_return(pcilib_context_t *ctx, pcilib_event_id_t event_id, pcilib_event_data_type_t data_type, void *data);
 
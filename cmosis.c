@@ -1,5 +1,6 @@
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
+#define _GNU_SOURCE
 #define _IPECAMERA_MODEL_C
 #include <stdio.h>
 #include <stdlib.h>
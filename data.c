@@ -5,9 +5,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
 #include <assert.h>
 
 #include <ufodecode.h>
@@ -15,103 +18,574 @@
 #include <pcilib.h>
 #include <pcilib/tools.h>
 #include <pcilib/error.h>
+#include <pcilib/timing.h>
 
 #include "private.h"
 #include "data.h"
+#include "decoder.h"
 
-// DS: Currently, on event_id overflow we are assuming the buffer is lost
-static int ipecamera_resolve_event_id(ipecamera_t *ctx, pcilib_event_id_t evid) {
-    pcilib_event_id_t diff;
+#define IPECAMERA_BAND_BITS 9			//**< Number of bits used to store the band counter in band_job, enough for IPECAMERA_MAX_BANDS */
+#define IPECAMERA_BAND_MASK ((1 << IPECAMERA_BAND_BITS) - 1)
+#define IPECAMERA_BAND_SHIFT (IPECAMERA_BAND_BITS + IPECAMERA_IMAGE_SLOT_BITS)
+#define IPECAMERA_BAND_JOB(evid, image) ((((uint64_t)(evid)) << IPECAMERA_BAND_SHIFT) | (((uint64_t)(image)) << IPECAMERA_BAND_BITS))	//**< Frame decoded in bands and its image slot, the band counter starts at 0 */
+#define IPECAMERA_BAND_EVENT(job) ((job) >> IPECAMERA_BAND_SHIFT)
+#define IPECAMERA_BAND_IMAGE(job) (((job) >> IPECAMERA_BAND_BITS) & IPECAMERA_IMAGE_SLOT_MASK)
 
-    if (evid > ctx->event_id) {
-	diff = (((pcilib_event_id_t)-1) - ctx->event_id) + evid;
-	if (diff >= ctx->buffer_size) return -1;
-    } else {
-	diff = ctx->event_id - evid;
-        if (diff >= ctx->buffer_size) return -1;
+/*
+ Frame slots are protected by sequence counters instead of locks. The slot
+ generation is derived from the event id: the counter is odd while the frame
+ is written and even once it is complete. So, the overwrite is detected
+ exactly by comparing the counter with the expected value after the data
+ is consumed. There are two counters: raw_seq is advanced by the reader
+ thread and image_seq by the thread decoding the image.
+
+ The writer stores the odd value, issues a release fence, writes the data and
+ publishes the even value with a release store. The consumer loads the
+ counter with acquire semantics before using the data and, after the data is
+ consumed, re-reads it behind an acquire fence. So, the fast path is a single
+ acquire load to resolve the slot and a single load to validate the copy.
+*/
+static inline int ipecamera_resolve_event_id(ipecamera_t *ctx, pcilib_event_id_t evid) {
+    int buf_ptr = IPECAMERA_EVENT_SLOT(ctx, evid);
+
+    if (__atomic_load_n(&ctx->frame[buf_ptr].raw_seq, __ATOMIC_ACQUIRE) != IPECAMERA_SEQ_READY(evid)) return -1;
+
+    return buf_ptr;
+}
+
+static inline int ipecamera_check_raw(ipecamera_t *ctx, int buf_ptr, pcilib_event_id_t evid) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&ctx->frame[buf_ptr].raw_seq, __ATOMIC_RELAXED) == IPECAMERA_SEQ_READY(evid))?0:PCILIB_ERROR_OVERWRITTEN;
+}
+
+static inline int ipecamera_check_image(ipecamera_t *ctx, int image, pcilib_event_id_t evid) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&ctx->decoded[image].image_seq, __ATOMIC_RELAXED) == IPECAMERA_SEQ_READY(evid))?0:PCILIB_ERROR_OVERWRITTEN;
+}
+
+/*
+ The decoded images are kept in a separate pool which is usually smaller than
+ the raw ring. The image slot is assigned when the frame is claimed for decoding
+ and recorded in image_ref of the ring slot together with the event id. The
+ reference is only a hint: the image slot may be reused for another frame at
+ any time, so it is validated against image_seq of the image slot. The least
+ recently used image is replaced.
+*/
+int ipecamera_find_image(ipecamera_t *ctx, pcilib_event_id_t evid) {
+    uint64_t ref = __atomic_load_n(&ctx->image_ref[IPECAMERA_EVENT_SLOT(ctx, evid)], __ATOMIC_ACQUIRE);
+    int image = ref & IPECAMERA_IMAGE_SLOT_MASK;
+
+    if ((ref >> IPECAMERA_IMAGE_SLOT_BITS) != evid) return -1;
+    if (__atomic_load_n(&ctx->decoded[image].image_seq, __ATOMIC_ACQUIRE) != IPECAMERA_SEQ_READY(evid)) return -1;
+
+    return image;
+}
+
+	// The image is not freed, the frame is just decoded again once requested
+void ipecamera_drop_image(ipecamera_t *ctx, pcilib_event_id_t evid) {
+    int buf_ptr = IPECAMERA_EVENT_SLOT(ctx, evid);
+    uint64_t ref = __atomic_load_n(&ctx->image_ref[buf_ptr], __ATOMIC_ACQUIRE);
+
+    if ((ref >> IPECAMERA_IMAGE_SLOT_BITS) == evid)
+	__atomic_compare_exchange_n(&ctx->image_ref[buf_ptr], &ref, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+static inline void ipecamera_touch_image(ipecamera_t *ctx, int image) {
+    ctx->decoded[image].used = __sync_add_and_fetch(&ctx->image_clock, 1);
+}
+
+	// Finds the least recently used image which is not being decoded
+static int ipecamera_find_victim(ipecamera_t *ctx) {
+    size_t i;
+    int res = -1;
+    uint64_t used = UINT64_MAX;
+
+    for (i = 0; i < ctx->image_slots; i++) {
+	if (ctx->decoded[i].image_seq&1) continue;
+	if (ctx->decoded[i].used < used) {
+	    used = ctx->decoded[i].used;
+	    res = i;
+	}
     }
-    
-	// DS: Request buffer_size to be power of 2 and replace to shifts (just recompute in set_buffer_size)
-    return (evid - 1) % ctx->buffer_size;
+
+    return res;
+}
+
+static inline void *ipecamera_get_raw_frame(ipecamera_t *ctx, int buf_ptr) {
+    return ctx->buffer + buf_ptr * ctx->padded_size;
+}
+
+static inline void ipecamera_copy_raw_frame(ipecamera_t *ctx, int buf_ptr, void *data) {
+    memcpy(data, ctx->buffer + buf_ptr * ctx->padded_size, ctx->frame[buf_ptr].raw_size);
+}
+
+static inline void ipecamera_copy_raw_range(ipecamera_t *ctx, int buf_ptr, size_t offset, size_t size, void *data) {
+    memcpy(data, ctx->buffer + buf_ptr * ctx->padded_size + offset, size);
+}
+
+/*
+ With n_bands set, the frame is split in row bands aligned to the line blocks
+ (line pairs for CMOSIS20) and the bands are decoded concurrently. The thread
+ which has claimed the frame publishes it together with the image slot in
+ band_job. Then, the owner and the idle preprocessors claim bands by advancing
+ the band counter with compare-and-swap. The owner keeps the image claimed (odd
+ image_seq) until all bands are decoded, so the helpers don't need to claim
+ anything. Only a single frame is published at a time, the owner of the next
+ frame first helps with the bands of the current one.
+*/
+static int ipecamera_claim_band(ipecamera_t *ctx, pcilib_event_id_t required_id, uint64_t *claimed) {
+    uint64_t job;
+
+    do {
+	job = ctx->band_job;
+	if ((!IPECAMERA_BAND_EVENT(job))||((job & IPECAMERA_BAND_MASK) >= ctx->n_bands)) return -1;
+	if ((required_id)&&(IPECAMERA_BAND_EVENT(job) != required_id)) return -1;
+    } while (!__sync_bool_compare_and_swap(&ctx->band_job, job, job + 1));
+
+    *claimed = job;
+
+    return 0;
+}
+
+	// With packed images or change detection, the lines are packed and compared in chunks right after decoding while they are still in cache
+static int ipecamera_decode_range(ipecamera_t *ctx, int image, const void *raw, size_t first_line, size_t n_lines) {
+    int err;
+    size_t line, lines, last_line;
+    ipecamera_decoded_t *decoded = ctx->decoded + image;
+
+    if ((!ctx->packed)&&(decoded->ref_image < 0)) return ipecamera_decode_lines(ctx, &decoded->layout, raw, first_line, n_lines, decoded->pixels);
+
+    last_line = first_line + n_lines;
+    if (last_line > decoded->layout.lines) last_line = decoded->layout.lines;
+
+    for (line = first_line; line < last_line; line += lines) {
+	lines = last_line - line;
+	if (lines > IPECAMERA_PACK_LINES) lines = IPECAMERA_PACK_LINES;
+
+	err = ipecamera_decode_lines(ctx, &decoded->layout, raw, line, lines, decoded->pixels);
+	if (err) return err;
+
+	if (ctx->packed) ipecamera_pack_lines(ctx, decoded->pixels, line, lines, ctx->packed + image * ctx->packed_size);
+	if (decoded->ref_image >= 0) ipecamera_compare_lines(ctx, decoded->pixels, ctx->image + decoded->ref_image * ctx->image_size, line, lines, ctx->cmask + image * ctx->dim.height);
+    }
+
+    return 0;
+}
+
+static void ipecamera_decode_band(ipecamera_t *ctx, uint64_t job) {
+    int err;
+    int buf_ptr = IPECAMERA_EVENT_SLOT(ctx, IPECAMERA_BAND_EVENT(job));
+    int image = IPECAMERA_BAND_IMAGE(job);
+    size_t band = job & IPECAMERA_BAND_MASK;
+    ipecamera_decoded_t *decoded = ctx->decoded + image;
+    size_t blocks = (decoded->layout.lines + decoded->layout.block_lines - 1) / decoded->layout.block_lines;
+    size_t first = band * blocks / ctx->n_bands;
+    size_t last = (band + 1) * blocks / ctx->n_bands;
+
+    if (last > first) {
+	err = ipecamera_decode_range(ctx, image, ipecamera_get_raw_frame(ctx, buf_ptr), first * decoded->layout.block_lines, (last - first) * decoded->layout.block_lines);
+	if (err) decoded->band_error = err;
+    }
+
+    if (__sync_add_and_fetch(&decoded->bands_done, 1) == ctx->n_bands)
+	ipecamera_notify(&ctx->band_done);
+}
+
+static inline int ipecamera_have_band(ipecamera_t *ctx) {
+    uint64_t job = ctx->band_job;
+    return ((IPECAMERA_BAND_EVENT(job))&&((job & IPECAMERA_BAND_MASK) < ctx->n_bands));
+}
+
+static int ipecamera_decode_bands(ipecamera_t *ctx, pcilib_event_id_t event_id, int buf_ptr, int image, void *raw) {
+    int err;
+    uint32_t key;
+    uint64_t job, claimed;
+    ipecamera_frame_t *frame = ctx->frame + buf_ptr;
+    ipecamera_decoded_t *decoded = ctx->decoded + image;
+
+    err = ipecamera_parse_layout(ctx, raw, frame->raw_size, &decoded->layout);
+    if (err) return err;
+
+    decoded->bands_done = 0;
+    decoded->band_error = 0;
+
+    for (;;) {
+	job = ctx->band_job;
+	if ((IPECAMERA_BAND_EVENT(job))&&((job & IPECAMERA_BAND_MASK) < ctx->n_bands)) {
+	    if (!ipecamera_claim_band(ctx, 0, &claimed))
+		ipecamera_decode_band(ctx, claimed);
+	} else if (__sync_bool_compare_and_swap(&ctx->band_job, job, IPECAMERA_BAND_JOB(event_id, image))) {
+	    break;
+	}
+    }
+
+	// wake up idle preprocessors, the other waiters will just re-check their conditions
+    ipecamera_notify(&ctx->new_event);
+
+    while (!ipecamera_claim_band(ctx, event_id, &claimed))
+	ipecamera_decode_band(ctx, claimed);
+
+    while (decoded->bands_done < ctx->n_bands) {
+	key = ipecamera_notifier_prepare(&ctx->band_done);
+	if (decoded->bands_done < ctx->n_bands)
+	    ipecamera_notifier_wait(&ctx->band_done, key, NULL);
+	ipecamera_notifier_cancel(&ctx->band_done);
+    }
+
+    if (decoded->band_error) return decoded->band_error;
+
+    ipecamera_decode_meta(&decoded->layout, raw, frame->raw_size, &decoded->meta);
+
+    return 0;
+}
+
+static int ipecamera_decode_builtin(ipecamera_t *ctx, int buf_ptr, int image, void *raw) {
+    int err;
+    ipecamera_frame_t *frame = ctx->frame + buf_ptr;
+    ipecamera_decoded_t *decoded = ctx->decoded + image;
+
+    err = ipecamera_parse_layout(ctx, raw, frame->raw_size, &decoded->layout);
+    if (!err) err = ipecamera_decode_range(ctx, image, raw, 0, decoded->layout.lines);
+    if (err) return err;
+
+    ipecamera_decode_meta(&decoded->layout, raw, frame->raw_size, &decoded->meta);
+
+    return 0;
+}
+
+	// ufodecode is decoding the whole frame at once, so it is packed and compared afterwards
+static int ipecamera_decode_ufo(ipecamera_t *ctx, int buf_ptr, int image, void *raw) {
+    ipecamera_frame_t *frame = ctx->frame + buf_ptr;
+    ipecamera_decoded_t *decoded = ctx->decoded + image;
+    ipecamera_pixel_t *pixels = decoded->pixels;
+
+    if (!ufo_decoder_decode_frame(ctx->ipedec, raw, frame->raw_size, pixels, &decoded->meta)) return PCILIB_ERROR_INVALID_DATA;
+
+    if (ctx->packed) ipecamera_pack_lines(ctx, pixels, 0, ctx->dim.height, ctx->packed + image * ctx->packed_size);
+    if (decoded->ref_image >= 0) ipecamera_compare_lines(ctx, pixels, ctx->image + decoded->ref_image * ctx->image_size, 0, (decoded->meta.n_rows < ctx->dim.height)?decoded->meta.n_rows:ctx->dim.height, ctx->cmask + image * ctx->dim.height);
+
+    return 0;
+}
+
+static int ipecamera_compare_meta(const UfoDecoderMeta *a, const UfoDecoderMeta *b) {
+    return ((a->frame_number != b->frame_number)||(a->time_stamp != b->time_stamp)||(a->n_rows != b->n_rows)||
+	    (a->n_skipped_rows != b->n_skipped_rows)||(a->cmosis_start_address != b->cmosis_start_address)||
+	    (a->status1.bits != b->status1.bits)||(a->status2.bits != b->status2.bits)||(a->status3.bits != b->status3.bits)||
+	    (a->output_mode != b->output_mode)||(a->adc_resolution != b->adc_resolution));
+}
+
+/*
+ The built-in decoder is only used once it has produced the same pixels and
+ metadata as ufodecode for IPECAMERA_BUILTIN_VERIFY_FRAMES frames. Until then,
+ the frames are decoded by ufodecode and, in addition, by the built-in decoder
+ into verify_pixels. The buffer is shared, the frames decoded by other threads
+ while it is in use are only decoded by ufodecode and are not counted. On the
+ first mismatch, ufodecode is used for the rest of the session.
+*/
+static int ipecamera_verify_builtin(ipecamera_t *ctx, pcilib_event_id_t event_id, int buf_ptr, int image, void *raw) {
+    int err, unverified;
+    size_t rows;
+    ipecamera_pixel_t *pixels;
+    ipecamera_frame_layout_t layout;
+    UfoDecoderMeta meta;
+    ipecamera_frame_t *frame = ctx->frame + buf_ptr;
+    ipecamera_decoded_t *decoded = ctx->decoded + image;
+
+    if (!ctx->verify_pixels) return PCILIB_ERROR_INVALID_STATE;
+
+    err = ipecamera_decode_ufo(ctx, buf_ptr, image, raw);
+    if (err) return err;
+
+    if (!__sync_bool_compare_and_swap(&ctx->verify_busy, 0, 1)) return 0;
+    pixels = ctx->verify_pixels;
+
+    err = ipecamera_parse_layout(ctx, raw, frame->raw_size, &layout);
+    if (!err) err = ipecamera_decode_lines(ctx, &layout, raw, 0, layout.lines, pixels);
+    if (!err) {
+	ipecamera_decode_meta(&layout, raw, frame->raw_size, &meta);
+	rows = (meta.n_rows < ctx->dim.height)?meta.n_rows:ctx->dim.height;
+	if ((ipecamera_compare_meta(&meta, &decoded->meta))||(memcmp(pixels, decoded->pixels, rows * ctx->dim.width * sizeof(ipecamera_pixel_t)))) err = PCILIB_ERROR_INVALID_DATA;
+    }
+
+    __sync_lock_release(&ctx->verify_busy);
+
+	// The frame is overwritten while decoding, both results are garbage
+    if (ipecamera_check_raw(ctx, buf_ptr, event_id)) return 0;
+
+    do {
+	unverified = ctx->builtin_unverified;
+	if (unverified <= 0) return 0;
+    } while (!__sync_bool_compare_and_swap(&ctx->builtin_unverified, unverified, err?-1:(unverified - 1)));
+
+    if (err) pcilib_warning("The built-in decoder does not match ufodecode on frame %zu (error %i), ufodecode is used instead", event_id, err);
+    else if (unverified == 1) pcilib_info("The built-in decoder is bit-exact with ufodecode on %i frames and is used from now on", IPECAMERA_BUILTIN_VERIFY_FRAMES);
+
+    return 0;
+}
+
+/*
+ The change mask is computed against the previous frame if its image is already
+ decoded into the image pool once decoding of the frame starts. The images handed
+ over to the callers are not used as they may be freed any time. The reference is
+ not protected while comparing, so it is re-validated once the frame is decoded.
+*/
+static int ipecamera_find_reference(ipecamera_t *ctx, pcilib_event_id_t event_id) {
+    int image;
+
+    if ((ctx->change_threshold < 0)||(event_id < 2)) return -1;
+
+    image = ipecamera_find_image(ctx, event_id - 1);
+    if ((image < 0)||(ctx->decoded[image].image_broken)) return -1;
+
+    return image;
+}
+
+static inline void ipecamera_fill_mask(ipecamera_t *ctx, int image, ipecamera_change_mask_t value) {
+    size_t i;
+    ipecamera_change_mask_t *cmask = ctx->cmask + image * ctx->dim.height;
+
+    for (i = 0; i < ctx->dim.height; i++)
+	cmask[i] = value;
+}
+
+/*
+ Claims the frame for decoding. The least recently used image slot is claimed
+ by switching its image_seq to the odd value of the event, then the frame is
+ claimed by pointing image_ref of the ring slot to this image. If the frame is
+ already decoded by another thread, we wait until it is finished and help with
+ the bands meanwhile. If all images are being decoded, we just re-check them
+ periodically.
+ @return 	- 0 if claimed, 1 if the image is already decoded, or error code
+*/
+static int ipecamera_claim_image(ipecamera_t *ctx, int buf_ptr, pcilib_event_id_t event_id, int *image) {
+    int res;
+    uint32_t key;
+    uint64_t ref, seq, job;
+    struct timeval deadline;
+
+    for (;;) {
+	ref = __atomic_load_n(&ctx->image_ref[buf_ptr], __ATOMIC_ACQUIRE);
+	res = ref & IPECAMERA_IMAGE_SLOT_MASK;
+
+	if ((ref >> IPECAMERA_IMAGE_SLOT_BITS) == event_id) {
+	    seq = __atomic_load_n(&ctx->decoded[res].image_seq, __ATOMIC_ACQUIRE);
+	    if (seq == IPECAMERA_SEQ_READY(event_id)) {
+		*image = res;
+		return 1;
+	    }
+	    if (seq == IPECAMERA_SEQ_WRITING(event_id)) goto wait;
+		// Otherwise, the image was already replaced and the frame is decoded again
+	}
+
+	res = ipecamera_find_victim(ctx);
+	if (res < 0) goto wait;
+
+	seq = __atomic_load_n(&ctx->decoded[res].image_seq, __ATOMIC_RELAXED);
+	if (seq&1) continue;
+	if (!__atomic_compare_exchange_n(&ctx->decoded[res].image_seq, &seq, IPECAMERA_SEQ_WRITING(event_id), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+
+	if (__atomic_compare_exchange_n(&ctx->image_ref[buf_ptr], &ref, IPECAMERA_IMAGE_REF(event_id, res), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	    *image = res;
+	    return 0;
+	}
+
+	    // The frame was claimed by another thread meanwhile, nothing is written in the image yet
+	__atomic_store_n(&ctx->decoded[res].image_seq, seq, __ATOMIC_RELEASE);
+	continue;
+
+wait:
+	if ((ctx->n_bands)&&(!ipecamera_claim_band(ctx, 0, &job))) {
+	    ipecamera_decode_band(ctx, job);
+	    continue;
+	}
+
+	if (ipecamera_check_raw(ctx, buf_ptr, event_id)) return PCILIB_ERROR_OVERWRITTEN;
+
+	key = ipecamera_notifier_prepare(&ctx->new_image);
+	if (ctx->image_ref[buf_ptr] == ref) {
+	    pcilib_calc_deadline(&deadline, IPECAMERA_PREPROC_WAIT_TIMEOUT);
+	    ipecamera_notifier_wait(&ctx->new_image, key, &deadline);
+	}
+	ipecamera_notifier_cancel(&ctx->new_image);
+    }
+}
+
+/*
+ The image is decoded into the caller buffer if it is supplied or registered for
+ this event. The registration is re-checked after the buffer is loaded, it may be
+ replaced by the registration of the next frame in the same ring slot.
+*/
+static ipecamera_pixel_t *ipecamera_get_destination(ipecamera_t *ctx, int buf_ptr, pcilib_event_id_t event_id, int image) {
+    ipecamera_pixel_t *data;
+    ipecamera_destination_t *dest = ctx->dest + buf_ptr;
+
+    if (__atomic_load_n(&dest->event_id, __ATOMIC_ACQUIRE) == event_id) {
+	data = dest->data;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&dest->event_id, __ATOMIC_RELAXED) == event_id) return data;
+    }
+
+    return ctx->image + image * ctx->image_size;
+}
+
+/*
+ The image decoded into a caller buffer is never published in the image pool:
+ the image slot is freed as soon as decoding is finished. If the buffer was
+ registered, it is unregistered (so nobody decodes into it again) and the result
+ is recorded with decoded_id for the caller which is going to supply this buffer.
+ If the buffer is registered again for the next frame meanwhile, the image is lost.
+*/
+static void ipecamera_hand_over_image(ipecamera_t *ctx, int buf_ptr, pcilib_event_id_t event_id, ipecamera_decoded_t *decoded) {
+    pcilib_event_id_t registered = event_id;
+    ipecamera_destination_t *dest = ctx->dest + buf_ptr;
+
+    if (dest->data != decoded->pixels) return;
+    if (!__atomic_compare_exchange_n(&dest->event_id, &registered, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+
+    dest->image_broken = decoded->image_broken;
+    dest->meta = decoded->meta;
+    __atomic_store_n(&dest->decoded_id, event_id, __ATOMIC_RELEASE);
+}
+
+int ipecamera_get_handed_over(ipecamera_t *ctx, pcilib_event_id_t evid, const void *data, int *image_broken, UfoDecoderMeta *meta) {
+    ipecamera_destination_t *dest = ctx->dest + IPECAMERA_EVENT_SLOT(ctx, evid);
+
+    if (__atomic_load_n(&dest->decoded_id, __ATOMIC_ACQUIRE) != evid) return 0;
+    if ((data)&&(dest->data != data)) return 0;
+
+    if (image_broken) *image_broken = dest->image_broken;
+    if (meta) *meta = dest->meta;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&dest->decoded_id, __ATOMIC_RELAXED) == evid);
 }
 
-inline static int ipecamera_decode_frame(ipecamera_t *ctx, pcilib_event_id_t event_id) {
+	// The preprocessors decode into the registered buffers, the caller requesting the image into the supplied buffer (data) if any
+static int ipecamera_decode_frame_to(ipecamera_t *ctx, pcilib_event_id_t event_id, ipecamera_pixel_t *data, int registered, int *handed_over) {
     int err = 0;
+    int image, unverified;
     size_t res;
-    uint16_t *pixels;
+    void *raw;
+    ipecamera_frame_t *frame;
+    ipecamera_decoded_t *decoded;
     
     int buf_ptr = ipecamera_resolve_event_id(ctx, event_id);
     if (buf_ptr < 0) return PCILIB_ERROR_OVERWRITTEN;
-    
-    if (ctx->frame[buf_ptr].event.image_ready) return 0;
-    
-    if (ctx->frame[buf_ptr].event.info.flags&PCILIB_EVENT_INFO_FLAG_BROKEN) {
+
+    err = ipecamera_claim_image(ctx, buf_ptr, event_id, &image);
+    if (err) return (err == 1)?0:err;
+
+    frame = ctx->frame + buf_ptr;
+    decoded = ctx->decoded + image;
+    if (data) decoded->pixels = data;
+    else if (registered) decoded->pixels = ipecamera_get_destination(ctx, buf_ptr, event_id, image);
+    else decoded->pixels = ctx->image + image * ctx->image_size;
+
+	// no image data may be written before the slot is marked as being updated
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+	// Without the reference all lines are flagged, otherwise only the compared lines may be flagged
+    decoded->ref_image = ipecamera_find_reference(ctx, event_id);
+    decoded->cmask_ref = (decoded->ref_image < 0)?0:(event_id - 1);
+    ipecamera_fill_mask(ctx, image, (decoded->ref_image < 0)?1:0);
+
+    if (frame->info.flags&PCILIB_EVENT_INFO_FLAG_BROKEN) {
 	err = PCILIB_ERROR_INVALID_DATA;
-	ctx->frame[buf_ptr].event.image_broken = err;
+	decoded->image_broken = err;
 	goto ready;
     }
-	
-		
-    pixels = ctx->image + buf_ptr * ctx->image_size;
-    memset(ctx->cmask + ctx->buffer_pos * ctx->dim.height, 0, ctx->dim.height * sizeof(ipecamera_change_mask_t));
 
-    ipecamera_debug_buffer(RAW_FRAMES, ctx->frame[buf_ptr].event.raw_size, ctx->buffer + buf_ptr * ctx->padded_size, PCILIB_DEBUG_BUFFER_MKDIR, "raw_frame.%4lu", ctx->event_id);
+    raw = ipecamera_get_raw_frame(ctx, buf_ptr);
+
+    ipecamera_debug_buffer(RAW_FRAMES, frame->raw_size, raw, PCILIB_DEBUG_BUFFER_MKDIR, "raw_frame.%4lu", ctx->event_id);
+
+    unverified = ctx->builtin_unverified;
+    if (unverified > 0)
+	res = ipecamera_verify_builtin(ctx, event_id, buf_ptr, image, raw)?0:1;
+    else if ((ctx->n_bands)&&(!unverified))
+	res = ipecamera_decode_bands(ctx, event_id, buf_ptr, image, raw)?0:1;
+    else if ((ctx->builtin_decoder)&&(!unverified))
+	res = ipecamera_decode_builtin(ctx, buf_ptr, image, raw)?0:1;
+    else
+	res = ipecamera_decode_ufo(ctx, buf_ptr, image, raw)?0:1;
 
-    res = ufo_decoder_decode_frame(ctx->ipedec, ctx->buffer + buf_ptr * ctx->padded_size, ctx->frame[buf_ptr].event.raw_size, pixels, &ctx->frame[buf_ptr].event.meta);
     if (!res) {
-	ipecamera_debug_buffer(BROKEN_FRAMES, ctx->frame[buf_ptr].event.raw_size, ctx->buffer + buf_ptr * ctx->padded_size, PCILIB_DEBUG_BUFFER_MKDIR, "broken_frame.%4lu", ctx->event_id);
+	ipecamera_debug_buffer(BROKEN_FRAMES, frame->raw_size, raw, PCILIB_DEBUG_BUFFER_MKDIR, "broken_frame.%4lu", ctx->event_id);
         err = PCILIB_ERROR_INVALID_DATA;
-        ctx->frame[buf_ptr].event.image_broken = err;
+        decoded->image_broken = err;
 	goto ready;
     } 
 
-    ctx->frame[buf_ptr].event.image_broken = 0;
+    decoded->image_broken = 0;
 
 ready:
-    ctx->frame[buf_ptr].event.image_ready = 1;
-
-    if (ipecamera_resolve_event_id(ctx, event_id) < 0) {
-	ctx->frame[buf_ptr].event.image_ready = 0;
+	// The raw data was overwritten while decoding, the image is garbage
+    if (ipecamera_check_raw(ctx, buf_ptr, event_id)) {
+	decoded->used = 0;
+	__atomic_store_n(&decoded->image_seq, 0, __ATOMIC_RELEASE);
+	ipecamera_notify(&ctx->new_image);
 	return PCILIB_ERROR_OVERWRITTEN;
     }
 
+	// The previous frame was replaced while comparing or has a different number of lines, so the mask is not reliable
+    if ((decoded->ref_image >= 0)&&((ipecamera_check_image(ctx, decoded->ref_image, event_id - 1))||(ctx->decoded[decoded->ref_image].meta.n_rows != decoded->meta.n_rows))) {
+	decoded->cmask_ref = 0;
+	ipecamera_fill_mask(ctx, image, 1);
+    }
+
+    __sync_fetch_and_add(&ctx->image_decoded, 1);
+
+    if (decoded->pixels != ctx->image + image * ctx->image_size) {
+	__sync_fetch_and_add(&ctx->image_direct, 1);
+	if (!data) ipecamera_hand_over_image(ctx, buf_ptr, event_id, decoded);
+	if (handed_over) *handed_over = 1;
+
+	decoded->used = 0;
+	__atomic_store_n(&decoded->image_seq, 0, __ATOMIC_RELEASE);
+    } else {
+	ipecamera_touch_image(ctx, image);
+	__atomic_store_n(&decoded->image_seq, IPECAMERA_SEQ_READY(event_id), __ATOMIC_RELEASE);
+    }
+
+    ipecamera_notify(&ctx->new_image);
+
     return err;
 }
 
+int ipecamera_decode_frame(ipecamera_t *ctx, pcilib_event_id_t event_id) {
+    return ipecamera_decode_frame_to(ctx, event_id, NULL, 1, NULL);
+}
+
+/*
+ The frames are claimed by advancing preproc_id with compare-and-swap, so
+ preprocessors are not serialized. The event_id is loaded with acquire
+ semantics, so the raw data of all frames up to it is visible.
+*/
 static int ipecamera_get_next_buffer_to_process(ipecamera_t *ctx, pcilib_event_id_t *evid) {
-    int err, res;
+    int res;
+    pcilib_event_id_t preproc_id, event_id, next_id;
 
-    if (ctx->preproc_id == ctx->event_id) return -1;
-    
-    if (ctx->preproc) 
-	pthread_mutex_lock(&ctx->preproc_mutex);
-	
-    if (ctx->preproc_id == ctx->event_id) {
-	if (ctx->preproc)
-	    pthread_mutex_unlock(&ctx->preproc_mutex);
-	return -1;
-    }
+    preproc_id = __atomic_load_n(&ctx->preproc_id, __ATOMIC_RELAXED);
+    do {
+	event_id = __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE);
 
-    if ((ctx->event_id - ctx->preproc_id) > (ctx->buffer_size - IPECAMERA_RESERVE_BUFFERS)) {
-	size_t preproc_id = ctx->preproc_id;
-	ctx->preproc_id = ctx->event_id - (ctx->buffer_size - 1 - IPECAMERA_RESERVE_BUFFERS - 1);
-	ipecamera_debug(HARDWARE, "Skipping preprocessing of events %zu to %zu as decoding is not fast enough. We are currently %zu buffers beyond, but only %zu buffers are available and safety limit is %zu",
-	    preproc_id, ctx->preproc_id - 1, ctx->event_id - ctx->preproc_id, ctx->buffer_size, IPECAMERA_RESERVE_BUFFERS);
-    }
+	if (preproc_id == event_id) return -1;
 
-    res = ctx->preproc_id%ctx->buffer_size;
+	if ((event_id - preproc_id) > (ctx->buffer_size - IPECAMERA_RESERVE_BUFFERS))
+	    next_id = event_id - (ctx->buffer_size - 1 - IPECAMERA_RESERVE_BUFFERS - 1);
+	else
+	    next_id = preproc_id;
+    } while (!__atomic_compare_exchange_n(&ctx->preproc_id, &preproc_id, next_id + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-    if ((err = pthread_rwlock_trywrlock(&ctx->frame[res].mutex)) != 0) {
-	if (ctx->preproc)
-	    pthread_mutex_unlock(&ctx->preproc_mutex);
-	ipecamera_debug(HARDWARE, "Can't lock buffer %i, errno %i", res, err);
-	return -1;
+    if (next_id != preproc_id) {
+	__sync_fetch_and_add(&ctx->preproc_skipped, next_id - preproc_id);
+	ipecamera_debug(HARDWARE, "Skipping preprocessing of events %zu to %zu as decoding is not fast enough. We are currently %zu buffers beyond, but only %zu buffers are available and safety limit is %zu",
+	    preproc_id, next_id - 1, event_id - next_id, ctx->buffer_size, IPECAMERA_RESERVE_BUFFERS);
     }
-    
-    *evid = ++ctx->preproc_id;
 
-    if (ctx->preproc)
-	pthread_mutex_unlock(&ctx->preproc_mutex);
+    res = next_id & ctx->buffer_mask;
+
+    *evid = next_id + 1;
 
     return res;
 }
@@ -120,21 +594,37 @@ static int ipecamera_get_next_buffer_to_process(ipecamera_t *ctx, pcilib_event_i
 void *ipecamera_preproc_thread(void *user) {
     int err;
     int buf_ptr;
+    uint32_t key;
+    uint64_t job;
     pcilib_event_id_t evid;
     
     ipecamera_preprocessor_t *preproc = (ipecamera_preprocessor_t*)user;
     ipecamera_t *ctx = preproc->ipecamera;
     
     while (ctx->run_preprocessors) {
+	    // Finishing the frame decoded in bands has priority over starting a new one
+	if ((ctx->n_bands)&&(!ipecamera_claim_band(ctx, 0, &job))) {
+	    ipecamera_decode_band(ctx, job);
+	    continue;
+	}
+
 	buf_ptr = ipecamera_get_next_buffer_to_process(ctx, &evid);
 	if (buf_ptr < 0) {
-	    usleep(IPECAMERA_NOFRAME_PREPROC_SLEEP);
+	    key = ipecamera_notifier_prepare(&ctx->new_event);
+	    if ((ctx->run_preprocessors)&&(ctx->preproc_id == __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE))&&((!ctx->n_bands)||(!ipecamera_have_band(ctx))))
+		ipecamera_notifier_wait(&ctx->new_event, key, NULL);
+	    ipecamera_notifier_cancel(&ctx->new_event);
 	    continue;
 	}
-	
+
+	    // The frame is decoded once requested, the clients waiting for preprocessors should not wait for it any longer
+	if ((ctx->preprocess_mode == IPECAMERA_PREPROCESS_LAZY)&&(!ipecamera_frame_wanted(ctx, evid))) {
+	    __sync_fetch_and_add(&ctx->lazy_skipped, 1);
+	    ipecamera_notify(&ctx->new_image);
+	    continue;
+	}
+
 	err = ipecamera_decode_frame(ctx, evid);
-	
-	pthread_rwlock_unlock(&ctx->frame[buf_ptr].mutex);
 
 #ifdef IPECAMERA_DEBUG_HARDWARE
 	if (err) {
@@ -155,54 +645,543 @@ void *ipecamera_preproc_thread(void *user) {
     return NULL;
 }
 
-static int ipecamera_get_frame(ipecamera_t *ctx, pcilib_event_id_t event_id) {
+/*
+ Waits until the frame is decoded by preprocessors or decodes it on its own if
+ preprocessors are not running, have skipped the frame, or the image was already
+ replaced by a newer frame. In the later case, the frame is decoded directly
+ into the data buffer if it is supplied. If the image is decoded into the data
+ buffer (here or by a preprocessor as the buffer was registered), it is handed
+ over and the image slot is set to -1.
+*/
+static int ipecamera_get_frame(ipecamera_t *ctx, pcilib_event_id_t event_id, ipecamera_pixel_t *data, int *image) {
+    int err, res, broken;
+    int handed_over = 0;
+    uint32_t key;
+    struct timeval deadline;
+
+	// The image handed over is not copied even if another consumer has decoded the frame again
+    if (data) handed_over = ipecamera_get_handed_over(ctx, event_id, data, &broken, NULL);
+    res = handed_over?-1:ipecamera_find_image(ctx, event_id);
+
+    if ((res < 0)&&(!handed_over)) __sync_fetch_and_add(&ctx->image_misses, 1);
+    else __sync_fetch_and_add(&ctx->image_hits, 1);
+
+    for (; (res < 0)&&(!handed_over); res = ipecamera_find_image(ctx, event_id)) {
+
+	if (ipecamera_resolve_event_id(ctx, event_id) < 0)
+	    return PCILIB_ERROR_OVERWRITTEN;
+
+	    // In lazy mode, the frame is decoded right away unless preprocessors are expected to decode it
+	if ((ctx->preproc)&&(__atomic_load_n(&ctx->preproc_id, __ATOMIC_ACQUIRE) < event_id)&&((ctx->preprocess_mode != IPECAMERA_PREPROCESS_LAZY)||(ipecamera_frame_wanted(ctx, event_id)))) {
+	    key = ipecamera_notifier_prepare(&ctx->new_image);
+	    if ((ipecamera_find_image(ctx, event_id) < 0)&&(__atomic_load_n(&ctx->preproc_id, __ATOMIC_ACQUIRE) < event_id)) {
+		    // preprocessors are not notifying if frames are skipped
+		pcilib_calc_deadline(&deadline, IPECAMERA_PREPROC_WAIT_TIMEOUT);
+		ipecamera_notifier_wait(&ctx->new_image, key, &deadline);
+	    }
+	    ipecamera_notifier_cancel(&ctx->new_image);
+	    continue;
+	}
+
+	err = ipecamera_decode_frame_to(ctx, event_id, data, 0, &handed_over);
+	if (handed_over) {
+	    *image = -1;
+	    return err;
+	}
+	if ((err)&&(err != PCILIB_ERROR_INVALID_DATA)) return err;
+
+	    // The frame could be decoded into the registered buffer meanwhile
+	if (data) handed_over = ipecamera_get_handed_over(ctx, event_id, data, &broken, NULL);
+    }
+
+    if (handed_over) {
+	*image = -1;
+	return broken;
+    }
+
+    ipecamera_touch_image(ctx, res);
+    *image = res;
+
+	// The caller validates the image against image_seq once it is consumed
+    return ctx->decoded[res].image_broken;
+}
+
+
+int ipecamera_prefetch(ipecamera_t *ctx, pcilib_event_id_t evid) {
+    if (!ctx->started) {
+	pcilib_error("IPECamera is not in grabbing mode");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    ctx->prefetch[IPECAMERA_EVENT_SLOT(ctx, evid)] = evid;
+
+    return 0;
+}
+
+int ipecamera_register_image_buffer(ipecamera_t *ctx, pcilib_event_id_t evid, void *buf, size_t size) {
+    ipecamera_destination_t *dest;
+
+    if (!ctx->started) {
+	pcilib_error("IPECamera is not in grabbing mode");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    if (size < ctx->image_size * sizeof(ipecamera_pixel_t)) {
+	pcilib_error("The image (%zu bytes) is too big for the registered buffer (%zu bytes)", ctx->image_size * sizeof(ipecamera_pixel_t), size);
+	return PCILIB_ERROR_TOOBIG;
+    }
+
+    dest = ctx->dest + IPECAMERA_EVENT_SLOT(ctx, evid);
+
+    __atomic_store_n(&dest->event_id, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&dest->decoded_id, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    dest->data = (ipecamera_pixel_t*)buf;
+    __atomic_store_n(&dest->event_id, evid, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void ipecamera_unregister_image_buffers(ipecamera_t *ctx) {
+    size_t i;
+
+    for (i = 0; i <= ctx->buffer_mask; i++) {
+	__atomic_store_n(&ctx->dest[i].event_id, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->dest[i].decoded_id, 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ipecamera_get_cache_stats(ipecamera_t *ctx, ipecamera_cache_stats_t *stats) {
+    stats->images = ctx->image_slots;
+    stats->hits = ctx->image_hits;
+    stats->misses = ctx->image_misses;
+    stats->decoded = ctx->image_decoded;
+    stats->skipped = ctx->lazy_skipped;
+    stats->direct = ctx->image_direct;
+}
+
+/*
+ In progressive mode, the reader publishes the number of received bytes in
+ ready_size of the slot being written. The data is stored before the watermark
+ is advanced with release semantics, so the lines below the watermark can be
+ used while the rest of the frame is still arriving. If the reader discards the
+ partially received frame (drop-newest policy), the slot is refilled under the
+ same event id and ready_gen is advanced. So, the copies are validated against
+ both raw_seq and ready_gen. The complete frames are handled the same way with
+ the watermark at the end of the frame.
+*/
+static int ipecamera_resolve_lines(ipecamera_t *ctx, pcilib_event_id_t evid, size_t *size, uint32_t *gen, int *complete) {
+    int buf_ptr = IPECAMERA_EVENT_SLOT(ctx, evid);
+    ipecamera_frame_t *frame = ctx->frame + buf_ptr;
+    uint64_t seq;
+
+    *gen = __atomic_load_n(&frame->ready_gen, __ATOMIC_ACQUIRE);
+    seq = __atomic_load_n(&frame->raw_seq, __ATOMIC_ACQUIRE);
+
+    *complete = (seq == IPECAMERA_SEQ_READY(evid));
+    if (*complete) {
+	*size = frame->raw_size;
+	return buf_ptr;
+    }
+
+    if (seq != IPECAMERA_SEQ_WRITING(evid)) return -1;
+
+	// Without progressive mode, nothing is published until the frame is complete
+    *size = ctx->progressive?__atomic_load_n(&frame->ready_size, __ATOMIC_ACQUIRE):0;
+    return buf_ptr;
+}
+
+static inline int ipecamera_check_lines(ipecamera_t *ctx, int buf_ptr, pcilib_event_id_t evid, uint32_t gen) {
+    uint64_t seq;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq = __atomic_load_n(&ctx->frame[buf_ptr].raw_seq, __ATOMIC_RELAXED);
+    if ((seq != IPECAMERA_SEQ_READY(evid))&&(seq != IPECAMERA_SEQ_WRITING(evid))) return PCILIB_ERROR_OVERWRITTEN;
+
+    return (__atomic_load_n(&ctx->frame[buf_ptr].ready_gen, __ATOMIC_RELAXED) == gen)?0:PCILIB_ERROR_OVERWRITTEN;
+}
+
+	// Parses the header of the (possibly incomplete) frame and finds how many lines are already received
+static int ipecamera_open_lines(ipecamera_t *ctx, pcilib_event_id_t event_id, int *buf_ptr, uint32_t *gen, int *complete, ipecamera_frame_layout_t *layout, size_t *lines) {
     int err;
-    int buf_ptr = (event_id - 1) % ctx->buffer_size;
+    size_t size, received;
+    pcilib_event_id_t last_id;
+    ipecamera_payload_t header[IPECAMERA_MAX_HEADER_SIZE / sizeof(ipecamera_payload_t)];
+
+    *lines = 0;
+    memset(layout, 0, sizeof(ipecamera_frame_layout_t));
+
+	// The frame following the last one may be not marked as being received yet
+    last_id = __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE);
+
+    *buf_ptr = ipecamera_resolve_lines(ctx, event_id, &received, gen, complete);
+    if (*buf_ptr < 0) return (event_id > last_id)?PCILIB_ERROR_BUSY:PCILIB_ERROR_OVERWRITTEN;
+
+    size = (received < IPECAMERA_MAX_HEADER_SIZE)?received:IPECAMERA_MAX_HEADER_SIZE;
+    ipecamera_copy_raw_range(ctx, *buf_ptr, 0, size, header);
+
+    err = ipecamera_parse_partial_layout(ctx, header, size, layout);
+
+    if (ipecamera_check_lines(ctx, *buf_ptr, event_id, *gen)) return PCILIB_ERROR_OVERWRITTEN;
+
+    if (err) {
+	    // The header is not completely received yet
+	if ((!*complete)&&(size < IPECAMERA_MAX_HEADER_SIZE)&&(err == PCILIB_ERROR_INVALID_DATA)) return 0;
+	return err;
+    }
+
+    *lines = ipecamera_layout_lines_ready(layout, received);
+
+    return 0;
+}
+
+static int ipecamera_count_lines(ipecamera_t *ctx, pcilib_event_id_t event_id, size_t *lines, int *complete) {
+    int buf_ptr;
+    uint32_t gen;
+    ipecamera_frame_layout_t layout;
+
+    *lines = 0;
+    *complete = 0;
+
+	// The frames after the one being received are not started yet
+    if (event_id > __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE) + (ctx->progressive?1:0)) return 0;
+
+    return ipecamera_open_lines(ctx, event_id, &buf_ptr, &gen, complete, &layout, lines);
+}
+
+int ipecamera_get_lines_ready(ipecamera_t *ctx, pcilib_event_id_t evid, size_t *lines) {
+    int complete;
+
+    return ipecamera_count_lines(ctx, evid, lines, &complete);
+}
+
+int ipecamera_wait_lines(ipecamera_t *ctx, pcilib_event_id_t evid, size_t lines, pcilib_timeout_t timeout, size_t *ready) {
+    int err, complete, wait;
+    uint32_t key;
+    size_t n_lines;
+    struct timeval deadline;
+	// Without progressive mode, only the completed frames are announced
+    ipecamera_notifier_t *notifier = ctx->progressive?&ctx->lines_ready:&ctx->new_event;
+
+    if (!ctx->started) {
+	pcilib_error("IPECamera is not in grabbing mode");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    if ((timeout)&&(timeout != PCILIB_TIMEOUT_INFINITE))
+	pcilib_calc_deadline(&deadline, timeout);
+
+    do {
+	key = ipecamera_notifier_prepare(notifier);
+	err = ipecamera_count_lines(ctx, evid, &n_lines, &complete);
+	if ((!err)&&(!complete)&&(n_lines < lines)) {
+	    if ((timeout)&&(ctx->run_reader)) err = ipecamera_notifier_wait(notifier, key, (timeout == PCILIB_TIMEOUT_INFINITE)?NULL:&deadline);
+	    else err = PCILIB_ERROR_TIMEOUT;
+	    wait = !err;
+	} else wait = 0;
+	ipecamera_notifier_cancel(notifier);
+    } while (wait);
+
+	// The lines may have arrived just before the deadline
+    if (err == PCILIB_ERROR_TIMEOUT) {
+	if ((!ipecamera_count_lines(ctx, evid, &n_lines, &complete))&&((complete)||(n_lines >= lines))) err = 0;
+    }
+
+    if (ready) *ready = n_lines;
+
+    return err;
+}
+
+	// The scratch buffer is only held while a chunk of lines is decoded and copied out, so waiting for a free one is short
+static ipecamera_pixel_t *ipecamera_claim_scratch(ipecamera_t *ctx, int *idx) {
+    int i;
+    uint32_t used;
+
+    for (;;) {
+	used = ctx->scratch_used;
+	for (i = 0; (i < IPECAMERA_REGION_SCRATCH)&&(used&(1u << i)); i++);
+
+	if (i == IPECAMERA_REGION_SCRATCH) sched_yield();
+	else if (__sync_bool_compare_and_swap(&ctx->scratch_used, used, used|(1u << i))) break;
+    }
+
+    *idx = i;
+    return ctx->scratch + i * IPECAMERA_REGION_LINES * ctx->dim.width;
+}
+
+static inline void ipecamera_release_scratch(ipecamera_t *ctx, int idx) {
+    __sync_fetch_and_and(&ctx->scratch_used, ~(1u << idx));
+}
+
+/*
+ Until the built-in decoder has matched ufodecode (or once it has differed), the
+ lines are not decoded separately. The frame is decoded as a whole by ufodecode
+ into the image pool once it is completely received, and the region is copied
+ out of the decoded image or, if packed is given, the lines are packed.
+*/
+static int ipecamera_copy_lines(ipecamera_t *ctx, pcilib_event_id_t event_id, const ipecamera_image_region_t *region, ipecamera_pixel_t *pixels, uint8_t *packed) {
+    int err, image;
+    size_t row, n_rows, lines;
+    size_t width = ctx->dim.width;
+    size_t row_size = region->width * sizeof(ipecamera_pixel_t);
+    size_t line_size = width * ctx->dim.real_bpp / 8;
+    const ipecamera_pixel_t *src;
+
+    err = ipecamera_get_frame(ctx, event_id, NULL, &image);
+    if (err) return err;
+
+    src = ctx->decoded[image].pixels;
+    n_rows = ctx->decoded[image].meta.n_rows;
+
+    if (packed) {
+	lines = (region->y < n_rows)?(n_rows - region->y):0;
+	if (lines > region->height) lines = region->height;
+
+	if (lines) ipecamera_pack_lines(ctx, src + region->y * width, 0, lines, packed);
+	if (lines < region->height) memset(packed + lines * line_size, 0, (region->height - lines) * line_size);
+    } else {
+	for (row = 0; row < region->height; row++) {
+	    if (region->y + row < n_rows) memcpy(pixels + row * region->width, src + (region->y + row) * width + region->x, row_size);
+	    else memset(pixels + row * region->width, 0, row_size);
+	}
+    }
+
+    return ipecamera_check_image(ctx, image, event_id)?PCILIB_ERROR_OVERWRITTEN:0;
+}
 
-    if (!ctx->preproc) {
-	pthread_rwlock_rdlock(&ctx->frame[buf_ptr].mutex);
+/*
+ Only the lines covering the region are decoded. The payloads of the line are
+ located directly by the line number and the line size, so the cost is
+ proportional to the number of rows in the region. The payloads carry pixels of
+ all channels, so the full lines are decoded in small chunks into the scratch
+ buffer. Then, the requested columns are copied out or, if packed is given, the
+ lines are packed (the region is full width in this case). The built-in decoder
+ is used once it is verified. The lines of the frame which is still being received are
+ available once the reader passes them (progressive mode), the frame is written
+ in place, so the received part is used directly.
+*/
+static int ipecamera_read_lines(ipecamera_t *ctx, pcilib_event_id_t event_id, const ipecamera_image_region_t *region, ipecamera_pixel_t *pixels, uint8_t *packed) {
+    int err, buf_ptr, complete, idx;
+    uint32_t gen;
+    size_t row, line, lines, first, last, ready, skip;
+    size_t width = ctx->dim.width;
+    size_t row_size = region->width * sizeof(ipecamera_pixel_t);
+    size_t line_size = width * ctx->dim.real_bpp / 8;
+    const void *raw;
+    ipecamera_pixel_t *scratch;
+    ipecamera_frame_layout_t layout;
+
+    err = ipecamera_open_lines(ctx, event_id, &buf_ptr, &gen, &complete, &layout, &ready);
+    if (err) return err;
+
+    if ((complete)&&(ctx->frame[buf_ptr].info.flags&PCILIB_EVENT_INFO_FLAG_BROKEN)) return PCILIB_ERROR_INVALID_DATA;
+
+	// The rows beyond the end of the frame are not transferred by the camera
+    last = region->y + region->height;
+    if ((!complete)&&((!layout.lines)||((ready < layout.lines)&&(last > ready)))) return PCILIB_ERROR_BUSY;
+    if (last > layout.lines) last = layout.lines;
+
+	// The built-in decoder is not verified yet (or has differed from ufodecode)
+    if (ctx->builtin_unverified) {
+	if (!complete) return PCILIB_ERROR_BUSY;
+	return ipecamera_copy_lines(ctx, event_id, region, pixels, packed);
+    }
 
-	err = ipecamera_decode_frame(ctx, event_id);
+    raw = ipecamera_get_raw_frame(ctx, buf_ptr);
 
+    first = region->y - region->y % layout.block_lines;
+    for (line = first; line < last; line += lines) {
+	lines = last - line;
+	if (lines > IPECAMERA_REGION_LINES) lines = IPECAMERA_REGION_LINES;
+
+	scratch = ipecamera_claim_scratch(ctx, &idx);
+
+	err = ipecamera_decode_rows(ctx, &layout, raw, line, lines, scratch);
 	if (err) {
-	    pthread_rwlock_unlock(&ctx->frame[buf_ptr].mutex);
-	    return err;
+	    ipecamera_release_scratch(ctx, idx);
+	    break;
 	}
-	
-	return 0;
+
+	skip = (line < region->y)?(region->y - line):0;
+	if (packed) {
+	    ipecamera_pack_lines(ctx, scratch + skip * width, 0, lines - skip, packed + (line + skip - region->y) * line_size);
+	} else {
+	    for (row = skip; row < lines; row++)
+		memcpy(pixels + (line + row - region->y) * region->width, scratch + row * width + region->x, row_size);
+	}
+
+	ipecamera_release_scratch(ctx, idx);
     }
 
+    if (err) return err;
+
+    for (row = (last > region->y)?last:region->y; row < region->y + region->height; row++) {
+	if (packed) memset(packed + (row - region->y) * line_size, 0, line_size);
+	else memset(pixels + (row - region->y) * region->width, 0, row_size);
+    }
 
-    while (!((volatile ipecamera_t*)ctx)->frame[buf_ptr].event.image_ready) {
-	usleep(IPECAMERA_NOFRAME_PREPROC_SLEEP);
+    return ipecamera_check_lines(ctx, buf_ptr, event_id, gen);
+}
 
-	buf_ptr = ipecamera_resolve_event_id(ctx, event_id);
-	if (buf_ptr < 0) return PCILIB_ERROR_OVERWRITTEN;
+	// The region of the already decoded image is copied, otherwise only the lines covering the region are decoded
+static int ipecamera_get_region(ipecamera_t *ctx, pcilib_event_id_t event_id, const ipecamera_image_region_t *region, ipecamera_pixel_t *data) {
+    int image;
+    size_t row, n_rows;
+    size_t width = ctx->dim.width;
+    size_t row_size = region->width * sizeof(ipecamera_pixel_t);
+
+    image = ipecamera_find_image(ctx, event_id);
+    if (image >= 0) {
+	if (ctx->decoded[image].image_broken) return ctx->decoded[image].image_broken;
+
+	    // The lines beyond the end of a short frame are not written by the decoder and are zeroed as when decoding the region
+	n_rows = ctx->decoded[image].meta.n_rows;
+	for (row = 0; row < region->height; row++) {
+	    if (region->y + row < n_rows) memcpy(data + row * region->width, ctx->decoded[image].pixels + (region->y + row) * width + region->x, row_size);
+	    else memset(data + row * region->width, 0, row_size);
+	}
+
+	    // Otherwise, the image was replaced while copying, but the raw data may still be available
+	if (!ipecamera_check_image(ctx, image, event_id)) return 0;
     }
 
-    if (((volatile ipecamera_t*)ctx)->frame[buf_ptr].event.image_broken)
-	return ctx->frame[buf_ptr].event.image_broken;
+    return ipecamera_read_lines(ctx, event_id, region, data, NULL);
+}
+
+	// The raw payload of the line blocks is copied as is, the size is only known once the frame header is parsed
+static int ipecamera_get_payload(ipecamera_t *ctx, pcilib_event_id_t event_id, const ipecamera_line_range_t *range, size_t *size, void **ret) {
+    int err, buf_ptr, complete;
+    uint32_t gen;
+    size_t ready, last, first_block, last_block, data_size;
+    void *data = *ret;
+    ipecamera_frame_layout_t layout;
 
-    pthread_rwlock_rdlock(&ctx->frame[buf_ptr].mutex);
+    err = ipecamera_open_lines(ctx, event_id, &buf_ptr, &gen, &complete, &layout, &ready);
+    if (err) return err;
 
-    buf_ptr = ipecamera_resolve_event_id(ctx, event_id);
-    if ((buf_ptr < 0)||(!ctx->frame[buf_ptr].event.image_ready)) {
-	pthread_rwlock_unlock(&ctx->frame[buf_ptr].mutex);
-	return PCILIB_ERROR_OVERWRITTEN;
+    if ((complete)&&(ctx->frame[buf_ptr].info.flags&PCILIB_EVENT_INFO_FLAG_BROKEN)) return PCILIB_ERROR_INVALID_DATA;
+
+    last = range->first_line + range->n_lines;
+    if ((!complete)&&((!layout.lines)||((ready < layout.lines)&&(last > ready)))) return PCILIB_ERROR_BUSY;
+
+    if (last > layout.lines) {
+	pcilib_warning("The lines %zu-%zu are requested, but the frame %zu only has %zu lines", range->first_line, last - 1, event_id, layout.lines);
+	return PCILIB_ERROR_INVALID_ARGUMENT;
+    }
+
+    first_block = range->first_line / layout.block_lines;
+    last_block = (last + layout.block_lines - 1) / layout.block_lines;
+
+    data_size = ipecamera_layout_block_offset(&layout, last_block) - ipecamera_layout_block_offset(&layout, first_block);
+    if (data) {
+	if ((!size)||(*size < data_size)) {
+	    pcilib_warning("The payload of the requested lines of frame %zu is too big (%zu bytes) for user supplied buffer (%zu bytes)", event_id, data_size, (size?*size:0));
+	    return PCILIB_ERROR_TOOBIG;
+	}
+    } else {
+	data = malloc(data_size);
+	if (!data) return PCILIB_ERROR_MEMORY;
     }
 
+    ipecamera_copy_raw_range(ctx, buf_ptr, ipecamera_layout_block_offset(&layout, first_block), data_size, data);
+
+    err = ipecamera_check_lines(ctx, buf_ptr, event_id, gen);
+    if (err) {
+	if (!*ret) free(data);
+	return err;
+    }
+
+    if (size) *size = data_size;
+    *ret = data;
+
     return 0;
 }
 
+/*
+ The line data (regions, packed lines, and payloads) is always copied, there is
+ nothing to return in place. If the user buffer is not supplied, it is allocated
+ and freed by ipecamera_return.
+*/
+static int ipecamera_get_lines(ipecamera_t *ctx, pcilib_event_id_t event_id, ipecamera_data_type_t data_type, size_t arg_size, void *arg, size_t *size, void **ret) {
+    int err;
+    size_t data_size;
+    void *data = *ret;
+    ipecamera_image_region_t region;
+    const ipecamera_line_range_t *range = (const ipecamera_line_range_t*)arg;
+
+    if (data_type == IPECAMERA_IMAGE_REGION) {
+	if ((!arg)||(arg_size < sizeof(ipecamera_image_region_t))) {
+	    pcilib_error("The image region is not specified");
+	    return PCILIB_ERROR_INVALID_ARGUMENT;
+	}
+
+	memcpy(&region, arg, sizeof(ipecamera_image_region_t));
+	if ((!region.width)||(!region.height)||(((size_t)region.x + region.width) > ctx->dim.width)||(((size_t)region.y + region.height) > ctx->dim.height)) {
+	    pcilib_error("The image region (%ux%u at %u,%u) is out of the image bounds", region.width, region.height, region.x, region.y);
+	    return PCILIB_ERROR_INVALID_ARGUMENT;
+	}
+
+	data_size = (size_t)region.width * region.height * sizeof(ipecamera_pixel_t);
+    } else {
+	if ((!range)||(arg_size < sizeof(ipecamera_line_range_t))) {
+	    pcilib_error("The line range is not specified");
+	    return PCILIB_ERROR_INVALID_ARGUMENT;
+	}
+
+	if ((!range->n_lines)||(range->first_line >= ctx->dim.height)||(range->n_lines > ctx->dim.height - range->first_line)) {
+	    pcilib_error("The line range (%zu lines from %zu) is out of the image bounds", range->n_lines, range->first_line);
+	    return PCILIB_ERROR_INVALID_ARGUMENT;
+	}
+
+	if (data_type == IPECAMERA_PACKED_PAYLOAD)
+	    return ipecamera_get_payload(ctx, event_id, range, size, ret);
+
+	region.x = 0;
+	region.y = range->first_line;
+	region.width = ctx->dim.width;
+	region.height = range->n_lines;
+
+	data_size = range->n_lines * ctx->dim.width * ctx->dim.real_bpp / 8;
+    }
+
+    if (data) {
+	if ((!size)||(*size < data_size)) {
+	    pcilib_warning("The requested lines of frame %zu are too big (%zu bytes) for user supplied buffer (%zu bytes)", event_id, data_size, (size?*size:0));
+	    return PCILIB_ERROR_TOOBIG;
+	}
+    } else {
+	data = malloc(data_size);
+	if (!data) return PCILIB_ERROR_MEMORY;
+    }
+
+    if (data_type == IPECAMERA_IMAGE_REGION)
+	err = ipecamera_get_region(ctx, event_id, &region, data);
+    else
+	err = ipecamera_read_lines(ctx, event_id, &region, NULL, data);
+
+    if (err) {
+	if (!*ret) free(data);
+	return err;
+    }
+
+    if (size) *size = data_size;
+    *ret = data;
+
+    return 0;
+}
 
 /*
- We will lock the data for non-raw data to prevent ocasional overwritting. The 
- raw data will be overwritten by the reader thread anyway and we can't do 
- anything to prevent it for performance reasons.
+ Nothing is locked. The copies are validated against the slot sequence counters
+ after copying. If the data is returned in place, it is validated once it is
+ given back with ipecamera_return. So, the client is not blocking the reader or
+ the preprocessors, but may get PCILIB_ERROR_OVERWRITTEN if it holds the frame
+ for too long.
 */
 int ipecamera_get(pcilib_context_t *vctx, pcilib_event_id_t event_id, pcilib_event_data_type_t data_type, size_t arg_size, void *arg, size_t *size, void **ret) {
     int err;
-    int buf_ptr;
+    int buf_ptr, image;
     size_t raw_size;
     ipecamera_t *ctx = (ipecamera_t*)vctx;
 
@@ -215,6 +1194,16 @@ int ipecamera_get(pcilib_context_t *vctx, pcilib_event_id_t event_id, pcilib_eve
 
     ipecamera_debug(API, "ipecamera: get (data)");
 
+	// The lines of the frame which is still being received are available in progressive mode
+    switch ((ipecamera_data_type_t)data_type) {
+	case IPECAMERA_IMAGE_REGION:
+	case IPECAMERA_PACKED_LINE:
+	case IPECAMERA_PACKED_PAYLOAD:
+	    return ipecamera_get_lines(ctx, event_id, (ipecamera_data_type_t)data_type, arg_size, arg, size, ret);
+	default:
+	    break;
+    }
+
     buf_ptr = ipecamera_resolve_event_id(ctx, event_id);
     if (buf_ptr < 0) {
 	ipecamera_debug(HARDWARE, "The data of the requested frame %zu has been meanwhile overwritten", event_id);
@@ -223,14 +1212,14 @@ int ipecamera_get(pcilib_context_t *vctx, pcilib_event_id_t event_id, pcilib_eve
 
     switch ((ipecamera_data_type_t)data_type) {
 	case IPECAMERA_RAW_DATA:
-	    raw_size = ctx->frame[buf_ptr].event.raw_size;
+	    raw_size = ctx->frame[buf_ptr].raw_size;
 	    if (data) {
 		if ((!size)||(*size < raw_size)) {
 		    pcilib_warning("The raw data associated with frame %zu is too big (%zu bytes) for user supplied buffer (%zu bytes)", event_id, raw_size, (size?*size:0));
 		    return PCILIB_ERROR_TOOBIG;
 		}
-		memcpy(data, ctx->buffer + buf_ptr * ctx->padded_size, raw_size);
-		if (ipecamera_resolve_event_id(ctx, event_id) < 0) {
+		ipecamera_copy_raw_frame(ctx, buf_ptr, data);
+		if (ipecamera_check_raw(ctx, buf_ptr, event_id)) {
 		    ipecamera_debug(HARDWARE, "The data of requested frame %zu was overwritten while copying", event_id);
 		    return PCILIB_ERROR_OVERWRITTEN;
 		}
@@ -238,10 +1227,16 @@ int ipecamera_get(pcilib_context_t *vctx, pcilib_event_id_t event_id, pcilib_eve
 		return 0;
 	    }
 	    if (size) *size = raw_size;
-	    *ret = ctx->buffer + buf_ptr * ctx->padded_size;
+	    *ret = ipecamera_get_raw_frame(ctx, buf_ptr);
 	    return 0;
 	case IPECAMERA_IMAGE_DATA:
-	    err = ipecamera_get_frame(ctx, event_id);
+	    if ((data)&&((!size)||(*size < ctx->image_size * sizeof(ipecamera_pixel_t)))) {
+		pcilib_warning("The image associated with frame %zu is too big (%zu bytes) for user supplied buffer (%zu bytes)", event_id, ctx->image_size * sizeof(ipecamera_pixel_t), (size?*size:0));
+		return PCILIB_ERROR_TOOBIG;
+	    }
+
+	    image = -1;
+	    err = ipecamera_get_frame(ctx, event_id, data, &image);
 	    if (err) {
 #ifdef IPECAMERA_DEBUG_HARDWARE
 		switch (err) {
@@ -259,45 +1254,67 @@ int ipecamera_get(pcilib_context_t *vctx, pcilib_event_id_t event_id, pcilib_eve
 	    }
 
 	    if (data) {
-		if ((!size)||(*size < ctx->image_size * sizeof(ipecamera_pixel_t))) {
-		    pcilib_warning("The image associated with frame %zu is too big (%zu bytes) for user supplied buffer (%zu bytes)", event_id, ctx->image_size * sizeof(ipecamera_pixel_t), (size?*size:0));
-		    return PCILIB_ERROR_TOOBIG;
+		    // Otherwise, the image is already decoded into the caller buffer
+		if (image >= 0) {
+		    memcpy(data, ctx->decoded[image].pixels, ctx->image_size * sizeof(ipecamera_pixel_t));
+		    if (ipecamera_check_image(ctx, image, event_id)) {
+			ipecamera_debug(HARDWARE, "The image of requested frame %zu was overwritten while copying", event_id);
+			return PCILIB_ERROR_OVERWRITTEN;
+		    }
 		}
-		memcpy(data, ctx->image + buf_ptr * ctx->image_size, ctx->image_size * sizeof(ipecamera_pixel_t));
-		pthread_rwlock_unlock(&ctx->frame[buf_ptr].mutex);
 		*size =  ctx->image_size * sizeof(ipecamera_pixel_t);
 		return 0;
 	    }
 	
 	    if (size) *size = ctx->image_size * sizeof(ipecamera_pixel_t);
-	    *ret = ctx->image + buf_ptr * ctx->image_size;
+	    *ret = ctx->decoded[image].pixels;
 	    return 0;
 	case IPECAMERA_CHANGE_MASK:
-	    err = ipecamera_get_frame(ctx, event_id);
+	    err = ipecamera_get_frame(ctx, event_id, NULL, &image);
 	    if (err) return err;
 
 	    if (data) {
 		if ((!size)||(*size < ctx->dim.height * sizeof(ipecamera_change_mask_t))) return PCILIB_ERROR_TOOBIG;
-		memcpy(data, ctx->image + buf_ptr * ctx->dim.height, ctx->dim.height * sizeof(ipecamera_change_mask_t));
-		pthread_rwlock_unlock(&ctx->frame[buf_ptr].mutex);
+		memcpy(data, ctx->cmask + image * ctx->dim.height, ctx->dim.height * sizeof(ipecamera_change_mask_t));
+		if (ipecamera_check_image(ctx, image, event_id)) return PCILIB_ERROR_OVERWRITTEN;
 		*size =  ctx->dim.height * sizeof(ipecamera_change_mask_t);
 		return 0;
 	    }
 
 	    if (size) *size = ctx->dim.height * sizeof(ipecamera_change_mask_t);
-	    *ret = ctx->cmask + buf_ptr * ctx->dim.height;
+	    *ret = ctx->cmask + image * ctx->dim.height;
 	    return 0;
 	case IPECAMERA_DIMENSIONS:
 	    if (size) *size = sizeof(ipecamera_image_dimensions_t);
-	    ret = (void*)&ctx->dim;
+	    *ret = (void*)&ctx->dim;
 	    return 0;
-	case IPECAMERA_IMAGE_REGION:
 	case IPECAMERA_PACKED_IMAGE:
-	    // Shall we return complete image or only changed parts?
-	case IPECAMERA_PACKED_LINE:
-	case IPECAMERA_PACKED_PAYLOAD:
-	    pcilib_error("Support for data type (%li) is not implemented yet", data_type);
-	    return PCILIB_ERROR_NOTSUPPORTED;
+	    if ((data)&&((!size)||(*size < ctx->packed_size))) {
+		pcilib_warning("The packed image associated with frame %zu is too big (%zu bytes) for user supplied buffer (%zu bytes)", event_id, ctx->packed_size, (size?*size:0));
+		return PCILIB_ERROR_TOOBIG;
+	    }
+
+	    if ((!data)&&(!ctx->packed)) {
+		pcilib_error("Packed images are not kept, the user-supplied buffer is required (or IPECAMERA_PACKED_IMAGES)");
+		return PCILIB_ERROR_NOTSUPPORTED;
+	    }
+
+	    err = ipecamera_get_frame(ctx, event_id, NULL, &image);
+	    if (err) return err;
+
+	    if (!data) {
+		if (size) *size = ctx->packed_size;
+		*ret = ctx->packed + image * ctx->packed_size;
+		return 0;
+	    }
+
+		// Without the packed copy, the image is packed straight into the user buffer instead of copying 16-bit pixels
+	    if (ctx->packed) memcpy(data, ctx->packed + image * ctx->packed_size, ctx->packed_size);
+	    else ipecamera_pack_lines(ctx, ctx->decoded[image].pixels, 0, ctx->dim.height, data);
+
+	    if (ipecamera_check_image(ctx, image, event_id)) return PCILIB_ERROR_OVERWRITTEN;
+	    *size = ctx->packed_size;
+	    return 0;
 	default:
 	    pcilib_error("Unknown data type (%li) is requested", data_type);
 	    return PCILIB_ERROR_INVALID_REQUEST;
@@ -306,7 +1323,7 @@ int ipecamera_get(pcilib_context_t *vctx, pcilib_event_id_t event_id, pcilib_eve
 
 
 /*
- We will unlock non-raw data and check if the raw data is not overwritten yet
+ We will check if the data returned in place was not overwritten meanwhile
 */
 int ipecamera_return(pcilib_context_t *vctx, pcilib_event_id_t event_id, pcilib_event_data_type_t data_type, void *data) {
     ipecamera_t *ctx = (ipecamera_t*)vctx;
@@ -317,11 +1334,29 @@ int ipecamera_return(pcilib_context_t *vctx, pcilib_event_id_t event_id, pcilib_
 
     }
 
-    if ((ipecamera_data_type_t)data_type == IPECAMERA_RAW_DATA) {
-	if (ipecamera_resolve_event_id(ctx, event_id) < 0) return PCILIB_ERROR_OVERWRITTEN;
-    } else {
-	int buf_ptr = (event_id - 1) % ctx->buffer_size;
-	pthread_rwlock_unlock(&ctx->frame[buf_ptr].mutex);
+    int buf_ptr = IPECAMERA_EVENT_SLOT(ctx, event_id);
+    uint64_t ref;
+
+    switch ((ipecamera_data_type_t)data_type) {
+	case IPECAMERA_RAW_DATA:
+	    if (ipecamera_check_raw(ctx, buf_ptr, event_id)) return PCILIB_ERROR_OVERWRITTEN;
+	    break;
+	case IPECAMERA_IMAGE_REGION:
+	case IPECAMERA_PACKED_LINE:
+	case IPECAMERA_PACKED_PAYLOAD:
+		// The line data is always copied, the data was validated already
+	    free(data);
+	    break;
+	case IPECAMERA_IMAGE_DATA:
+	case IPECAMERA_CHANGE_MASK:
+	case IPECAMERA_PACKED_IMAGE:
+	    ref = ctx->image_ref[buf_ptr];
+	    if ((ref >> IPECAMERA_IMAGE_SLOT_BITS) != event_id) return PCILIB_ERROR_OVERWRITTEN;
+	    if (ipecamera_check_image(ctx, ref & IPECAMERA_IMAGE_SLOT_MASK, event_id)) return PCILIB_ERROR_OVERWRITTEN;
+	    break;
+	default:
+		// IPECAMERA_DIMENSIONS and others are not bound to the frame
+	    return 0;
     }
 
     ipecamera_debug(API, "ipecamera: return (data)");
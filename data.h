@@ -1,6 +1,30 @@
 #ifndef _IPECAMERA_DATA_H
 #define _IPECAMERA_DATA_H
 
+int ipecamera_decode_frame(ipecamera_t *ctx, pcilib_event_id_t event_id);
+
+/**
+ * Finds the image slot holding the decoded frame.
+ * @return		- image slot or -1 if the frame is not decoded (or the image is already replaced)
+ */
+int ipecamera_find_image(ipecamera_t *ctx, pcilib_event_id_t evid);
+
+/**
+ * Forgets the image of the frame, so the frame is decoded again on the next request.
+ */
+void ipecamera_drop_image(ipecamera_t *ctx, pcilib_event_id_t evid);
+
+/**
+ * Checks if the frame was decoded into the registered buffer and handed over
+ * (see ipecamera_register_image_buffer). The buffer is only checked if data is not NULL.
+ * @return		- 1 if the image is handed over, image_broken and meta are filled then
+ */
+int ipecamera_get_handed_over(ipecamera_t *ctx, pcilib_event_id_t evid, const void *data, int *image_broken, UfoDecoderMeta *meta);
+
+/**
+ * Drops all registered buffers, should be called before preprocessors are stopped.
+ */
+void ipecamera_unregister_image_buffers(ipecamera_t *ctx);
 void *ipecamera_preproc_thread(void *user);
 
 #endif /* _IPECAMERA_DATA_H */
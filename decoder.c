@@ -0,0 +1,686 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)||defined(__i386__)
+# include <immintrin.h>
+# define IPECAMERA_DECODER_X86
+# define IPECAMERA_TARGET_SSE4 __attribute__((target("sse4.1")))
+# define IPECAMERA_TARGET_AVX2 __attribute__((target("avx2")))
+#else /* __x86_64__ */
+# define IPECAMERA_TARGET_SSE4
+# define IPECAMERA_TARGET_AVX2
+#endif /* __x86_64__ */
+
+#include <pcilib.h>
+#include <pcilib/error.h>
+
+#include "private.h"
+#include "decoder.h"
+
+#define IPECAMERA_PAYLOAD_SIZE (8 * sizeof(ipecamera_payload_t))
+#define IPECAMERA_PAYLOAD_LANES 16
+#define IPECAMERA_UNPACK_BLOCK 8		//**< Number of payloads transposed at once by SIMD kernels */
+
+typedef enum {
+    IPECAMERA_UNPACKER_SCALAR = 0,
+    IPECAMERA_UNPACKER_SSE4,
+    IPECAMERA_UNPACKER_AVX2,
+    IPECAMERA_UNPACKER_MAX
+} ipecamera_unpacker_t;
+
+typedef enum {
+    IPECAMERA_LAYOUT_CMOSIS_16 = 0,
+    IPECAMERA_LAYOUT_CMOSIS_4,
+    IPECAMERA_LAYOUT_CMOSIS20_16,
+    IPECAMERA_LAYOUT_CMOSIS20_4,
+    IPECAMERA_LAYOUT_MAX
+} ipecamera_layout_t;
+
+static int ipecamera_unpacker = -1;
+static const char *ipecamera_unpacker_names[IPECAMERA_UNPACKER_MAX] = { "scalar", "sse4", "avx2" };
+
+
+int ipecamera_parse_partial_layout(ipecamera_t *ctx, const void *raw, size_t size, ipecamera_frame_layout_t *layout) {
+    const ipecamera_payload_t *buf = (const ipecamera_payload_t*)raw;
+    size_t header_size = 0;
+
+    if (size < CMOSIS_FRAME_HEADER_SIZE) return PCILIB_ERROR_INVALID_DATA;
+
+    memset(layout, 0, sizeof(ipecamera_frame_layout_t));
+
+    switch ((buf[0] >> 1) & 7) {
+     case 0:
+	layout->format = IPECAMERA_FORMAT_CMOSIS;
+	layout->lines = buf[5] & 0x7FF;
+	break;
+     case 1:
+	layout->format = (buf[6] >> 24) & 0x0F;
+	layout->lines = buf[5] & 0xFFFF;
+	break;
+     default:
+	return PCILIB_ERROR_INVALID_DATA;
+    }
+    layout->seqnum = buf[6] & 0xFFFFFF;
+
+    while (!(buf[header_size / sizeof(ipecamera_payload_t)] & 1)) {
+	header_size += CMOSIS_FRAME_HEADER_SIZE;
+	if ((header_size + CMOSIS_FRAME_HEADER_SIZE) > size) return PCILIB_ERROR_INVALID_DATA;
+    }
+    header_size += CMOSIS_FRAME_HEADER_SIZE;
+
+	// We should be careful here (currently firmware matches format, but this may not be the case in future)
+    if ((int)layout->format != (int)ctx->firmware) return PCILIB_ERROR_NOTSUPPORTED;
+
+    switch (layout->format) {
+     case IPECAMERA_FORMAT_CMOSIS:
+	layout->block_lines = 1;
+	layout->payloads = CMOSIS_PIXELS_PER_CHANNEL;
+	break;
+     case IPECAMERA_FORMAT_CMOSIS20:
+	layout->block_lines = 2;
+	layout->payloads = 2 * CMOSIS20_PIXELS_PER_CHANNEL;
+	break;
+     default:
+	return PCILIB_ERROR_NOTSUPPORTED;
+    }
+
+    if ((!layout->lines)||(layout->lines > ctx->dim.height)) return PCILIB_ERROR_INVALID_DATA;
+
+    layout->header_size = header_size;
+    layout->repeats = CMOSIS_MAX_CHANNELS / ctx->cmosis_outputs;
+    layout->repeat_size = ctx->data_line_size * layout->block_lines;
+    layout->data_offset = header_size;
+#ifdef IPECAMERA_BUG_MISSING_PAYLOAD
+	// CMOSIS misses the header of the first line, CMOSIS20 the last pixel payload of the first line pair
+    if (layout->format == IPECAMERA_FORMAT_CMOSIS20) layout->missing_payloads = 1;
+    else layout->data_offset -= IPECAMERA_PAYLOAD_SIZE;
+#endif /* IPECAMERA_BUG_MISSING_PAYLOAD */
+
+    return 0;
+}
+
+size_t ipecamera_layout_block_offset(const ipecamera_frame_layout_t *layout, size_t block) {
+    size_t offset = layout->data_offset + block * layout->repeats * layout->repeat_size;
+    return block?(offset - layout->missing_payloads * IPECAMERA_PAYLOAD_SIZE):offset;
+}
+
+int ipecamera_parse_layout(ipecamera_t *ctx, const void *raw, size_t size, ipecamera_frame_layout_t *layout) {
+    int err;
+    size_t blocks;
+
+    err = ipecamera_parse_partial_layout(ctx, raw, size, layout);
+    if (err) return err;
+
+    blocks = (layout->lines + layout->block_lines - 1) / layout->block_lines;
+    if (ipecamera_layout_block_offset(layout, blocks) > size)
+	return PCILIB_ERROR_INVALID_DATA;
+
+    return 0;
+}
+
+	// 16 lanes of 12-bit pixels are packed in the first 24 bytes of the payload, 2 lanes per 3 bytes
+static inline void ipecamera_unpack_payload(const uint8_t *payload, ipecamera_pixel_t *lanes) {
+    int i;
+
+    for (i = 0; i < IPECAMERA_PAYLOAD_LANES / 2; i++, payload += 3) {
+	lanes[2 * i] = payload[0] | ((payload[1] & 0x0F) << 8);
+	lanes[2 * i + 1] = (payload[1] >> 4) | (payload[2] << 4);
+    }
+}
+
+static inline void ipecamera_unpack_payloads_scalar(const void *payload, size_t payloads, ipecamera_pixel_t **dst) {
+    size_t k, lane;
+    ipecamera_pixel_t lanes[IPECAMERA_PAYLOAD_LANES];
+
+    for (k = 0; k < payloads; k++) {
+	ipecamera_unpack_payload(payload + k * IPECAMERA_PAYLOAD_SIZE, lanes);
+	for (lane = 0; lane < IPECAMERA_PAYLOAD_LANES; lane++) {
+	    if (dst[lane]) dst[lane][k] = lanes[lane];
+	}
+    }
+}
+
+#ifdef IPECAMERA_DECODER_X86
+/*
+ The SIMD kernels unpack 8 lanes (12 bytes) into a vector of 16-bit pixels: the
+ bytes are shuffled so that every pixel gets its 2 source bytes, the odd pixels
+ are shifted by 4 bits and the top 4 bits are masked out. A block of 8 payloads
+ is then transposed, so that every vector holds 8 consecutive pixels of a single
+ channel and can be stored directly in the image line.
+*/
+IPECAMERA_TARGET_SSE4
+static inline __m128i ipecamera_unpack8_sse4(const void *src) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), shuffle);
+    v = _mm_blend_epi16(v, _mm_srli_epi16(v, 4), 0xAA);
+    return _mm_and_si128(v, _mm_set1_epi16(0x0FFF));
+}
+
+IPECAMERA_TARGET_SSE4
+static inline void ipecamera_transpose8_sse4(__m128i *r) {
+    __m128i t[8], u[8];
+
+    t[0] = _mm_unpacklo_epi16(r[0], r[1]); t[1] = _mm_unpackhi_epi16(r[0], r[1]);
+    t[2] = _mm_unpacklo_epi16(r[2], r[3]); t[3] = _mm_unpackhi_epi16(r[2], r[3]);
+    t[4] = _mm_unpacklo_epi16(r[4], r[5]); t[5] = _mm_unpackhi_epi16(r[4], r[5]);
+    t[6] = _mm_unpacklo_epi16(r[6], r[7]); t[7] = _mm_unpackhi_epi16(r[6], r[7]);
+
+    u[0] = _mm_unpacklo_epi32(t[0], t[2]); u[1] = _mm_unpackhi_epi32(t[0], t[2]);
+    u[2] = _mm_unpacklo_epi32(t[1], t[3]); u[3] = _mm_unpackhi_epi32(t[1], t[3]);
+    u[4] = _mm_unpacklo_epi32(t[4], t[6]); u[5] = _mm_unpackhi_epi32(t[4], t[6]);
+    u[6] = _mm_unpacklo_epi32(t[5], t[7]); u[7] = _mm_unpackhi_epi32(t[5], t[7]);
+
+    r[0] = _mm_unpacklo_epi64(u[0], u[4]); r[1] = _mm_unpackhi_epi64(u[0], u[4]);
+    r[2] = _mm_unpacklo_epi64(u[1], u[5]); r[3] = _mm_unpackhi_epi64(u[1], u[5]);
+    r[4] = _mm_unpacklo_epi64(u[2], u[6]); r[5] = _mm_unpackhi_epi64(u[2], u[6]);
+    r[6] = _mm_unpacklo_epi64(u[3], u[7]); r[7] = _mm_unpackhi_epi64(u[3], u[7]);
+}
+
+IPECAMERA_TARGET_SSE4
+static inline void ipecamera_unpack_payloads_sse4(const void *payload, size_t payloads, ipecamera_pixel_t **dst) {
+    int i;
+    size_t k;
+    const void *src;
+    __m128i lo[IPECAMERA_UNPACK_BLOCK], hi[IPECAMERA_UNPACK_BLOCK];
+
+    for (k = 0; (k + IPECAMERA_UNPACK_BLOCK) <= payloads; k += IPECAMERA_UNPACK_BLOCK) {
+	for (i = 0; i < IPECAMERA_UNPACK_BLOCK; i++) {
+	    src = payload + (k + i) * IPECAMERA_PAYLOAD_SIZE;
+	    lo[i] = ipecamera_unpack8_sse4(src);
+	    hi[i] = ipecamera_unpack8_sse4(src + 12);
+	}
+
+	ipecamera_transpose8_sse4(lo);
+	ipecamera_transpose8_sse4(hi);
+
+	for (i = 0; i < 8; i++) {
+	    if (dst[i]) _mm_storeu_si128((__m128i*)(dst[i] + k), lo[i]);
+	    if (dst[i + 8]) _mm_storeu_si128((__m128i*)(dst[i + 8] + k), hi[i]);
+	}
+    }
+
+    if (k < payloads) {
+	ipecamera_pixel_t *tail[IPECAMERA_PAYLOAD_LANES];
+	for (i = 0; i < IPECAMERA_PAYLOAD_LANES; i++)
+	    tail[i] = dst[i]?(dst[i] + k):NULL;
+	ipecamera_unpack_payloads_scalar(payload + k * IPECAMERA_PAYLOAD_SIZE, payloads - k, tail);
+    }
+}
+
+	// Both 128-bit halves are processed independently: the lower one holds lanes 0-7 and the upper one lanes 8-15
+IPECAMERA_TARGET_AVX2
+static inline __m256i ipecamera_unpack16_avx2(const void *src) {
+    const __m256i permute = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11, 0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)src), permute);
+    v = _mm256_shuffle_epi8(v, shuffle);
+    v = _mm256_blend_epi16(v, _mm256_srli_epi16(v, 4), 0xAA);
+    return _mm256_and_si256(v, _mm256_set1_epi16(0x0FFF));
+}
+
+IPECAMERA_TARGET_AVX2
+static inline void ipecamera_transpose8_avx2(__m256i *r) {
+    __m256i t[8], u[8];
+
+    t[0] = _mm256_unpacklo_epi16(r[0], r[1]); t[1] = _mm256_unpackhi_epi16(r[0], r[1]);
+    t[2] = _mm256_unpacklo_epi16(r[2], r[3]); t[3] = _mm256_unpackhi_epi16(r[2], r[3]);
+    t[4] = _mm256_unpacklo_epi16(r[4], r[5]); t[5] = _mm256_unpackhi_epi16(r[4], r[5]);
+    t[6] = _mm256_unpacklo_epi16(r[6], r[7]); t[7] = _mm256_unpackhi_epi16(r[6], r[7]);
+
+    u[0] = _mm256_unpacklo_epi32(t[0], t[2]); u[1] = _mm256_unpackhi_epi32(t[0], t[2]);
+    u[2] = _mm256_unpacklo_epi32(t[1], t[3]); u[3] = _mm256_unpackhi_epi32(t[1], t[3]);
+    u[4] = _mm256_unpacklo_epi32(t[4], t[6]); u[5] = _mm256_unpackhi_epi32(t[4], t[6]);
+    u[6] = _mm256_unpacklo_epi32(t[5], t[7]); u[7] = _mm256_unpackhi_epi32(t[5], t[7]);
+
+    r[0] = _mm256_unpacklo_epi64(u[0], u[4]); r[1] = _mm256_unpackhi_epi64(u[0], u[4]);
+    r[2] = _mm256_unpacklo_epi64(u[1], u[5]); r[3] = _mm256_unpackhi_epi64(u[1], u[5]);
+    r[4] = _mm256_unpacklo_epi64(u[2], u[6]); r[5] = _mm256_unpackhi_epi64(u[2], u[6]);
+    r[6] = _mm256_unpacklo_epi64(u[3], u[7]); r[7] = _mm256_unpackhi_epi64(u[3], u[7]);
+}
+
+IPECAMERA_TARGET_AVX2
+static inline void ipecamera_unpack_payloads_avx2(const void *payload, size_t payloads, ipecamera_pixel_t **dst) {
+    int i;
+    size_t k;
+    __m256i r[IPECAMERA_UNPACK_BLOCK];
+
+    for (k = 0; (k + IPECAMERA_UNPACK_BLOCK) <= payloads; k += IPECAMERA_UNPACK_BLOCK) {
+	for (i = 0; i < IPECAMERA_UNPACK_BLOCK; i++)
+	    r[i] = ipecamera_unpack16_avx2(payload + (k + i) * IPECAMERA_PAYLOAD_SIZE);
+
+	ipecamera_transpose8_avx2(r);
+
+	for (i = 0; i < 8; i++) {
+	    if (dst[i]) _mm_storeu_si128((__m128i*)(dst[i] + k), _mm256_castsi256_si128(r[i]));
+	    if (dst[i + 8]) _mm_storeu_si128((__m128i*)(dst[i + 8] + k), _mm256_extracti128_si256(r[i], 1));
+	}
+    }
+
+    if (k < payloads) {
+	ipecamera_pixel_t *tail[IPECAMERA_PAYLOAD_LANES];
+	for (i = 0; i < IPECAMERA_PAYLOAD_LANES; i++)
+	    tail[i] = dst[i]?(dst[i] + k):NULL;
+	ipecamera_unpack_payloads_scalar(payload + k * IPECAMERA_PAYLOAD_SIZE, payloads - k, tail);
+    }
+}
+#else /* IPECAMERA_DECODER_X86 */
+# define ipecamera_unpack_payloads_sse4 ipecamera_unpack_payloads_scalar
+# define ipecamera_unpack_payloads_avx2 ipecamera_unpack_payloads_scalar
+#endif /* IPECAMERA_DECODER_X86 */
+
+/*
+ The decoding loop is instantiated for every combination of the frame format,
+ the output mode, and the unpacker. The number of lanes, repetitions, and
+ payloads per repetition as well as the line width are compile-time constants,
+ the unpacker is inlined. So, the channel mapping is resolved at compile time
+ and the payload loops have constant trip counts. The ADC resolution does not
+ need own instances: 10 and 11 bit pixels are MSB-aligned in the 12-bit lanes
+ and are unpacked exactly as 12 bit ones.
+*/
+#define IPECAMERA_DECODE_BLOCKS(name, target, unpack, block_lines, payloads, outputs) \
+    target static void name(const void *raw, size_t data_offset, size_t first_block, size_t last_block, ipecamera_pixel_t *pixels) { \
+	size_t block, rep, lane, ch; \
+	const size_t repeats = CMOSIS_MAX_CHANNELS / (outputs); \
+	const size_t lanes_per_line = IPECAMERA_PAYLOAD_LANES / (block_lines); \
+	const size_t width = lanes_per_line * (payloads); \
+	const size_t repeat_size = (1 + (payloads)) * IPECAMERA_PAYLOAD_SIZE; \
+	ipecamera_pixel_t *dst[IPECAMERA_PAYLOAD_LANES]; \
+	\
+	for (block = first_block; block < last_block; block++) { \
+	    for (rep = 0; rep < repeats; rep++) { \
+		for (lane = 0; lane < IPECAMERA_PAYLOAD_LANES; lane++) { \
+		    ch = (repeats == 1)?lane:(lane * repeats + rep); \
+		    dst[lane] = (lane < (outputs))?(pixels + ((block - first_block) * (block_lines) + ch / lanes_per_line) * width + (ch % lanes_per_line) * (payloads)):NULL; \
+		} \
+		unpack(raw + data_offset + (block * repeats + rep) * repeat_size + IPECAMERA_PAYLOAD_SIZE, (payloads), dst); \
+	    } \
+	} \
+    }
+
+#define IPECAMERA_DECODE_LAYOUTS(unpacker, target, unpack) \
+    IPECAMERA_DECODE_BLOCKS(ipecamera_decode_cmosis_16_##unpacker, target, unpack, 1, CMOSIS_PIXELS_PER_CHANNEL, 16) \
+    IPECAMERA_DECODE_BLOCKS(ipecamera_decode_cmosis_4_##unpacker, target, unpack, 1, CMOSIS_PIXELS_PER_CHANNEL, 4) \
+    IPECAMERA_DECODE_BLOCKS(ipecamera_decode_cmosis20_16_##unpacker, target, unpack, 2, 2 * CMOSIS20_PIXELS_PER_CHANNEL, 16) \
+    IPECAMERA_DECODE_BLOCKS(ipecamera_decode_cmosis20_4_##unpacker, target, unpack, 2, 2 * CMOSIS20_PIXELS_PER_CHANNEL, 4)
+
+#define IPECAMERA_DECODE_LAYOUTS_TABLE(unpacker) \
+    { ipecamera_decode_cmosis_16_##unpacker, ipecamera_decode_cmosis_4_##unpacker, ipecamera_decode_cmosis20_16_##unpacker, ipecamera_decode_cmosis20_4_##unpacker }
+
+IPECAMERA_DECODE_LAYOUTS(scalar, , ipecamera_unpack_payloads_scalar)
+IPECAMERA_DECODE_LAYOUTS(sse4, IPECAMERA_TARGET_SSE4, ipecamera_unpack_payloads_sse4)
+IPECAMERA_DECODE_LAYOUTS(avx2, IPECAMERA_TARGET_AVX2, ipecamera_unpack_payloads_avx2)
+
+static const ipecamera_decode_blocks_t ipecamera_decoders[IPECAMERA_UNPACKER_MAX][IPECAMERA_LAYOUT_MAX] = {
+    IPECAMERA_DECODE_LAYOUTS_TABLE(scalar),
+    IPECAMERA_DECODE_LAYOUTS_TABLE(sse4),
+    IPECAMERA_DECODE_LAYOUTS_TABLE(avx2)
+};
+
+/*
+ The packers store the pixels as a little-endian bit stream with real_bpp bits
+ per pixel (the pixel N of the image occupies bits N*bpp..N*bpp+bpp-1). The 10
+ and 11 bit values are MSB-aligned in the decoded image, so the low bits are
+ dropped. The image width is a multiple of 8 pixels, so a group of 8 pixels
+ always occupies bpp bytes and the lines may be packed independently.
+*/
+typedef void (*ipecamera_pack_pixels_t)(const ipecamera_pixel_t *pixels, size_t n, int bpp, uint8_t *dst);
+
+static void ipecamera_pack_pixels_scalar(const ipecamera_pixel_t *pixels, size_t n, int bpp, uint8_t *dst) {
+    size_t i;
+    int bits = 0;
+    uint64_t acc = 0;
+
+    for (i = 0; i < n; i++) {
+	acc |= (uint64_t)((pixels[i] & 0x0FFF) >> (12 - bpp)) << bits;
+	for (bits += bpp; bits >= 8; bits -= 8, acc >>= 8)
+	    *dst++ = acc;
+    }
+
+    if (bits) *dst = acc;
+}
+
+#ifdef IPECAMERA_DECODER_X86
+/*
+ The SIMD packers merge the pixel pairs into 32-bit lanes with a multiply-add,
+ the pairs of pairs into 64-bit lanes with shifts, and gather the bytes of both
+ 64-bit lanes with shuffles. With 11 bit pixels, the second half starts in the
+ middle of a byte, so it is shifted by 4 bits and the shared byte is combined
+ with OR. The vectors are stored with overlap and the last pixels of the range
+ are packed by the scalar code, so nothing is written beyond the range.
+*/
+typedef struct {
+    __m128i shift;		/**< MSB-alignment of the pixels */
+    __m128i pair_shift;		/**< Offset of the second pair in the 64-bit lane */
+    __m128i half_shift;		/**< Bit offset of the second 64-bit lane in the packed group */
+    __m128i mul;		/**< Multiplier merging the pixel pairs with _mm_madd_epi16 */
+    __m128i lo, hi;		/**< Shuffles placing the bytes of the 64-bit lanes in the packed group */
+} ipecamera_packer_sse4_t;
+
+IPECAMERA_TARGET_SSE4
+static inline void ipecamera_init_packer_sse4(ipecamera_packer_sse4_t *packer, int bpp) {
+    int i;
+    int offset = (4 * bpp) / 8;
+    int8_t lo[16], hi[16];
+
+    for (i = 0; i < 16; i++) {
+	lo[i] = (i < 6)?i:-1;
+	hi[i] = ((i >= offset)&&(i < offset + 6))?(8 + i - offset):-1;
+    }
+
+    packer->shift = _mm_cvtsi32_si128(12 - bpp);
+    packer->pair_shift = _mm_cvtsi32_si128(2 * bpp);
+    packer->half_shift = _mm_cvtsi32_si128((4 * bpp) % 8);
+    packer->mul = _mm_set1_epi32(1 | (1 << (bpp + 16)));
+    packer->lo = _mm_loadu_si128((const __m128i*)lo);
+    packer->hi = _mm_loadu_si128((const __m128i*)hi);
+}
+
+IPECAMERA_TARGET_SSE4
+static inline __m128i ipecamera_pack8_sse4(const ipecamera_packer_sse4_t *packer, __m128i v) {
+    v = _mm_srl_epi16(_mm_and_si128(v, _mm_set1_epi16(0x0FFF)), packer->shift);
+    v = _mm_madd_epi16(v, packer->mul);
+    v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi64x(0xFFFFFFFF)), _mm_sll_epi64(_mm_srli_epi64(v, 32), packer->pair_shift));
+    return _mm_or_si128(_mm_shuffle_epi8(v, packer->lo), _mm_shuffle_epi8(_mm_sll_epi64(v, packer->half_shift), packer->hi));
+}
+
+IPECAMERA_TARGET_SSE4
+static void ipecamera_pack_pixels_sse4(const ipecamera_pixel_t *pixels, size_t n, int bpp, uint8_t *dst) {
+    size_t i;
+    ipecamera_packer_sse4_t packer;
+
+    ipecamera_init_packer_sse4(&packer, bpp);
+
+    for (i = 0; (i + 16) <= n; i += 8)
+	_mm_storeu_si128((__m128i*)(dst + (i / 8) * bpp), ipecamera_pack8_sse4(&packer, _mm_loadu_si128((const __m128i*)(pixels + i))));
+
+    ipecamera_pack_pixels_scalar(pixels + i, n - i, bpp, dst + (i / 8) * bpp);
+}
+
+	// The 128-bit halves are packed independently and stored one after another
+IPECAMERA_TARGET_AVX2
+static void ipecamera_pack_pixels_avx2(const ipecamera_pixel_t *pixels, size_t n, int bpp, uint8_t *dst) {
+    size_t i;
+    __m256i v;
+    ipecamera_packer_sse4_t packer;
+    __m256i lo, hi, mul;
+
+    ipecamera_init_packer_sse4(&packer, bpp);
+
+    lo = _mm256_broadcastsi128_si256(packer.lo);
+    hi = _mm256_broadcastsi128_si256(packer.hi);
+    mul = _mm256_broadcastsi128_si256(packer.mul);
+
+    for (i = 0; (i + 24) <= n; i += 16) {
+	v = _mm256_loadu_si256((const __m256i*)(pixels + i));
+	v = _mm256_srl_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0x0FFF)), packer.shift);
+	v = _mm256_madd_epi16(v, mul);
+	v = _mm256_or_si256(_mm256_and_si256(v, _mm256_set1_epi64x(0xFFFFFFFF)), _mm256_sll_epi64(_mm256_srli_epi64(v, 32), packer.pair_shift));
+	v = _mm256_or_si256(_mm256_shuffle_epi8(v, lo), _mm256_shuffle_epi8(_mm256_sll_epi64(v, packer.half_shift), hi));
+
+	_mm_storeu_si128((__m128i*)(dst + (i / 8) * bpp), _mm256_castsi256_si128(v));
+	_mm_storeu_si128((__m128i*)(dst + (i / 8 + 1) * bpp), _mm256_extracti128_si256(v, 1));
+    }
+
+    ipecamera_pack_pixels_sse4(pixels + i, n - i, bpp, dst + (i / 8) * bpp);
+}
+#else /* IPECAMERA_DECODER_X86 */
+# define ipecamera_pack_pixels_sse4 ipecamera_pack_pixels_scalar
+# define ipecamera_pack_pixels_avx2 ipecamera_pack_pixels_scalar
+#endif /* IPECAMERA_DECODER_X86 */
+
+static const ipecamera_pack_pixels_t ipecamera_packers[IPECAMERA_UNPACKER_MAX] = {
+    ipecamera_pack_pixels_scalar,
+    ipecamera_pack_pixels_sse4,
+    ipecamera_pack_pixels_avx2
+};
+
+/*
+ The line is flagged in the change mask if any pixel differs from the reference
+ by more than the threshold. The absolute difference of unsigned pixels is
+ computed with two saturating subtractions, and the threshold is subtracted
+ from it with saturation as well, so the result is non-zero only for the pixels
+ above the threshold. The results are accumulated over a few vectors and the
+ scan stops at the first changed group, the changed lines are only read partially.
+*/
+typedef int (*ipecamera_compare_pixels_t)(const ipecamera_pixel_t *pixels, const ipecamera_pixel_t *ref, size_t n, ipecamera_pixel_t threshold);
+
+static int ipecamera_compare_pixels_scalar(const ipecamera_pixel_t *pixels, const ipecamera_pixel_t *ref, size_t n, ipecamera_pixel_t threshold) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	if (((pixels[i] > ref[i])?(pixels[i] - ref[i]):(ref[i] - pixels[i])) > threshold)
+	    return 1;
+    }
+
+    return 0;
+}
+
+#ifdef IPECAMERA_DECODER_X86
+IPECAMERA_TARGET_SSE4
+static inline __m128i ipecamera_diff8_sse4(const ipecamera_pixel_t *pixels, const ipecamera_pixel_t *ref, __m128i threshold) {
+    __m128i a = _mm_loadu_si128((const __m128i*)pixels);
+    __m128i b = _mm_loadu_si128((const __m128i*)ref);
+    return _mm_subs_epu16(_mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a)), threshold);
+}
+
+IPECAMERA_TARGET_SSE4
+static int ipecamera_compare_pixels_sse4(const ipecamera_pixel_t *pixels, const ipecamera_pixel_t *ref, size_t n, ipecamera_pixel_t threshold) {
+    size_t i;
+    __m128i acc;
+    __m128i thr = _mm_set1_epi16(threshold);
+
+    for (i = 0; (i + 32) <= n; i += 32) {
+	acc = _mm_or_si128(
+	    _mm_or_si128(ipecamera_diff8_sse4(pixels + i, ref + i, thr), ipecamera_diff8_sse4(pixels + i + 8, ref + i + 8, thr)),
+	    _mm_or_si128(ipecamera_diff8_sse4(pixels + i + 16, ref + i + 16, thr), ipecamera_diff8_sse4(pixels + i + 24, ref + i + 24, thr))
+	);
+	if (!_mm_testz_si128(acc, acc)) return 1;
+    }
+
+    return ipecamera_compare_pixels_scalar(pixels + i, ref + i, n - i, threshold);
+}
+
+IPECAMERA_TARGET_AVX2
+static inline __m256i ipecamera_diff16_avx2(const ipecamera_pixel_t *pixels, const ipecamera_pixel_t *ref, __m256i threshold) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)pixels);
+    __m256i b = _mm256_loadu_si256((const __m256i*)ref);
+    return _mm256_subs_epu16(_mm256_or_si256(_mm256_subs_epu16(a, b), _mm256_subs_epu16(b, a)), threshold);
+}
+
+IPECAMERA_TARGET_AVX2
+static int ipecamera_compare_pixels_avx2(const ipecamera_pixel_t *pixels, const ipecamera_pixel_t *ref, size_t n, ipecamera_pixel_t threshold) {
+    size_t i;
+    __m256i acc;
+    __m256i thr = _mm256_set1_epi16(threshold);
+
+    for (i = 0; (i + 64) <= n; i += 64) {
+	acc = _mm256_or_si256(
+	    _mm256_or_si256(ipecamera_diff16_avx2(pixels + i, ref + i, thr), ipecamera_diff16_avx2(pixels + i + 16, ref + i + 16, thr)),
+	    _mm256_or_si256(ipecamera_diff16_avx2(pixels + i + 32, ref + i + 32, thr), ipecamera_diff16_avx2(pixels + i + 48, ref + i + 48, thr))
+	);
+	if (!_mm256_testz_si256(acc, acc)) return 1;
+    }
+
+    return ipecamera_compare_pixels_sse4(pixels + i, ref + i, n - i, threshold);
+}
+#else /* IPECAMERA_DECODER_X86 */
+# define ipecamera_compare_pixels_sse4 ipecamera_compare_pixels_scalar
+# define ipecamera_compare_pixels_avx2 ipecamera_compare_pixels_scalar
+#endif /* IPECAMERA_DECODER_X86 */
+
+static const ipecamera_compare_pixels_t ipecamera_comparators[IPECAMERA_UNPACKER_MAX] = {
+    ipecamera_compare_pixels_scalar,
+    ipecamera_compare_pixels_sse4,
+    ipecamera_compare_pixels_avx2
+};
+
+
+int ipecamera_select_unpacker(const char *name) {
+#ifdef IPECAMERA_DECODER_X86
+    __builtin_cpu_init();
+    if (((!name)||(!strcmp(name, "avx2")))&&(__builtin_cpu_supports("avx2"))) {
+	ipecamera_unpacker = IPECAMERA_UNPACKER_AVX2;
+	return 0;
+    }
+    if (((!name)||(!strcmp(name, "sse4")))&&(__builtin_cpu_supports("sse4.1"))) {
+	ipecamera_unpacker = IPECAMERA_UNPACKER_SSE4;
+	return 0;
+    }
+#endif /* IPECAMERA_DECODER_X86 */
+    if ((!name)||(!strcmp(name, "scalar"))) {
+	ipecamera_unpacker = IPECAMERA_UNPACKER_SCALAR;
+	return 0;
+    }
+
+    return PCILIB_ERROR_NOTSUPPORTED;
+}
+
+const char *ipecamera_get_unpacker_name() {
+    if (ipecamera_unpacker < 0) ipecamera_select_unpacker(NULL);
+    return ipecamera_unpacker_names[ipecamera_unpacker];
+}
+
+int ipecamera_select_decoder(ipecamera_t *ctx) {
+    ipecamera_layout_t layout;
+
+    switch (ctx->firmware) {
+     case IPECAMERA_FIRMWARE_UFO5:
+	layout = IPECAMERA_LAYOUT_CMOSIS_16;
+	break;
+     case IPECAMERA_FIRMWARE_CMOSIS20:
+	layout = IPECAMERA_LAYOUT_CMOSIS20_16;
+	break;
+     default:
+	return PCILIB_ERROR_NOTSUPPORTED;
+    }
+
+    switch (ctx->cmosis_outputs) {
+     case 16:
+	break;
+     case 4:
+	layout += 1;
+	break;
+     default:
+	return PCILIB_ERROR_NOTSUPPORTED;
+    }
+
+    if (ipecamera_unpacker < 0) ipecamera_select_unpacker(NULL);
+    ctx->decode_blocks = ipecamera_decoders[ipecamera_unpacker][layout];
+
+    return 0;
+}
+
+/*
+ The short first block (IPECAMERA_BUG_MISSING_PAYLOAD) is decoded in place.
+ The missing payload is then read from the start of the next block (or the
+ frame tail), so the pixels it has produced are cleared afterwards.
+*/
+static void ipecamera_clear_missing_payload(ipecamera_t *ctx, const ipecamera_frame_layout_t *layout, ipecamera_pixel_t *pixels) {
+    size_t lane, ch;
+    size_t lanes_per_line = IPECAMERA_PAYLOAD_LANES / layout->block_lines;
+    size_t rep = layout->repeats - 1;
+
+    for (lane = 0; lane < (size_t)ctx->cmosis_outputs; lane++) {
+	ch = (layout->repeats == 1)?lane:(lane * layout->repeats + rep);
+	pixels[(ch / lanes_per_line) * ctx->dim.width + (ch % lanes_per_line) * layout->payloads + layout->payloads - 1] = 0;
+    }
+}
+
+	// The decoding routines are writing the first block at the start of the pixel buffer
+static int ipecamera_decode_blocks(ipecamera_t *ctx, const ipecamera_frame_layout_t *layout, const void *raw, size_t first_line, size_t n_lines, ipecamera_pixel_t *pixels, int relative) {
+    int err;
+    size_t first_block, last_block;
+
+    if ((first_line % layout->block_lines)||(first_line >= layout->lines)) return PCILIB_ERROR_INVALID_ARGUMENT;
+    if ((first_line + n_lines) > layout->lines) n_lines = layout->lines - first_line;
+
+    if (!ctx->decode_blocks) {
+	err = ipecamera_select_decoder(ctx);
+	if (err) return err;
+    }
+
+    first_block = first_line / layout->block_lines;
+    last_block = (first_line + n_lines + layout->block_lines - 1) / layout->block_lines;
+
+    if (!relative) pixels += first_block * layout->block_lines * ctx->dim.width;
+
+	// The blocks following the short first one are shifted back by the missing payloads
+    if ((layout->missing_payloads)&&(!first_block)) {
+	ctx->decode_blocks(raw, layout->data_offset, 0, 1, pixels);
+	ipecamera_clear_missing_payload(ctx, layout, pixels);
+
+	pixels += layout->block_lines * ctx->dim.width;
+	first_block = 1;
+    }
+
+    if (first_block < last_block)
+	ctx->decode_blocks(raw, layout->data_offset - layout->missing_payloads * IPECAMERA_PAYLOAD_SIZE, first_block, last_block, pixels);
+
+    return 0;
+}
+
+int ipecamera_decode_lines(ipecamera_t *ctx, const ipecamera_frame_layout_t *layout, const void *raw, size_t first_line, size_t n_lines, ipecamera_pixel_t *pixels) {
+    return ipecamera_decode_blocks(ctx, layout, raw, first_line, n_lines, pixels, 0);
+}
+
+int ipecamera_decode_rows(ipecamera_t *ctx, const ipecamera_frame_layout_t *layout, const void *raw, size_t first_line, size_t n_lines, ipecamera_pixel_t *rows) {
+    return ipecamera_decode_blocks(ctx, layout, raw, first_line, n_lines, rows, 1);
+}
+
+size_t ipecamera_layout_lines_ready(const ipecamera_frame_layout_t *layout, size_t size) {
+    size_t lines;
+
+    if (size < ipecamera_layout_block_offset(layout, 1)) return 0;
+
+    lines = (size - layout->data_offset + layout->missing_payloads * IPECAMERA_PAYLOAD_SIZE) / (layout->repeats * layout->repeat_size) * layout->block_lines;
+    return (lines < layout->lines)?lines:layout->lines;
+}
+
+void ipecamera_decode_meta(const ipecamera_frame_layout_t *layout, const void *raw, size_t size, UfoDecoderMeta *meta) {
+    const ipecamera_payload_t *buf = (const ipecamera_payload_t*)raw;
+    const ipecamera_payload_t *tail;
+    size_t blocks = (layout->lines + layout->block_lines - 1) / layout->block_lines;
+    size_t tail_offset = ipecamera_layout_block_offset(layout, blocks);
+
+    memset(meta, 0, sizeof(UfoDecoderMeta));
+    meta->frame_number = layout->seqnum;
+    meta->n_rows = layout->lines;
+    meta->time_stamp = buf[7] & 0xFFFFFF;
+    meta->output_mode = (buf[7] >> 24) & 0x03;
+    meta->adc_resolution = (buf[7] >> 26) & 0x03;
+
+	// The status words are only available once the frame tail is received
+    if ((tail_offset + CMOSIS_FRAME_TAIL_SIZE) <= size) {
+	tail = (const ipecamera_payload_t*)(raw + tail_offset);
+	meta->status1.bits = tail[1];
+	meta->status2.bits = tail[2];
+	meta->status3.bits = tail[3];
+    }
+}
+
+void ipecamera_pack_lines(ipecamera_t *ctx, const ipecamera_pixel_t *pixels, size_t first_line, size_t n_lines, void *packed) {
+    size_t width = ctx->dim.width;
+    int bpp = ctx->dim.real_bpp;
+
+    if (ipecamera_unpacker < 0) ipecamera_select_unpacker(NULL);
+
+    ipecamera_packers[ipecamera_unpacker](pixels + first_line * width, n_lines * width, bpp, (uint8_t*)packed + first_line * width * bpp / 8);
+}
+
+void ipecamera_compare_lines(ipecamera_t *ctx, const ipecamera_pixel_t *pixels, const ipecamera_pixel_t *ref, size_t first_line, size_t n_lines, ipecamera_change_mask_t *cmask) {
+    size_t line;
+    size_t width = ctx->dim.width;
+    ipecamera_compare_pixels_t compare;
+
+    if (ipecamera_unpacker < 0) ipecamera_select_unpacker(NULL);
+    compare = ipecamera_comparators[ipecamera_unpacker];
+
+    for (line = first_line; line < first_line + n_lines; line++)
+	cmask[line] = compare(pixels + line * width, ref + line * width, width, ctx->change_threshold);
+}
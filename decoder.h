@@ -0,0 +1,77 @@
+#ifndef _IPECAMERA_DECODER_H
+#define _IPECAMERA_DECODER_H
+
+/**
+ * Parses the frame header and computes the layout of the payload. The frame is
+ * checked to be long enough to hold all the lines declared in the header.
+ */
+int ipecamera_parse_layout(ipecamera_t *ctx, const void *raw, size_t size, ipecamera_frame_layout_t *layout);
+
+/**
+ * Same as ipecamera_parse_layout, but only the header is required to be available
+ * (the frame is still being received in progressive mode).
+ */
+int ipecamera_parse_partial_layout(ipecamera_t *ctx, const void *raw, size_t size, ipecamera_frame_layout_t *layout);
+
+/**
+ * Returns the offset of the specified line block in the raw frame. The blocks
+ * following the short first one are shifted (IPECAMERA_BUG_MISSING_PAYLOAD).
+ */
+size_t ipecamera_layout_block_offset(const ipecamera_frame_layout_t *layout, size_t block);
+
+/**
+ * Returns the number of lines which are completely covered by the first size bytes of the frame.
+ */
+size_t ipecamera_layout_lines_ready(const ipecamera_frame_layout_t *layout, size_t size);
+
+/**
+ * Decodes the specified range of lines into the image. The first line and the
+ * number of lines should be aligned to the block size (the range is clipped at
+ * the end of frame).
+ * @param pixels	- full image, the lines are written at their position in the frame
+ */
+int ipecamera_decode_lines(ipecamera_t *ctx, const ipecamera_frame_layout_t *layout, const void *raw, size_t first_line, size_t n_lines, ipecamera_pixel_t *pixels);
+
+/**
+ * Same as ipecamera_decode_lines, but the buffer holds only the decoded lines
+ * (starting with first_line). The number of lines is rounded up to the block size.
+ */
+int ipecamera_decode_rows(ipecamera_t *ctx, const ipecamera_frame_layout_t *layout, const void *raw, size_t first_line, size_t n_lines, ipecamera_pixel_t *rows);
+
+/**
+ * Fills the frame metadata which is normally provided by ufodecode from the frame
+ * header and tail (see docs/format.txt). The number of skipped rows and the CMOSIS
+ * start address are not transferred in the frame and are reported as 0.
+ */
+void ipecamera_decode_meta(const ipecamera_frame_layout_t *layout, const void *raw, size_t size, UfoDecoderMeta *meta);
+
+/**
+ * Selects the payload unpacker used by ipecamera_decode_lines. The fastest one
+ * supported by the CPU is used if name is NULL, otherwise one of "scalar", "sse4", "avx2".
+ * @return		- PCILIB_ERROR_NOTSUPPORTED if requested unpacker is not supported by CPU
+ */
+int ipecamera_select_unpacker(const char *name);
+const char *ipecamera_get_unpacker_name();
+
+/**
+ * Selects the decoding routine specialized for the current format and output
+ * mode using the currently selected unpacker. Should be called once the output
+ * mode is known and again if the unpacker is changed.
+ */
+int ipecamera_select_decoder(ipecamera_t *ctx);
+
+/**
+ * Packs the specified range of lines of the decoded image with real_bpp bits per
+ * pixel using the packer matching the selected unpacker (see IPECAMERA_PACKED_IMAGE).
+ * @param packed	- full packed image, the lines are written at their position in the frame
+ */
+void ipecamera_pack_lines(ipecamera_t *ctx, const ipecamera_pixel_t *pixels, size_t first_line, size_t n_lines, void *packed);
+
+/**
+ * Flags the lines of the decoded image which differ from the reference image
+ * by more than ctx->change_threshold in at least one pixel (see IPECAMERA_CHANGE_MASK).
+ * @param cmask		- change mask of the full image, only the specified lines are written
+ */
+void ipecamera_compare_lines(ipecamera_t *ctx, const ipecamera_pixel_t *pixels, const ipecamera_pixel_t *ref, size_t first_line, size_t n_lines, ipecamera_change_mask_t *cmask);
+
+#endif /* _IPECAMERA_DECODER_H */
@@ -8,6 +8,22 @@ typedef enum {
     IPECAMERA_DEBUG_HARDWARE_ENV,
     IPECAMERA_DEBUG_FRAME_HEADERS_ENV,
     IPECAMERA_DEBUG_API_ENV,
+    IPECAMERA_REPLAY_ENV,
+    IPECAMERA_REPLAY_PACKET_SIZE_ENV,
+    IPECAMERA_REPLAY_FPS_ENV,
+    IPECAMERA_REPLAY_RATE_ENV,
+    IPECAMERA_REPLAY_LOOPS_ENV,
+    IPECAMERA_DECODE_BANDS_ENV,
+    IPECAMERA_DECODER_ENV,
+    IPECAMERA_RING_MEMORY_ENV,
+    IPECAMERA_NUMA_NODE_ENV,
+    IPECAMERA_PREPROC_CPUS_ENV,
+    IPECAMERA_CONSUMER_POLICY_ENV,
+    IPECAMERA_IMAGE_BUFFER_SIZE_ENV,
+    IPECAMERA_PREPROCESS_ENV,
+    IPECAMERA_PACKED_IMAGES_ENV,
+    IPECAMERA_PROGRESSIVE_ENV,
+    IPECAMERA_CHANGE_THRESHOLD_ENV,
     IPECAMERA_MAX_ENV
 } ipecamera_env_t;
 
@@ -7,6 +7,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <errno.h>
 #include <pthread.h>
 #include <assert.h>
 
@@ -20,6 +24,7 @@
 #include "ipecamera.h"
 #include "private.h"
 #include "events.h"
+#include "data.h"
 
 #define LOCK(lock_name) \
     err = pcilib_lock(ctx->lock_name##_lock); \
@@ -35,12 +40,131 @@
 	ctx->lock_name##_locked = 0; \
     }
 
+void ipecamera_notifier_wake(ipecamera_notifier_t *notifier) {
+    syscall(SYS_futex, &notifier->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+int ipecamera_notifier_wait(ipecamera_notifier_t *notifier, uint32_t key, struct timeval *deadline) {
+    int res;
+    struct timespec ts;
+
+    if (!deadline) {
+	syscall(SYS_futex, &notifier->seq, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+	return 0;
+    }
+
+	// pcilib deadlines are based on gettimeofday, so we are using absolute CLOCK_REALTIME timeouts
+    ts.tv_sec = deadline->tv_sec;
+    ts.tv_nsec = deadline->tv_usec * 1000;
+
+    res = syscall(SYS_futex, &notifier->seq, FUTEX_WAIT_BITSET_PRIVATE|FUTEX_CLOCK_REALTIME, key, &ts, NULL, FUTEX_BITSET_MATCH_ANY);
+    if ((res < 0)&&(errno == ETIMEDOUT)) return PCILIB_ERROR_TIMEOUT;
+
+    return 0;
+}
+
+	// Number of events the consumer advances by, only every Nth event is reported with decimation
+static inline size_t ipecamera_consumer_step(ipecamera_consumer_t *consumer) {
+    return (consumer->policy == IPECAMERA_POLICY_DECIMATE)?consumer->decimation:1;
+}
+
+	// Checks if there are events which are not reported to the consumer yet
+static inline int ipecamera_have_event(ipecamera_t *ctx, ipecamera_consumer_t *consumer) {
+#ifdef IPECAMERA_ANNOUNCE_READY
+    if (ctx->preproc) return ((__atomic_load_n(&ctx->preproc_id, __ATOMIC_ACQUIRE) - consumer->reported_id) >= ipecamera_consumer_step(consumer));
+#endif /* IPECAMERA_ANNOUNCE_READY */
+    return ((__atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE) - consumer->reported_id) >= ipecamera_consumer_step(consumer));
+}
+
+static inline ipecamera_notifier_t *ipecamera_get_event_notifier(ipecamera_t *ctx) {
+#ifdef IPECAMERA_ANNOUNCE_READY
+    if (ctx->preproc) return &ctx->new_image;
+#endif /* IPECAMERA_ANNOUNCE_READY */
+    return &ctx->new_event;
+}
+
+/*
+ The event info is split between the ring slot and the image slot which are
+ written by different threads. The image-related fields are only filled if
+ the image is decoded and not replaced yet (or handed over to the caller).
+*/
+static void ipecamera_get_event_info(ipecamera_t *ctx, pcilib_event_id_t evid, ipecamera_event_info_t *info) {
+    int image;
+    ipecamera_frame_t *frame = ctx->frame + IPECAMERA_EVENT_SLOT(ctx, evid);
+    ipecamera_decoded_t *decoded;
+
+    memset(info, 0, sizeof(ipecamera_event_info_t));
+
+    info->info = frame->info;
+    info->raw_size = frame->raw_size;
+
+    image = ipecamera_find_image(ctx, evid);
+    if (image >= 0) {
+	decoded = ctx->decoded + image;
+	info->meta = decoded->meta;
+	info->image_broken = decoded->image_broken;
+	info->image_ready = 1;
+	info->cmask_ref = decoded->cmask_ref;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&decoded->image_seq, __ATOMIC_RELAXED) != IPECAMERA_SEQ_READY(evid)) {
+	    memset(&info->meta, 0, sizeof(UfoDecoderMeta));
+	    info->image_broken = 0;
+	    info->image_ready = 0;
+	    info->cmask_ref = 0;
+	}
+    } else if (ipecamera_get_handed_over(ctx, evid, NULL, &info->image_broken, &info->meta)) {
+	    // Decoded into the registered buffer, there is no change mask for this image
+	info->image_ready = 1;
+    } else {
+	memset(&info->meta, 0, sizeof(UfoDecoderMeta));
+	info->image_broken = 0;
+    }
+}
+
+/*
+ Advances the consumer to the next event. Only the consumer owner updates it,
+ so no atomics are needed here. If the consumer is too slow, the events which
+ are about to be overwritten are skipped. This does not affect other consumers.
+ With drop-newest and block policies this only happens if the reader gave up
+ waiting for the consumer. The reader is woken up once the consumer advances.
+*/
+static inline void ipecamera_next_reported_id(ipecamera_t *ctx, ipecamera_consumer_t *consumer) {
+    pcilib_event_id_t event_id = __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE);
+    pcilib_event_id_t next_id = consumer->reported_id + ipecamera_consumer_step(consumer);
+    pcilib_event_id_t oldest_id;
+
+    if ((event_id - next_id) > (ctx->buffer_size - 1 - IPECAMERA_RESERVE_BUFFERS)) {
+	oldest_id = event_id - (ctx->buffer_size - 1 - IPECAMERA_RESERVE_BUFFERS);
+	ipecamera_debug(HARDWARE, "Skipping events %zu to %zu as preprocessing is too slow. We are currently %zu buffers beyond, but only %zu buffers are available and safety limit is %zu",
+	    consumer->reported_id, oldest_id, event_id - consumer->reported_id, ctx->buffer_size, IPECAMERA_RESERVE_BUFFERS);
+	consumer->dropped += oldest_id - consumer->reported_id - 1;
+	next_id = oldest_id;
+    } else {
+	consumer->decimated += next_id - consumer->reported_id - 1;
+    }
+
+    __atomic_store_n(&consumer->reported_id, next_id, __ATOMIC_RELEASE);
+    consumer->reported++;
+
+    if (consumer->policy == IPECAMERA_POLICY_BLOCK)
+	ipecamera_notify(&ctx->consumed);
+}
+
+	// Checks that the event info was not overwritten while copying
+static inline int ipecamera_event_info_valid(ipecamera_t *ctx, pcilib_event_id_t evid) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&ctx->frame[IPECAMERA_EVENT_SLOT(ctx, evid)].raw_seq, __ATOMIC_RELAXED) == IPECAMERA_SEQ_READY(evid));
+}
+
 int ipecamera_stream(pcilib_context_t *vctx, pcilib_event_callback_t callback, void *user) {
     int run_flag = 1;
     int res, err = 0;
     int do_stop = 0;
+    uint32_t key;
     
     ipecamera_event_info_t info;
+    ipecamera_notifier_t *notifier;
     ipecamera_t *ctx = (ipecamera_t*)vctx;
 
     if (!ctx) {
@@ -64,25 +188,19 @@ int ipecamera_stream(pcilib_context_t *vctx, pcilib_event_callback_t callback, v
 	
 	do_stop = 1;
     }
+
+    notifier = ipecamera_get_event_notifier(ctx);
     
     if (ctx->parse_data) {
 	    // This loop iterates while the generation
-	while ((run_flag)&&((ctx->run_streamer)||(ctx->reported_id != ctx->event_id))) {
-#ifdef IPECAMERA_ANNOUNCE_READY
-	    while (((!ctx->preproc)&&(ctx->reported_id != ctx->event_id))||((ctx->preproc)&&(ctx->reported_id != ctx->preproc_id))) {
-#else /* IPECAMERA_ANNOUNCE_READY */
-	    while (ctx->reported_id != ctx->event_id) {
-#endif /* IPECAMERA_ANNOUNCE_READY */
-		if ((ctx->event_id - ctx->reported_id) > (ctx->buffer_size - IPECAMERA_RESERVE_BUFFERS)) {
-		    ipecamera_debug(HARDWARE, "Skipping events %zu to %zu as preprocessing is too slow. We are currently %zu buffers beyond, but only %zu buffers are available and safety limit is %zu",
-			ctx->reported_id, ctx->event_id - (ctx->buffer_size - 1 - IPECAMERA_RESERVE_BUFFERS), ctx->event_id - ctx->reported_id, ctx->buffer_size, IPECAMERA_RESERVE_BUFFERS);
-		    ctx->reported_id = ctx->event_id - (ctx->buffer_size - 1 - IPECAMERA_RESERVE_BUFFERS);
-		} else ++ctx->reported_id;
+	while ((run_flag)&&((ctx->run_streamer)||(ipecamera_have_event(ctx, ctx->consumers)))) {
+	    while (ipecamera_have_event(ctx, ctx->consumers)) {
+		ipecamera_next_reported_id(ctx, ctx->consumers);
 
-		memcpy(&info, ctx->frame + ((ctx->reported_id-1)%ctx->buffer_size), sizeof(ipecamera_event_info_t));
+		ipecamera_get_event_info(ctx, ctx->consumers[0].reported_id, &info);
 
-		if ((ctx->event_id - ctx->reported_id) < ctx->buffer_size) {
-		    res = callback(ctx->reported_id, (pcilib_event_info_t*)&info, user);
+		if (ipecamera_event_info_valid(ctx, ctx->consumers[0].reported_id)) {
+		    res = callback(ctx->consumers[0].reported_id, (pcilib_event_info_t*)&info, user);
 		    if (res <= 0) {
 			if (res < 0) err = -res;
 			run_flag = 0;
@@ -90,11 +208,20 @@ int ipecamera_stream(pcilib_context_t *vctx, pcilib_event_callback_t callback, v
 		    }
 		}
 	    }
-	    usleep(IPECAMERA_NOFRAME_SLEEP);
+
+	    if (!run_flag) break;
+
+	    key = ipecamera_notifier_prepare(notifier);
+	    if ((ctx->run_streamer)&&(!ipecamera_have_event(ctx, ctx->consumers)))
+		ipecamera_notifier_wait(notifier, key, NULL);
+	    ipecamera_notifier_cancel(notifier);
 	}
     } else {
 	while ((run_flag)&&(ctx->run_streamer)) {
-	    usleep(IPECAMERA_NOFRAME_SLEEP);
+	    key = ipecamera_notifier_prepare(&ctx->new_event);
+	    if (ctx->run_streamer)
+		ipecamera_notifier_wait(&ctx->new_event, key, NULL);
+	    ipecamera_notifier_cancel(&ctx->new_event);
 	}
     }
 
@@ -111,9 +238,61 @@ int ipecamera_stream(pcilib_context_t *vctx, pcilib_event_callback_t callback, v
     return err;
 }
 
-int ipecamera_next_event(pcilib_context_t *vctx, pcilib_timeout_t timeout, pcilib_event_id_t *evid, size_t info_size, pcilib_event_info_t *info) {
+static int ipecamera_consumer_next(ipecamera_t *ctx, ipecamera_consumer_t *consumer, pcilib_timeout_t timeout, pcilib_event_id_t *evid, size_t info_size, pcilib_event_info_t *info) {
     int err;
+    uint32_t key;
     struct timeval tv;
+    ipecamera_notifier_t *notifier;
+    ipecamera_event_info_t event_info;
+
+    if ((info)&&(info_size < sizeof(pcilib_event_info_t)))
+	return PCILIB_ERROR_INVALID_ARGUMENT;
+
+    if (!ipecamera_have_event(ctx, consumer)) {
+	if (timeout) {
+	    notifier = ipecamera_get_event_notifier(ctx);
+
+	    if (timeout != PCILIB_TIMEOUT_INFINITE)
+		pcilib_calc_deadline(&tv, timeout);
+
+	    err = 0;
+	    while ((!err)&&(ctx->started)) {
+		key = ipecamera_notifier_prepare(notifier);
+		if ((!ctx->started)||(ipecamera_have_event(ctx, consumer))) {
+		    ipecamera_notifier_cancel(notifier);
+		    break;
+		}
+		err = ipecamera_notifier_wait(notifier, key, (timeout == PCILIB_TIMEOUT_INFINITE)?NULL:&tv);
+		ipecamera_notifier_cancel(notifier);
+	    }
+	}
+
+	if (!ipecamera_have_event(ctx, consumer))
+	    return PCILIB_ERROR_TIMEOUT;
+    }
+
+retry:
+    ipecamera_next_reported_id(ctx, consumer);
+
+    if (evid) *evid = consumer->reported_id;
+
+    if (info) {
+	ipecamera_get_event_info(ctx, consumer->reported_id, &event_info);
+	memcpy(info, &event_info, (info_size >= sizeof(ipecamera_event_info_t))?sizeof(ipecamera_event_info_t):sizeof(pcilib_event_info_t));
+    }
+
+	// The info was copied while the slot was reused by the reader
+    if (!ipecamera_event_info_valid(ctx, consumer->reported_id)) {
+	consumer->reported--;
+	consumer->dropped++;
+	goto retry;
+    }
+
+    return 0;
+}
+
+int ipecamera_next_event(pcilib_context_t *vctx, pcilib_timeout_t timeout, pcilib_event_id_t *evid, size_t info_size, pcilib_event_info_t *info) {
+    int err;
     ipecamera_t *ctx = (ipecamera_t*)vctx;
 
     if (!ctx) {
@@ -135,72 +314,291 @@ int ipecamera_next_event(pcilib_context_t *vctx, pcilib_timeout_t timeout, pcili
 
     LOCK(stream);
 
-#ifdef IPECAMERA_ANNOUNCE_READY
-    if (((!ctx->preproc)&&(ctx->reported_id == ctx->event_id))||((ctx->preproc)&&(ctx->reported_id == ctx->preproc_id))) {
-#else /* IPECAMERA_ANNOUNCE_READY */
-    if (ctx->reported_id == ctx->event_id) {
-#endif /* IPECAMERA_ANNOUNCE_READY */
+    err = ipecamera_consumer_next(ctx, ctx->consumers, timeout, evid, info_size, info);
 
-	if (timeout) {
-	    if (timeout == PCILIB_TIMEOUT_INFINITE) {
-#ifdef IPECAMERA_ANNOUNCE_READY
-		while ((ctx->started)&&(((!ctx->preproc)&&(ctx->reported_id == ctx->event_id))||((ctx->preproc)&&(ctx->reported_id == ctx->preproc_id)))) {
-#else /* IPECAMERA_ANNOUNCE_READY */
-		while ((ctx->started)&&(ctx->reported_id == ctx->event_id)) {
-#endif /* IPECAMERA_ANNOUNCE_READY */
-		usleep(IPECAMERA_NOFRAME_SLEEP);
-		}
-	    } else {
-		pcilib_calc_deadline(&tv, timeout);
+    UNLOCK(stream);
 
-#ifdef IPECAMERA_ANNOUNCE_READY
-		while ((ctx->started)&&(pcilib_calc_time_to_deadline(&tv) > 0)&&(((!ctx->preproc)&&(ctx->reported_id == ctx->event_id))||((ctx->preproc)&&(ctx->reported_id == ctx->preproc_id)))) {
-#else /* IPECAMERA_ANNOUNCE_READY */
-		while ((ctx->started)&&(pcilib_calc_time_to_deadline(&tv) > 0)&&(ctx->reported_id == ctx->event_id)) {
-#endif /* IPECAMERA_ANNOUNCE_READY */
-		    usleep(IPECAMERA_NOFRAME_SLEEP);
-		}
-	    }
+    switch (err) {
+     case 0:
+	ipecamera_debug(API, "ipecamera: next_event returned");
+	break;
+     case PCILIB_ERROR_TIMEOUT:
+	ipecamera_debug(API, "ipecamera: next_event timed out");
+	break;
+     default:
+	ipecamera_debug(API, "ipecamera: next_event returned a error");
+    }
+
+    return err;
+}
+
+int ipecamera_consumer_next_event(ipecamera_t *ctx, ipecamera_consumer_t *consumer, pcilib_timeout_t timeout, pcilib_event_id_t *evid, size_t info_size, pcilib_event_info_t *info) {
+    if (!ctx) {
+	pcilib_error("IPECamera imaging is not initialized");
+	return PCILIB_ERROR_NOTINITIALIZED;
+    }
+
+    if (!ctx->started) {
+	pcilib_error("IPECamera is not in grabbing mode");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    if (!ctx->parse_data) {
+	pcilib_error("RAWData only mode is requested");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    return ipecamera_consumer_next(ctx, consumer, timeout, evid, info_size, info);
+}
+
+/*
+ The events are advanced one by one as usual, but the lock and the wait are
+ amortized over the batch. The info is only copied after the data is obtained,
+ so it reflects the decoding done by ipecamera_get.
+*/
+static int ipecamera_consumer_next_batch(ipecamera_t *ctx, ipecamera_consumer_t *consumer, pcilib_timeout_t timeout, pcilib_event_data_type_t data_type, size_t max_events, ipecamera_batch_entry_t *events, size_t *n_events) {
+    int err;
+    size_t i;
+    ipecamera_batch_entry_t *entry;
+
+    *n_events = 0;
+
+    for (i = 0; i < max_events; i++) {
+	entry = events + i;
+
+	err = ipecamera_consumer_next(ctx, consumer, i?0:timeout, &entry->event_id, 0, NULL);
+	if ((err == PCILIB_ERROR_TIMEOUT)&&(i)) break;
+	if (err) return err;
+
+	entry->data = NULL;
+	entry->size = 0;
+	entry->error = ipecamera_get(&ctx->event, entry->event_id, data_type, 0, NULL, &entry->size, &entry->data);
+
+	ipecamera_get_event_info(ctx, entry->event_id, &entry->info);
+	if ((!entry->error)&&(!ipecamera_event_info_valid(ctx, entry->event_id)))
+	    entry->error = PCILIB_ERROR_OVERWRITTEN;
+    }
+
+    *n_events = i;
+
+    return 0;
+}
+
+int ipecamera_next_batch(ipecamera_t *ctx, ipecamera_consumer_t *consumer, pcilib_timeout_t timeout, pcilib_event_data_type_t data_type, size_t max_events, ipecamera_batch_entry_t *events, size_t *n_events) {
+    int err;
+
+    if (!ctx) {
+	pcilib_error("IPECamera imaging is not initialized");
+	return PCILIB_ERROR_NOTINITIALIZED;
+    }
+
+    if (!ctx->started) {
+	pcilib_error("IPECamera is not in grabbing mode");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    if (!ctx->parse_data) {
+	pcilib_error("RAWData only mode is requested");
+	return PCILIB_ERROR_INVALID_REQUEST;
+    }
+
+    if (!max_events) {
+	*n_events = 0;
+	return 0;
+    }
+
+    ipecamera_debug(API, "ipecamera: next_batch");
+
+    if (consumer) return ipecamera_consumer_next_batch(ctx, consumer, timeout, data_type, max_events, events, n_events);
+
+    LOCK(stream);
+
+    err = ipecamera_consumer_next_batch(ctx, ctx->consumers, timeout, data_type, max_events, events, n_events);
+
+    UNLOCK(stream);
+
+    return err;
+}
+
+int ipecamera_return_batch(ipecamera_t *ctx, pcilib_event_data_type_t data_type, size_t n_events, ipecamera_batch_entry_t *events) {
+    size_t i;
+    int err = 0;
+
+    if (!ctx) {
+	pcilib_error("IPECamera imaging is not initialized");
+	return PCILIB_ERROR_NOTINITIALIZED;
+    }
+
+    for (i = 0; i < n_events; i++) {
+	if ((!events[i].data)||(events[i].error)) continue;
+
+	if (ipecamera_return(&ctx->event, events[i].event_id, data_type, events[i].data)) {
+	    events[i].error = PCILIB_ERROR_OVERWRITTEN;
+	    err = PCILIB_ERROR_OVERWRITTEN;
 	}
-	
-	if (ctx->reported_id == ctx->event_id) {
-	    UNLOCK(stream);
-	    ipecamera_debug(API, "ipecamera: next_event timed out");
-	    return PCILIB_ERROR_TIMEOUT;
+    }
+
+    return err;
+}
+
+/*
+ The consumers are allocated in a fixed table with compare-and-swap, so the
+ reader thread can scan the table without locking and the entries are never
+ freed under it. New consumers start from the current event, the cursors of all
+ consumers are reset once the grabbing is (re)started.
+*/
+ipecamera_consumer_t *ipecamera_subscribe(ipecamera_t *ctx) {
+    int i;
+    ipecamera_consumer_t *consumer;
+
+    for (i = 1; i < IPECAMERA_MAX_CONSUMERS; i++) {
+	consumer = ctx->consumers + i;
+	if (__sync_bool_compare_and_swap(&consumer->used, 0, 1)) {
+	    consumer->policy = IPECAMERA_POLICY_DROP_OLDEST;
+	    consumer->decimation = 1;
+	    consumer->prefetch = 0;
+	    consumer->reported = 0;
+	    consumer->dropped = 0;
+	    consumer->decimated = 0;
+	    consumer->discarded = 0;
+	    consumer->stalls = 0;
+	    consumer->overruns = 0;
+	    __atomic_store_n(&consumer->reported_id, __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	    return consumer;
 	}
-	
     }
 
-retry:
-    if ((ctx->event_id - ctx->reported_id) > (ctx->buffer_size - IPECAMERA_RESERVE_BUFFERS)) {
-	ipecamera_debug(HARDWARE, "Skipping events %zu to %zu as preprocessing is too slow. We are currently %zu buffers beyond, but only %zu buffers are available and safety limit is %zu",
-	    ctx->reported_id, ctx->event_id - (ctx->buffer_size - 1 - IPECAMERA_RESERVE_BUFFERS), ctx->event_id - ctx->reported_id, ctx->buffer_size, IPECAMERA_RESERVE_BUFFERS);
-	ctx->reported_id = ctx->event_id - (ctx->buffer_size - 1 - IPECAMERA_RESERVE_BUFFERS);
-    } else ++ctx->reported_id;
+    pcilib_error("Too many consumers, at most %i are supported", IPECAMERA_MAX_CONSUMERS - 1);
+
+    return NULL;
+}
 
-    if (evid) *evid = ctx->reported_id;
+void ipecamera_unsubscribe(ipecamera_t *ctx, ipecamera_consumer_t *consumer) {
+    if ((consumer <= ctx->consumers)||(consumer >= ctx->consumers + IPECAMERA_MAX_CONSUMERS)||(!consumer->used)) {
+	pcilib_warning("The consumer is not registered");
+	return;
+    }
 
-    if (info) {
-	if (info_size >= sizeof(ipecamera_event_info_t))
-	    memcpy(info, ctx->frame + ((ctx->reported_id-1)%ctx->buffer_size), sizeof(ipecamera_event_info_t));
-	else if (info_size >= sizeof(pcilib_event_info_t))
-	    memcpy(info, ctx->frame + ((ctx->reported_id-1)%ctx->buffer_size), sizeof(pcilib_event_info_t));
-	else {
-	    UNLOCK(stream);
-	    ipecamera_debug(API, "ipecamera: next_event returned a error");
+	// The reader should not wait for the consumer anymore
+    consumer->policy = IPECAMERA_POLICY_DROP_OLDEST;
+    __sync_synchronize();
+    consumer->used = 0;
+
+    ipecamera_notify(&ctx->consumed);
+}
+
+int ipecamera_consumer_set_policy(ipecamera_t *ctx, ipecamera_consumer_t *consumer, ipecamera_consumer_policy_t policy, size_t decimation) {
+    if (!consumer) consumer = ctx->consumers;
+
+    switch (policy) {
+     case IPECAMERA_POLICY_DECIMATE:
+	if (decimation < 1) {
+	    pcilib_error("Invalid decimation (%zu) is specified", decimation);
 	    return PCILIB_ERROR_INVALID_ARGUMENT;
 	}
+	break;
+     case IPECAMERA_POLICY_DROP_OLDEST:
+     case IPECAMERA_POLICY_DROP_NEWEST:
+     case IPECAMERA_POLICY_BLOCK:
+	decimation = 1;
+	break;
+     default:
+	pcilib_error("Invalid consumer policy (%i) is specified", policy);
+	return PCILIB_ERROR_INVALID_ARGUMENT;
     }
 
-    if ((ctx->event_id - ctx->reported_id) >= ctx->buffer_size) goto retry;
+    consumer->decimation = decimation;
+    consumer->policy = policy;
 
-    UNLOCK(stream);
+	// The reader may be waiting for the consumer
+    ipecamera_notify(&ctx->consumed);
 
-    ipecamera_debug(API, "ipecamera: next_event returned");
+    return 0;
+}
+
+int ipecamera_consumer_set_prefetch(ipecamera_t *ctx, ipecamera_consumer_t *consumer, int prefetch) {
+    if (!consumer) consumer = ctx->consumers;
+
+    consumer->prefetch = prefetch?1:0;
+
+    return 0;
+}
+
+/*
+ In lazy mode, preprocessors only decode the frames which are going to be
+ requested soon: the hinted ones and the frames expected by the prefetching
+ consumers. A consumer lagging by more than the ring will skip the frame anyway,
+ and the decimating consumers only get every Nth frame.
+*/
+int ipecamera_frame_wanted(ipecamera_t *ctx, pcilib_event_id_t evid) {
+    int i;
+    pcilib_event_id_t reported_id;
+    ipecamera_consumer_t *consumer;
+
+    if (ctx->prefetch[IPECAMERA_EVENT_SLOT(ctx, evid)] == evid) return 1;
+
+    for (i = 0; i < IPECAMERA_MAX_CONSUMERS; i++) {
+	consumer = ctx->consumers + i;
+	if ((!consumer->used)||(!consumer->prefetch)) continue;
+
+	reported_id = __atomic_load_n(&consumer->reported_id, __ATOMIC_RELAXED);
+	if ((evid <= reported_id)||((evid - reported_id) > (ctx->buffer_size - IPECAMERA_RESERVE_BUFFERS))) continue;
+	if ((consumer->policy == IPECAMERA_POLICY_DECIMATE)&&((evid - reported_id) % consumer->decimation)) continue;
+
+	return 1;
+    }
 
     return 0;
 }
 
+int ipecamera_parse_consumer_policy(const char *name, ipecamera_consumer_policy_t *policy, size_t *decimation) {
+    char *end;
+
+    *decimation = 1;
+
+    if (!strcmp(name, "drop-oldest")) *policy = IPECAMERA_POLICY_DROP_OLDEST;
+    else if (!strcmp(name, "drop-newest")) *policy = IPECAMERA_POLICY_DROP_NEWEST;
+    else if (!strcmp(name, "block")) *policy = IPECAMERA_POLICY_BLOCK;
+    else if (!strncmp(name, "decimate:", 9)) {
+	*policy = IPECAMERA_POLICY_DECIMATE;
+	*decimation = strtoul(name + 9, &end, 10);
+	if ((end == name + 9)||(*end)||(*decimation < 1)) return PCILIB_ERROR_INVALID_ARGUMENT;
+    } else return PCILIB_ERROR_INVALID_ARGUMENT;
+
+    return 0;
+}
+
+void ipecamera_consumer_get_stats(ipecamera_t *ctx, ipecamera_consumer_t *consumer, ipecamera_consumer_stats_t *stats) {
+    stats->last_id = consumer->reported_id;
+    stats->reported = consumer->reported;
+    stats->dropped = consumer->dropped;
+    stats->decimated = consumer->decimated;
+    stats->discarded = consumer->discarded;
+    stats->stalls = consumer->stalls;
+    stats->overruns = consumer->overruns;
+    stats->lag = __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE) - stats->last_id;
+}
+
+	// The policies are preserved across restarts
+void ipecamera_reset_consumers(ipecamera_t *ctx) {
+    int i;
+    ipecamera_consumer_t *consumer;
+
+    for (i = 0; i < IPECAMERA_MAX_CONSUMERS; i++) {
+	consumer = ctx->consumers + i;
+	if (!consumer->used) continue;
+
+	consumer->reported_id = 0;
+	consumer->reported = 0;
+	consumer->dropped = 0;
+	consumer->decimated = 0;
+	consumer->discarded = 0;
+	consumer->stalls = 0;
+	consumer->overruns = 0;
+	consumer->hold_expired = 0;
+    }
+}
+
 pcilib_event_id_t ipecamera_get_last_event_id(ipecamera_t *ctx) {
-    return ctx->event_id;
+    return __atomic_load_n(&ctx->event_id, __ATOMIC_ACQUIRE);
 }
@@ -1,5 +1,48 @@
 #ifndef _IPECAMERA_EVENTS_H
 #define _IPECAMERA_EVENTS_H
 
+#include <stdint.h>
+#include <sys/time.h>
+
+/**
+ * Event counter used to wake up threads waiting for new frames or decoded images.
+ * The producer increments the sequence after publishing new data. The consumer
+ * snapshots the sequence with ipecamera_notifier_prepare, re-checks its condition,
+ * and sleeps on the futex only if the sequence was not changed meanwhile. The
+ * futex syscall is only issued by the producer if somebody is waiting. Zeroed
+ * structure is a valid initial state.
+ */
+typedef struct {
+    volatile uint32_t seq;		/**< Incremented on each notification */
+    volatile uint32_t waiters;		/**< Number of threads which are preparing to sleep or sleeping */
+} ipecamera_notifier_t;
+
+void ipecamera_notifier_wake(ipecamera_notifier_t *notifier);
+
+static inline void ipecamera_notify(ipecamera_notifier_t *notifier) {
+    __sync_fetch_and_add(&notifier->seq, 1);
+    if (notifier->waiters) ipecamera_notifier_wake(notifier);
+}
+
+/**
+ * Registers the waiter and returns the key which should be passed to ipecamera_notifier_wait.
+ * The waiting condition should be checked after this call and ipecamera_notifier_cancel
+ * should be called in any case after the wait is over.
+ */
+static inline uint32_t ipecamera_notifier_prepare(ipecamera_notifier_t *notifier) {
+    __sync_fetch_and_add(&notifier->waiters, 1);
+    return notifier->seq;
+}
+
+static inline void ipecamera_notifier_cancel(ipecamera_notifier_t *notifier) {
+    __sync_fetch_and_sub(&notifier->waiters, 1);
+}
+
+/**
+ * Sleeps until notification or the deadline.
+ * @param deadline	- absolute time (as computed by pcilib_calc_deadline), NULL to wait infinitely
+ * @return		- 0 if notified (or spuriously woken up), PCILIB_ERROR_TIMEOUT if the deadline is reached
+ */
+int ipecamera_notifier_wait(ipecamera_notifier_t *notifier, uint32_t key, struct timeval *deadline);
 
 #endif /* _IPECAMERA_EVENTS_H */
@@ -11,35 +11,242 @@ typedef  struct {
     unsigned int width, height;
 } ipecamera_image_dimensions_t;
 
+typedef struct {
+    unsigned int x, y;			/**< First column and row of the region */
+    unsigned int width, height;		/**< Size of the region */
+} ipecamera_image_region_t;
+
+typedef struct {
+    size_t first_line;			/**< First line of the range */
+    size_t n_lines;			/**< Number of lines in the range */
+} ipecamera_line_range_t;
+
 typedef enum {
     IPECAMERA_IMAGE_DATA = 0,
     IPECAMERA_RAW_DATA = 1,
     IPECAMERA_DIMENSIONS = 0x8000,
-    IPECAMERA_IMAGE_REGION = 0x8010,
+    IPECAMERA_IMAGE_REGION = 0x8010,	/**< Sub-image specified by ipecamera_image_region_t passed as arg, the rows are tightly packed */
     IPECAMERA_PACKED_IMAGE = 0x8020,
-    IPECAMERA_PACKED_LINE = 0x8021,
-    IPECAMERA_PACKED_PAYLOAD = 0x8022,
-    IPECAMERA_CHANGE_MASK = 0x8030
+    IPECAMERA_PACKED_LINE = 0x8021,	/**< Lines specified by ipecamera_line_range_t passed as arg, packed as IPECAMERA_PACKED_IMAGE */
+    IPECAMERA_PACKED_PAYLOAD = 0x8022,	/**< Raw payload of the lines specified by ipecamera_line_range_t passed as arg (rounded to the line blocks) */
+    IPECAMERA_CHANGE_MASK = 0x8030	/**< One ipecamera_change_mask_t per line of the image, non-zero if the line differs from the previous frame (see ipecamera_set_change_threshold) */
 } ipecamera_data_type_t;
 
 typedef uint16_t ipecamera_change_mask_t;
 typedef uint16_t ipecamera_pixel_t;
 
+typedef struct ipecamera_consumer_s ipecamera_consumer_t;
+
+typedef enum {
+    IPECAMERA_POLICY_DROP_OLDEST = 0,	/**< The lagging consumer skips the events which are about to be overwritten (default) */
+    IPECAMERA_POLICY_DROP_NEWEST,	/**< The reader discards the new frames while the consumer lags, the consumer gets a gap-free stream */
+    IPECAMERA_POLICY_BLOCK,		/**< The reader waits for the consumer and the frames are kept in the camera DDR memory until it is full */
+    IPECAMERA_POLICY_DECIMATE		/**< Only every Nth event is reported to the consumer, the oldest events are skipped if it still lags */
+} ipecamera_consumer_policy_t;
+
+typedef struct {
+    pcilib_event_id_t last_id;	/**< Last event reported to the consumer */
+    size_t reported;		/**< Number of events reported to the consumer */
+    size_t dropped;		/**< Number of events skipped as the consumer was not fast enough */
+    size_t decimated;		/**< Number of events skipped due to decimation */
+    size_t discarded;		/**< Number of new frames discarded by the reader waiting for the consumer (drop-newest) */
+    size_t stalls;		/**< Number of times the reader was blocked waiting for the consumer (block) */
+    size_t overruns;		/**< Number of times the camera DDR memory was full or the wait has timed out and the reader stopped waiting (block) */
+    size_t lag;			/**< Number of already available events which are not reported to the consumer yet */
+} ipecamera_consumer_stats_t;
+
+typedef enum {
+    IPECAMERA_PREPROCESS_ALL = 0,	/**< All frames are decoded ahead by preprocessors (default) */
+    IPECAMERA_PREPROCESS_LAZY		/**< Only the frames expected by prefetching consumers or hinted with ipecamera_prefetch are decoded ahead, the rest is decoded on request */
+} ipecamera_preprocess_mode_t;
+
+typedef struct {
+    size_t images;		/**< Number of decoded images kept in memory */
+    size_t hits;		/**< Number of image requests served by already decoded images */
+    size_t misses;		/**< Number of image requests which had to wait for decoding or to decode the frame */
+    size_t decoded;		/**< Number of decoded frames (the frames decoded again after their image was replaced are counted twice) */
+    size_t skipped;		/**< Number of frames not decoded ahead by preprocessors in lazy mode */
+    size_t direct;		/**< Number of frames decoded directly into the caller buffers */
+} ipecamera_cache_stats_t;
+
 typedef struct {
     pcilib_event_info_t info;
     UfoDecoderMeta meta;	/**< Frame metadata declared in ufodecode.h */
     int image_ready;		/**< Indicates if image data is parsed */
     int image_broken;		/**< Unlike the info.flags this is bound to the reconstructed image (i.e. is not updated on rawdata overwrite) */
     size_t raw_size;		/**< Indicates the actual size of raw data */
+    pcilib_event_id_t cmask_ref;	/**< Event the change mask of the image is computed against, 0 if all lines are flagged as changed */
 } ipecamera_event_info_t;
 
+typedef struct {
+    pcilib_event_id_t event_id;
+    ipecamera_event_info_t info;
+    void *data;			/**< Data returned in place or NULL if it is not available */
+    size_t size;		/**< Size of the data */
+    int error;			/**< Error getting the data (i.e. PCILIB_ERROR_INVALID_DATA if frame is broken) or PCILIB_ERROR_OVERWRITTEN if detected when returned */
+} ipecamera_batch_entry_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int ipecamera_set_buffer_size(ipecamera_t *ctx, int size);
+
+/**
+ * Sets the number of decoded images kept in memory. The images are not bound to
+ * the slots of the raw ring buffer, the least recently used one is replaced once
+ * a new frame is decoded. So, a deep raw ring may be used to absorb bursts without
+ * allocating the same number of images. The size is limited by the raw ring size.
+ * @param size		- number of images or 0 to use the default
+ */
+int ipecamera_set_image_buffer_size(ipecamera_t *ctx, int size);
+
+/**
+ * Keeps the packed copy of every decoded image, so IPECAMERA_PACKED_IMAGE is
+ * returned in place. The decoded lines are packed in small chunks right after
+ * decoding. Otherwise, IPECAMERA_PACKED_IMAGE is only packed on request into
+ * the user-supplied buffer. The packed pixels have real_bpp bits (10, 11, or 12
+ * bits as configured by ADC resolution), the pixel N of the image occupies
+ * bits N*real_bpp..N*real_bpp+real_bpp-1 of the little-endian bit stream. Can
+ * also be enabled with IPECAMERA_PACKED_IMAGES=1 environment variable.
+ */
+int ipecamera_set_packed_images(ipecamera_t *ctx, int enable);
+
+/**
+ * In progressive mode, the reader publishes how much of the frame is received
+ * after every DMA packet. Then, IPECAMERA_IMAGE_REGION, IPECAMERA_PACKED_LINE, and
+ * IPECAMERA_PACKED_PAYLOAD are available for the completely received lines of the
+ * frame which is still being read (event ipecamera_get_last_event_id() + 1).
+ * Can also be enabled with IPECAMERA_PROGRESSIVE=1 environment variable.
+ */
+int ipecamera_set_progressive(ipecamera_t *ctx, int enable);
+
+/**
+ * Enables the change detection. The decoded lines are compared with the same
+ * lines of the previous frame while they are still in cache and the line is
+ * flagged in IPECAMERA_CHANGE_MASK if at least one pixel differs by more than
+ * the threshold. The previous frame is only used if its image is already
+ * decoded and still kept in the image pool once decoding of the frame starts
+ * (i.e. it is decoded in bands or by a single preprocessor), otherwise all lines
+ * are flagged. The reference event is reported in cmask_ref of ipecamera_event_info_t.
+ * Can also be set with IPECAMERA_CHANGE_THRESHOLD environment variable.
+ * @param threshold	- maximal pixel difference which is not considered a change or -1 to disable (all lines are flagged, default)
+ */
+int ipecamera_set_change_threshold(ipecamera_t *ctx, int threshold);
 pcilib_event_id_t ipecamera_get_last_event_id(ipecamera_t *ctx);
 
+/**
+ * Registers an additional consumer of the acquired events. Each consumer has its
+ * own position in the event stream, so several consumers (i.e. a live viewer and a
+ * disk writer) receive all events independently of each other and of the consumer
+ * behind pcilib_stream/pcilib_get_next_event. If a consumer is too slow, only
+ * this consumer skips the events which are about to be overwritten (unless other
+ * policy is selected with ipecamera_consumer_set_policy). The data is
+ * obtained with the normal pcilib_get_data/pcilib_return_data calls. A consumer
+ * should only be used by a single thread at a time.
+ * @return		- consumer or NULL if too many consumers are registered
+ */
+ipecamera_consumer_t *ipecamera_subscribe(ipecamera_t *ctx);
+void ipecamera_unsubscribe(ipecamera_t *ctx, ipecamera_consumer_t *consumer);
+
+/**
+ * Analog of pcilib_get_next_event for the consumer registered with ipecamera_subscribe.
+ */
+int ipecamera_consumer_next_event(ipecamera_t *ctx, ipecamera_consumer_t *consumer, pcilib_timeout_t timeout, pcilib_event_id_t *evid, size_t info_size, pcilib_event_info_t *info);
+void ipecamera_consumer_get_stats(ipecamera_t *ctx, ipecamera_consumer_t *consumer, ipecamera_consumer_stats_t *stats);
+
+/**
+ * Selects how the consumer is handled if it can't keep up with the camera. The
+ * drop-newest and block policies are enforced by the reader thread, so they
+ * throttle all consumers of the acquisition (the other consumers are still not
+ * waited for). The reader checks them inside the DMA callback: with block policy
+ * it stops reading DMA and waits there until the consumer advances, the camera
+ * DDR memory is full, or IPECAMERA_HOLD_TIMEOUT (1 s) expires. Meanwhile, the
+ * other consumers only get the already published events. Once the timeout has
+ * expired, the consumer is not waited for again until it gets the next event. With drop-newest,
+ * the frames received while the consumer lags are discarded, so they are missed
+ * by all consumers. The default consumer is selected if consumer is NULL. Its policy
+ * can also be set with IPECAMERA_CONSUMER_POLICY environment variable, i.e.
+ * drop-oldest, drop-newest, block, or decimate:N.
+ * @param decimation	- report only every Nth event (only used with IPECAMERA_POLICY_DECIMATE)
+ */
+int ipecamera_consumer_set_policy(ipecamera_t *ctx, ipecamera_consumer_t *consumer, ipecamera_consumer_policy_t policy, size_t decimation);
+
+/**
+ * Selects which frames are decoded ahead by preprocessors (only if grabbing is
+ * started with PCILIB_EVENT_FLAG_PREPROCESS). In lazy mode, only the frames the
+ * prefetching consumers are going to receive are decoded ahead. The frames
+ * which will be skipped by consumers (decimation or lagging too much) are not
+ * decoded at all unless requested. The mode can't be changed while grabbing,
+ * it can also be set with IPECAMERA_PREPROCESS environment variable (all or lazy).
+ */
+int ipecamera_set_preprocess_mode(ipecamera_t *ctx, ipecamera_preprocess_mode_t mode);
+
+/**
+ * Enables decoding ahead of the frames the consumer is going to receive in lazy
+ * preprocessing mode. It is enabled for the default consumer and disabled for
+ * the subscribed ones. The default consumer is selected if consumer is NULL.
+ */
+int ipecamera_consumer_set_prefetch(ipecamera_t *ctx, ipecamera_consumer_t *consumer, int prefetch);
+
+/**
+ * Hints preprocessors to decode the specified event ahead in lazy mode. The hint
+ * has no effect if the preprocessors have already passed the event.
+ */
+int ipecamera_prefetch(ipecamera_t *ctx, pcilib_event_id_t evid);
+
+void ipecamera_get_cache_stats(ipecamera_t *ctx, ipecamera_cache_stats_t *stats);
+
+/**
+ * Returns the number of completely received lines of the frame. For the frame which
+ * is still being read this is only non-zero in progressive mode. For the complete
+ * frame it is the number of lines in the frame (less if the frame is broken).
+ * @return		- PCILIB_ERROR_OVERWRITTEN if the frame is not available anymore
+ */
+int ipecamera_get_lines_ready(ipecamera_t *ctx, pcilib_event_id_t evid, size_t *lines);
+
+/**
+ * Waits until the specified number of lines of the frame is received (progressive mode)
+ * or the frame is complete. The frame may have fewer lines (see ready).
+ * @param ready		- number of lines available, may be NULL
+ * @return		- PCILIB_ERROR_TIMEOUT if neither happens within the timeout
+ */
+int ipecamera_wait_lines(ipecamera_t *ctx, pcilib_event_id_t evid, size_t lines, pcilib_timeout_t timeout, size_t *ready);
+
+/**
+ * Registers the caller buffer the specified event should be decoded into. If
+ * the frame is not decoded yet, the preprocessors write the pixels directly into
+ * this buffer and pcilib_get_data called with this buffer returns without copying.
+ * The image is handed over to the caller as soon as it is decoded, i.e. the buffer
+ * is unregistered and never returned to the other consumers, they will have to
+ * decode the frame again. The buffer should stay valid until the image is obtained
+ * or the grabbing is stopped, ipecamera_stop unregisters all buffers. Even without
+ * registration, pcilib_get_data decodes directly into the supplied buffer if the
+ * frame is not decoded yet and the preprocessors are not expected to decode it.
+ * @param size		- size of the buffer, should fit the full image
+ */
+int ipecamera_register_image_buffer(ipecamera_t *ctx, pcilib_event_id_t evid, void *buf, size_t size);
+
+/**
+ * Gets up to max_events events with their info and data in one call. It waits
+ * for the first event up to the specified timeout, the further events are only
+ * taken if they are already available. The data is returned in place (as with
+ * pcilib_get_data and no user-supplied buffer). The errors concerning a single
+ * event are reported in the error field of its entry, the event is still
+ * counted. The default consumer (behind pcilib_stream/pcilib_get_next_event)
+ * is used if consumer is NULL, then the stream lock is taken once per batch.
+ * @param n_events	- number of returned events
+ * @return		- PCILIB_ERROR_TIMEOUT if no event is available or other error code
+ */
+int ipecamera_next_batch(ipecamera_t *ctx, ipecamera_consumer_t *consumer, pcilib_timeout_t timeout, pcilib_event_data_type_t data_type, size_t max_events, ipecamera_batch_entry_t *events, size_t *n_events);
+
+/**
+ * Gives back the data obtained with ipecamera_next_batch. The entries which were
+ * overwritten while used get PCILIB_ERROR_OVERWRITTEN in the error field.
+ * @return		- PCILIB_ERROR_OVERWRITTEN if any of events was overwritten
+ */
+int ipecamera_return_batch(ipecamera_t *ctx, pcilib_event_data_type_t data_type, size_t n_events, ipecamera_batch_entry_t *events);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,162 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <pcilib.h>
+#include <pcilib/error.h>
+
+#include "memory.h"
+
+#define IPECAMERA_HUGE_2MB_SIZE (2ul * 1024 * 1024)
+#define IPECAMERA_HUGE_1GB_SIZE (1024ul * 1024 * 1024)
+
+#ifndef MAP_HUGE_SHIFT
+# define MAP_HUGE_SHIFT 26
+#endif /* MAP_HUGE_SHIFT */
+
+static const char *ipecamera_memory_modes[] = { "malloc", "locked", "thp", "huge-2mb", "huge-1gb" };
+
+
+static size_t ipecamera_memory_round(size_t size, size_t page) {
+    return (size + page - 1) & ~(page - 1);
+}
+
+static void ipecamera_memory_bind(void *ptr, size_t size, int node) {
+    unsigned long nodemask[4] = {0};
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ipecamera_memory_round((uintptr_t)ptr, page);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~(page - 1);
+
+    if ((node < 0)||(node >= 8 * sizeof(nodemask))||(end <= start)) return;
+
+    nodemask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+
+	// Preferred rather than strict binding: if the node runs out of memory, remote pages are better than failure
+    syscall(SYS_mbind, (void*)start, end - start, MPOL_PREFERRED, nodemask, 8 * sizeof(nodemask), 0);
+}
+
+static void *ipecamera_memory_map(ipecamera_memory_t *mem, size_t size, ipecamera_memory_mode_t mode, int node) {
+    int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+    size_t i, page = sysconf(_SC_PAGESIZE);
+    size_t fault_step = page;
+    void *map;
+
+    switch (mode) {
+#ifdef MAP_HUGETLB
+     case IPECAMERA_MEMORY_HUGE_1GB:
+	    // 1 GB pages are wasting too much memory on the smaller buffers
+	if (size < IPECAMERA_HUGE_1GB_SIZE) return NULL;
+	page = fault_step = IPECAMERA_HUGE_1GB_SIZE;
+	flags |= MAP_HUGETLB|(30 << MAP_HUGE_SHIFT);
+	break;
+     case IPECAMERA_MEMORY_HUGE_2MB:
+	page = fault_step = IPECAMERA_HUGE_2MB_SIZE;
+	flags |= MAP_HUGETLB|(21 << MAP_HUGE_SHIFT);
+	break;
+#endif /* MAP_HUGETLB */
+#ifdef MADV_HUGEPAGE
+     case IPECAMERA_MEMORY_THP:
+	    // The mapping is aligned to the hugepage boundary
+	page = IPECAMERA_HUGE_2MB_SIZE;
+	break;
+#endif /* MADV_HUGEPAGE */
+     case IPECAMERA_MEMORY_LOCKED:
+	break;
+     default:
+	return NULL;
+    }
+
+    size = ipecamera_memory_round(size, page);
+    if (mode == IPECAMERA_MEMORY_THP) size += page;
+
+	// hugetlb mappings are reserved at mmap time, so it fails if the pool is too small.
+	// The pages are not populated here as the memory policy should be set first.
+    map = mmap(NULL, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    mem->map = map;
+    mem->size = size;
+    mem->ptr = map;
+
+#ifdef MADV_HUGEPAGE
+    if (mode == IPECAMERA_MEMORY_THP) {
+	mem->ptr = (void*)ipecamera_memory_round((uintptr_t)map, page);
+	if (madvise(mem->ptr, size - page, MADV_HUGEPAGE)) {
+	    munmap(map, size);
+	    return NULL;
+	}
+    }
+#endif /* MADV_HUGEPAGE */
+
+    ipecamera_memory_bind(mem->map, mem->size, node);
+
+    for (i = 0; i < size; i += fault_step)
+	((volatile char*)mem->map)[i] = 0;
+
+    mem->mode = mode;
+    mem->locked = mlock(mem->map, mem->size)?0:1;
+
+    return mem->ptr;
+}
+
+void *ipecamera_memory_alloc(ipecamera_memory_t *mem, size_t size, ipecamera_memory_mode_t mode, int node) {
+    memset(mem, 0, sizeof(ipecamera_memory_t));
+
+    for (; mode > IPECAMERA_MEMORY_MALLOC; mode--) {
+	if (ipecamera_memory_map(mem, size, mode, node))
+	    return mem->ptr;
+    }
+
+    mem->ptr = malloc(size);
+    mem->size = size;
+    mem->mode = IPECAMERA_MEMORY_MALLOC;
+
+	// The large blocks are mmap'ed by malloc and not touched yet, so the policy is applied on the first access
+    if (mem->ptr) ipecamera_memory_bind(mem->ptr, size, node);
+
+    return mem->ptr;
+}
+
+void ipecamera_memory_free(ipecamera_memory_t *mem) {
+    if (mem->mode == IPECAMERA_MEMORY_MALLOC) {
+	if (mem->ptr) free(mem->ptr);
+    } else {
+	if (mem->locked) munlock(mem->map, mem->size);
+	munmap(mem->map, mem->size);
+    }
+
+    memset(mem, 0, sizeof(ipecamera_memory_t));
+}
+
+const char *ipecamera_memory_mode_name(ipecamera_memory_mode_t mode) {
+    if (mode > IPECAMERA_MEMORY_HUGE_1GB) return "unknown";
+    return ipecamera_memory_modes[mode];
+}
+
+int ipecamera_memory_parse_mode(const char *name, ipecamera_memory_mode_t *mode) {
+    ipecamera_memory_mode_t i;
+
+    if (!strcmp(name, "huge")) {
+	*mode = IPECAMERA_MEMORY_HUGE_1GB;
+	return 0;
+    }
+
+    for (i = IPECAMERA_MEMORY_MALLOC; i <= IPECAMERA_MEMORY_HUGE_1GB; i++) {
+	if (!strcmp(name, ipecamera_memory_modes[i])) {
+	    *mode = i;
+	    return 0;
+	}
+    }
+
+    return PCILIB_ERROR_INVALID_ARGUMENT;
+}
@@ -0,0 +1,50 @@
+#ifndef _IPECAMERA_MEMORY_H
+#define _IPECAMERA_MEMORY_H
+
+#include <stddef.h>
+
+typedef enum {
+    IPECAMERA_MEMORY_MALLOC = 0,		/**< Plain heap allocation, pages are faulted in on the first access */
+    IPECAMERA_MEMORY_LOCKED,			/**< Prefaulted and locked 4 KB pages */
+    IPECAMERA_MEMORY_THP,			/**< Prefaulted and locked transparent hugepages (as far as kernel is able to provide them) */
+    IPECAMERA_MEMORY_HUGE_2MB,			/**< Prefaulted and locked 2 MB hugetlb pages */
+    IPECAMERA_MEMORY_HUGE_1GB			/**< Prefaulted and locked 1 GB hugetlb pages */
+} ipecamera_memory_mode_t;
+
+typedef struct {
+    void *ptr;					/**< Start of the buffer */
+    void *map;					/**< Start of the mapping (may differ from ptr if the mapping was aligned) */
+    size_t size;				/**< Size of the mapping */
+    ipecamera_memory_mode_t mode;		/**< Obtained allocation mode */
+    int locked;					/**< Indicates if the pages are locked in memory (not the case if RLIMIT_MEMLOCK is too low) */
+} ipecamera_memory_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Allocates a ring buffer. The modes are tried starting from the requested one
+ * down to IPECAMERA_MEMORY_LOCKED, i.e. 1 GB pages are only attempted if huge
+ * pages are requested and the buffer is at least 1 GB large. Except in malloc
+ * mode, the buffer is zeroed and all pages are faulted in and locked before return.
+ * Failure to lock (i.e. because of RLIMIT_MEMLOCK) is not fatal and reported in mem->locked.
+ * @param node		- preferred NUMA node or -1 to use the default policy
+ * @return		- NULL on error
+ */
+void *ipecamera_memory_alloc(ipecamera_memory_t *mem, size_t size, ipecamera_memory_mode_t mode, int node);
+void ipecamera_memory_free(ipecamera_memory_t *mem);
+
+const char *ipecamera_memory_mode_name(ipecamera_memory_mode_t mode);
+
+/**
+ * Parses the mode name: malloc, locked, thp, huge (the largest hugetlb pages available).
+ * @return		- 0 on success or PCILIB_ERROR_INVALID_ARGUMENT
+ */
+int ipecamera_memory_parse_mode(const char *name, ipecamera_memory_mode_t *mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IPECAMERA_MEMORY_H */
@@ -199,6 +199,8 @@ static const pcilib_event_description_t ipecamera_events[] = {
 static const pcilib_event_data_type_description_t ipecamera_data_types[] = {
     {IPECAMERA_IMAGE_DATA,	PCILIB_EVENT0, "image",	"16 bit pixel data" },
     {IPECAMERA_RAW_DATA,	PCILIB_EVENT0, "raw", 	"raw data from camera" },
+    {IPECAMERA_IMAGE_REGION,	PCILIB_EVENT0, "region",	"16 bit pixel data of the image region" },
+    {IPECAMERA_PACKED_IMAGE,	PCILIB_EVENT0, "packed",	"10, 11, or 12 bit packed pixel data" },
     {IPECAMERA_CHANGE_MASK,	PCILIB_EVENT0, "cmask",	"change mask" },
     {0, 0, NULL, NULL}
 };
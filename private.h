@@ -8,6 +8,10 @@
 #include "base.h"
 #include "ipecamera.h"
 #include "env.h"
+#include "replay.h"
+#include "events.h"
+#include "memory.h"
+#include "topology.h"
 
 #define IPECAMERA_DEBUG
 #ifdef IPECAMERA_DEBUG
@@ -19,7 +23,7 @@
 # define IPECAMERA_DEBUG_API			//**< Debug IPECamera API calls */
 #endif /* IPECAMERA_DEBUG */
 
-#define IPECAMERA_BUG_MISSING_PAYLOAD		//**< CMOSIS fails to provide a first payload for each frame, therefore the frame is 32 bit shorter */
+#define IPECAMERA_BUG_MISSING_PAYLOAD		//**< A payload is missing in each frame, therefore the frame is 32 bytes shorter: the first one (line header of the first line) for CMOSIS and the last payload of the first line pair for CMOSIS20 */
 #define IPECAMERA_BUG_MULTIFRAME_PACKETS	//**< This is by design, start of packet comes directly after the end of last one in streaming mode */
 #define IPECAMERA_BUG_MULTIFRAME_HEADERS	//**< UFO Camera operates with 32-byte entities, but some times there is 16-byte padding before the data which may result in spliting the header between 2 DMA packets. We still need to define a minimal number of bytes which are always in the same DMA packet (CMOSIS_ENTITY_SIZE) */
 #define IPECAMERA_BUG_REPEATING_DATA		//**< 16 bytes repeated at frame offset 4096, the problem start/stop happenning on board restart */
@@ -30,6 +34,11 @@
 //#define IPECAMERA_ADJUST_BUFFER_SIZE		//**< Adjust default buffer size based on the hardware capabilities (number of frames stored in the FPGA memory) */
 
 #define IPECAMERA_DEFAULT_BUFFER_SIZE 256  	//**< number of buffers in a ring buffer, should be power of 2 */
+#define IPECAMERA_DEFAULT_IMAGE_BUFFER_SIZE 32	//**< number of decoded images kept in memory (limited by the size of the ring buffer) */
+#define IPECAMERA_MAX_HEADER_SIZE (16 * CMOSIS_FRAME_HEADER_SIZE)	//**< Only this much is inspected to find the layout of the frame which is still being received */
+#define IPECAMERA_REGION_LINES 8		//**< Lines decoded at once if only a region of the frame is requested (multiple of the line block) */
+#define IPECAMERA_REGION_SCRATCH 4		//**< Number of scratch buffers to decode regions, further concurrent requests wait for a free one */
+#define IPECAMERA_PACK_LINES 32			//**< Decoded lines are packed and compared with the previous frame in chunks of this size while they are still in cache (multiple of the line block) */
 #define IPECAMERA_DEFAULT_CMOSIS20_BUFFER_SIZE 64 //*< overrides number of buffers for CMOSIS20 sensor to reduce memory consumption */
 #define IPECAMERA_RESERVE_BUFFERS 4		//**< Return Frame is Lost error, if requested frame will be overwritten after specified number of frames
 
@@ -43,6 +52,12 @@
 #define IPECAMERA_READ_STATUS_DELAY 1000	//**< According to Uros, 1ms delay needed before consequitive reads from status registers */
 #define IPECAMERA_NOFRAME_SLEEP 100		//**< Sleep while polling for a new frame in reader */
 #define IPECAMERA_NOFRAME_PREPROC_SLEEP 100	//**< Sleep while polling for a new frame in pre-processor */
+#define IPECAMERA_BUILTIN_VERIFY_FRAMES 16	//**< Number of frames which should be decoded bit-exactly by ufodecode and the built-in decoder before the built-in one is used */
+#define IPECAMERA_PREPROC_WAIT_TIMEOUT 10000	//**< Interval to re-check the slot while waiting until the previous frame in it is decoded by another thread */
+#define IPECAMERA_MAX_BANDS 256		//**< Maximal number of row bands a frame can be split into for parallel decoding */
+#define IPECAMERA_MAX_CONSUMERS 16		//**< Maximal number of consumers of a single acquisition (including the one behind pcilib stream/next_event calls) */
+#define IPECAMERA_HOLD_POLL_INTERVAL 10000	//**< Interval to re-check the camera DDR memory while the reader is blocked by a slow consumer */
+#define IPECAMERA_HOLD_TIMEOUT 1000000		//**< Maximal time the reader is blocked by a slow consumer in the DMA callback, then the events not yet reported to it are overwritten */
 
 #define IPECAMERA_EXPECTED_STATUS_4 0x08409FFFF
 #define IPECAMERA_EXPECTED_STATUS 0x08449FFFF
@@ -160,19 +175,131 @@ typedef struct {
     struct timeval timestamp;
 } ipecamera_autostop_t;
 
+/**
+ * The options overridden from environment in ipecamera_start. The values set
+ * with the API are saved and restored in ipecamera_stop.
+ */
+typedef struct {
+    int preprocess_mode;		/**< preprocess_mode is set by IPECAMERA_PREPROCESS */
+    ipecamera_preprocess_mode_t saved_preprocess_mode;	/**< Mode set with ipecamera_set_preprocess_mode */
+    int progressive;			/**< progressive is enabled by IPECAMERA_PROGRESSIVE (it was disabled with the API) */
+    int change_threshold;		/**< change_threshold is set by IPECAMERA_CHANGE_THRESHOLD */
+    int saved_change_threshold;		/**< Threshold set with ipecamera_set_change_threshold */
+} ipecamera_overrides_t;
+
 typedef struct {
     size_t i;
     pthread_t thread;
     ipecamera_t *ipecamera;
+    int cpu;				/**< CPU the thread is pinned to or -1 */
     
     int started;			/**< flag indicating that join & cleanup is required */
 } ipecamera_preprocessor_t;
 
 
+/**
+ * Position of the pixel data in the raw frame. The lines are encoded in blocks:
+ * a single line for CMOSIS and a line pair for CMOSIS20. In the 4-channel output
+ * mode, each block consists of 4 repetitions (one for each group of channels).
+ * A repetition starts with the line header (CMOSIS) or the skipped C0 payload
+ * (CMOSIS20) followed by the pixel payloads. See docs/format.txt for details.
+ * Use ipecamera_layout_block_offset to locate the blocks, the first one may be
+ * shorter (IPECAMERA_BUG_MISSING_PAYLOAD).
+ */
+typedef struct {
+    ipecamera_format_t format;		/**< Frame format as reported by the frame header */
+    size_t header_size;			/**< Total size of frame headers in bytes */
+    size_t lines;			/**< Number of lines in the frame */
+    size_t seqnum;			/**< Frame sequence number */
+    size_t block_lines;			/**< Number of lines encoded together */
+    size_t repeats;			/**< Number of repetitions per block, 16 / cmosis_outputs */
+    size_t repeat_size;			/**< Size of a single repetition in bytes (including line header or C0 payload) */
+    size_t payloads;			/**< Number of pixel payloads per repetition */
+    size_t data_offset;			/**< Offset of the (missing) first line header in the raw frame */
+    size_t missing_payloads;		/**< Number of payloads missing at the end of the first block */
+} ipecamera_frame_layout_t;
+
+typedef void (*ipecamera_decode_blocks_t)(const void *raw, size_t data_offset, size_t first_block, size_t last_block, ipecamera_pixel_t *pixels);
+
+#define IPECAMERA_SEQ_WRITING(evid) (2 * (uint64_t)(evid) + 1)
+#define IPECAMERA_SEQ_READY(evid) (2 * (uint64_t)(evid))
+#define IPECAMERA_EVENT_SLOT(ctx, evid) (((evid) - 1) & (ctx)->buffer_mask)	//**< Ring slot of the event (the event ids are starting from 1) */
+#define IPECAMERA_IMAGE_SLOT_BITS 16		//**< Number of bits used to store the image slot in the image reference */
+#define IPECAMERA_IMAGE_SLOT_MASK ((1 << IPECAMERA_IMAGE_SLOT_BITS) - 1)
+#define IPECAMERA_IMAGE_REF(evid, image) ((((uint64_t)(evid)) << IPECAMERA_IMAGE_SLOT_BITS) | (image))	//**< Reference from the ring slot to the image slot holding the decoded frame */
+
+#define IPECAMERA_CACHE_LINE_SIZE 64		//**< Data written by different threads is kept on separate cache lines of this size */
+#define IPECAMERA_CACHE_ALIGNED __attribute__((aligned(IPECAMERA_CACHE_LINE_SIZE)))
+
+/**
+ * Raw part of the ring slot, it is only written by the reader thread. The
+ * decoding state of the slot is kept separately in ipecamera_decoded_t, so
+ * the reader filling the next slot does not invalidate the cache lines used by
+ * preprocessors decoding the previous frames (and vice versa).
+ */
+typedef struct {
+    pcilib_event_info_t info;		/**< Event info reported to the client, the image-related part of ipecamera_event_info_t lives in ipecamera_decoded_t */
+    size_t raw_size;			/**< Actual size of raw data */
+    volatile uint64_t raw_seq;		/**< Sequence counter of the raw data and event info: IPECAMERA_SEQ_WRITING(evid) while the reader fills the slot, IPECAMERA_SEQ_READY(evid) once the frame is complete */
+    volatile size_t ready_size;		/**< Number of bytes received so far, published by the reader in progressive mode while the slot is written */
+    volatile uint32_t ready_gen;	/**< Advanced if the partially received frame is discarded and the slot is refilled with the same event id */
+} IPECAMERA_CACHE_ALIGNED ipecamera_frame_t;
+
+/**
+ * Decoding state of the image slot. The image slots are not bound to the ring
+ * slots, but assigned once the frame is claimed for decoding. It is written by
+ * the thread which has claimed the image, except the band counters which are
+ * updated by all preprocessors decoding the frame in bands and, hence, are
+ * moved to a separate cache line.
+ */
 typedef struct {
-    ipecamera_event_info_t event;	/**< this structure is overwritten by the reader thread, we need a copy */
-    pthread_rwlock_t mutex;		/**< this mutex protects reconstructed buffers only, the raw data, event_info, etc. will be overwritten by reader thread anyway */
-} ipecamera_frame_t;
+    volatile uint64_t image_seq;	/**< Sequence counter of the decoded image: IPECAMERA_SEQ_WRITING(evid) while decoding, IPECAMERA_SEQ_READY(evid) once decoded, 0 if no valid image */
+    volatile uint64_t used;		/**< Value of image_clock when the image was last decoded or requested, the least recently used image is replaced */
+    int image_broken;			/**< Error decoding the image, unlike the info.flags this is bound to the reconstructed image (i.e. is not updated on rawdata overwrite) */
+    UfoDecoderMeta meta;		/**< Frame metadata declared in ufodecode.h */
+    ipecamera_frame_layout_t layout;	/**< Payload layout of the frame as parsed by the built-in decoder */
+    ipecamera_pixel_t *pixels;		/**< Image data, either the image slot or the caller buffer the frame was decoded into */
+    int ref_image;			/**< Image slot holding the previous frame the change mask is computed against, -1 if all lines are flagged */
+    pcilib_event_id_t cmask_ref;	/**< Event the change mask was computed against, 0 if all lines are flagged */
+
+    volatile size_t bands_done IPECAMERA_CACHE_ALIGNED;	/**< Number of already decoded bands */
+    volatile int band_error;		/**< Error decoding one of the bands */
+} IPECAMERA_CACHE_ALIGNED ipecamera_decoded_t;
+
+/**
+ * Caller buffer registered with ipecamera_register_image_buffer for the frame in
+ * the ring slot. The data pointer is stored before the event id with release
+ * semantics and the event id is re-checked by the decoder after loading it. Once
+ * the image is decoded into the buffer, the registration is cleared and the
+ * decoding result is published with decoded_id.
+ */
+typedef struct {
+    volatile pcilib_event_id_t event_id;	/**< Event the buffer is registered for, 0 if none */
+    ipecamera_pixel_t *volatile data;		/**< Buffer large enough to hold the full image */
+    volatile pcilib_event_id_t decoded_id;	/**< Event decoded into the buffer and handed over, 0 if none */
+    int image_broken;				/**< Decoding error of the handed over image */
+    UfoDecoderMeta meta;			/**< Metadata of the handed over image */
+} ipecamera_destination_t;
+
+/**
+ * Position of a consumer in the event stream. It is only updated by the thread
+ * owning the consumer (for the default consumer, under the stream lock). The
+ * reader thread only reads the position and updates the reader-side counters.
+ */
+struct ipecamera_consumer_s {
+    volatile int used;			/**< Indicates if the table entry is allocated */
+    ipecamera_consumer_policy_t policy;	/**< Policy applied when the consumer lags */
+    size_t decimation;			/**< Only every Nth event is reported with IPECAMERA_POLICY_DECIMATE */
+    int prefetch;			/**< The frames expected by the consumer are decoded ahead in IPECAMERA_PREPROCESS_LAZY mode */
+    volatile pcilib_event_id_t reported_id;	/**< Last event reported to the consumer, events after it are held by the reader with drop-newest and block policies */
+    size_t reported;			/**< Number of events reported to the consumer */
+    size_t dropped;			/**< Number of events skipped as the consumer was not fast enough */
+    size_t decimated;			/**< Number of events skipped due to decimation */
+    volatile size_t discarded;		/**< Number of new frames discarded by the reader as the consumer was not fast enough (drop-newest) */
+    volatile size_t stalls;		/**< Number of times the reader was blocked waiting for the consumer (block) */
+    volatile size_t overruns;		/**< Number of times the reader stopped waiting as the camera DDR memory is full or IPECAMERA_HOLD_TIMEOUT has expired (block) */
+    pcilib_event_id_t hold_expired;	/**< reported_id + 1 once IPECAMERA_HOLD_TIMEOUT has expired, the consumer is not waited for until it advances (0 otherwise) */
+} IPECAMERA_CACHE_ALIGNED;
 
 struct ipecamera_s {
     pcilib_context_t event;
@@ -189,11 +316,28 @@ struct ipecamera_s {
     ipecamera_pixel_t *image;
     size_t size;
 
-    volatile pcilib_event_id_t event_id;
-    volatile pcilib_event_id_t preproc_id;
-    pcilib_event_id_t reported_id;
-
-    pcilib_dma_engine_t rdma;
+    volatile pcilib_event_id_t event_id IPECAMERA_CACHE_ALIGNED;	/**< Last event published by the reader thread, stored with release semantics after the raw_seq of the frame */
+    volatile pcilib_event_id_t preproc_id IPECAMERA_CACHE_ALIGNED;	/**< Last event claimed by preprocessors, advanced with compare-and-swap */
+    volatile size_t preproc_skipped;	/**< Number of events skipped by preprocessors as decoding was not fast enough */
+    ipecamera_consumer_t consumers[IPECAMERA_MAX_CONSUMERS];	/**< Table of consumers, the first one is the default consumer used by ipecamera_stream and ipecamera_next_event */
+
+    ipecamera_notifier_t new_event IPECAMERA_CACHE_ALIGNED;	/**< Notified by the reader thread when a new frame is received or the reader is stopped */
+    ipecamera_notifier_t new_image;	/**< Notified when decoding of a frame is finished */
+    ipecamera_notifier_t band_done;	/**< Notified when the last band of a frame is decoded */
+    ipecamera_notifier_t consumed;	/**< Notified when a consumer with block policy advances or the reader is stopped */
+    ipecamera_notifier_t lines_ready;	/**< Notified by the reader on each received DMA packet and completed frame in progressive mode only */
+
+    size_t n_bands;			/**< Number of row bands decoded concurrently by preprocessors, 0 - each frame is decoded by a single thread */
+    volatile uint64_t band_job IPECAMERA_CACHE_ALIGNED;	/**< Event id of the frame currently decoded in bands, its image slot and the next unclaimed band, see IPECAMERA_BAND_JOB in data.c */
+    volatile uint64_t image_clock IPECAMERA_CACHE_ALIGNED;	/**< Advanced on each access to the decoded images */
+    volatile size_t image_hits;		/**< Number of image requests served by already decoded images */
+    volatile size_t image_misses;	/**< Number of image requests which had to wait for decoding or to decode the frame */
+    volatile size_t image_decoded;	/**< Number of decoded frames */
+    volatile size_t lazy_skipped;	/**< Number of frames not decoded ahead by preprocessors in lazy mode */
+    volatile size_t image_direct;	/**< Number of frames decoded directly into the caller buffers */
+
+    pcilib_dma_engine_t rdma IPECAMERA_CACHE_ALIGNED;
+    ipecamera_replay_t *replay;		/**< If set, the recorded DMA stream is replayed instead of reading the DMA engine */
 
     pcilib_register_t control_reg, status_reg;
     pcilib_register_t status2_reg, status3_reg;
@@ -212,20 +356,36 @@ struct ipecamera_s {
     int started;			/**< Camera is in grabbing mode (start function is called) */
     int streaming;			/**< Camera is in streaming mode (we are within stream call) */
     int parse_data;			/**< Indicates if some processing of the data is required, otherwise only rawdata_callback will be called */
+    int builtin_decoder;		/**< Use in-tree decoder instead of ufodecode (always used for decoding in bands) */
+    volatile int builtin_unverified;	/**< Number of frames still to be decoded by both decoders before the built-in one is used, -1 if the results have differed */
+    ipecamera_pixel_t *verify_pixels;	/**< Image written by the built-in decoder while it is verified against ufodecode */
+    volatile int verify_busy;		/**< verify_pixels is in use, the frames decoded by other threads meanwhile are not verified */
+    ipecamera_decode_blocks_t decode_blocks;	/**< Built-in decoding routine specialized for the current format and output mode */
+    int pack_images;			/**< Keep the packed copy of the decoded images */
+    uint8_t *packed;			/**< Packed images (one per image slot), NULL unless pack_images is set */
+    size_t packed_size;			/**< Size of a single packed image in bytes */
+    ipecamera_pixel_t *scratch;		/**< IPECAMERA_REGION_SCRATCH buffers of IPECAMERA_REGION_LINES lines to decode image regions */
+    volatile uint32_t scratch_used;	/**< Bit mask of the scratch buffers in use */
+    int progressive;			/**< The reader publishes the progress of the frame being received, so the completed lines are available before the frame end */
+    int change_threshold;		/**< Pixel difference above which the line is flagged in the change mask, -1 - change detection is disabled */
 
     volatile int run_reader;		/**< Instructs the reader thread to stop processing */
     volatile int run_streamer;		/**< Indicates request to stop streaming events and can be set by reader_thread upon exit or by user request */
     volatile int run_preprocessors;	/**< Instructs preprocessors to exit */
     
     ipecamera_autostop_t autostop;
+    ipecamera_overrides_t overrides;	/**< Options overridden from environment for the current acquisition */
 
     struct timeval autostop_time;
     struct timeval next_trigger;	/**< The minimal delay between trigger signals is mandatory, this indicates time when next trigger is possible */
 
-    size_t buffer_size;			/**< How many images to store */
-    size_t buffer_pos;			/**< Current image offset in the buffer, due to synchronization reasons should not be used outside of reader_thread */
+    size_t buffer_size;			/**< How many images to store, power of 2 */
+    size_t buffer_mask;			/**< buffer_size - 1, maps event ids to ring slots */
+    size_t image_buffer_size;		/**< Requested number of decoded images to keep, 0 - default */
+    size_t image_slots;			/**< Actual number of image slots, not bound to the number of ring slots */
+    size_t buffer_pos IPECAMERA_CACHE_ALIGNED;	/**< Current image offset in the buffer, due to synchronization reasons should not be used outside of reader_thread */
     size_t cur_size;			/**< Already written part of data in bytes */
-    size_t raw_size;			/**< Expected maximum size of raw data in bytes */
+    size_t raw_size IPECAMERA_CACHE_ALIGNED;	/**< Expected maximum size of raw data in bytes */
     size_t padded_size;			/**< Expected maximum size of buffer for raw data, including additional padding */
     size_t roi_raw_size;		/**< Expected size (for currently configured ROI) of raw data in bytes */
     size_t roi_padded_size;		/**< Expected size (for currently configured ROI) of buffer for raw data, including additional padding */
@@ -241,7 +401,22 @@ struct ipecamera_s {
 //    void *raw_buffer;
     void *buffer;
     ipecamera_change_mask_t *cmask;
-    ipecamera_frame_t *frame;
+    ipecamera_frame_t *frame;		/**< Raw part of ring slots, written by the reader thread */
+    ipecamera_decoded_t *decoded;	/**< Decoding state of image slots, written by preprocessors */
+    volatile uint64_t *image_ref;	/**< Image slot the frame in the ring slot was last decoded to, see IPECAMERA_IMAGE_REF */
+    volatile pcilib_event_id_t *prefetch;	/**< Events hinted with ipecamera_prefetch, indexed by ring slot */
+    ipecamera_destination_t *dest;	/**< Caller buffers the frames are decoded into, indexed by ring slot */
+    ipecamera_preprocess_mode_t preprocess_mode;	/**< Selects which frames are decoded ahead by preprocessors */
+
+    int numa_node;			/**< NUMA node hosting ring buffers, reader and preprocessor threads (-1 - not restricted) */
+    cpu_set_t numa_cpus;		/**< CPUs of numa_node allowed for the reader and preprocessor threads */
+    int reader_cpu;			/**< CPU the reader thread is pinned to */
+    cpu_set_t preproc_cpus;		/**< CPUs the preprocessor threads are pinned to (a thread per CPU) */
+    ipecamera_memory_mode_t memory_mode;	/**< Requested allocation mode of ring buffers */
+    ipecamera_memory_t buffer_mem;		/**< Allocation of the raw frame ring */
+    ipecamera_memory_t image_mem;		/**< Allocation of the image slots */
+    ipecamera_memory_t cmask_mem;		/**< Allocation of the change masks (one per image slot) */
+    ipecamera_memory_t packed_mem;		/**< Allocation of the packed images (one per image slot) */
 
 #ifdef IPECAMERA_BUG_MULTIFRAME_HEADERS
     size_t saved_header_size;				/**< If it happened that the frame header is split between 2 DMA packets, this variable holds the size of the part containing in the first packet */
@@ -249,16 +424,13 @@ struct ipecamera_s {
 #endif /* IPECAMERA_BUG_MULTIFRAME_HEADERS */
 
     size_t data_line_size;
+    size_t raw_line_size;		/**< Size of raw data per line in the current output mode (i.e. including all repetitions) */
     ipecamera_image_dimensions_t dim;
 
     pthread_t rthread;
     
     size_t n_preproc;
     ipecamera_preprocessor_t *preproc;
-    pthread_mutex_t preproc_mutex;
-    
-    int preproc_mutex_destroy;
-    int frame_mutex_destroy;
 };
 
 #endif /* _IPECAMERA_PRIVATE_H */
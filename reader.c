@@ -22,6 +22,7 @@
 #include "model.h"
 #include "private.h"
 #include "reader.h"
+#include "scanner.h"
 
 
 #define GET_REG(reg, var) \
@@ -56,23 +57,19 @@ int ipecamera_compute_buffer_size(ipecamera_t *ctx, ipecamera_format_t format, s
 //    const size_t header_size = 8 * sizeof(ipecamera_payload_t);
     const size_t footer_size = CMOSIS_FRAME_TAIL_SIZE;
 
-    size_t max_channels;
-    size_t line_size, raw_size, padded_blocks;
+    size_t raw_size, padded_blocks;
 
     switch (format) {
      case IPECAMERA_FORMAT_CMOSIS:
      case IPECAMERA_FORMAT_CMOSIS20:
-	max_channels = CMOSIS_MAX_CHANNELS;
-	line_size = ctx->data_line_size;
 	break;
      default:
 	pcilib_warning("Unsupported version (%u) of frame format...", format);
 	return PCILIB_ERROR_NOTSUPPORTED;
     }
 
-    raw_size = lines * line_size;
-    raw_size *= max_channels / ctx->cmosis_outputs;
-    raw_size += header_size + footer_size;
+	// raw_line_size accounts for the repetitions in the reduced output modes (computed once in ipecamera_alloc_buffers)
+    raw_size = lines * ctx->raw_line_size + header_size + footer_size;
 
 #ifdef IPECAMERA_BUG_MISSING_PAYLOAD
         // As I understand, the first 32-byte packet is missing, so we need to substract 32 (both CMOSIS and CMOSIS20)
@@ -98,8 +95,8 @@ static int ipecamera_parse_header(ipecamera_t *ctx, ipecamera_payload_t *buf, si
     switch (version) {
      case 0:
 	n_lines = ((uint32_t*)buf)[5] & 0x7FF;
-	ctx->frame[ctx->buffer_pos].event.info.seqnum = buf[6] & 0xFFFFFF;
-	ctx->frame[ctx->buffer_pos].event.info.offset = (buf[7] & 0xFFFFFF) * 80;
+	ctx->frame[ctx->buffer_pos].info.seqnum = buf[6] & 0xFFFFFF;
+	ctx->frame[ctx->buffer_pos].info.offset = (buf[7] & 0xFFFFFF) * 80;
 	break;
      case 1:
 	n_lines = ((uint32_t*)buf)[5] & 0xFFFF;
@@ -108,18 +105,18 @@ static int ipecamera_parse_header(ipecamera_t *ctx, ipecamera_payload_t *buf, si
 	    return 0;
 	}
 
-	ctx->frame[ctx->buffer_pos].event.info.seqnum = buf[6] & 0xFFFFFF;
-	ctx->frame[ctx->buffer_pos].event.info.offset = (buf[7] & 0xFFFFFF) * 80;
+	ctx->frame[ctx->buffer_pos].info.seqnum = buf[6] & 0xFFFFFF;
+	ctx->frame[ctx->buffer_pos].info.offset = (buf[7] & 0xFFFFFF) * 80;
 	format = (buf[6] >> 24)&0x0F;
         break;
      default:
 	ipecamera_debug(HARDWARE, "Incorrect version of the frame header, ignoring broken data...");
 	return 0;
     }
-    gettimeofday(&ctx->frame[ctx->buffer_pos].event.info.timestamp, NULL);
+    gettimeofday(&ctx->frame[ctx->buffer_pos].info.timestamp, NULL);
 
-    ipecamera_debug(FRAME_HEADERS, "frame %lu: %x %x %x %x", ctx->frame[ctx->buffer_pos].event.info.seqnum, buf[0], buf[1], buf[2], buf[3]);
-    ipecamera_debug(FRAME_HEADERS, "frame %lu: %x %x %x %x", ctx->frame[ctx->buffer_pos].event.info.seqnum, buf[4], buf[5], buf[6], buf[7]);
+    ipecamera_debug(FRAME_HEADERS, "frame %lu: %x %x %x %x", ctx->frame[ctx->buffer_pos].info.seqnum, buf[0], buf[1], buf[2], buf[3]);
+    ipecamera_debug(FRAME_HEADERS, "frame %lu: %x %x %x %x", ctx->frame[ctx->buffer_pos].info.seqnum, buf[4], buf[5], buf[6], buf[7]);
 
     while ((!last)&&((size + CMOSIS_FRAME_HEADER_SIZE) <= buf_size)) {
 	size += CMOSIS_FRAME_HEADER_SIZE;
@@ -136,19 +133,143 @@ static int ipecamera_parse_header(ipecamera_t *ctx, ipecamera_payload_t *buf, si
 }
 
 
+	// Checks if the camera DDR memory is full and the frames will be lost if we continue waiting
+static int ipecamera_ddr_full(ipecamera_t *ctx) {
+    int err = 0;
+    pcilib_register_value_t value = 0;
+    pcilib_t *pcilib = ctx->event.pcilib;
+    const pcilib_model_description_t *model_info;
+
+	// The replayed stream is just paused
+    if ((ctx->replay)||(!ctx->max_frames)) return 0;
+
+    model_info = pcilib_get_model_description(pcilib);
+    GET_REG(num_frames_reg, value);
+
+    return ((err)||(value >= ctx->max_frames));
+}
+
+	// Finds the most lagging consumer which would miss the frame if it is published
+static ipecamera_consumer_t *ipecamera_find_holding_consumer(ipecamera_t *ctx) {
+    int i;
+    size_t lag, max_lag = ctx->buffer_size - IPECAMERA_RESERVE_BUFFERS;
+    pcilib_event_id_t reported_id, event_id = ctx->event_id + 1;
+    ipecamera_consumer_t *consumer, *res = NULL;
+
+    for (i = 0; i < IPECAMERA_MAX_CONSUMERS; i++) {
+	consumer = ctx->consumers + i;
+	if ((!consumer->used)||((consumer->policy != IPECAMERA_POLICY_DROP_NEWEST)&&(consumer->policy != IPECAMERA_POLICY_BLOCK))) continue;
+
+	reported_id = __atomic_load_n(&consumer->reported_id, __ATOMIC_ACQUIRE);
+	if (consumer->hold_expired == (reported_id + 1)) continue;
+
+	lag = event_id - reported_id;
+	if (lag > max_lag) {
+	    max_lag = lag;
+	    res = consumer;
+	}
+    }
+
+    return res;
+}
+
+/*
+ The consumers with drop-newest and block policies are never overrun by the
+ reader. With drop-newest, the new frame is discarded. With block, the reader
+ stops reading DMA until the consumer advances and the camera keeps frames in
+ its DDR memory meanwhile. Once the DDR memory is full, the reader gives up and
+ the consumer will skip the oldest events as usual.
+ @return	- 1 if the current frame should be discarded
+*/
+static int ipecamera_hold_frame(ipecamera_t *ctx) {
+    uint32_t key;
+    int stalled = 0;
+    struct timeval deadline, hold_deadline;
+    ipecamera_consumer_t *consumer;
+
+    while ((consumer = ipecamera_find_holding_consumer(ctx))) {
+	if (consumer->policy == IPECAMERA_POLICY_DROP_NEWEST) {
+	    consumer->discarded++;
+	    return 1;
+	}
+
+	if (!ctx->run_reader) break;
+
+	if (ipecamera_ddr_full(ctx)) {
+	    ipecamera_debug(HARDWARE, "Camera DDR memory is full, overwriting events not yet reported to the consumer");
+	    consumer->overruns++;
+	    break;
+	}
+
+	if (!stalled) {
+	    consumer->stalls++;
+	    stalled = 1;
+	    pcilib_calc_deadline(&hold_deadline, IPECAMERA_HOLD_TIMEOUT);
+	} else if (pcilib_check_deadline(&hold_deadline, 0)) {
+	    ipecamera_debug(HARDWARE, "The consumer has not advanced in %u us, overwriting events not yet reported to it", IPECAMERA_HOLD_TIMEOUT);
+	    consumer->hold_expired = consumer->reported_id + 1;
+	    consumer->overruns++;
+	    stalled = 0;
+	    continue;
+	}
+
+	key = ipecamera_notifier_prepare(&ctx->consumed);
+	if ((ctx->run_reader)&&(ipecamera_find_holding_consumer(ctx) == consumer)) {
+	    pcilib_calc_deadline(&deadline, IPECAMERA_HOLD_POLL_INTERVAL);
+	    ipecamera_notifier_wait(&ctx->consumed, key, &deadline);
+	}
+	ipecamera_notifier_cancel(&ctx->consumed);
+    }
+
+    return 0;
+}
+
+	// The slot is reused for the next frame, the data is not published
+static inline void ipecamera_reset_frame(ipecamera_t *ctx) {
+    ctx->cur_size = 0;
+
+    ctx->frame[ctx->buffer_pos].info.type = PCILIB_EVENT0;
+    ctx->frame[ctx->buffer_pos].info.flags = 0;
+}
+
 static inline int ipecamera_new_frame(ipecamera_t *ctx) {
-    ctx->frame[ctx->buffer_pos].event.raw_size = ctx->cur_size;
+    pcilib_event_id_t event_id;
+
+    ctx->frame[ctx->buffer_pos].raw_size = ctx->cur_size;
 
     if (ctx->cur_size < ctx->roi_raw_size) {
-	ctx->frame[ctx->buffer_pos].event.info.flags |= PCILIB_EVENT_INFO_FLAG_BROKEN;
+	ctx->frame[ctx->buffer_pos].info.flags |= PCILIB_EVENT_INFO_FLAG_BROKEN;
     }
-    
-    ctx->buffer_pos = (++ctx->event_id) % ctx->buffer_size;
-    ctx->cur_size = 0;
 
-    ctx->frame[ctx->buffer_pos].event.info.type = PCILIB_EVENT0;
-    ctx->frame[ctx->buffer_pos].event.info.flags = 0;
-    ctx->frame[ctx->buffer_pos].event.image_ready = 0;
+    if (ipecamera_hold_frame(ctx)) {
+	    // The progressive consumers may have started using the data, the refilled slot gets a new generation
+	if (ctx->progressive) {
+	    __atomic_store_n(&ctx->frame[ctx->buffer_pos].ready_size, 0, __ATOMIC_RELAXED);
+	    __atomic_store_n(&ctx->frame[ctx->buffer_pos].ready_gen, ctx->frame[ctx->buffer_pos].ready_gen + 1, __ATOMIC_RELAXED);
+	    __atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	ipecamera_reset_frame(ctx);
+	return 0;
+    }
+
+	// Publishing the frame: the data is visible to anybody who has observed either the sequence counter or the event_id
+    event_id = ctx->event_id + 1;
+    __atomic_store_n(&ctx->frame[ctx->buffer_pos].raw_seq, IPECAMERA_SEQ_READY(event_id), __ATOMIC_RELEASE);
+    __atomic_store_n(&ctx->event_id, event_id, __ATOMIC_RELEASE);
+
+    ctx->buffer_pos = event_id & ctx->buffer_mask;
+
+	// The slot is invalidated before anything is written in it. The progress of the previous
+	// frame in the slot is reset first, so it is never attributed to the new one.
+    ctx->frame[ctx->buffer_pos].ready_size = 0;
+    __atomic_store_n(&ctx->frame[ctx->buffer_pos].raw_seq, IPECAMERA_SEQ_WRITING(event_id + 1), __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ipecamera_reset_frame(ctx);
+
+    ipecamera_notify(&ctx->new_event);
+    if (ctx->progressive) ipecamera_notify(&ctx->lines_ready);
 
     if ((ctx->event_id == ctx->autostop.evid)&&(ctx->event_id)) {
 	ctx->run_reader = 0;
@@ -163,7 +284,7 @@ static inline int ipecamera_new_frame(ipecamera_t *ctx) {
     return 0;
 }
 
-static int ipecamera_data_callback(void *user, pcilib_dma_flags_t flags, size_t bufsize, void *buf) {
+int ipecamera_data_callback(void *user, pcilib_dma_flags_t flags, size_t bufsize, void *buf) {
     int res;
     int eof = 0;
     
@@ -202,10 +323,7 @@ static int ipecamera_data_callback(void *user, pcilib_dma_flags_t flags, size_t
 #endif /* IPECAMERA_BUG_MULTIFRAME_HEADERS */
 
 #if defined(IPECAMERA_BUG_INCOMPLETE_PACKETS)||defined(IPECAMERA_BUG_MULTIFRAME_PACKETS)
-	size_t startpos;
-	for (startpos = 0; (startpos + CMOSIS_ENTITY_SIZE) <= bufsize; startpos += sizeof(ipecamera_payload_t)) {
-	    if (!CHECK_FRAME_MAGIC(buf + startpos)) break;
-	}
+	size_t startpos = ipecamera_find_frame_magic(buf, bufsize, 0);
 	
 	if ((startpos +  CMOSIS_ENTITY_SIZE) > bufsize) {
 	    ipecamera_debug_buffer(RAW_PACKETS, bufsize, NULL, 0, "frame%4lu/frame%9lu.invalid", ctx->event_id, packet_id);
@@ -256,11 +374,7 @@ static int ipecamera_data_callback(void *user, pcilib_dma_flags_t flags, size_t
     real_size = bufsize;
     
     if (ctx->cur_size + bufsize > ctx->roi_raw_size) {
-        size_t need;
-	
-	for (need = ctx->roi_raw_size - ctx->cur_size; (need + CMOSIS_ENTITY_SIZE) <= bufsize; need += sizeof(uint32_t)) {
-	    if (!CHECK_FRAME_MAGIC(buf + need)) break;
-	}
+        size_t need = ipecamera_find_frame_magic(buf, bufsize, ctx->roi_raw_size - ctx->cur_size);
 	
 	if ((need + CMOSIS_ENTITY_SIZE) <= bufsize) {
 	    extra_data = bufsize - need;
@@ -295,6 +409,12 @@ static int ipecamera_data_callback(void *user, pcilib_dma_flags_t flags, size_t
 
     ctx->cur_size += bufsize;
 
+	// The data is stored before the watermark is advanced
+    if ((ctx->progressive)&&(ctx->parse_data)) {
+	__atomic_store_n(&ctx->frame[ctx->buffer_pos].ready_size, ctx->cur_size, __ATOMIC_RELEASE);
+	ipecamera_notify(&ctx->lines_ready);
+    }
+
     if (ctx->cur_size >= ctx->roi_raw_size) {
 	eof = 1;
     }
@@ -332,7 +452,10 @@ void *ipecamera_reader_thread(void *user) {
 #endif /* IPECAMERA_BUG_STUCKED_BUSY */
 
     while (ctx->run_reader) {
-	err = pcilib_stream_dma(ctx->event.pcilib, ctx->rdma, 0, 0, PCILIB_DMA_FLAG_MULTIPACKET, IPECAMERA_DMA_TIMEOUT, &ipecamera_data_callback, user);
+	if (ctx->replay)
+	    err = ipecamera_replay_stream(ctx->replay, IPECAMERA_DMA_TIMEOUT, &ipecamera_data_callback, user);
+	else
+	    err = pcilib_stream_dma(ctx->event.pcilib, ctx->rdma, 0, 0, PCILIB_DMA_FLAG_MULTIPACKET, IPECAMERA_DMA_TIMEOUT, &ipecamera_data_callback, user);
 	if (err) {
 	    if (err == PCILIB_ERROR_TIMEOUT) {
 		if (ctx->cur_size >= ctx->roi_raw_size) ipecamera_new_frame(ctx);
@@ -360,6 +483,10 @@ void *ipecamera_reader_thread(void *user) {
     }
     
     ctx->run_streamer = 0;
+    ipecamera_notify(&ctx->new_event);
+	// The streamer waits on new_image with IPECAMERA_ANNOUNCE_READY, it should not wait for ipecamera_stop
+    ipecamera_notify(&ctx->new_image);
+    if (ctx->progressive) ipecamera_notify(&ctx->lines_ready);
     
     if (ctx->cur_size)
 	pcilib_info("partialy read frame after stop signal, %zu bytes in the buffer", ctx->cur_size);
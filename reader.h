@@ -3,6 +3,7 @@
 
 int ipecamera_compute_buffer_size(ipecamera_t *ctx, ipecamera_format_t format, size_t header_size, size_t lines);
 
+int ipecamera_data_callback(void *user, pcilib_dma_flags_t flags, size_t bufsize, void *buf);
 void *ipecamera_reader_thread(void *user);
 
 #endif /* _IPECAMERA_READER_H */
@@ -0,0 +1,389 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <pcilib.h>
+#include <pcilib/error.h>
+
+#include "model.h"
+#include "private.h"
+#include "scanner.h"
+#include "replay.h"
+
+typedef struct {
+    size_t offset;			/**< Offset of the packet in the replay buffer */
+    size_t size;			/**< Size of the packet */
+    int frame_start;			/**< Indicates that the new frame is starting with this packet (used for fps pacing) */
+} ipecamera_replay_packet_t;
+
+struct ipecamera_replay_s {
+    char *data;				/**< Recorded stream */
+    size_t size;			/**< Size of the recorded stream */
+    int own_data;			/**< Indicates that the buffer is allocated by us and should be freed */
+
+    size_t n_packets;			/**< Number of DMA packets in the stream */
+    size_t n_frames;			/**< Number of frames in the stream */
+    ipecamera_replay_packet_t *packets;
+
+    double fps;				/**< Maximal number of frames per second, 0 - unlimited */
+    double rate;			/**< Maximal data rate in bytes per second, 0 - unlimited */
+    size_t loops;			/**< Number of loops, 0 - infinite */
+
+    size_t pos;				/**< Next packet to replay */
+    size_t loop;			/**< Current loop */
+    size_t sent;			/**< Number of bytes sent since the start of replay */
+    struct timespec start;		/**< Time when the replay was started */
+    struct timespec next_frame;		/**< Time when the next frame may be send */
+};
+
+typedef struct {
+    unsigned long frame;
+    unsigned long packet;
+    char *name;
+} ipecamera_replay_file_t;
+
+
+static void ipecamera_replay_add_time(struct timespec *ts, double seconds) {
+    long nsec = ts->tv_nsec + (long)((seconds - (long)seconds) * 1000000000.);
+
+    ts->tv_sec += (long)seconds + nsec / 1000000000;
+    ts->tv_nsec = nsec % 1000000000;
+}
+
+static int ipecamera_replay_add_packet(ipecamera_replay_t *replay, size_t *allocated, size_t offset, size_t size, int frame_start) {
+    if (replay->n_packets == *allocated) {
+	size_t new_allocated = (*allocated)?(2 * (*allocated)):1024;
+	ipecamera_replay_packet_t *packets = realloc(replay->packets, new_allocated * sizeof(ipecamera_replay_packet_t));
+	if (!packets) return PCILIB_ERROR_MEMORY;
+
+	replay->packets = packets;
+	*allocated = new_allocated;
+    }
+
+    replay->packets[replay->n_packets].offset = offset;
+    replay->packets[replay->n_packets].size = size;
+    replay->packets[replay->n_packets].frame_start = frame_start;
+    replay->n_packets++;
+    if (frame_start) replay->n_frames++;
+
+    return 0;
+}
+
+    // Splits continuous stream in DMA packets, the packets including frame magic are marked as frame starts
+static int ipecamera_replay_split(ipecamera_replay_t *replay, size_t packet_size) {
+    int err;
+    size_t allocated = 0;
+    size_t pos, size, magic;
+
+    magic = ipecamera_find_frame_magic(replay->data, replay->size, 0);
+
+    for (pos = 0; pos < replay->size; pos += packet_size) {
+	size = ((pos + packet_size) > replay->size)?(replay->size - pos):packet_size;
+
+	err = ipecamera_replay_add_packet(replay, &allocated, pos, size, (!pos)||(magic < (pos + size)));
+	if (err) return err;
+
+	while (magic < (pos + size))
+	    magic = ipecamera_find_frame_magic(replay->data, replay->size, magic + CMOSIS_FRAME_HEADER_SIZE);
+    }
+
+    return 0;
+}
+
+static int ipecamera_replay_compare_files(const void *a, const void *b) {
+    const ipecamera_replay_file_t *fa = (const ipecamera_replay_file_t*)a;
+    const ipecamera_replay_file_t *fb = (const ipecamera_replay_file_t*)b;
+
+    if (fa->packet < fb->packet) return -1;
+    return (fa->packet > fb->packet)?1:0;
+}
+
+static int ipecamera_replay_scan_frame(const char *path, unsigned long frame, ipecamera_replay_file_t **files, size_t *n_files, size_t *allocated) {
+    DIR *dir;
+    struct dirent *entry;
+    unsigned long packet;
+    char tail;
+
+    dir = opendir(path);
+    if (!dir) return PCILIB_ERROR_FAILED;
+
+    while ((entry = readdir(dir))) {
+	    // Skip .invalid and .partial files, the partial data is included in the packet anyway
+	if (sscanf(entry->d_name, "frame%lu%c", &packet, &tail) != 1) continue;
+
+	if (*n_files == *allocated) {
+	    size_t new_allocated = (*allocated)?(2 * (*allocated)):1024;
+	    ipecamera_replay_file_t *new_files = realloc(*files, new_allocated * sizeof(ipecamera_replay_file_t));
+	    if (!new_files) {
+		closedir(dir);
+		return PCILIB_ERROR_MEMORY;
+	    }
+	    *files = new_files;
+	    *allocated = new_allocated;
+	}
+
+	(*files)[*n_files].frame = frame;
+	(*files)[*n_files].packet = packet;
+	(*files)[*n_files].name = malloc(strlen(path) + strlen(entry->d_name) + 2);
+	if (!(*files)[*n_files].name) {
+	    closedir(dir);
+	    return PCILIB_ERROR_MEMORY;
+	}
+	sprintf((*files)[*n_files].name, "%s/%s", path, entry->d_name);
+	(*n_files)++;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static int ipecamera_replay_load_packets(ipecamera_replay_t *replay, const char *path) {
+    int err = 0;
+    DIR *dir;
+    FILE *f;
+    struct stat st;
+    struct dirent *entry;
+    unsigned long frame;
+    char tail, *subdir;
+    size_t i, allocated = 0, packets_allocated = 0;
+    size_t n_files = 0;
+    ipecamera_replay_file_t *files = NULL;
+
+    dir = opendir(path);
+    if (!dir) {
+	pcilib_error("Can't open directory (%s) with recorded DMA packets", path);
+	return PCILIB_ERROR_FAILED;
+    }
+
+    while ((!err)&&(entry = readdir(dir))) {
+	if (sscanf(entry->d_name, "frame%lu%c", &frame, &tail) != 1) continue;
+
+	subdir = malloc(strlen(path) + strlen(entry->d_name) + 2);
+	if (!subdir) {
+	    err = PCILIB_ERROR_MEMORY;
+	    break;
+	}
+
+	sprintf(subdir, "%s/%s", path, entry->d_name);
+	if ((!stat(subdir, &st))&&(S_ISDIR(st.st_mode)))
+	    err = ipecamera_replay_scan_frame(subdir, frame, &files, &n_files, &allocated);
+	free(subdir);
+    }
+    closedir(dir);
+
+    if ((!err)&&(!n_files)) {
+	pcilib_error("No recorded DMA packets are found in (%s)", path);
+	err = PCILIB_ERROR_NOTFOUND;
+    }
+
+    if (!err) {
+	qsort(files, n_files, sizeof(ipecamera_replay_file_t), ipecamera_replay_compare_files);
+
+	for (i = 0; i < n_files; i++) {
+	    if (!stat(files[i].name, &st)) replay->size += st.st_size;
+	}
+
+	replay->data = malloc(replay->size?replay->size:1);
+	if (!replay->data) err = PCILIB_ERROR_MEMORY;
+	else replay->own_data = 1;
+    }
+
+    for (i = 0, replay->size = 0; (!err)&&(i < n_files); i++) {
+	size_t size;
+
+	f = fopen(files[i].name, "r");
+	if (!f) {
+	    pcilib_error("Failed to open recorded DMA packet (%s)", files[i].name);
+	    err = PCILIB_ERROR_FAILED;
+	    break;
+	}
+
+	if ((fstat(fileno(f), &st))||(!st.st_size)) {
+	    fclose(f);
+	    continue;
+	}
+
+	size = fread(replay->data + replay->size, 1, st.st_size, f);
+	fclose(f);
+
+	err = ipecamera_replay_add_packet(replay, &packets_allocated, replay->size, size, (!i)||(files[i].frame != files[i - 1].frame));
+	replay->size += size;
+    }
+
+    for (i = 0; i < n_files; i++) free(files[i].name);
+    free(files);
+
+    return err;
+}
+
+static int ipecamera_replay_load_file(ipecamera_replay_t *replay, const char *path, size_t packet_size) {
+    FILE *f;
+    struct stat st;
+
+    f = fopen(path, "r");
+    if (!f) {
+	pcilib_error("Can't open file (%s) with recorded DMA stream", path);
+	return PCILIB_ERROR_FAILED;
+    }
+
+    if ((fstat(fileno(f), &st))||(!st.st_size)) {
+	fclose(f);
+	pcilib_error("The recorded DMA stream (%s) is empty", path);
+	return PCILIB_ERROR_INVALID_DATA;
+    }
+
+    replay->data = malloc(st.st_size);
+    if (!replay->data) {
+	fclose(f);
+	pcilib_error("Unable to allocate memory (%zu bytes) for recorded DMA stream", (size_t)st.st_size);
+	return PCILIB_ERROR_MEMORY;
+    }
+
+    replay->own_data = 1;
+    replay->size = fread(replay->data, 1, st.st_size, f);
+    fclose(f);
+
+    return ipecamera_replay_split(replay, packet_size);
+}
+
+static ipecamera_replay_t *ipecamera_replay_create() {
+    ipecamera_replay_t *replay = (ipecamera_replay_t*)malloc(sizeof(ipecamera_replay_t));
+    if (!replay) return NULL;
+
+    memset(replay, 0, sizeof(ipecamera_replay_t));
+    replay->loops = 1;
+
+    return replay;
+}
+
+ipecamera_replay_t *ipecamera_replay_open(const char *path, size_t packet_size) {
+    int err;
+    struct stat st;
+    ipecamera_replay_t *replay;
+
+    if (stat(path, &st)) {
+	pcilib_error("The recorded DMA stream (%s) is not found", path);
+	return NULL;
+    }
+
+    replay = ipecamera_replay_create();
+    if (!replay) return NULL;
+
+    if (S_ISDIR(st.st_mode)) err = ipecamera_replay_load_packets(replay, path);
+    else err = ipecamera_replay_load_file(replay, path, packet_size?packet_size:IPECAMERA_DMA_PACKET_LENGTH);
+
+    if (err) {
+	ipecamera_replay_free(replay);
+	return NULL;
+    }
+
+    return replay;
+}
+
+ipecamera_replay_t *ipecamera_replay_new(void *data, size_t size, size_t packet_size) {
+    ipecamera_replay_t *replay = ipecamera_replay_create();
+    if (!replay) return NULL;
+
+    replay->data = data;
+    replay->size = size;
+
+    if (ipecamera_replay_split(replay, packet_size?packet_size:IPECAMERA_DMA_PACKET_LENGTH)) {
+	ipecamera_replay_free(replay);
+	return NULL;
+    }
+
+    return replay;
+}
+
+void ipecamera_replay_free(ipecamera_replay_t *replay) {
+    if (replay) {
+	if ((replay->own_data)&&(replay->data))
+	    free(replay->data);
+	if (replay->packets)
+	    free(replay->packets);
+	free(replay);
+    }
+}
+
+void ipecamera_replay_set_pacing(ipecamera_replay_t *replay, double fps, double rate, size_t loops) {
+    replay->fps = fps;
+    replay->rate = rate * 1024 * 1024;
+    replay->loops = loops;
+}
+
+void ipecamera_replay_rewind(ipecamera_replay_t *replay) {
+    replay->pos = 0;
+    replay->loop = 0;
+    replay->sent = 0;
+}
+
+size_t ipecamera_replay_get_frames(ipecamera_replay_t *replay) {
+    return replay->n_frames;
+}
+
+size_t ipecamera_replay_get_size(ipecamera_replay_t *replay) {
+    return replay->size;
+}
+
+int ipecamera_replay_stream(ipecamera_replay_t *replay, pcilib_timeout_t timeout, pcilib_dma_callback_t cb, void *cbattr) {
+    int ret;
+    struct timespec now, deadline;
+    ipecamera_replay_packet_t *packet;
+
+    if (!replay->n_packets) {
+	usleep(timeout);
+	return PCILIB_ERROR_TIMEOUT;
+    }
+
+    if ((!replay->pos)&&(!replay->loop)&&(!replay->sent)) {
+	clock_gettime(CLOCK_MONOTONIC, &replay->start);
+	replay->next_frame = replay->start;
+    }
+
+    while (1) {
+	if (replay->pos == replay->n_packets) {
+	    if ((replay->loops)&&((replay->loop + 1) >= replay->loops)) {
+		usleep(timeout);
+		return PCILIB_ERROR_TIMEOUT;
+	    }
+
+	    replay->loop++;
+	    replay->pos = 0;
+	}
+
+	packet = replay->packets + replay->pos;
+
+	if ((packet->frame_start)&&(replay->fps > 0)) {
+	    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &replay->next_frame, NULL);
+
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    ipecamera_replay_add_time(&replay->next_frame, 1. / replay->fps);
+		// Do not try to catch up if we were delayed by the consumer
+	    if ((replay->next_frame.tv_sec < now.tv_sec)||((replay->next_frame.tv_sec == now.tv_sec)&&(replay->next_frame.tv_nsec < now.tv_nsec))) {
+		replay->next_frame = now;
+	    }
+	}
+
+	if (replay->rate > 0) {
+	    deadline = replay->start;
+	    ipecamera_replay_add_time(&deadline, replay->sent / replay->rate);
+	    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+	}
+
+	replay->pos++;
+	replay->sent += packet->size;
+
+	ret = cb(cbattr, PCILIB_DMA_FLAGS_DEFAULT, packet->size, replay->data + packet->offset);
+	if (ret < 0) return -ret;
+	if (ret == PCILIB_STREAMING_STOP) return 0;
+    }
+}
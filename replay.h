@@ -0,0 +1,50 @@
+#ifndef _IPECAMERA_REPLAY_H
+#define _IPECAMERA_REPLAY_H
+
+#include <pcilib.h>
+
+typedef struct ipecamera_replay_s ipecamera_replay_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Loads recorded DMA stream. The path is either a directory with raw packets stored
+ * by IPECAMERA_DEBUG_RAW_PACKETS (frameNNNN/frameNNNNNNNNN) or a single file with
+ * raw data (i.e. 'pci -g --data raw'). In the later case, the data is split in
+ * packets of the specified size as DMA engine would do.
+ */
+ipecamera_replay_t *ipecamera_replay_open(const char *path, size_t packet_size);
+
+/**
+ * Creates replay of the stream stored in memory, the data is not copied and 
+ * should stay valid until the replay is destroyed.
+ */
+ipecamera_replay_t *ipecamera_replay_new(void *data, size_t size, size_t packet_size);
+void ipecamera_replay_free(ipecamera_replay_t *replay);
+
+/**
+ * Configures the replay speed.
+ * @param fps		- maximal number of frames per second, 0 - unlimited
+ * @param rate		- maximal data rate in MB/s, 0 - unlimited
+ * @param loops		- number of times the recorded stream is replayed, 0 - infinite
+ */
+void ipecamera_replay_set_pacing(ipecamera_replay_t *replay, double fps, double rate, size_t loops);
+void ipecamera_replay_rewind(ipecamera_replay_t *replay);
+
+size_t ipecamera_replay_get_frames(ipecamera_replay_t *replay);
+size_t ipecamera_replay_get_size(ipecamera_replay_t *replay);
+
+/**
+ * Replacement of pcilib_stream_dma. The packets are passed to the callback the
+ * same way as DMA engine does it. PCILIB_ERROR_TIMEOUT is returned after the
+ * specified timeout if the recorded stream is over.
+ */
+int ipecamera_replay_stream(ipecamera_replay_t *replay, pcilib_timeout_t timeout, pcilib_dma_callback_t cb, void *cbattr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IPECAMERA_REPLAY_H */
@@ -0,0 +1,119 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)||defined(__i386__)
+# include <immintrin.h>
+# define IPECAMERA_SCANNER_X86
+#endif /* __x86_64__ */
+
+#include "private.h"
+#include "scanner.h"
+
+#define IPECAMERA_FRAME_MAGIC1 0x52222222
+#define IPECAMERA_FRAME_MAGIC2 0x53333333
+
+typedef size_t (*ipecamera_scanner_t)(const void *buf, size_t size, size_t offset);
+
+static ipecamera_scanner_t ipecamera_scanner = NULL;
+static const char *ipecamera_scanner_name = NULL;
+
+
+size_t ipecamera_find_frame_magic_scalar(const void *buf, size_t size, size_t offset) {
+    size_t pos;
+    uint32_t magic[2];
+
+    for (pos = offset; (pos + CMOSIS_ENTITY_SIZE) <= size; pos += sizeof(ipecamera_payload_t)) {
+	memcpy(magic, buf + pos + sizeof(ipecamera_payload_t), sizeof(magic));
+	if ((magic[0] == IPECAMERA_FRAME_MAGIC1)&&(magic[1] == IPECAMERA_FRAME_MAGIC2))
+	    return pos;
+    }
+
+    return size;
+}
+
+#ifdef IPECAMERA_SCANNER_X86
+    // The candidate at pos is matched if the words at pos + 4 and pos + 8 are equal to magic
+__attribute__((target("sse2")))
+size_t ipecamera_find_frame_magic_sse2(const void *buf, size_t size, size_t offset) {
+    int mask;
+    size_t pos, found;
+    const __m128i magic1 = _mm_set1_epi32(IPECAMERA_FRAME_MAGIC1);
+    const __m128i magic2 = _mm_set1_epi32(IPECAMERA_FRAME_MAGIC2);
+
+    for (pos = offset; (pos + 2 * sizeof(ipecamera_payload_t) + sizeof(__m128i)) <= size; pos += sizeof(__m128i)) {
+	__m128i first = _mm_loadu_si128((const __m128i*)(buf + pos + sizeof(ipecamera_payload_t)));
+	__m128i second = _mm_loadu_si128((const __m128i*)(buf + pos + 2 * sizeof(ipecamera_payload_t)));
+
+	mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(_mm_cmpeq_epi32(first, magic1), _mm_cmpeq_epi32(second, magic2))));
+	if (mask) {
+	    found = pos + __builtin_ctz(mask) * sizeof(ipecamera_payload_t);
+	    return ((found + CMOSIS_ENTITY_SIZE) <= size)?found:size;
+	}
+    }
+
+    return ipecamera_find_frame_magic_scalar(buf, size, pos);
+}
+
+__attribute__((target("avx2")))
+size_t ipecamera_find_frame_magic_avx2(const void *buf, size_t size, size_t offset) {
+    int mask;
+    size_t pos, found;
+    const __m256i magic1 = _mm256_set1_epi32(IPECAMERA_FRAME_MAGIC1);
+    const __m256i magic2 = _mm256_set1_epi32(IPECAMERA_FRAME_MAGIC2);
+
+    for (pos = offset; (pos + 2 * sizeof(ipecamera_payload_t) + sizeof(__m256i)) <= size; pos += sizeof(__m256i)) {
+	__m256i first = _mm256_loadu_si256((const __m256i*)(buf + pos + sizeof(ipecamera_payload_t)));
+	__m256i second = _mm256_loadu_si256((const __m256i*)(buf + pos + 2 * sizeof(ipecamera_payload_t)));
+
+	mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(_mm256_cmpeq_epi32(first, magic1), _mm256_cmpeq_epi32(second, magic2))));
+	if (mask) {
+	    found = pos + __builtin_ctz(mask) * sizeof(ipecamera_payload_t);
+	    return ((found + CMOSIS_ENTITY_SIZE) <= size)?found:size;
+	}
+    }
+
+    return ipecamera_find_frame_magic_sse2(buf, size, pos);
+}
+#else /* IPECAMERA_SCANNER_X86 */
+size_t ipecamera_find_frame_magic_sse2(const void *buf, size_t size, size_t offset) {
+    return ipecamera_find_frame_magic_scalar(buf, size, offset);
+}
+
+size_t ipecamera_find_frame_magic_avx2(const void *buf, size_t size, size_t offset) {
+    return ipecamera_find_frame_magic_scalar(buf, size, offset);
+}
+#endif /* IPECAMERA_SCANNER_X86 */
+
+static void ipecamera_select_scanner() {
+#ifdef IPECAMERA_SCANNER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	ipecamera_scanner_name = "avx2";
+	ipecamera_scanner = ipecamera_find_frame_magic_avx2;
+	return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+	ipecamera_scanner_name = "sse2";
+	ipecamera_scanner = ipecamera_find_frame_magic_sse2;
+	return;
+    }
+#endif /* IPECAMERA_SCANNER_X86 */
+    ipecamera_scanner_name = "scalar";
+    ipecamera_scanner = ipecamera_find_frame_magic_scalar;
+}
+
+size_t ipecamera_find_frame_magic(const void *buf, size_t size, size_t offset) {
+    if (!ipecamera_scanner) ipecamera_select_scanner();
+    return ipecamera_scanner(buf, size, offset);
+}
+
+const char *ipecamera_get_scanner_name() {
+    if (!ipecamera_scanner) ipecamera_select_scanner();
+    return ipecamera_scanner_name;
+}
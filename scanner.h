@@ -0,0 +1,29 @@
+#ifndef _IPECAMERA_SCANNER_H
+#define _IPECAMERA_SCANNER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Looks for the frame magic (0x52222222, 0x53333333 following the first word of 
+ * the frame header) in the buffer. The search starts at the specified offset and 
+ * continues in steps of 32-bit words. Only complete entities (CMOSIS_ENTITY_SIZE)
+ * are considered.
+ * @return offset of the frame header, or size if no frame magic is found
+ */
+size_t ipecamera_find_frame_magic(const void *buf, size_t size, size_t offset);
+
+size_t ipecamera_find_frame_magic_scalar(const void *buf, size_t size, size_t offset);
+size_t ipecamera_find_frame_magic_sse2(const void *buf, size_t size, size_t offset);
+size_t ipecamera_find_frame_magic_avx2(const void *buf, size_t size, size_t offset);
+
+const char *ipecamera_get_scanner_name();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IPECAMERA_SCANNER_H */
@@ -0,0 +1,28 @@
+#! /bin/bash
+
+#Replays recorded DMA stream instead of reading from the camera
+# ./replay.sh <raw_file|packet_dir> [pci options]
+#Example options:
+# IPECAMERA_REPLAY_FPS=100 ./replay.sh mult1.out		- replay at 100 frames per second
+# IPECAMERA_REPLAY_RATE=800 ./replay.sh mult1.out		- limit data rate to 800 MB/s
+# IPECAMERA_REPLAY_LOOPS=0 ./replay.sh mult1.out --run-time 10000000	- loop the stream during 10 seconds
+# IPECAMERA_REPLAY_PACKET_SIZE=65536 ./replay.sh mult1.out	- split raw file in 64 KB packets
+
+function pci {
+    APP_PATH=`dirname $0`/..
+    if [ -d $APP_PATH/../pcitool ]; then
+        PCILIB_BINARY="$APP_PATH/../pcitool/pcitool/pci"
+        PCILIB_PATH="$APP_PATH/../pcitool/pcilib"
+    else
+	PCILIB_BINARY=`which pci`
+	PCILIB_PATH=""
+    fi
+    
+    LD_LIBRARY_PATH="$PCILIB_PATH" PCILIB_PLUGIN_DIR="$APP_PATH" $PCILIB_BINARY $*
+}
+
+[ -n "$1" ] || { echo "Usage: $0 <raw_file|packet_dir> [pci options]"; exit 1; }
+replay=$1
+shift
+
+IPECAMERA_REPLAY="$replay" pci -g -o /dev/null --run-time ${IPECAMERA_REPLAY_TIME:-5000000} --verbose 10 $@
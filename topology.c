@@ -0,0 +1,167 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include <pcilib.h>
+#include <pcilib/pci.h>
+#include <pcilib/error.h>
+
+#include "topology.h"
+
+#define IPECAMERA_SYSFS_LINE 4096		/**< Enough to hold any cpulist we may find in sysfs */
+
+
+static int ipecamera_read_sysfs(const char *path, char *buf, size_t size) {
+    FILE *f;
+    size_t len;
+
+    f = fopen(path, "r");
+    if (!f) return PCILIB_ERROR_NOTFOUND;
+
+    len = fread(buf, 1, size - 1, f);
+    fclose(f);
+
+    while ((len > 0)&&((buf[len - 1] == '\n')||(buf[len - 1] == ' '))) len--;
+    buf[len] = 0;
+
+    return 0;
+}
+
+int ipecamera_get_device_node(pcilib_t *pcilib) {
+    char path[256], buf[32];
+    const pcilib_board_info_t *board_info = pcilib_get_board_info(pcilib);
+
+    if (!board_info) return -1;
+
+	// pcilib does not report the PCI domain, multi-domain systems are rare enough
+    sprintf(path, "/sys/bus/pci/devices/0000:%02x:%02x.%x/numa_node", board_info->bus, board_info->slot, board_info->func);
+    if (ipecamera_read_sysfs(path, buf, sizeof(buf))) return -1;
+
+    return atoi(buf);
+}
+
+int ipecamera_get_node_cpus(int node, cpu_set_t *cpus) {
+    int err;
+    char path[256], buf[IPECAMERA_SYSFS_LINE];
+    cpu_set_t allowed;
+
+    sprintf(path, "/sys/devices/system/node/node%i/cpulist", node);
+    err = ipecamera_read_sysfs(path, buf, sizeof(buf));
+    if (err) return err;
+
+    err = ipecamera_parse_cpulist(buf, cpus);
+    if (err) return err;
+
+    if (!sched_getaffinity(0, sizeof(cpu_set_t), &allowed))
+	CPU_AND(cpus, cpus, &allowed);
+
+    return CPU_COUNT(cpus)?0:PCILIB_ERROR_NOTFOUND;
+}
+
+int ipecamera_get_core_cpus(int cpu, cpu_set_t *cpus) {
+    char path[256], buf[IPECAMERA_SYSFS_LINE];
+
+    sprintf(path, "/sys/devices/system/cpu/cpu%i/topology/thread_siblings_list", cpu);
+    if ((ipecamera_read_sysfs(path, buf, sizeof(buf)))||(ipecamera_parse_cpulist(buf, cpus))||(!CPU_ISSET(cpu, cpus))) {
+	    // Unknown topology, handling as a separate core
+	CPU_ZERO(cpus);
+	CPU_SET(cpu, cpus);
+    }
+
+    return 0;
+}
+
+void ipecamera_plan_threads(const cpu_set_t *allowed, const cpu_set_t *cpulist, int *reader_cpu, cpu_set_t *preproc_cpus) {
+    int cpu;
+    cpu_set_t busy, core;
+
+    CPU_ZERO(preproc_cpus);
+
+    *reader_cpu = -1;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if ((CPU_ISSET(cpu, allowed))&&((!cpulist)||(!CPU_ISSET(cpu, cpulist)))) {
+	    *reader_cpu = cpu;
+	    break;
+	}
+    }
+
+	// Explicit list should be honoured even if it includes the reader CPU
+    if ((*reader_cpu < 0)&&(cpulist)) {
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	    if (CPU_ISSET(cpu, allowed)) {
+		*reader_cpu = cpu;
+		break;
+	    }
+	}
+    }
+
+    if (cpulist) {
+	CPU_OR(preproc_cpus, preproc_cpus, cpulist);
+	if (*reader_cpu >= 0) CPU_CLR(*reader_cpu, preproc_cpus);
+	return;
+    }
+
+    if (*reader_cpu < 0) return;
+
+	// The siblings of the reader are kept idle, it is running with real-time priority and should not compete for the core
+    ipecamera_get_core_cpus(*reader_cpu, &busy);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if ((!CPU_ISSET(cpu, allowed))||(CPU_ISSET(cpu, &busy))) continue;
+
+	ipecamera_get_core_cpus(cpu, &core);
+	CPU_OR(&busy, &busy, &core);
+	CPU_SET(cpu, preproc_cpus);
+    }
+}
+
+int ipecamera_parse_cpulist(const char *list, cpu_set_t *cpus) {
+    long first, last;
+    char *end;
+
+    CPU_ZERO(cpus);
+
+    while (*list) {
+	first = strtol(list, &end, 10);
+	if ((end == list)||(first < 0)) return PCILIB_ERROR_INVALID_ARGUMENT;
+
+	if (*end == '-') {
+	    list = end + 1;
+	    last = strtol(list, &end, 10);
+	    if ((end == list)||(last < first)) return PCILIB_ERROR_INVALID_ARGUMENT;
+	} else last = first;
+
+	if (last >= CPU_SETSIZE) return PCILIB_ERROR_INVALID_ARGUMENT;
+	for (; first <= last; first++) CPU_SET(first, cpus);
+
+	if (*end == ',') end++;
+	else if (*end) return PCILIB_ERROR_INVALID_ARGUMENT;
+	list = end;
+    }
+
+    return 0;
+}
+
+const char *ipecamera_format_cpulist(const cpu_set_t *cpus, char *buf, size_t size) {
+    int cpu, last;
+    size_t pos = 0;
+
+    buf[0] = 0;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (!CPU_ISSET(cpu, cpus)) continue;
+	if (pos >= size) break;
+	for (last = cpu; (last + 1 < CPU_SETSIZE)&&(CPU_ISSET(last + 1, cpus)); last++);
+
+	if (last > cpu) pos += snprintf(buf + pos, size - pos, "%s%i-%i", pos?",":"", cpu, last);
+	else pos += snprintf(buf + pos, size - pos, "%s%i", pos?",":"", cpu);
+
+	cpu = last;
+    }
+
+    return buf;
+}
@@ -0,0 +1,51 @@
+#ifndef _IPECAMERA_TOPOLOGY_H
+#define _IPECAMERA_TOPOLOGY_H
+
+#include <sched.h>
+#include <pcilib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Finds the NUMA node the camera is attached to (/sys/bus/pci/devices/.../numa_node).
+ * @return		- node or -1 if unknown (i.e. the system is not NUMA)
+ */
+int ipecamera_get_device_node(pcilib_t *pcilib);
+
+/**
+ * Returns the CPUs of the specified NUMA node limited to the CPUs the process is allowed to run on.
+ * @return		- 0 on success or error code if node is not found or has no allowed CPUs
+ */
+int ipecamera_get_node_cpus(int node, cpu_set_t *cpus);
+
+/**
+ * Returns the hyperthread siblings of the CPU (including the CPU itself).
+ */
+int ipecamera_get_core_cpus(int cpu, cpu_set_t *cpus);
+
+/**
+ * Distributes the reader and preprocessor threads over the allowed CPUs. The
+ * reader gets the first allowed CPU and its hyperthread siblings are kept idle.
+ * Then, a single preprocessor is placed on every remaining physical core. If
+ * the explicit list of preprocessor CPUs is given, it is used as is (except
+ * the reader CPU) and the reader gets the first allowed CPU not in the list.
+ * @param allowed	- CPUs allowed for the threads
+ * @param cpulist	- explicit list of preprocessor CPUs or NULL
+ * @param reader_cpu	- CPU for the reader thread or -1 if no CPUs are allowed
+ * @param preproc_cpus	- CPUs for preprocessor threads (one thread per CPU), may be empty on small systems
+ */
+void ipecamera_plan_threads(const cpu_set_t *allowed, const cpu_set_t *cpulist, int *reader_cpu, cpu_set_t *preproc_cpus);
+
+/**
+ * Parses the CPU list in the format used by sysfs and taskset, e.g. 0-3,8,10-11
+ */
+int ipecamera_parse_cpulist(const char *list, cpu_set_t *cpus);
+const char *ipecamera_format_cpulist(const cpu_set_t *cpus, char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IPECAMERA_TOPOLOGY_H */